@@ -7,10 +7,10 @@
 #include <vector>
 
 /** Helper class for DivListModel. */
-template<bool UseLinkedList, bool UseDivMask>
+template<bool UseLinkedList, bool UseDivMask, size_t DivMaskBits = 32>
 class DivListModelConfiguration;
 
-template<bool ULL, bool UDM>
+template<bool ULL, bool UDM, size_t DMB>
 class DivListModelConfiguration {
 public:
   typedef int Exponent;
@@ -31,6 +31,7 @@ public:
 
   static const bool UseLinkedList = ULL;
   static const bool UseDivMask = UDM;
+  static const size_t DivMaskBits = DMB;
 
   bool getDoAutomaticRebuilds() const {return _useAutomaticRebuild;}
   double getRebuildRatio() const {return _rebuildRatio;}
@@ -74,14 +75,14 @@ public:
   mutable unsigned long long _expQueryCount;
 };
 
-template<bool UseLinkedList, bool UseDivMask>
+template<bool UseLinkedList, bool UseDivMask, size_t DivMaskBits = 32>
 class DivListModel;
 
 /** An instantiation of the capabilities of DivList. */
-template<bool ULL, bool UDM>
+template<bool ULL, bool UDM, size_t DMB>
 class DivListModel {
  private:
-  typedef DivListModelConfiguration<ULL, UDM> C;
+  typedef DivListModelConfiguration<ULL, UDM, DMB> C;
   typedef mathic::DivList<C> Finder;
  public:
   typedef typename Finder::iterator iterator;
@@ -104,6 +105,10 @@ class DivListModel {
   void insert(const Entry& entry);
   template<class MultipleOutput>
   void insert(const Entry& entry, MultipleOutput& removed);
+  template<class MultipleOutput>
+  bool removeMultiples(const Monomial& monomial, MultipleOutput& removed) {
+    return _finder.removeMultiples(monomial, removed);
+  }
 
   Entry* findDivisor(const Monomial& monomial) {
     iterator it = _finder.findDivisorIterator(monomial);
@@ -114,7 +119,12 @@ class DivListModel {
     return it == end() ? 0 : &*it;
   }
   const Entry* findDivisor(const Monomial& monomial) const {
-    return const_cast<DivListModel<ULL, UDM>&>(*this).findDivisor(monomial);
+    return const_cast<DivListModel<ULL, UDM, DMB>&>(*this).findDivisor(monomial);
+  }
+  /** Divisors found this way are not moved to the front. */
+  template<class Iter, class DivisorOutput>
+  void findDivisors(Iter begin, Iter end, DivisorOutput out) {
+    _finder.findDivisors(begin, end, out);
   }
 
   template<class DO>
@@ -152,8 +162,8 @@ class DivListModel {
   const bool _moveDivisorToFront;
 };
 
-template<bool ULL, bool UDM>
-inline void DivListModel<ULL, UDM>::insert(const Entry& entry) {
+template<bool ULL, bool UDM, size_t DMB>
+inline void DivListModel<ULL, UDM, DMB>::insert(const Entry& entry) {
   if (!_minimizeOnInsert) {
     _finder.insert(entry);
     return;
@@ -168,9 +178,9 @@ inline void DivListModel<ULL, UDM>::insert(const Entry& entry) {
   }
 }
 
-template<bool ULL, bool UDM>
+template<bool ULL, bool UDM, size_t DMB>
 template<class MO>
-inline void DivListModel<ULL, UDM>::insert(const Entry& entry, MO& out) {
+inline void DivListModel<ULL, UDM, DMB>::insert(const Entry& entry, MO& out) {
   if (!_minimizeOnInsert) {
     _finder.insert(entry);
     return;
@@ -185,8 +195,8 @@ inline void DivListModel<ULL, UDM>::insert(const Entry& entry, MO& out) {
   }
 }
 
-template<bool ULL, bool UDM>
-inline std::string DivListModel<ULL, UDM>::getName() const {
+template<bool ULL, bool UDM, size_t DMB>
+inline std::string DivListModel<ULL, UDM, DMB>::getName() const {
   return _finder.getName() +
     (_minimizeOnInsert ? " remin" : " nomin") +
     (_moveDivisorToFront ? " toFront" : "");
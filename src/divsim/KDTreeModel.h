@@ -11,11 +11,13 @@ template<
   bool UseTreeDivMask,
   bool PackedTree,
   size_t LeafSize,
-  bool AllowRemovals>
+  bool AllowRemovals,
+  size_t DivMaskBits = 32,
+  int SplitStrategy = 0>
 class KDTreeModelConfiguration;
 
 /** Helper class for KDTreeModel. */
-template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR>
+template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR, size_t DMB, int SS>
 class KDTreeModelConfiguration {
  public:
   typedef int Exponent;
@@ -75,6 +77,9 @@ class KDTreeModelConfiguration {
   static const bool PackedTree = PT;
   static const size_t LeafSize = LS;
   static const bool AllowRemovals = AR;
+  static const size_t DivMaskBits = DMB;
+  static const mathic::KDTreeSplitStrategy splitStrategy =
+    static_cast<mathic::KDTreeSplitStrategy>(SS);
 
   unsigned long long getExpQueryCount() const {return _expQueryCount;}
 
@@ -94,12 +99,14 @@ template<
   bool UseTreeDivMask,
   bool PackedTree,
   size_t LeafSize,
-  bool AllowRemovals
+  bool AllowRemovals,
+  size_t DivMaskBits = 32,
+  int SplitStrategy = 0
 >
 class KDTreeModel {
  private:
-  typedef KDTreeModelConfiguration
-    <UseDivMask, UseTreeDivMask, PackedTree, LeafSize, AllowRemovals> C;
+  typedef KDTreeModelConfiguration<UseDivMask, UseTreeDivMask,
+    PackedTree, LeafSize, AllowRemovals, DivMaskBits, SplitStrategy> C;
   typedef mathic::KDTree<C> Finder;
  public:
   typedef typename Finder::Monomial Monomial;
@@ -120,6 +127,10 @@ class KDTreeModel {
   void insert(const Entry& entry);
   template<class MultipleOutput>
   void insert(const Entry& entry, MultipleOutput& removed);
+  template<class MultipleOutput>
+  bool removeMultiples(const Monomial& monomial, MultipleOutput& removed) {
+    return _finder.removeMultiples(monomial, removed);
+  }
 
   Entry* findDivisor(const Monomial& monomial) {
     return _finder.findDivisor(monomial);
@@ -127,6 +138,10 @@ class KDTreeModel {
   const Entry* findDivisor(const Monomial& monomial) const {
     return _finder.findDivisor(monomial);
   }
+  template<class Iter, class DivisorOutput>
+  void findDivisors(Iter begin, Iter end, DivisorOutput out) {
+    _finder.findDivisors(begin, end, out);
+  }
   std::string getName() const;
 
   template<class DO>
@@ -158,8 +173,8 @@ class KDTreeModel {
   bool _minimizeOnInsert;
 };
 
-template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR>
-inline void KDTreeModel<UDM, UTDM, PT, LS, AR>::insert(const Entry& entry) {
+template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR, size_t DMB, int SS>
+inline void KDTreeModel<UDM, UTDM, PT, LS, AR, DMB, SS>::insert(const Entry& entry) {
   if (!_minimizeOnInsert) {
     _finder.insert(entry);
     return;
@@ -170,9 +185,9 @@ inline void KDTreeModel<UDM, UTDM, PT, LS, AR>::insert(const Entry& entry) {
   _finder.insert(entry);
 }
 
-template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR>
+template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR, size_t DMB, int SS>
 template<class MultipleOutput>
-inline void KDTreeModel<UDM, UTDM, PT, LS, AR>::
+inline void KDTreeModel<UDM, UTDM, PT, LS, AR, DMB, SS>::
 insert(const Entry& entry, MultipleOutput& removed) {
   if (!_minimizeOnInsert) {
     _finder.insert(entry);
@@ -184,8 +199,8 @@ insert(const Entry& entry, MultipleOutput& removed) {
   _finder.insert(entry);
 }
 
-template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR>
-inline std::string KDTreeModel<UDM, UTDM, PT, LS, AR>::getName() const {
+template<bool UDM, bool UTDM, bool PT, size_t LS, bool AR, size_t DMB, int SS>
+inline std::string KDTreeModel<UDM, UTDM, PT, LS, AR, DMB, SS>::getName() const {
   return _finder.getName() +
     (_minimizeOnInsert ? " remin" : " nomin");
 }
@@ -12,6 +12,9 @@ public:
   Monomial(std::vector<Exponent>& v): _exponents(&v[0]) {
     IF_DEBUG(_size = v.size());
   }
+  Monomial(Exponent* exponents, size_t size): _exponents(exponents) {
+    IF_DEBUG(_size = size);
+  }
 
   inline Exponent& operator[](size_t index) {
     ASSERT(index < _size);
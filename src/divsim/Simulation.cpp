@@ -4,8 +4,13 @@
 #include "mathic/ColumnPrinter.h"
 #include <cstdlib>
 #include <algorithm>
+#include <sstream>
 
 namespace {
+  unsigned long long wallMilliseconds(const mic::PerfCounts& counts) {
+    return (counts.nanoseconds + 500000) / 1000000;
+  }
+
   void makeRandom(std::vector<int>& monomial) {
     for (size_t var = 0; var < monomial.size(); ++var)
       monomial[var] = rand() % 1000;
@@ -19,6 +24,10 @@ void Simulation::makeStandard
   _findAll = findAll;
   _varCount = varCount;
   _events.clear();
+  std::ostringstream simType;
+  simType << "standard " << varCount << ' ' << inserts << ' ' << queries
+    << (findAll ? " all" : "");
+  _simType = simType.str();
   for (size_t i = 0; i < inserts + queries; ++i) {
     /*Event event2;
     event2._type = StateUnknown;
@@ -32,31 +41,149 @@ void Simulation::makeStandard
   }
 }
 
+void Simulation::replay(const std::string& fileName) {
+  _events.clear();
+  _traceResults.clear();
+  _trace.reset(new mic::MappedFile(fileName));
+
+  mic::DivTraceReader reader(_trace->begin(), _trace->end());
+  _varCount = reader.getVarCount();
+  size_t counts[mic::DivTraceReader::EndEvent] = {};
+  while (true) {
+    const mic::DivTraceReader::Event event = reader.next();
+    if (event == mic::DivTraceReader::EndEvent)
+      break;
+    ++counts[event];
+  }
+  _findAll = counts[mic::DivTraceReader::FindAllDivisorsEvent] > 0;
+  _simType = "trace " + fileName;
+
+  std::cout << "Trace \"" << fileName << "\" has "
+    << _varCount << " variables, "
+    << counts[mic::DivTraceReader::InsertEvent] << " inserts, "
+    << counts[mic::DivTraceReader::FindDivisorEvent] << " queries, "
+    << counts[mic::DivTraceReader::FindAllDivisorsEvent]
+    << " queries for all divisors and "
+    << counts[mic::DivTraceReader::RemoveMultiplesEvent]
+    << " removals of multiples. ";
+}
+
+Monomial::Exponent* Simulation::storeMonomial
+(const std::vector<mic::DivTraceReader::Exponent>& exponents) {
+  const size_t BlockSize = 1 << 16;
+  const size_t size = exponents.size();
+  if (_traceBlock < _traceBlocks.size() &&
+    _traceBlocks[_traceBlock].size() + size >
+    _traceBlocks[_traceBlock].capacity())
+    ++_traceBlock;
+  if (_traceBlock == _traceBlocks.size())
+    _traceBlocks.push_back(std::vector<Monomial::Exponent>());
+  std::vector<Monomial::Exponent>& block = _traceBlocks[_traceBlock];
+  if (block.capacity() < size) {
+    // only happens for an empty block, so reserve copies nothing.
+    block.reserve(std::max(BlockSize, size));
+  }
+  const size_t offset = block.size();
+  for (size_t var = 0; var < size; ++var)
+    block.push_back(static_cast<Monomial::Exponent>(exponents[var]));
+  return &block[offset];
+}
+
+void Simulation::releaseTraceMonomials() {
+  for (size_t i = 0; i < _traceBlocks.size(); ++i)
+    _traceBlocks[i].clear();
+  _traceBlock = 0;
+}
+
 void Simulation::printData(std::ostream& out) const {
   std::vector<SimData> sorted(_data);
   std::sort(sorted.begin(), sorted.end());
   out << "*** Simulation outcome for "
       << _repeats << " repeats ***" << std::endl;
+  bool hasCycles = false;
+  bool hasCounters = false;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    hasCycles = hasCycles || sorted[i]._counts.hasCycles;
+    hasCounters = hasCounters || sorted[i]._counts.hasCounters;
+  }
+
   mic::ColumnPrinter pr;
   pr.addColumn(true);
   pr.addColumn(false, " ", "ms");
   pr.addColumn(false, " ", "eqs");
+  if (hasCycles)
+    pr.addColumn(false, " ", "Mcycles");
+  if (hasCounters) {
+    pr.addColumn(false, " ", "Minstrs");
+    pr.addColumn(false, " ", "k cache misses");
+    pr.addColumn(false, " ", "k branch misses");
+  }
   for (std::vector<SimData>::const_iterator it = sorted.begin();
     it != sorted.end(); ++it) {
+    const mic::PerfCounts& counts = it->_counts;
     pr[0] << it->_name << '\n';
-    pr[1] << mic::ColumnPrinter::commafy(it->_mseconds) << '\n';
+    pr[1] << mic::ColumnPrinter::commafy(wallMilliseconds(counts)) << '\n';
     pr[2] << mic::ColumnPrinter::commafy(it->_expQueryCount) << '\n';
+    size_t column = 3;
+    if (hasCycles)
+      pr[column++] << mic::ColumnPrinter::commafy(counts.cycles / 1000000)
+        << '\n';
+    if (hasCounters) {
+      pr[column++] << mic::ColumnPrinter::commafy
+        (counts.instructions / 1000000) << '\n';
+      pr[column++] << mic::ColumnPrinter::commafy
+        (counts.cacheMisses / 1000) << '\n';
+      pr[column++] << mic::ColumnPrinter::commafy
+        (counts.branchMisses / 1000) << '\n';
+    }
   }
   pr.print(out);
 }
 
+std::vector<mic::SimRecord> Simulation::getRecords() const {
+  std::vector<mic::SimRecord> records;
+  for (size_t i = 0; i < _data.size(); ++i) {
+    const SimData& data = _data[i];
+    mic::SimRecord record(data._name);
+    record.addParameter("simulation", _simType);
+    record.addParameter("repeats", _repeats);
+    record.addMetric("ms", data._counts.getMilliseconds());
+    if (data._counts.hasCycles)
+      record.addMetric("cycles", static_cast<double>(data._counts.cycles));
+    record.addMetric
+      ("exponent_queries", static_cast<double>(data._expQueryCount));
+    if (data._counts.hasCounters) {
+      record.addMetric
+        ("instructions", static_cast<double>(data._counts.instructions));
+      record.addMetric
+        ("cache_misses", static_cast<double>(data._counts.cacheMisses));
+      record.addMetric
+        ("branch_misses", static_cast<double>(data._counts.branchMisses));
+    }
+    records.push_back(record);
+  }
+  return records;
+}
+
 void Simulation::SimData::print(std::ostream& out) {
   out << _name
-    << " " << mic::ColumnPrinter::commafy(_mseconds) << " ms"
-    << " " << mic::ColumnPrinter::commafy(_expQueryCount) << " eqs"
-    << '\n';
+    << " " << mic::ColumnPrinter::commafy(wallMilliseconds(_counts))
+    << " ms";
+  if (_counts.hasCycles)
+    out << " " << mic::ColumnPrinter::commafy(_counts.cycles / 1000000)
+      << " Mcycles";
+  out << " " << mic::ColumnPrinter::commafy(_expQueryCount) << " eqs";
+  if (_counts.hasCounters) {
+    out << " " << mic::ColumnPrinter::commafy(_counts.instructions / 1000000)
+      << " Minstrs"
+      << " " << mic::ColumnPrinter::commafy(_counts.cacheMisses / 1000)
+      << " k cache misses"
+      << " " << mic::ColumnPrinter::commafy(_counts.branchMisses / 1000)
+      << " k branch misses";
+  }
+  out << '\n';
 }
 
 bool Simulation::SimData::operator<(const SimData& sd) const {
-  return _mseconds < sd._mseconds;
+  return _counts.nanoseconds < sd._counts.nanoseconds;
 }
@@ -3,7 +3,13 @@
 
 #include "Monomial.h"
 #include "mathic/Timer.h"
+#include "mathic/MappedFile.h"
+#include "mathic/DivTrace.h"
+#include "mathic/SimRecord.h"
 #include <vector>
+#include <deque>
+#include <memory>
+#include <string>
 #include <iostream>
 #include <cstdlib>
 #include <algorithm>
@@ -11,10 +17,19 @@
 class Simulation {
  public:
   Simulation(size_t repeats, bool printPartialData):
-   _repeats(repeats), _printPartialData(printPartialData), _simType("none") {}
+   _repeats(repeats), _printPartialData(printPartialData), _simType("none"),
+   _traceBlock(0) {}
 
   void makeStandard(size_t varCount, size_t inserts, size_t queries, bool findAll);
 
+  /** Replays the trace in the given file instead of the events of
+      makeStandard. The trace is read from the file as each finder is
+      run, so it need not fit in memory. The results of the queries of
+      the first finder are recorded and every later finder must give
+      the same results. Reports an error through mathic::reportError
+      if the file cannot be read. */
+  void replay(const std::string& fileName);
+
   template<class DivFinder>
   void run();
   template<class DivFinder, class Param1>
@@ -35,18 +50,28 @@ class Simulation {
 
   void printData(std::ostream& out) const;
 
+  /** Returns the data of each run as records for writing to CSV or JSON. */
+  std::vector<mic::SimRecord> getRecords() const;
+
  private:
   struct SimData {
     bool operator<(const SimData& sd) const;
     void print(std::ostream& out);
 
     std::string _name;
-    unsigned long _mseconds;
     unsigned long long _expQueryCount;
+    mic::PerfCounts _counts;
   };
 
   template<class DivFinder>
   void run(DivFinder& finder);
+  template<class DivFinder>
+  void runTrace(DivFinder& finder);
+  template<class DivFinder>
+  void checkTraceResult(size_t& index, size_t result, const DivFinder& finder);
+  Monomial::Exponent* storeMonomial
+    (const std::vector<mic::DivTraceReader::Exponent>& exponents);
+  void releaseTraceMonomials();
 
   enum EventType {
     InsertUnknown,
@@ -76,6 +101,15 @@ class Simulation {
   size_t _repeats;
   bool _printPartialData;
   std::string _simType;
+
+  std::unique_ptr<mic::MappedFile> _trace;
+  // The results of the queries of the trace in the order they occur.
+  std::vector<size_t> _traceResults;
+  // Entries of finders point into these blocks. A deque never moves
+  // its elements, so the blocks stay put when more are added.
+  std::deque<std::vector<Monomial::Exponent> > _traceBlocks;
+  size_t _traceBlock;
+  std::vector<Monomial::Exponent> _traceQuery;
 };
 
 template<class DivFinder>
@@ -149,6 +183,18 @@ public:
     return true;
   }
 
+  size_t size() const {
+#ifdef DEBUG
+    return _monomials.size();
+#else
+    return _monomialCount;
+#endif
+  }
+
+#ifdef DEBUG
+  const std::vector<Monomial>& getMonomials() const {return _monomials;}
+#endif
+
   template<class Finder>
   void checkInsert(Event& e, const Finder& finder) {
 #ifdef DEBUG
@@ -236,10 +282,12 @@ private:
 
 template<class DivFinder>
 void Simulation::run(DivFinder& finder) {
-  mic::Timer timer;
+  mic::PerfTimer perfTimer;
   std::vector<Monomial> divisors;
   std::vector<const Monomial::Exponent*> tmp;
-  for (size_t step = 0; step < _repeats; ++step) {
+  if (_trace.get() != 0)
+    runTrace(finder);
+  for (size_t step = 0; step < _repeats && _trace.get() == 0; ++step) {
     for (size_t i = 0; i < _events.size(); ++i) {
       Event& e = _events[i];
       if (e._type == InsertKnown || e._type == InsertUnknown) {
@@ -298,7 +346,7 @@ void Simulation::run(DivFinder& finder) {
   }
 
   SimData data;
-  data._mseconds = (unsigned long)timer.getMilliseconds();
+  data._counts = perfTimer.read();
   data._name = finder.getName();
   data._expQueryCount = finder.getExpQueryCount();
   _data.push_back(data);
@@ -307,4 +355,74 @@ void Simulation::run(DivFinder& finder) {
   std::cout << finder.size() << std::endl;
 }
 
+template<class DivFinder>
+void Simulation::runTrace(DivFinder& finder) {
+  mic::DivTraceReader reader(_trace->begin(), _trace->end());
+  releaseTraceMonomials();
+  _traceQuery.resize(_varCount);
+  Monomial query(_traceQuery);
+  size_t resultIndex = 0;
+  for (size_t step = 0; step < _repeats; ++step) {
+    reader.rewind();
+    while (true) {
+      const mic::DivTraceReader::Event event = reader.next();
+      if (event == mic::DivTraceReader::EndEvent)
+        break;
+      const std::vector<mic::DivTraceReader::Exponent>& exponents =
+        reader.exponents();
+      if (event == mic::DivTraceReader::InsertEvent) {
+        finder.insert(Monomial(storeMonomial(exponents), _varCount));
+        continue;
+      }
+      for (size_t var = 0; var < _varCount; ++var)
+        _traceQuery[var] = static_cast<Monomial::Exponent>(exponents[var]);
+
+      if (event == mic::DivTraceReader::FindDivisorEvent) {
+        typename DivFinder::Entry* entry = finder.findDivisor(query);
+#ifdef DEBUG
+        if (entry != 0)
+          for (size_t var = 0; var < _varCount; ++var)
+            ASSERT((*entry)[var] <= query[var]);
+#endif
+        checkTraceResult(resultIndex, entry != 0, finder);
+      } else if (event == mic::DivTraceReader::FindAllDivisorsEvent) {
+        MonomialStore store;
+        const_cast<const DivFinder&>(finder).findAllDivisors(query, store);
+#ifdef DEBUG
+        for (size_t d = 0; d < store.size(); ++d)
+          for (size_t var = 0; var < _varCount; ++var)
+            ASSERT(store.getMonomials()[d][var] <= query[var]);
+#endif
+        checkTraceResult(resultIndex, store.size(), finder);
+      } else {
+        ASSERT(event == mic::DivTraceReader::RemoveMultiplesEvent);
+        MonomialStore store;
+        finder.removeMultiples(query, store);
+#ifdef DEBUG
+        for (size_t m = 0; m < store.size(); ++m)
+          for (size_t var = 0; var < _varCount; ++var)
+            ASSERT(query[var] <= store.getMonomials()[m][var]);
+#endif
+        checkTraceResult(resultIndex, store.size(), finder);
+      }
+    }
+    checkTraceResult(resultIndex, finder.size(), finder);
+  }
+}
+
+template<class DivFinder>
+void Simulation::checkTraceResult
+(size_t& index, size_t result, const DivFinder& finder) {
+  if (index == _traceResults.size())
+    _traceResults.push_back(result); // the first finder sets the results
+  else if (_traceResults[index] != result) {
+    std::cerr << "Finder \"" << finder.getName()
+      << "\" gave an incorrect result for query " << index
+      << " while replaying trace " << _trace->getFileName() << '.'
+      << std::endl;
+    std::exit(1);
+  }
+  ++index;
+}
+
 #endif
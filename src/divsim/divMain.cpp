@@ -4,9 +4,112 @@
 #include "KDTreeModel.h"
 #include "Simulation.h"
 #include "mathic/Timer.h"
+#include "mathic/CliParser.h"
+#include "mathic/CompareAction.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <exception>
+
+namespace {
+  /** Runs the models that can replay a trace. The trace says when to
+      remove multiples, so the models do not minimize on insert. */
+  void runReplay(Simulation& sim) {
+    sim.run<KDTreeModel<1,1,1,1,1> >(0, 0, 0, 1.0, 1000);
+    sim.run<KDTreeModel<1,1,1,1,1> >(0, 0, 1, 1.0, 1000);
+    sim.run<KDTreeModel<1,0,1,1,1> >(0, 0, 0, 1.0, 1000);
+    sim.run<KDTreeModel<0,0,1,2,1> >(0, 0, 0, 0.0, 0);
+    sim.run<KDTreeModel<0,0,0,2,1> >(0, 0, 0, 0.0, 0);
+    sim.run<KDTreeModel<1,1,0,40,1> >(0, 0, 0, 1.0, 1000);
+    sim.run<KDTreeModel<1,1,1,10,1,64> >(0, 0, 0, 1.0, 1000);
+    sim.run<KDTreeModel<1,1,0,40,1,32,1> >(0, 0, 0, 1.0, 1000);
+    sim.run<KDTreeModel<1,1,0,40,1,32,2> >(0, 0, 0, 1.0, 1000);
+    sim.run<KDTreeModel<1,1,0,40,1,32,3> >(0, 0, 0, 1.0, 1000);
+    sim.run<DivListModel<0,0> >(0, 0, 0, 0.0, 0);
+    sim.run<DivListModel<0,0> >(0, 0, 1, 0.0, 0);
+    sim.run<DivListModel<0,1> >(0, 1, 0, 0.5, 500);
+    sim.run<DivListModel<1,0> >(0, 0, 0, 0.0, 0);
+    sim.run<DivListModel<1,1> >(0, 1, 0, 0.5, 500);
+  }
+
+  /** Runs the compare action of mathic on the arguments after "compare". */
+  int compare(int argc, const char** args) {
+    try {
+      mic::CliParser parser;
+      parser.registerAction<mic::CompareAction>();
+      std::vector<std::string> commandLine(args, args + argc);
+      parser.parse(commandLine)->performAction();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  /** Writes the results to the files given by -csv and -json, if any.
+      CSV is appended to so that repeated runs collect samples for
+      compare. */
+  bool writeRecords(const Simulation& sim,
+    const std::string& csvFile, const std::string& jsonFile) {
+    try {
+      if (!csvFile.empty())
+        mic::appendSimRecordsCsv(csvFile, sim.getRecords());
+      if (!jsonFile.empty()) {
+        std::ofstream out(jsonFile.c_str());
+        mic::writeSimRecordsJson(out, sim.getRecords());
+        if (!out)
+          mic::reportError("Could not write to file \"" + jsonFile + "\".");
+      }
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, const char** args) {
+  if (argc >= 2 && std::string(args[1]) == "compare")
+    return compare(argc - 1, args + 1);
+
+  std::string csvFile;
+  std::string jsonFile;
+  std::vector<const char*> positional;
+  for (int i = 0; i < argc; ++i) {
+    const std::string arg = args[i];
+    if ((arg == "-csv" || arg == "-json") && i + 1 < argc)
+      (arg == "-csv" ? csvFile : jsonFile) = args[++i];
+    else
+      positional.push_back(args[i]);
+  }
+  argc = static_cast<int>(positional.size());
+  args = &positional[0];
+
+  if (argc >= 2 && std::string(args[1]) == "replay") {
+    if (argc < 3) {
+      std::cerr << "usage: replay trace-file [repeats]\n"
+        << "   or: compare baseline.csv candidate.csv [-threshold percent]\n"
+        << "Give -csv file or -json file to also write the results to file.\n";
+      return 0;
+    }
+    size_t repeats = 1;
+    if (argc >= 4)
+      std::istringstream(args[3]) >> repeats;
+    Simulation sim(repeats, true);
+    try {
+      sim.replay(args[2]);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    std::cout << std::endl;
+    runReplay(sim);
+    std::cout << "\n\n";
+    sim.printData(std::cout);
+    return writeRecords(sim, csvFile, jsonFile) ? 0 : 1;
+  }
 
-int main() {
   const size_t repeats = IF_DEBUG(true ? 1 :) 1;
   Simulation sim(repeats, true);
   mic::Timer timer;
@@ -24,7 +127,7 @@ int main() {
 #ifndef DEBUG
   sim.run<KDTreeModel<1,1,1,1,1> >(0, 0, 0, 1.0, 1000);
   sim.run<KDTreeModel<1,1,1,1,0> >(0, 0, 0, 1.0, 1000);
-return 0;
+return writeRecords(sim, csvFile, jsonFile) ? 0 : 1;
 
   sim.run<KDTreeModel<0,0,1,2,1> >(1, 0, 0, 0.0, 0); // best tree, no mask
   sim.run<KDTreeModel<0,0,0,2,1> >(1, 0, 0, 0.0, 0); // best tree, no mask
@@ -144,5 +247,5 @@ return 0;
 
   std::cout << "\n\n";
   sim.printData(std::cout);
-  return 0;
+  return writeRecords(sim, csvFile, jsonFile) ? 0 : 1;
 }
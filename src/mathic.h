@@ -4,6 +4,10 @@
 #include "mathic/Timer.h"
 #include "mathic/ColumnPrinter.h"
 #include "mathic/error.h"
+#include "mathic/MappedFile.h"
+#include "mathic/PQTrace.h"
+#include "mathic/DivTrace.h"
+#include "mathic/SimRecord.h"
 
 // other data structures
 #include "mathic/BitTriangle.h"
@@ -17,6 +21,8 @@
 #include "mathic/TourTree.h"
 #include "mathic/StlSet.h"
 #include "mathic/Heap.h"
+#include "mathic/PairingHeap.h"
+#include "mathic/RadixHeap.h"
 #include "mathic/Geobucket.h"
 #include "mathic/PairQueue.h"
 
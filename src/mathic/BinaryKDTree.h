@@ -4,8 +4,15 @@
 #include "stdinc.h"
 #include "DivMask.h"
 #include "KDEntryArray.h"
+#include "KDRebuild.h"
+#include "KDNodePool.h"
+#include "NodeStack.h"
 #include <memtailor.h>
 #include <ostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <utility>
 
 namespace mathic {
   template<class C>
@@ -14,9 +21,11 @@ namespace mathic {
     typedef typename C::Monomial Monomial;
     typedef typename C::Entry Entry;
     typedef typename C::Exponent Exponent;
-    typedef typename DivMask::Extender<Entry, C::UseDivMask> ExtEntry;
-    typedef typename DivMask::Extender<const Monomial&,C::UseDivMask> ExtMonoRef;
-    typedef typename DivMask::Calculator<C> DivMaskCalculator;
+    typedef typename DivMaskOf<C>::template Extender<Entry, C::UseDivMask>
+      ExtEntry;
+    typedef typename DivMaskOf<C>::template
+      Extender<const Monomial&, C::UseDivMask> ExtMonoRef;
+    typedef typename DivMaskOf<C>::template Calculator<C> DivMaskCalculator;
 
     struct ExpOrder {
     ExpOrder(size_t var, const C& conf): _var(var), _conf(conf) {}
@@ -63,7 +72,7 @@ namespace mathic {
       bool isInterior() const {return !isLeaf();}
       const Interior& asInterior() const {
         MATHIC_ASSERT(isInterior());
-        return static_cast<Interior&>(*this);
+        return static_cast<const Interior&>(*this);
       }
       Interior& asInterior() {
         MATHIC_ASSERT(isInterior());
@@ -82,7 +91,7 @@ namespace mathic {
     };
 
     class KDTreeInterior : public KDTreeNode,
-      public mathic::DivMask::HasDivMask<C::UseTreeDivMask> {
+      public DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask> {
     public:
       typedef typename C::Exponent Exponent;
       typedef KDTreeInterior Interior;
@@ -98,7 +107,9 @@ namespace mathic {
         _equalOrLess(&equalOrLess),
         _strictlyGreater(&strictlyGreater),
         _var(var),
-        _exponent(exponent) {
+        _exponent(exponent),
+        _size(0),
+        _builtSize(0) {
         }
       KDTreeInterior
         (size_t var,
@@ -107,7 +118,9 @@ namespace mathic {
         _equalOrLess(0),
         _strictlyGreater(0),
         _var(var),
-        _exponent(exponent) {
+        _exponent(exponent),
+        _size(0),
+        _builtSize(0) {
         }
       size_t getVar() const {return _var;}
       Exponent getExponent() const {return _exponent;}
@@ -122,6 +135,17 @@ namespace mathic {
         _strictlyGreater = strictlyGreater;
       }
 
+      /** The number of entries below this node, counting insertions
+          but not removals, so it is an upper bound. */
+      size_t getSize() const {return _size;}
+      /** The size when the subtree at this node was last built. */
+      size_t getBuiltSize() const {return _builtSize;}
+      void setSize(size_t size, size_t builtSize) {
+        _size = size;
+        _builtSize = builtSize;
+      }
+      void incrementSize() {++_size;}
+
       Node& getChildFor(const ExtEntry& entry, const C& conf) {
         if (getExponent() < conf.getExponent(entry.get(), getVar()))
           return getStrictlyGreater();
@@ -129,15 +153,16 @@ namespace mathic {
           return getEqualOrLess();
       }
 
-      using DivMask::HasDivMask<C::UseTreeDivMask>::updateToLowerBound;
+      using DivMaskOf<C>::template
+        HasDivMask<C::UseTreeDivMask>::updateToLowerBound;
       void updateToLowerBound(Node& node) {
         if (!C::UseTreeDivMask)
           return;
         if (node.isLeaf())
-          DivMask::HasDivMask<C::UseTreeDivMask>::
+          DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask>::
             updateToLowerBound(node.asLeaf().entries());
         else
-          DivMask::HasDivMask<C::UseTreeDivMask>::
+          DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask>::
             updateToLowerBound(node.asInterior());
       }
 
@@ -146,6 +171,8 @@ namespace mathic {
       Node* _strictlyGreater;
       size_t _var;
       Exponent _exponent;
+      size_t _size;
+      size_t _builtSize;
     };
 
     
@@ -159,7 +186,7 @@ namespace mathic {
       typedef const ExtEntry* const_iterator;
       typedef const ExtEntry& const_reference;
       typedef ExtEntry value_type;
-      typedef DivMask::Calculator<C> DivMaskCalculator;
+      typedef typename DivMaskOf<C>::template Calculator<C> DivMaskCalculator;
 
       KDTreeLeaf(memt::Arena& arena, const C& conf);
 
@@ -180,7 +207,8 @@ namespace mathic {
        splits the elements in this noe into two leaves and returns
        a new interior node that is the parent of them. */
       Interior& splitInsert(const ExtEntry& entry, Interior* parent,
-        memt::Arena& arena, const C& conf);
+        memt::Arena& arena, KDNodePool& pool, const C& conf,
+        const KDQuerySample<C>& queries);
 
     private:
       KDEntryArray<C, ExtEntry> _entries;
@@ -203,25 +231,60 @@ namespace mathic {
     template<class Iter>
     void reset(Iter begin, Iter end, const DivMaskCalculator& calc);
 
-    inline Entry* findDivisor(const ExtMonoRef& monomial);
+    inline Entry* findDivisor(const ExtMonoRef& monomial) const;
+
+    /** Sets divisors[i] to an entry that divides queries[i] for each i
+        in [0, queryCount) where divisors[i] is null and there is such an
+        entry. The entries that are not null to begin with are left
+        alone. All the queries go down the tree together, so each node
+        is visited at most once for the whole batch. */
+    void findDivisors
+      (const ExtMonoRef* queries, size_t queryCount, Entry** divisors) const;
 
     template<class DivisorOutput>
     inline void findAllDivisors
-      (const ExtMonoRef& monomial, DivisorOutput& out);
+      (const ExtMonoRef& monomial, DivisorOutput& out) const;
 
     template<class Output>
     inline void findAllMultiples
-      (const ExtMonoRef& monomial, Output& out);
+      (const ExtMonoRef& monomial, Output& out) const;
 
     template<class EntryOutput>
-    void forAll(EntryOutput& out);
+    void forAll(EntryOutput& out) const;
 
     void clear();
 
+    /** Recomputes every div mask in the tree using calc. */
+    void recalculateDivMasks(const DivMaskCalculator& calc);
+
+    /** Copies the nodes into one block of memory in van Emde Boas order
+        and frees the memory of the old nodes. A subtree of height h is
+        then stored as a top tree of height h/2 followed by each of the
+        bottom trees below it, recursively, so the nodes on any path
+        from the root are close together in memory however the tree was
+        built. Nodes that are inserted afterwards are allocated as usual.
+        reset() calls this, so a rebuilt tree is laid out this way. The
+        entries move, so pointers to them become invalid. */
+    void relayout();
+
+    /** Frees the memory of the nodes that are no longer in the tree by
+        copying the tree to new memory as relayout() does. */
+    void compact() {relayout();}
+
     size_t getMemoryUse() const;
 
+    /** The part of getMemoryUse() that is taken up by nodes that have
+        been removed from the tree, either because their entries were
+        removed or because a rebuild replaced them. New nodes are made
+        there, and compact() frees it. */
+    size_t getDeadMemoryUse() const {return _pool.getMemoryUse();}
+
     C& getConfiguration() {return _conf;}
 
+    /** The sample of queries that splits are chosen from when
+        C::splitStrategy is KDSplitQueries. */
+    KDQuerySample<C>& getQuerySample() {return _querySample;}
+
     void print(std::ostream& out) const;
 
     /// Asserts internal invariants if asserts are turned on.
@@ -238,10 +301,102 @@ namespace mathic {
       Interior* parent;
     };
 
+    /** Builds a subtree of the entries in [begin, end), which may be
+        empty, and returns its root. var is the variable that the parent
+        of the subtree splits on, or -1. The div masks of Entry's are
+        computed by *calc while ExtEntry's already have theirs, so calc
+        can then be null. The sizes and the tree div masks of the
+        interior nodes are not set. */
+    template<class Iter>
+    Node* build(Iter begin, Iter end, size_t var, const DivMaskCalculator* calc);
+
+    // The size classes of the nodes in _pool.
+    enum {LeafClass = 0, InteriorClass = 1};
+
+    void* allocLeaf() {return _pool.alloc(_arena, LeafClass, sizeof(Leaf));}
+    void* allocInterior() {
+      return _pool.alloc(_arena, InteriorClass, sizeof(Interior));
+    }
+
+    template<class Iter>
+    Leaf* makeLeaf(Iter begin, Iter end, const DivMaskCalculator* calc) {
+      return new (allocLeaf()) Leaf(begin, end, _arena, *calc, _conf);
+    }
+    Leaf* makeLeaf(ExtEntry* begin, ExtEntry* end, const DivMaskCalculator*) {
+      return new (allocLeaf()) Leaf(begin, end, _arena, _conf);
+    }
+
+    /** Puts the memory of node in _pool. The entries of a leaf must
+        have been cleared. */
+    void freeNode(Node* node);
+
+    /** Puts by in the place of child, which is a child of parent or
+        the root if parent is null. */
+    void replaceChild(Interior* parent, Node* child, Node* by);
+
+    /** If a child of interior is a leaf without entries, then interior
+        is replaced by its other child and both are freed. parent is the
+        parent of interior, or null if interior is the root. */
+    void removeEmptyChild(Interior* parent, Interior& interior);
+
+    /** A node to visit in removeMultiples. An interior node is visited
+        again after its children so that a child that has become empty
+        can be removed. */
+    struct RemoveTodo {
+      RemoveTodo() {}
+      RemoveTodo(Node* node, Interior* parent, bool childrenDone):
+        node(node), parent(parent), childrenDone(childrenDone) {}
+      Node* node;
+      Interior* parent;
+      bool childrenDone;
+    };
+
+    /** Sets the size of each interior node of the subtree at root to
+        the number of entries below it, and marks them as just built. */
+    static void updateSizes(Node* root);
+
+    /** Recomputes the tree div masks of the interior nodes of the
+        subtree at root from the div masks of the leaves. */
+    static void updateTreeDivMasks(Node* root);
+
+    /** Rebuilds the subtree at node, whose parent is parent or which is
+        the root if parent is null. The entries move. */
+    void rebuildSubtree(Interior* parent, Node* node);
+
+    static size_t sizeOf(const Node& node) {
+      return node.isLeaf() ?
+        node.asLeaf().entries().size() : node.asInterior().getSize();
+    }
+
+    /** A node to visit in findDivisors along with the queries that are
+        to be looked up in it. */
+    struct BatchTodo {
+      BatchTodo(Node* node, size_t begin, size_t end):
+        node(node), begin(begin), end(end) {}
+      Node* node;
+      size_t begin; // first index of the queries in the index buffer
+      size_t end; // one past the last index
+    };
+
+    /** Appends the nodes of the subtree at node that are less than
+        height levels below node to order in van Emde Boas order. */
+    static void appendVebOrder
+      (Node* node, size_t height, std::vector<Node*>& order);
+
+    typedef std::pair<Node*, Node*> Moved; // a node and where it moved
+    struct MovedLess {
+      bool operator()(const Moved& a, const Moved& b) const {
+        return std::less<Node*>()(a.first, b.first);
+      }
+    };
+    static Node* movedTo(const std::vector<Moved>& moved, Node* node);
+
     memt::Arena _arena; // Everything permanent allocated from here.
+    std::vector<char> _layout; // except the nodes moved by relayout.
+    KDNodePool _pool; // The memory of removed nodes in the two above.
     C _conf; // User supplied configuration.
-    mutable std::vector<Node*> _tmp; // For navigating the tree.
     Node* _root; // Root of the tree. Can be null!
+    KDQuerySample<C> _querySample;
   };
 
   template<class C>
@@ -259,53 +414,129 @@ namespace mathic {
   template<class C>
   template<class MO>
   size_t BinaryKDTree<C>::removeMultiples(const ExtMonoRef& extMonomial, MO& out) {
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<RemoveTodo> stack;
     if (_root == 0)
       return 0;
     size_t removedCount = 0;
-    Node* node = _root;
-    while (true) {
-      while (node->isInterior()) {
-        Interior& interior = node->asInterior();
-        if (!(interior.getExponent() <
-              _conf.getExponent(extMonomial.get(), interior.getVar())))
-          _tmp.push_back(&interior.getEqualOrLess());
-        node = &interior.getStrictlyGreater();
+    stack.push_back(RemoveTodo(_root, 0, false));
+    while (!stack.empty()) {
+      RemoveTodo todo = stack.back();
+      stack.pop_back();
+      if (todo.node->isLeaf()) {
+        removedCount += todo.node->asLeaf().entries().
+          removeMultiples(extMonomial, out, _conf);
+        continue;
       }
-      MATHIC_ASSERT(node->isLeaf());
-      removedCount += node->asLeaf().entries().removeMultiples(extMonomial, out, _conf);
-      if (_tmp.empty())
-        break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      Interior& interior = todo.node->asInterior();
+      if (todo.childrenDone) {
+        removeEmptyChild(todo.parent, interior);
+        continue;
+      }
+      todo.childrenDone = true;
+      stack.push_back(todo);
+      if (!(interior.getExponent() <
+            _conf.getExponent(extMonomial.get(), interior.getVar())))
+        stack.push_back(RemoveTodo(&interior.getEqualOrLess(), &interior, false));
+      stack.push_back
+        (RemoveTodo(&interior.getStrictlyGreater(), &interior, false));
+    }
+    if (_root->isLeaf() && _root->asLeaf().entries().empty()) {
+      freeNode(_root);
+      _root = 0;
     }
-    MATHIC_ASSERT(_tmp.empty());
     MATHIC_ASSERT(debugIsValid());
     return removedCount;
   }
 
   template<class C>
   bool BinaryKDTree<C>::removeElement(const Monomial& monomial) {
-    MATHIC_ASSERT(_tmp.empty());
     if (_root == 0)
-      return 0;
+      return false;
+    Interior* grandParent = 0;
+    Interior* parent = 0;
     Node* node = _root;
-
-    while (node->isInterior())
-      node = node->asInterior().getChildFor(monomial, _conf);
-    const bool value = node->asLeaf().removeElement(monomial);
+    while (node->isInterior()) {
+      grandParent = parent;
+      parent = &node->asInterior();
+      if (parent->getExponent() <
+          _conf.getExponent(monomial, parent->getVar()))
+        node = &parent->getStrictlyGreater();
+      else
+        node = &parent->getEqualOrLess();
+    }
+    KDEntryArray<C, ExtEntry>& entries = node->asLeaf().entries();
+    const bool value = entries.removeElement(monomial, _conf);
+    if (entries.empty()) {
+      if (parent != 0)
+        removeEmptyChild(grandParent, *parent);
+      else {
+        freeNode(_root);
+        _root = 0;
+      }
+    }
     MATHIC_ASSERT(debugIsValid());
     return value;
   }
 
+  template<class C>
+  void BinaryKDTree<C>::freeNode(Node* node) {
+    if (node->isLeaf()) {
+      MATHIC_ASSERT(node->asLeaf().entries().empty());
+      _pool.free(node, LeafClass, sizeof(Leaf));
+    } else
+      _pool.free(node, InteriorClass, sizeof(Interior));
+  }
+
+  template<class C>
+  void BinaryKDTree<C>::replaceChild(Interior* parent, Node* child, Node* by) {
+    if (parent == 0) {
+      MATHIC_ASSERT(child == _root);
+      _root = by;
+    } else if (&parent->getEqualOrLess() == child)
+      parent->setEqualOrLess(by);
+    else {
+      MATHIC_ASSERT(&parent->getStrictlyGreater() == child);
+      parent->setStrictlyGreater(by);
+    }
+  }
+
+  template<class C>
+  void BinaryKDTree<C>::removeEmptyChild(Interior* parent, Interior& interior) {
+    Node* empty = &interior.getEqualOrLess();
+    Node* other = &interior.getStrictlyGreater();
+    if (!empty->isLeaf() || !empty->asLeaf().entries().empty()) {
+      std::swap(empty, other);
+      if (!empty->isLeaf() || !empty->asLeaf().entries().empty())
+        return;
+    }
+    // The div masks and sizes above stay bounds for what is left.
+    replaceChild(parent, &interior, other);
+    freeNode(empty);
+    freeNode(&interior);
+  }
+
   template<class C>
   void BinaryKDTree<C>::insert(const ExtEntry& extEntry) {
     Interior* parent = 0;
     if (_root == 0)
-      _root = new (_arena.allocObjectNoCon<Leaf>()) Leaf(_arena, _conf);
+      _root = new (allocLeaf()) Leaf(_arena, _conf);
     Node* node = _root;
+    // the lowest subtree on the path to rebuild, if any, and its parent.
+    Interior* rebuild = 0;
+    Interior* rebuildParent = 0;
     while (node->isInterior()) {
+      Interior* grandParent = parent;
       parent = &node->asInterior();
+      parent->incrementSize();
+      if (KDRebuildInternal::shouldRebuild(
+        parent->getSize(),
+        parent->getBuiltSize(),
+        std::max(sizeOf(parent->getEqualOrLess()),
+          sizeOf(parent->getStrictlyGreater())),
+        _conf)) {
+        rebuild = parent;
+        rebuildParent = grandParent;
+      }
       if (C::UseTreeDivMask)
         parent->updateToLowerBound(extEntry);
       node = &parent->getChildFor(extEntry, _conf);
@@ -314,7 +545,8 @@ namespace mathic {
 
     MATHIC_ASSERT(leaf->entries().size() <= C::LeafSize);
     if (leaf->entries().size() == C::LeafSize) {
-      Interior& interior = leaf->splitInsert(extEntry, parent, _arena, _conf);
+      Interior& interior =
+        leaf->splitInsert(extEntry, parent, _arena, _pool, _conf, _querySample);
       if (parent == 0) {
         MATHIC_ASSERT(leaf == _root);
         _root = &interior;
@@ -324,6 +556,8 @@ namespace mathic {
       leaf->entries().insert(extEntry, _conf);
       MATHIC_ASSERT(debugIsValid());
     }
+    if (rebuild != 0)
+      rebuildSubtree(rebuildParent, rebuild);
   }
 
   template<class C>
@@ -332,11 +566,26 @@ namespace mathic {
     clear();
     if (insertBegin == insertEnd)
       return;
+    _root = build(insertBegin, insertEnd, static_cast<size_t>(-1), &calc);
+    updateSizes(_root);
+    updateTreeDivMasks(_root);
+    relayout();
+    MATHIC_ASSERT(debugIsValid());
+  }
 
+  template<class C>
+  template<class Iter>
+  typename BinaryKDTree<C>::Node* BinaryKDTree<C>::build(
+    Iter insertBegin,
+    Iter insertEnd,
+    size_t var,
+    const DivMaskCalculator* calc
+  ) {
     typedef InsertTodo<Iter> Task;
     typedef std::vector<Task> TaskCont;
     TaskCont todo;
 
+    Node* root = 0;
     Interior* parent = 0;
     bool isEqualOrLessChild = false;
     while (true) {
@@ -344,17 +593,15 @@ namespace mathic {
       const size_t insertCount = std::distance(insertBegin, insertEnd);
       const bool isLeaf = (insertCount <= C::LeafSize);
       if (isLeaf)
-        node = new (_arena.allocObjectNoCon<Leaf>())
-          Leaf(insertBegin, insertEnd, _arena, calc, _conf);
+        node = makeLeaf(insertBegin, insertEnd, calc);
       else {
-        size_t var =
-          (parent == 0 ? static_cast<size_t>(-1) : parent->getVar());
+        if (parent != 0)
+          var = parent->getVar();
 
         Exponent exp;
         Iter middle = KDEntryArray<C, ExtEntry>::
-          split(insertBegin, insertEnd, var, exp, _conf);
-        Interior* interior = new (_arena.allocObjectNoCon<Interior>())
-          Interior(var, exp);
+          split(insertBegin, insertEnd, var, exp, _conf, 0, &_querySample);
+        Interior* interior = new (allocInterior()) Interior(var, exp);
 
         MATHIC_ASSERT(middle != insertBegin && middle != insertEnd);
         // push strictly-greater on todo
@@ -369,8 +616,8 @@ namespace mathic {
       }
 
       if (parent == 0) {
-        MATHIC_ASSERT(_root == 0);
-        _root = node;
+        MATHIC_ASSERT(root == 0);
+        root = node;
       } else if (isEqualOrLessChild)
         parent->setEqualOrLess(node);
       else
@@ -393,39 +640,121 @@ namespace mathic {
         // continue with equal-or-less as next item      
       }
     }
-    MATHIC_ASSERT(_root != 0);
+    MATHIC_ASSERT(root != 0);
+    return root;
+  }
 
-    if (C::UseTreeDivMask) {
-      // record nodes in tree using breadth first search
-      typedef std::vector<Interior*> NodeCont;
-      NodeCont nodes;
-      if (_root->isInterior())
-        nodes.push_back(&_root->asInterior());
-      for (size_t i = 0; i < nodes.size(); ++i) {
-        Interior* node = nodes[i];
-        if (node->getEqualOrLess().isInterior())
-          nodes.push_back(&node->getEqualOrLess().asInterior());
-        if (node->getStrictlyGreater().isInterior())
-          nodes.push_back(&node->getStrictlyGreater().asInterior());
-      }
-      // compute div masks in reverse order of breath first search
-      typename NodeCont::reverse_iterator it = nodes.rbegin();
-      typename NodeCont::reverse_iterator end = nodes.rend();
-      for (; it != end; ++it) {
-        Interior* node = *it;
-        node->updateToLowerBound(node->getEqualOrLess());
-        node->updateToLowerBound(node->getStrictlyGreater());
+  template<class C>
+  void BinaryKDTree<C>::updateSizes(Node* root) {
+    // record interior nodes using breadth first search
+    std::vector<Interior*> nodes;
+    if (root->isInterior())
+      nodes.push_back(&root->asInterior());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      Interior* node = nodes[i];
+      if (node->getEqualOrLess().isInterior())
+        nodes.push_back(&node->getEqualOrLess().asInterior());
+      if (node->getStrictlyGreater().isInterior())
+        nodes.push_back(&node->getStrictlyGreater().asInterior());
+    }
+    // the children come after their parent
+    for (size_t i = nodes.size(); i > 0; --i) {
+      Interior* node = nodes[i - 1];
+      const size_t size = sizeOf(node->getEqualOrLess()) +
+        sizeOf(node->getStrictlyGreater());
+      node->setSize(size, size);
+    }
+  }
+
+  template<class C>
+  void BinaryKDTree<C>::updateTreeDivMasks(Node* root) {
+    if (!C::UseTreeDivMask)
+      return;
+    // record nodes in tree using breadth first search
+    typedef std::vector<Interior*> NodeCont;
+    NodeCont nodes;
+    if (root->isInterior())
+      nodes.push_back(&root->asInterior());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      Interior* node = nodes[i];
+      if (node->getEqualOrLess().isInterior())
+        nodes.push_back(&node->getEqualOrLess().asInterior());
+      if (node->getStrictlyGreater().isInterior())
+        nodes.push_back(&node->getStrictlyGreater().asInterior());
+    }
+    // compute div masks in reverse order of breath first search
+    typename NodeCont::reverse_iterator it = nodes.rbegin();
+    typename NodeCont::reverse_iterator end = nodes.rend();
+    for (; it != end; ++it) {
+      Interior* node = *it;
+      node->resetDivMask();
+      node->updateToLowerBound(node->getEqualOrLess());
+      node->updateToLowerBound(node->getStrictlyGreater());
+    }
+  }
+
+  template<class C>
+  void BinaryKDTree<C>::rebuildSubtree(Interior* parent, Node* node) {
+    MATHIC_ASSERT(parent == 0 ? node == _root :
+      (&parent->getEqualOrLess() == node ||
+       &parent->getStrictlyGreater() == node));
+    std::vector<ExtEntry> entries;
+    entries.reserve(sizeOf(*node));
+    NodeStack<Node*> stack;
+    stack.push_back(node);
+    while (!stack.empty()) {
+      Node* n = stack.back();
+      stack.pop_back();
+      while (n->isInterior()) {
+        Interior& interior = n->asInterior();
+        stack.push_back(&interior.getStrictlyGreater());
+        n = &interior.getEqualOrLess();
+        freeNode(&interior);
+      }
+      KDEntryArray<C, ExtEntry>& leafEntries = n->asLeaf().entries();
+      entries.insert(entries.end(), leafEntries.begin(), leafEntries.end());
+      leafEntries.clear();
+      freeNode(n);
+    }
+    // The new subtree is made in the memory of the old one.
+
+    ExtEntry* begin = entries.empty() ? 0 : &entries.front();
+    ExtEntry* end = begin + entries.size();
+    const size_t var =
+      parent == 0 ? static_cast<size_t>(-1) : parent->getVar();
+    Node* subtree = build(begin, end, var, 0);
+    updateSizes(subtree);
+    updateTreeDivMasks(subtree);
+    // The entries are the same, so the div masks above are still right.
+    replaceChild(parent, node, subtree);
+    MATHIC_ASSERT(debugIsValid());
+  }
+
+  template<class C>
+  void BinaryKDTree<C>::recalculateDivMasks(const DivMaskCalculator& calc) {
+    if (!C::UseDivMask || _root == 0)
+      return;
+    NodeStack<Node*> stack;
+    stack.push_back(_root);
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
+      while (node->isInterior()) {
+        stack.push_back(&node->asInterior().getStrictlyGreater());
+        node = &node->asInterior().getEqualOrLess();
       }
+      node->asLeaf().entries().recalculateDivMasks(calc, _conf);
     }
+    updateTreeDivMasks(_root);
     MATHIC_ASSERT(debugIsValid());
   }
 
   template<class C>
   typename BinaryKDTree<C>::Entry* BinaryKDTree<C>::findDivisor
-    (const ExtMonoRef& extMonomial) {
+    (const ExtMonoRef& extMonomial) const {
 
     MATHIC_ASSERT(debugIsValid());
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     if (_root == 0)
       return 0;
     Node* node = _root;
@@ -438,7 +767,7 @@ namespace mathic {
 
         if (interior.getExponent() <
             _conf.getExponent(extMonomial.get(), interior.getVar()))
-          _tmp.push_back(&interior.getStrictlyGreater());
+          stack.push_back(&interior.getStrictlyGreater());
         node = &interior.getEqualOrLess();
       }
 
@@ -448,24 +777,100 @@ namespace mathic {
         LeafIt leafIt = leaf.entries().findDivisor(extMonomial, _conf);
         if (leafIt != leaf.entries().end()) {
           MATHIC_ASSERT(_conf.divides(leafIt->get(), extMonomial.get()));
-          _tmp.clear();
           return &leafIt->get();
         }
       }
     next:
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
     return 0;
   }
 
+  template<class C>
+  void BinaryKDTree<C>::findDivisors(
+    const ExtMonoRef* queries,
+    size_t queryCount,
+    Entry** divisors
+  ) const {
+    MATHIC_ASSERT(debugIsValid());
+    if (_root == 0)
+      return;
+
+    // The queries for a node to visit are a range in indices. The range
+    // of each node on todo ends where the range of the node above it
+    // begins, so the ranges of nodes that have already been visited
+    // are removed by shrinking indices to the end of the next range.
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < queryCount; ++i)
+      if (divisors[i] == 0)
+        indices.push_back(i);
+    if (indices.empty())
+      return;
+    std::vector<BatchTodo> todo;
+    todo.push_back(BatchTodo(_root, 0, indices.size()));
+    while (!todo.empty()) {
+      BatchTodo visit = todo.back();
+      todo.pop_back();
+      indices.resize(visit.end);
+
+      // Drop the queries that found a divisor elsewhere since this
+      // node was recorded.
+      size_t openEnd = visit.begin;
+      for (size_t i = visit.begin; i < visit.end; ++i)
+        if (divisors[indices[i]] == 0)
+          indices[openEnd++] = indices[i];
+
+      Node* node = visit.node;
+      while (node->isInterior() && visit.begin < openEnd) {
+        Interior& interior = node->asInterior();
+        if (C::UseTreeDivMask) {
+          size_t stillOpen = visit.begin;
+          for (size_t i = visit.begin; i < openEnd; ++i)
+            if (interior.getDivMask().canDivide
+              (queries[indices[i]].getDivMask()))
+              indices[stillOpen++] = indices[i];
+          openEnd = stillOpen;
+        }
+
+        // All open queries go on to the equal-or-less side while those
+        // with a greater exponent also go to the strictly greater side.
+        // The equal-or-less side keeps its range in place, so the range
+        // for the strictly greater side goes at the end of indices.
+        const size_t greaterBegin = indices.size();
+        for (size_t i = visit.begin; i < openEnd; ++i) {
+          const size_t query = indices[i];
+          if (interior.getExponent() <
+            _conf.getExponent(queries[query].get(), interior.getVar()))
+            indices.push_back(query);
+        }
+        if (greaterBegin < indices.size()) {
+          todo.push_back(BatchTodo
+            (&interior.getStrictlyGreater(), greaterBegin, indices.size()));
+        }
+        node = &interior.getEqualOrLess();
+      }
+      if (!node->isLeaf())
+        continue; // all queries were ruled out by div masks
+
+      Leaf& leaf = node->asLeaf();
+      for (size_t i = visit.begin; i < openEnd; ++i) {
+        const size_t query = indices[i];
+        LeafIt leafIt = leaf.entries().findDivisor(queries[query], _conf);
+        if (leafIt != leaf.entries().end()) {
+          MATHIC_ASSERT(_conf.divides(leafIt->get(), queries[query].get()));
+          divisors[query] = &leafIt->get();
+        }
+      }
+    }
+  }
+
   template<class C>
   template<class DO>
-  void BinaryKDTree<C>::findAllDivisors(const ExtMonoRef& extMonomial, DO& output) {
-    MATHIC_ASSERT(_tmp.empty());
+  void BinaryKDTree<C>::findAllDivisors(const ExtMonoRef& extMonomial, DO& output) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
@@ -477,30 +882,27 @@ namespace mathic {
           goto next;
         if (interior.getExponent() <
             _conf.getExponent(extMonomial.get(), interior.getVar()))
-          _tmp.push_back(&interior.getStrictlyGreater());
+          stack.push_back(&interior.getStrictlyGreater());
         node = &interior.getEqualOrLess();
       }
       MATHIC_ASSERT(node->isLeaf());
       {
         Leaf& leaf = node->asLeaf();
-        if (!leaf.entries().findAllDivisors(extMonomial, output, _conf)) {
-          _tmp.clear();
+        if (!leaf.entries().findAllDivisors(extMonomial, output, _conf))
           break;
-        }
       }
 next:
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
   template<class DO>
-  void BinaryKDTree<C>::findAllMultiples(const ExtMonoRef& extMonomial, DO& output) {
-    MATHIC_ASSERT(_tmp.empty());
+  void BinaryKDTree<C>::findAllMultiples(const ExtMonoRef& extMonomial, DO& output) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
@@ -509,84 +911,191 @@ next:
         Interior& interior = node->asInterior();
         if (!(interior.getExponent() <
             _conf.getExponent(extMonomial.get(), interior.getVar())))
-          _tmp.push_back(&interior.getEqualOrLess());
+          stack.push_back(&interior.getEqualOrLess());
         node = &interior.getStrictlyGreater();
       }
       MATHIC_ASSERT(node->isLeaf());
       {
         Leaf& leaf = node->asLeaf();
-        if (!leaf.entries().findAllMultiples(extMonomial, output, _conf)) {
-          _tmp.clear();
+        if (!leaf.entries().findAllMultiples(extMonomial, output, _conf))
           break;
-        }
       }
 next:
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
   template<class EO>
-  void BinaryKDTree<C>::forAll(EO& output) {
-    MATHIC_ASSERT(_tmp.empty());
+  void BinaryKDTree<C>::forAll(EO& output) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
     while (true) {
       while (node->isInterior()) {
         Interior& interior = node->asInterior();
-        _tmp.push_back(&interior.getStrictlyGreater());
+        stack.push_back(&interior.getStrictlyGreater());
         node = &interior.getEqualOrLess();
       }
       MATHIC_ASSERT(node->isLeaf());
       Leaf& leaf = node->asLeaf();
-      if (!leaf.entries().forAll(output)) {
-        _tmp.clear();
+      if (!leaf.entries().forAll(output))
         break;
-      }
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
   void BinaryKDTree<C>::clear() {
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     // Call Entry destructors
     if (_root != 0)
-      _tmp.push_back(_root);
-    while (!_tmp.empty()) {
-      Node* node = _tmp.back();
-      _tmp.pop_back();
+      stack.push_back(_root);
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
       while (node->isInterior()) {
-        _tmp.push_back(&node->asInterior().getStrictlyGreater());
+        stack.push_back(&node->asInterior().getStrictlyGreater());
         node = &node->asInterior().getEqualOrLess();
       }
       MATHIC_ASSERT(node->isLeaf());
       node->asLeaf().entries().clear();
     }
     _arena.freeAllAllocs();
+    std::vector<char>().swap(_layout);
+    _pool.clear();
     _root = 0;
   }
 
+  template<class C>
+  void BinaryKDTree<C>::relayout() {
+    if (_root == 0)
+      return;
+
+    size_t height = 0;
+    std::vector<std::pair<Node*, size_t> > pending;
+    pending.push_back(std::make_pair(_root, static_cast<size_t>(1)));
+    while (!pending.empty()) {
+      Node* node = pending.back().first;
+      const size_t depth = pending.back().second;
+      pending.pop_back();
+      height = std::max(height, depth);
+      if (node->isInterior()) {
+        Interior& interior = node->asInterior();
+        pending.push_back(std::make_pair(&interior.getEqualOrLess(), depth + 1));
+        pending.push_back
+          (std::make_pair(&interior.getStrictlyGreater(), depth + 1));
+      }
+    }
+    std::vector<Node*> order;
+    appendVebOrder(_root, height, order);
+
+    std::vector<size_t> offsets(order.size());
+    size_t layoutSize = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+      const bool leaf = order[i]->isLeaf();
+      const size_t align = leaf ? alignof(Leaf) : alignof(Interior);
+      layoutSize = (layoutSize + align - 1) / align * align;
+      offsets[i] = layoutSize;
+      layoutSize += leaf ? sizeof(Leaf) : sizeof(Interior);
+    }
+    std::vector<char> layout(layoutSize);
+
+    std::vector<Moved> moved(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      Node* node = order[i];
+      void* to = &layout[offsets[i]];
+      Node* copy;
+      if (node->isLeaf()) {
+        KDEntryArray<C, ExtEntry>& entries = node->asLeaf().entries();
+        copy = new (to) Leaf(entries.begin(), entries.end(), _arena, _conf);
+      } else {
+        Interior& interior = node->asInterior();
+        Interior* interiorCopy = new (to)
+          Interior(interior.getVar(), interior.getExponent());
+        interiorCopy->setSize(interior.getSize(), interior.getBuiltSize());
+        interiorCopy->updateToLowerBound(*node);
+        copy = interiorCopy;
+      }
+      moved[i] = Moved(node, copy);
+    }
+    _root = moved.front().second;
+
+    std::sort(moved.begin(), moved.end(), MovedLess());
+    for (size_t i = 0; i < moved.size(); ++i) {
+      Node* node = moved[i].first;
+      if (node->isLeaf()) {
+        node->asLeaf().entries().clear();
+        continue;
+      }
+      Interior& interior = node->asInterior();
+      Interior& copy = moved[i].second->asInterior();
+      copy.setEqualOrLess(movedTo(moved, &interior.getEqualOrLess()));
+      copy.setStrictlyGreater(movedTo(moved, &interior.getStrictlyGreater()));
+    }
+
+    _arena.freeAllAllocs();
+    _layout.swap(layout); // the old layout is freed when layout goes
+    _pool.clear();
+    MATHIC_ASSERT(debugIsValid());
+  }
+
+  template<class C>
+  void BinaryKDTree<C>::appendVebOrder
+    (Node* node, size_t height, std::vector<Node*>& order) {
+    MATHIC_ASSERT(height > 0);
+    if (height == 1 || node->isLeaf()) {
+      order.push_back(node);
+      return;
+    }
+    const size_t topHeight = height / 2;
+    appendVebOrder(node, topHeight, order);
+
+    // the roots of the bottom trees are topHeight levels below node.
+    std::vector<std::pair<Node*, size_t> > pending;
+    pending.push_back(std::make_pair(node, static_cast<size_t>(0)));
+    while (!pending.empty()) {
+      Node* bottom = pending.back().first;
+      const size_t depth = pending.back().second;
+      pending.pop_back();
+      if (depth == topHeight)
+        appendVebOrder(bottom, height - topHeight, order);
+      else if (bottom->isInterior()) {
+        Interior& interior = bottom->asInterior();
+        pending.push_back
+          (std::make_pair(&interior.getStrictlyGreater(), depth + 1));
+        pending.push_back(std::make_pair(&interior.getEqualOrLess(), depth + 1));
+      }
+    }
+  }
+
+  template<class C>
+  typename BinaryKDTree<C>::Node* BinaryKDTree<C>::movedTo
+    (const std::vector<Moved>& moved, Node* node) {
+    typename std::vector<Moved>::const_iterator it = std::lower_bound
+      (moved.begin(), moved.end(), Moved(node, 0), MovedLess());
+    MATHIC_ASSERT(it != moved.end() && it->first == node);
+    return it->second;
+  }
+
   template<class C>
   size_t BinaryKDTree<C>::getMemoryUse() const {
-	size_t sum = _arena.getMemoryUse();
-	sum += _tmp.capacity() * sizeof(_tmp.front());
-	return sum;
+    size_t sum = _arena.getMemoryUse() + _layout.capacity();
+    sum += _querySample.getMemoryUse();
+    return sum;
   }
 
   template<class C>
   void BinaryKDTree<C>::print(std::ostream& out) const {
     out << "<<<<<<<< BinaryKDTree >>>>>>>>\n";
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     if (_root != 0) {
       Node* node = _root;
       while (true) {
@@ -598,8 +1107,8 @@ next:
           out << "Child <=: " << &interior.getEqualOrLess() << '\n';
           out << "Child > : " << &interior.getStrictlyGreater() << '\n';
           out << '\n';
-          _tmp.push_back(&interior.getEqualOrLess());
-          _tmp.push_back(&interior.getStrictlyGreater());
+          stack.push_back(&interior.getEqualOrLess());
+          stack.push_back(&interior.getStrictlyGreater());
         } else {
           Leaf& leaf = node->asLeaf();
           out << "**** Leaf Node " << &leaf << '\n';
@@ -609,12 +1118,11 @@ next:
           }
           out << '\n';
         }
-        if (_tmp.empty())
+        if (stack.empty())
           break;
-        node = _tmp.back();
-        _tmp.pop_back();
+        node = stack.back();
+        stack.pop_back();
       }
-      MATHIC_ASSERT(_tmp.empty());
     }
   }
 
@@ -623,7 +1131,6 @@ next:
 #ifndef MATHIC_DEBUG
     return true;
 #else
-    MATHIC_ASSERT(_tmp.empty());
     MATHIC_ASSERT(!_conf.getDoAutomaticRebuilds() || _conf.getRebuildRatio() > 0);
 
     if (_root == 0)
@@ -644,7 +1151,7 @@ next:
     }
 
     // check the recorded nodes
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     for (size_t i = 0; i < nodes.size(); ++i) {
       Node* nodei = nodes[i];
       if (nodei->isLeaf()) {
@@ -655,12 +1162,14 @@ next:
       size_t var = interior.getVar();
       Exponent exp = interior.getExponent();
 
-      MATHIC_ASSERT(_tmp.empty());
+      MATHIC_ASSERT(stack.empty());
+      MATHIC_ASSERT(interior.getBuiltSize() <= interior.getSize());
+      size_t entryCount = 0;
       // check equal or less than sub tree
-      _tmp.push_back(&interior.getEqualOrLess());
-      while (!_tmp.empty()) {
-        Node* node = _tmp.back();
-        _tmp.pop_back();
+      stack.push_back(&interior.getEqualOrLess());
+      while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
         if (C::UseTreeDivMask) {
           if (node->isInterior())
             MATHIC_ASSERT(interior.getDivMask().canDivide(node->asInterior().getDivMask()));
@@ -668,18 +1177,19 @@ next:
             MATHIC_ASSERT(interior.getDivMask().canDivide(node->asLeaf().entries().getDivMask()));
         }
         if (node->isInterior()) {
-          _tmp.push_back(&node->asInterior().getStrictlyGreater());
-          _tmp.push_back(&node->asInterior().getEqualOrLess());
+          stack.push_back(&node->asInterior().getStrictlyGreater());
+          stack.push_back(&node->asInterior().getEqualOrLess());
         } else {
           MATHIC_ASSERT(node->asLeaf().entries().allLessThanOrEqualTo(var, exp, _conf));
+          entryCount += node->asLeaf().entries().size();
         }
       }
 
       // check strictly greater
-      _tmp.push_back(&interior.getStrictlyGreater());
-      while (!_tmp.empty()) {
-        Node* node = _tmp.back();
-        _tmp.pop_back();
+      stack.push_back(&interior.getStrictlyGreater());
+      while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
         if (C::UseTreeDivMask) {
           if (node->isInterior())
             MATHIC_ASSERT(interior.getDivMask().canDivide(node->asInterior().getDivMask()));
@@ -687,12 +1197,15 @@ next:
             MATHIC_ASSERT(interior.getDivMask().canDivide(node->asLeaf().entries().getDivMask()));
         }
         if (node->isInterior()) {
-          _tmp.push_back(&node->asInterior().getStrictlyGreater());
-          _tmp.push_back(&node->asInterior().getEqualOrLess());
+          stack.push_back(&node->asInterior().getStrictlyGreater());
+          stack.push_back(&node->asInterior().getEqualOrLess());
         } else {
           MATHIC_ASSERT(node->asLeaf().entries().allStrictlyGreaterThan(var, exp, _conf));
+          entryCount += node->asLeaf().entries().size();
         }
       }
+      // removals are not counted in the size
+      MATHIC_ASSERT(entryCount <= interior.getSize());
     }
     return true;
 #endif
@@ -739,22 +1252,26 @@ next:
 
   template<class C>
   typename BinaryKDTree<C>::KDTreeInterior&
-  BinaryKDTree<C>::KDTreeLeaf::splitInsert(const ExtEntry& extEntry, Interior* parent, memt::Arena& arena, const C& conf) {
+  BinaryKDTree<C>::KDTreeLeaf::splitInsert(const ExtEntry& extEntry, Interior* parent, memt::Arena& arena, KDNodePool& pool, const C& conf, const KDQuerySample<C>& queries) {
     MATHIC_ASSERT(conf.getVarCount() > 0);
     MATHIC_ASSERT(entries().size() > 0);
     size_t var = (parent == 0 ? static_cast<size_t>(-1) : parent->getVar());
     typename C::Exponent exp;
 
     iterator middle = KDEntryArray<C, ExtEntry>::split
-      (entries().begin(), entries().end(), var, exp, conf, &extEntry);
-    Leaf& other = *new (arena.allocObjectNoCon<Leaf>()) Leaf(middle, entries().end(), arena, conf);
+      (entries().begin(), entries().end(), var, exp, conf, &extEntry, &queries);
+    Leaf& other = *new (pool.alloc(arena, LeafClass, sizeof(Leaf)))
+      Leaf(middle, entries().end(), arena, conf);
     while (middle != entries().end())
       entries().pop_back();
     if (conf.getSortOnInsert())
       std::sort(entries().begin(), entries().end(), Comparer<C>(conf));
+    entries().updateMaskArray(conf);
 
-    Interior& interior = *new (arena.allocObjectNoCon<Interior>())
+    Interior& interior =
+      *new (pool.alloc(arena, InteriorClass, sizeof(Interior)))
       Interior(*this, other, var, exp);
+    interior.setSize(C::LeafSize + 1, C::LeafSize + 1);
     if (C::UseTreeDivMask) {
       entries().recalculateTreeDivMask();
       interior.updateToLowerBound(entries());
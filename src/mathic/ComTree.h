@@ -25,11 +25,27 @@ namespace mathic {
    If FastIndex is false, then Nodes contain an index i. If FastIndex is
    true, then Nodes contain the byte offset i * sizeof(Entry). FastIndex must
    be false if sizeof(Entry) is not a power of two.
+
+   The tree can also be Arity-ary instead of binary. Then the children of
+   node n are at indexes Arity * (n - 1) + 2 up to Arity * n + 1, so the
+   children of a node are next to each other and a sift-down touches fewer
+   levels. left(), right(), sibling(), leftSibling(), isLeft() and isRight()
+   are only available for binary trees. Use firstChild() and next() for
+   other arities.
+
+   If CacheAligned is true, then the array is placed so that index 2 is at
+   the start of a cache line. If Arity * sizeof(Entry) divides
+   CacheLineSize, then every group of siblings lies inside a single
+   cache line, so looking at all the children of a node costs at most one
+   cache miss.
   */
-  template<class Entry, bool FastIndex>
+  template<class Entry, bool FastIndex, size_t Arity = 2,
+    bool CacheAligned = false>
   class ComTree {
   public:
     class Node;
+    static const size_t CacheLineSize = 64;
+
     ComTree(size_t initialCapacity = 0);
     ComTree(const ComTree& tree, size_t minCapacity = 0);
     ComTree(ComTree&& tree);
@@ -60,6 +76,7 @@ namespace mathic {
       Node(): _index(fi ? S : 1) {} // the root node is the default
       
       Node parent() const;
+      Node firstChild() const;
       Node left() const;
       Node right() const;
       Node sibling() const;
@@ -73,11 +90,17 @@ namespace mathic {
 
       // Returns a size_t instead of a bool so that the compiler does not
       // have to convert to bool (this silences a MSVC performance warning).
-      size_t isLeft() const {return fi ? !(_index & S) : !(_index & 1);}
+      size_t isLeft() const {
+        MATHIC_ASSERT(A == 2);
+        return fi ? !(_index & S) : !(_index & 1);
+      }
 
       // Returns a size_t instead of a bool so that the compiler does not
       // have to convert to bool (this silences a MSVC performance warning).
-      size_t isRight() const {return fi ? _index & S : _index & 1;}
+      size_t isRight() const {
+        MATHIC_ASSERT(A == 2);
+        return fi ? _index & S : _index & 1;
+      }
 
       bool operator<(Node node) const {return _index < node._index;}
       bool operator<=(Node node) const {return _index <= node._index;}
@@ -87,8 +110,9 @@ namespace mathic {
       bool operator!=(Node node) const {return _index != node._index;}
 
       //private:
-      friend class ComTree<Entry, FastIndex>;
+      friend class ComTree<Entry, FastIndex, Arity, CacheAligned>;
       static const bool fi = FastIndex;
+      static const size_t A = Arity;
       static const size_t S = sizeof(Entry);
       explicit Node(size_t i): _index(i) {}
       size_t getNormalIndex() const {return fi ? _index / S : _index;}
@@ -107,6 +131,15 @@ namespace mathic {
   private:
     ComTree& operator=(const ComTree& tree) const; // not available
 
+    /// The number of extra entries allocated to make room for aligning
+    /// the array when CacheAligned is true.
+    static const size_t AlignSlack =
+      CacheAligned ? CacheLineSize / sizeof(Entry) + 1 : 0;
+
+    /// Allocates room for capacity entries, sets keepAlive to the
+    /// allocated memory and returns the value to use for _array.
+    static Entry* allocate(size_t capacity, Entry*& keepAlive);
+
     Entry* _array;
 
     /// Macaulay 2 uses Mathic and Macaulay 2 also uses the Boehm garbage
@@ -120,38 +153,54 @@ namespace mathic {
     Node _capacityEnd;
   };
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::clear() {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::clear() {
     _lastLeaf = Node(0);
   }
 
-  template<class E, bool FI>
-  size_t ComTree<E, FI>::getMemoryUse() const {
-    return capacity() * sizeof(E);
+  template<class E, bool FI, size_t A, bool CA>
+  size_t ComTree<E, FI, A, CA>::getMemoryUse() const {
+    return capacity() == 0 ? 0 : (capacity() + AlignSlack) * sizeof(E);
+  }
+
+  template<class E, bool FI, size_t A, bool CA>
+  E* ComTree<E, FI, A, CA>::allocate(size_t capacity, E*& keepAlive) {
+    keepAlive = new E[capacity + AlignSlack];
+    if (!CA)
+      return keepAlive - 1;
+    // Index 2 is the first child of the root, so if it starts a cache
+    // line then so does every group of siblings. If no offset achieves
+    // that, then sizeof(E) does not divide CacheLineSize and we do not
+    // align the array.
+    for (size_t offset = 1; offset < AlignSlack; ++offset) {
+      const size_t address = reinterpret_cast<size_t>(keepAlive + offset);
+      if (address % CacheLineSize == 0)
+        return keepAlive + offset - 2;
+    }
+    return keepAlive - 1;
   }
 
-  template<class E, bool FI>
-  std::ostream& operator<<(std::ostream& out, const ComTree<E, FI>& tree) {
+  template<class E, bool FI, size_t A, bool CA>
+  std::ostream& operator<<
+    (std::ostream& out, const ComTree<E, FI, A, CA>& tree) {
     tree.print(out);
     return out;
   }
 
-  template<class E, bool FI>
-  ComTree<E, FI>::ComTree(size_t initialCapacity):
+  template<class E, bool FI, size_t A, bool CA>
+  ComTree<E, FI, A, CA>::ComTree(size_t initialCapacity):
     _array(static_cast<E*>(0) - 1),
     _arrayKeepAlive(0),
     _lastLeaf(0),
     _capacityEnd(Node(0).next(initialCapacity))
   {
-    if (initialCapacity > 0) {
-      _arrayKeepAlive = new E[initialCapacity];
-      _array = _arrayKeepAlive - 1;
-    }
+    if (initialCapacity > 0)
+      _array = allocate(initialCapacity, _arrayKeepAlive);
     MATHIC_ASSERT(isValid());
   }
 
-  template<class E, bool FI>
-  ComTree<E, FI>::ComTree(const ComTree& tree, size_t minCapacity):
+  template<class E, bool FI, size_t A, bool CA>
+  ComTree<E, FI, A, CA>::ComTree(const ComTree& tree, size_t minCapacity):
     _array(static_cast<E*>(0) - 1),
     _arrayKeepAlive(0),
     _lastLeaf(tree._lastLeaf)
@@ -160,8 +209,7 @@ namespace mathic {
       minCapacity = tree.size();
     _capacityEnd = Node(0).next(minCapacity);
     if (minCapacity != 0) {
-      _arrayKeepAlive = new E[minCapacity];
-      _array = _arrayKeepAlive - 1;
+      _array = allocate(minCapacity, _arrayKeepAlive);
       for (Node i; i <= tree.lastLeaf(); ++i)
         (*this)[i] = tree[i];
     }
@@ -169,8 +217,8 @@ namespace mathic {
     MATHIC_ASSERT(isValid());
   }
 
-  template<class E, bool FI>
-  ComTree<E, FI>::ComTree(ComTree&& tree):
+  template<class E, bool FI, size_t A, bool CA>
+  ComTree<E, FI, A, CA>::ComTree(ComTree&& tree):
     _array(tree._array),
     _arrayKeepAlive(tree._arrayKeepAlive),
     _lastLeaf(tree._lastLeaf),
@@ -182,9 +230,9 @@ namespace mathic {
     _capacityEnd = Node(0);
   }
 
-  template<class E, bool FI>
-  inline E& ComTree<E, FI>::operator[](Node n) {
-    MATHIC_ASSERT(_array == _arrayKeepAlive - 1);
+  template<class E, bool FI, size_t A, bool CA>
+  inline E& ComTree<E, FI, A, CA>::operator[](Node n) {
+    MATHIC_ASSERT(CA || _array == _arrayKeepAlive - 1);
     if (!FI)
       return _array[n._index];
     char* base = reinterpret_cast<char*>(_array);
@@ -193,34 +241,34 @@ namespace mathic {
     return *element;
   }
 
-  template<class E, bool FI>
-  inline const E& ComTree<E, FI>::operator[](Node n) const {
-    return const_cast<ComTree<E, FI>*>(this)->operator[](n);
+  template<class E, bool FI, size_t A, bool CA>
+  inline const E& ComTree<E, FI, A, CA>::operator[](Node n) const {
+    return const_cast<ComTree<E, FI, A, CA>*>(this)->operator[](n);
   }
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::pushBack(const E& value) {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::pushBack(const E& value) {
     if (_lastLeaf == _capacityEnd)
       increaseCapacity();
     _lastLeaf = _lastLeaf.next();
     (*this)[lastLeaf()] = value;
   }
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::pushBackWithCapacity(const E& value) {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::pushBackWithCapacity(const E& value) {
     MATHIC_ASSERT(_lastLeaf != _capacityEnd);
     _lastLeaf = _lastLeaf.next();
     (*this)[lastLeaf()] = value;
   }
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::popBack() {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::popBack() {
     MATHIC_ASSERT(_lastLeaf >= Node());
     _lastLeaf = _lastLeaf.prev();
   }
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::swap(ComTree& tree) {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::swap(ComTree& tree) {
     MATHIC_ASSERT(isValid());
     MATHIC_ASSERT(tree.isValid());
 
@@ -233,63 +281,94 @@ namespace mathic {
     MATHIC_ASSERT(tree.isValid());
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::parent() const {
-    return fi ? Node((_index / (2 * S)) * S) : Node(_index / 2);
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::parent() const {
+    if (A == 2)
+      return fi ? Node((_index / (2 * S)) * S) : Node(_index / 2);
+    MATHIC_ASSERT(!isRoot());
+    return fi ?
+      Node(((_index - 2 * S) / (A * S)) * S + S) :
+      Node((_index - 2) / A + 1);
+  }
+
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::firstChild() const {
+    if (A == 2)
+      return left();
+    return fi ? Node(A * _index - (A - 2) * S) : Node(A * _index - (A - 2));
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::left() const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::left() const {
+    MATHIC_ASSERT(A == 2);
     return Node(2 * _index);
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::right() const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::right() const {
+    MATHIC_ASSERT(A == 2);
     return fi ? Node(2 * _index + S) : Node(2 * _index + 1);
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::sibling() const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::sibling() const {
+    MATHIC_ASSERT(A == 2);
     return fi ? Node(_index ^ S) : Node(_index ^ 1);
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::leftSibling() const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::leftSibling() const {
+    MATHIC_ASSERT(A == 2);
     return fi ? Node(_index & ~S) : Node(_index & ~1);
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::next() const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::next() const {
     return fi ? Node(_index + S) : Node(_index + 1);
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::next(size_t count) const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::next(size_t count) const {
     return fi ? Node(_index + S * count) : Node(_index + count);
   }
 
-  template<class E, bool FI>
-  typename ComTree<E, FI>::Node ComTree<E, FI>::Node::prev() const {
+  template<class E, bool FI, size_t A, bool CA>
+  typename ComTree<E, FI, A, CA>::Node
+  ComTree<E, FI, A, CA>::Node::prev() const {
     return fi ? Node(_index - S) : Node(_index - 1);
   }
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::print(std::ostream& out) const {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::print(std::ostream& out) const {
     Node last = lastLeaf();
+    size_t levelBegin = 1;
+    size_t levelSize = 1;
     for (Node i; i <= last; i = i.next()) {
-      if ((i._index & (i._index - 1)) == 0) // if i._index is a power of 2
+      if (i.getNormalIndex() == levelBegin) { // if i starts a new level
         out << "\n " << i._index << ':';
+        levelBegin += levelSize;
+        levelSize *= A;
+      }
       out << ' ' << (*this)[i];
     }
     out << "}\n";
   }
 
-  template<class E, bool FI>
-  bool ComTree<E, FI>::isValid() const {
+  template<class E, bool FI, size_t A, bool CA>
+  bool ComTree<E, FI, A, CA>::isValid() const {
 #ifndef MATHIC_DEBUG
     return true;
 #else
-    MATHIC_ASSERT(_array == _arrayKeepAlive - 1);
+    MATHIC_ASSERT(CA || _array == _arrayKeepAlive - 1);
+    MATHIC_ASSERT(A >= 2);
 
     // sizeof(Entry) must be a power of two if FastIndex is true.
     MATHIC_ASSERT(!FI || (sizeof(E) & (sizeof(E) - 1)) == 0);
@@ -306,16 +385,16 @@ namespace mathic {
 #endif
   }
 
-  template<class E, bool FI>
-  bool ComTree<E, FI>::hasFreeCapacity(size_t extraCapacity) const {
+  template<class E, bool FI, size_t A, bool CA>
+  bool ComTree<E, FI, A, CA>::hasFreeCapacity(size_t extraCapacity) const {
     return Node(_capacityEnd._index - _lastLeaf._index) >=
       Node(0).next(extraCapacity);
   }
 
-  template<class E, bool FI>
-  void ComTree<E, FI>::increaseCapacity() {
+  template<class E, bool FI, size_t A, bool CA>
+  void ComTree<E, FI, A, CA>::increaseCapacity() {
     MATHIC_ASSERT(isValid());
-    ComTree<E, FI> newTree(capacity() == 0 ? 16 : capacity() * 2);
+    ComTree<E, FI, A, CA> newTree(capacity() == 0 ? 16 : capacity() * 2);
     for (Node i; i <= lastLeaf(); i = i.next())
       newTree.pushBack((*this)[i]);
     MATHIC_ASSERT(newTree.isValid());
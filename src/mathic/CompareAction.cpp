@@ -0,0 +1,203 @@
+#include "CompareAction.h"
+
+#include "SimRecord.h"
+#include "ColumnPrinter.h"
+#include "error.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <cmath>
+
+namespace mathic {
+  CompareAction::CompareAction():
+    _threshold("threshold",
+      "Report a regression when a metric gets worse by more than this many "
+      "percent. If the samples of a metric vary by more than this, then "
+      "their variation is used as the threshold instead.",
+      5),
+    _metric("metric",
+      "Only compare the metric with this name. Compare all metrics if empty.",
+      "") {
+  }
+
+  const char* CompareAction::name() const {
+    return staticName();
+  }
+
+  const char* CompareAction::description() const {
+    return
+      "Give the parameters 'compare baseline.csv candidate.csv' to compare "
+      "the results of pqsim or divsim in the two files. Every metric of a "
+      "configuration that appears in both files is compared. If a file has "
+      "several results for the same configuration, such as from appending "
+      "the output of repeated runs, then the medians are compared. It is an "
+      "error if any metric is worse in the candidate by more than the "
+      "threshold.\n";
+  }
+
+  const char* CompareAction::shortDescription() const {
+    return "Compare two files of simulation results.";
+  }
+
+  void CompareAction::directOptions(
+    std::vector<std::string> tokens,
+    CliParser& parser
+  ) {
+    if (tokens.size() != 2)
+      reportError("Expected the names of a baseline and a candidate file.");
+    _baselineFile = tokens[0];
+    _candidateFile = tokens[1];
+  }
+
+  void CompareAction::pushBackParameters
+  (std::vector<CliParameter*>& parameters) {
+    parameters.push_back(&_threshold);
+    parameters.push_back(&_metric);
+  }
+
+  namespace {
+    typedef std::map<std::string, std::vector<SimRecord> > ByKey;
+
+    ByKey groupByKey(const std::vector<SimRecord>& records) {
+      ByKey byKey;
+      for (size_t i = 0; i < records.size(); ++i)
+        byKey[records[i].getKey()].push_back(records[i]);
+      return byKey;
+    }
+
+    /** Collects the values of metric in records into samples. */
+    void getSamples(
+      const std::vector<SimRecord>& records,
+      const std::string& metric,
+      std::vector<double>& samples
+    ) {
+      samples.clear();
+      for (size_t i = 0; i < records.size(); ++i) {
+        const double* value = records[i].findMetric(metric);
+        if (value != 0)
+          samples.push_back(*value);
+      }
+      std::sort(samples.begin(), samples.end());
+    }
+
+    double median(const std::vector<double>& sorted) {
+      MATHIC_ASSERT(!sorted.empty());
+      const size_t middle = sorted.size() / 2;
+      if (sorted.size() % 2 == 1)
+        return sorted[middle];
+      return (sorted[middle - 1] + sorted[middle]) / 2;
+    }
+
+    /** Returns the range of the samples relative to their median. */
+    double spread(const std::vector<double>& sorted) {
+      const double m = median(sorted);
+      return m == 0 ? 0 : (sorted.back() - sorted.front()) / m;
+    }
+
+    std::string percent(double ratio) {
+      std::ostringstream out;
+      out.setf(std::ios::fixed);
+      out.precision(1);
+      out << (ratio > 0 ? "+" : "") << ratio * 100 << '%';
+      return out.str();
+    }
+
+    std::string number(double value) {
+      std::ostringstream out;
+      if (value == std::floor(value) && std::fabs(value) < 1e15)
+        out << static_cast<long long>(value);
+      else {
+        out.setf(std::ios::fixed);
+        out.precision(2);
+        out << value;
+      }
+      return out.str();
+    }
+  }
+
+  void CompareAction::performAction() {
+    const ByKey baseline = groupByKey(readSimRecordsCsv(_baselineFile));
+    const ByKey candidate = groupByKey(readSimRecordsCsv(_candidateFile));
+    const double threshold = _threshold.value() / 100.0;
+
+    ColumnPrinter pr;
+    pr.addColumn(true, "");
+    pr.addColumn(true, " ");
+    pr.addColumn(false, " ");
+    pr.addColumn(false, " ");
+    pr.addColumn(false, " ");
+    pr.addColumn(false, " ", " noise");
+    pr.addColumn(true, " ");
+    pr[0] << "configuration\n";
+    pr[1] << "metric\n";
+    pr[2] << "baseline\n";
+    pr[3] << "candidate\n";
+    pr[4] << "change\n";
+    pr[5] << "samples\n";
+    pr[6] << "\n";
+
+    size_t regressions = 0;
+    std::vector<double> baseSamples;
+    std::vector<double> candSamples;
+    for (ByKey::const_iterator it = candidate.begin();
+      it != candidate.end(); ++it) {
+      ByKey::const_iterator base = baseline.find(it->first);
+      if (base == baseline.end()) {
+        std::cout << "Only in candidate: " << it->first << '\n';
+        continue;
+      }
+      const SimRecord& first = it->second.front();
+      for (size_t m = 0; m < first.getMetrics().size(); ++m) {
+        const std::string& metric = first.getMetrics()[m].first;
+        if (!_metric.value().empty() && metric != _metric.value())
+          continue;
+        getSamples(base->second, metric, baseSamples);
+        getSamples(it->second, metric, candSamples);
+        if (baseSamples.empty() || candSamples.empty())
+          continue;
+
+        const double baseMedian = median(baseSamples);
+        const double candMedian = median(candSamples);
+        const double noise = std::max
+          (threshold, std::max(spread(baseSamples), spread(candSamples)));
+        double change = 0;
+        if (baseMedian != 0)
+          change = (candMedian - baseMedian) / baseMedian;
+        else if (candMedian != 0)
+          change = 1;
+        const char* verdict = "";
+        if (change > noise) {
+          verdict = "REGRESSION";
+          ++regressions;
+        } else if (change < -noise)
+          verdict = "improved";
+
+        pr[0] << it->first << '\n';
+        pr[1] << metric << '\n';
+        pr[2] << number(baseMedian) << '\n';
+        pr[3] << number(candMedian) << '\n';
+        pr[4] << percent(change) << '\n';
+        pr[5] << baseSamples.size() << '/' << candSamples.size()
+          << ' ' << ColumnPrinter::percentDouble(noise) << '\n';
+        pr[6] << verdict << '\n';
+      }
+    }
+    for (ByKey::const_iterator it = baseline.begin();
+      it != baseline.end(); ++it)
+      if (candidate.find(it->first) == candidate.end())
+        std::cout << "Only in baseline: " << it->first << '\n';
+
+    pr.print(std::cout);
+    std::cout << std::flush;
+    if (regressions > 0) {
+      std::ostringstream out;
+      out << regressions << " metrics regressed by more than the threshold.";
+      reportError(out.str());
+    }
+  }
+
+  const char* CompareAction::staticName() {
+    return "compare";
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef MATHIC_COMPARE_ACTION_GUARD
+#define MATHIC_COMPARE_ACTION_GUARD
+
+#include "stdinc.h"
+#include "Action.h"
+#include "IntegerParameter.h"
+#include "StringParameter.h"
+#include <string>
+
+namespace mathic {
+  /** Compares two CSV files of SimRecords written by pqsim or divsim and
+      reports every metric that got worse by more than the noise
+      threshold. A file can hold several samples for each configuration
+      from repeated runs, in which case the medians are compared. Reports
+      an error through reportError if there are any regressions, so that
+      the action can gate changes in automated performance tests. */
+  class CompareAction : public Action {
+  public:
+    CompareAction();
+
+    virtual void directOptions
+      (std::vector<std::string> tokens, CliParser& parser);
+    virtual void performAction();
+
+    virtual const char* name() const;
+    virtual const char* description() const;
+    virtual const char* shortDescription() const;
+    virtual void pushBackParameters(std::vector<CliParameter*>& parameters);
+
+    static const char* staticName();
+
+  private:
+    std::string _baselineFile;
+    std::string _candidateFile;
+    IntegerParameter _threshold;
+    StringParameter _metric;
+  };
+}
+
+#endif
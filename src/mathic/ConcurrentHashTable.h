@@ -0,0 +1,361 @@
+#ifndef MATHIC_CONCURRENT_HASH_TABLE_GUARD
+#define MATHIC_CONCURRENT_HASH_TABLE_GUARD
+
+#include "stdinc.h"
+#include <memtailor.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <string>
+#include <new>
+
+namespace mathic {
+  /** A chained hash table that several threads can insert into and look
+      up in at the same time. It has the same Configuration as HashTable,
+      except that hash and keysEqual must be safe to call from several
+      threads at once.
+
+      * lookup never blocks. It does not take any locks and only follows
+        pointers that are published with release stores.
+
+      * insert takes the lock of one of StripeCount stripes. The stripe
+        of a key is given by the low bits of its hash value, and each bin
+        belongs to a single stripe, so inserts of keys in different stripes
+        proceed in parallel. Two threads inserting the same key always get
+        the same Handle* back, so insert can be used to intern keys.
+
+      * The table grows incrementally. When it gets too full a table with
+        twice as many bins is allocated, and then the stripes are moved to
+        the new table one at a time. An insert moves its own stripe before
+        it inserts and also tries to move one other stripe that no other
+        thread is busy with, so no thread has to rebuild the whole table.
+        finishResize() moves all remaining stripes.
+
+      Handles are never moved, so a Handle* stays valid until reset().
+      There is no remove since a lookup might be reading the entry that
+      is being removed. reset() and memoryUse() must not run concurrently
+      with anything else. */
+  template<class C>
+  class ConcurrentHashTable {
+  public:
+    typedef C Configuration;
+    typedef typename C::Key Key;
+    typedef typename C::Value Value;
+
+    static const size_t StripeCount = 64;
+
+    class Handle {
+    public:
+      friend class ConcurrentHashTable;
+
+      Handle(const Key& k, const Value& v, size_t hash):
+        next(0), hash(hash), entry(k, v) {}
+
+      const Key& key() const {return entry.first;}
+      const Value& value() const {return entry.second;}
+      Value& value() {return entry.second;}
+
+    private:
+      std::atomic<Handle*> next;
+      const size_t hash;
+      std::pair<Key, Value> entry;
+    };
+
+    /** Creates a table with max(2^nbits, StripeCount) bins. */
+    ConcurrentHashTable(const Configuration& conf, unsigned int nbits = 10);
+    ~ConcurrentHashTable();
+
+    Configuration& configuration() {return mConf;}
+    Configuration const& configuration() const {return mConf;}
+
+    /** If k is already in the table then returns (false, handle of k).
+        Otherwise inserts k with value v and returns (true, new handle). */
+    std::pair<bool, Handle*> insert(Key const& k, Value const& v);
+
+    /** Returns the handle of k if k is in the table and otherwise null. */
+    Handle* lookup(const Key& k);
+
+    /** Moves every stripe to the newest table, waiting for locks as
+        needed. */
+    void finishResize();
+
+    /** Removes all entries. */
+    void reset();
+
+    size_t size() const {return mSize.load(std::memory_order_relaxed);}
+
+    /** Returns how many bytes of memory this data structure consumes
+        not including sizeof(*this). */
+    size_t memoryUse() const;
+
+    std::string name() const {return "ConcurrentHashTable";}
+
+  private:
+    ConcurrentHashTable(const ConcurrentHashTable&); // unavailable
+    void operator=(const ConcurrentHashTable&); // unavailable
+
+    struct Table {
+      Table(size_t binCount);
+      ~Table() {delete[] bins;}
+
+      const size_t mask; // number of bins minus 1
+      std::atomic<Handle*>* const bins;
+
+      /// The table that the entries are moved to when this table has
+      /// grown too full. Null until then.
+      std::atomic<Table*> successor;
+    };
+
+    struct Stripe {
+      Stripe(): pool(sizeof(Handle)), table(0) {}
+
+      std::mutex lock;
+      memt::BufferPool pool; // the handles of this stripe
+      Table* table; // the table that has the entries of this stripe
+      char padding[64]; // keep stripes on separate cache lines
+    };
+
+    Stripe& stripeOf(size_t hash) {
+      return mStripes[hash & (StripeCount - 1)];
+    }
+
+    /** Moves the entries of stripe from stripe.table to the successor of
+        that table. The lock of stripe must be held. */
+    void moveStripe(Stripe& stripe);
+
+    /** Starts a resize if the newest table is too full and no resize is
+        in progress. */
+    void maybeStartResize();
+
+    /** Moves one stripe that has not been moved yet if its lock is free. */
+    void helpResize();
+
+    void clear();
+
+    Configuration mConf;
+    Stripe* mStripes;
+
+    /// Lookups start at mOldest and follow successor pointers. Every table
+    /// before mOldest is empty.
+    std::atomic<Table*> mOldest;
+    std::atomic<Table*> mNewest;
+
+    /// The number of stripes that have yet to be moved to mNewest.
+    std::atomic<size_t> mStripesToMove;
+    std::atomic<size_t> mHelpCursor;
+    std::atomic<size_t> mSize;
+
+    /// Lookups might still be reading an old table after it has been
+    /// emptied, so tables are only deleted by reset and the destructor.
+    /// Guarded by mResizeLock.
+    std::vector<Table*> mTables;
+    std::mutex mResizeLock;
+  };
+
+  template<class C>
+  ConcurrentHashTable<C>::Table::Table(size_t binCount):
+    mask(binCount - 1),
+    bins(new std::atomic<Handle*>[binCount]),
+    successor(0)
+  {
+    MATHIC_ASSERT((binCount & mask) == 0);
+    for (size_t bin = 0; bin < binCount; ++bin)
+      bins[bin].store(0, std::memory_order_relaxed);
+  }
+
+  template<class C>
+  ConcurrentHashTable<C>::ConcurrentHashTable
+  (const Configuration& conf, unsigned int nbits):
+    mConf(conf),
+    mStripes(new Stripe[StripeCount]),
+    mOldest(0),
+    mNewest(0),
+    mStripesToMove(0),
+    mHelpCursor(0),
+    mSize(0)
+  {
+    size_t binCount = static_cast<size_t>(1) << nbits;
+    if (binCount < StripeCount)
+      binCount = StripeCount;
+    try {
+      mTables.push_back(new Table(binCount));
+    } catch (...) {
+      delete[] mStripes;
+      throw;
+    }
+    for (size_t i = 0; i < StripeCount; ++i)
+      mStripes[i].table = mTables.back();
+    mOldest.store(mTables.back());
+    mNewest.store(mTables.back());
+  }
+
+  template<class C>
+  ConcurrentHashTable<C>::~ConcurrentHashTable() {
+    clear();
+    delete[] mStripes;
+  }
+
+  template<class C>
+  void ConcurrentHashTable<C>::clear() {
+    for (size_t i = 0; i < mTables.size(); ++i)
+      delete mTables[i];
+    mTables.clear();
+    for (size_t i = 0; i < StripeCount; ++i)
+      mStripes[i].pool.freeAllBuffers();
+  }
+
+  template<class C>
+  typename ConcurrentHashTable<C>::Handle*
+  ConcurrentHashTable<C>::lookup(const Key& k) {
+    const size_t hash = mConf.hash(k);
+    // An entry that is being moved is put into the new table before it is
+    // taken out of the old table, so looking in the tables from oldest to
+    // newest finds every entry.
+    Table* table = mOldest.load(std::memory_order_acquire);
+    for (; table != 0;
+      table = table->successor.load(std::memory_order_acquire)) {
+      Handle* handle =
+        table->bins[hash & table->mask].load(std::memory_order_acquire);
+      for (; handle != 0;
+        handle = handle->next.load(std::memory_order_acquire))
+        if (handle->hash == hash && mConf.keysEqual(handle->key(), k))
+          return handle;
+    }
+    return 0;
+  }
+
+  template<class C>
+  std::pair<bool, typename ConcurrentHashTable<C>::Handle*>
+  ConcurrentHashTable<C>::insert(const Key& k, const Value& v) {
+    const size_t hash = mConf.hash(k);
+    Stripe& stripe = stripeOf(hash);
+    Handle* handle;
+    {
+      std::lock_guard<std::mutex> guard(stripe.lock);
+      if (stripe.table != mNewest.load(std::memory_order_acquire))
+        moveStripe(stripe);
+
+      // all the entries of this stripe are in stripe.table now.
+      Table* const table = stripe.table;
+      std::atomic<Handle*>& bin = table->bins[hash & table->mask];
+      Handle* const head = bin.load(std::memory_order_relaxed);
+      for (handle = head; handle != 0;
+        handle = handle->next.load(std::memory_order_relaxed))
+        if (handle->hash == hash && mConf.keysEqual(handle->key(), k))
+          return std::make_pair(false, handle);
+
+      handle = new (stripe.pool.alloc()) Handle(k, v, hash);
+      handle->next.store(head, std::memory_order_relaxed);
+      bin.store(handle, std::memory_order_release);
+    }
+    mSize.fetch_add(1, std::memory_order_relaxed);
+
+    if (mStripesToMove.load(std::memory_order_relaxed) != 0)
+      helpResize();
+    else
+      maybeStartResize();
+    return std::make_pair(true, handle);
+  }
+
+  template<class C>
+  void ConcurrentHashTable<C>::moveStripe(Stripe& stripe) {
+    Table* const from = stripe.table;
+    Table* const to = from->successor.load(std::memory_order_acquire);
+    MATHIC_ASSERT(to != 0);
+    const size_t firstBin = &stripe - mStripes;
+    for (size_t bin = firstBin; bin <= from->mask; bin += StripeCount) {
+      std::atomic<Handle*>& head = from->bins[bin];
+      while (head.load(std::memory_order_relaxed) != 0) {
+        // Move the last entry of the chain. A lookup that is at that
+        // entry continues into the chain of the new table, which is
+        // harmless. Moving an entry in the middle of the chain would make
+        // such a lookup miss the rest of the old chain.
+        std::atomic<Handle*>* link = &head;
+        Handle* last = head.load(std::memory_order_relaxed);
+        while (true) {
+          Handle* const next = last->next.load(std::memory_order_relaxed);
+          if (next == 0)
+            break;
+          link = &last->next;
+          last = next;
+        }
+        std::atomic<Handle*>& newHead = to->bins[last->hash & to->mask];
+        last->next.store
+          (newHead.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        newHead.store(last, std::memory_order_release);
+        link->store(0, std::memory_order_release);
+      }
+    }
+    stripe.table = to;
+    if (mStripesToMove.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      mOldest.store(to, std::memory_order_release);
+  }
+
+  template<class C>
+  void ConcurrentHashTable<C>::maybeStartResize() {
+    Table* newest = mNewest.load(std::memory_order_acquire);
+    // grow when there are more entries than bins
+    if (mSize.load(std::memory_order_relaxed) <= newest->mask + 1)
+      return;
+    std::unique_lock<std::mutex> guard(mResizeLock, std::try_to_lock);
+    if (!guard.owns_lock())
+      return; // some other thread is starting a resize
+    newest = mNewest.load(std::memory_order_acquire);
+    if (mStripesToMove.load(std::memory_order_acquire) != 0 ||
+      mSize.load(std::memory_order_relaxed) <= newest->mask + 1)
+      return;
+
+    mTables.push_back(0);
+    Table* const table = new Table(2 * (newest->mask + 1));
+    mTables.back() = table;
+    mStripesToMove.store(StripeCount, std::memory_order_release);
+    newest->successor.store(table, std::memory_order_release);
+    mNewest.store(table, std::memory_order_release);
+  }
+
+  template<class C>
+  void ConcurrentHashTable<C>::helpResize() {
+    const size_t index =
+      mHelpCursor.fetch_add(1, std::memory_order_relaxed) % StripeCount;
+    Stripe& stripe = mStripes[index];
+    std::unique_lock<std::mutex> guard(stripe.lock, std::try_to_lock);
+    if (guard.owns_lock() &&
+      stripe.table != mNewest.load(std::memory_order_acquire))
+      moveStripe(stripe);
+  }
+
+  template<class C>
+  void ConcurrentHashTable<C>::finishResize() {
+    for (size_t i = 0; i < StripeCount; ++i) {
+      std::lock_guard<std::mutex> guard(mStripes[i].lock);
+      if (mStripes[i].table != mNewest.load(std::memory_order_acquire))
+        moveStripe(mStripes[i]);
+    }
+  }
+
+  template<class C>
+  void ConcurrentHashTable<C>::reset() {
+    const size_t binCount = mNewest.load()->mask + 1;
+    clear();
+    mTables.push_back(new Table(binCount));
+    for (size_t i = 0; i < StripeCount; ++i)
+      mStripes[i].table = mTables.back();
+    mOldest.store(mTables.back());
+    mNewest.store(mTables.back());
+    mStripesToMove.store(0);
+    mSize.store(0);
+  }
+
+  template<class C>
+  size_t ConcurrentHashTable<C>::memoryUse() const {
+    size_t result = 0;
+    for (size_t i = 0; i < mTables.size(); ++i)
+      result += (mTables[i]->mask + 1) * sizeof(std::atomic<Handle*>);
+    for (size_t i = 0; i < StripeCount; ++i)
+      result += mStripes[i].pool.getMemoryUse();
+    return result;
+  }
+}
+
+#endif
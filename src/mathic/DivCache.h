@@ -0,0 +1,118 @@
+#ifndef MATHIC_DIV_CACHE_GUARD
+#define MATHIC_DIV_CACHE_GUARD
+
+#include "stdinc.h"
+#include "DivMask.h"
+
+namespace mathic {
+  namespace DivCacheInternal {
+    /** Value is C::DivisorCacheSize if C declares it and otherwise
+        Default. */
+    MATHIC_DEFINE_OPTIONAL_FIELD(SizeOf, size_t, DivisorCacheSize, 0);
+  }
+
+  /** Remembers up to Capacity entries that were recently found as
+      divisors so that a divisor query can check those before it
+      searches the whole data structure. This pays off when the queries
+      keep coming back to a handful of divisors, as when reducing by a
+      few frequently used reducers.
+
+      The div mask of each cached entry is kept next to it, so a cached
+      entry that cannot divide a query is usually ruled out without
+      looking at its exponents. The masks are computed with the
+      calculator passed to add(), so the cache must be cleared when the
+      owner starts using a different calculator. It must also be cleared
+      whenever the entries might have moved or been removed, since the
+      cache holds pointers to them.
+
+      When the cache is full, add() replaces an entry using the CLOCK
+      approximation of least recently used: each entry has a bit that a
+      hit sets, and a hand goes around the entries clearing those bits
+      until it finds an entry whose bit is not set, which is replaced.
+      With a Capacity of 1 this always replaces the single entry, and a
+      Capacity of 0 caches nothing. */
+  template<class C, size_t Capacity>
+  class DivCache {
+  public:
+    typedef typename C::Entry Entry;
+    typedef typename DivMaskOf<C>::template Calculator<C> DivMaskCalculator;
+
+    DivCache(): _size(0), _hand(0), _hits(0), _misses(0) {}
+
+    /** Returns a cached entry that divides extMonomial, or null if there
+        is none. The div mask of extMonomial must have been computed by
+        the calculator that was passed to add(). */
+    template<class ExtMono>
+    Entry* find(const ExtMono& extMonomial, const C& conf) {
+      for (size_t i = 0; i < _size; ++i) {
+        Slot& slot = _slots[i];
+        if (slot.canDivide(extMonomial) &&
+          conf.divides(*slot.entry, extMonomial.get())) {
+          slot.referenced = true;
+          ++_hits;
+          return slot.entry;
+        }
+      }
+      ++_misses;
+      return 0;
+    }
+
+    /** Caches divisor. Does nothing if divisor is already cached. */
+    void add(Entry* divisor, const DivMaskCalculator& calc, const C& conf) {
+      MATHIC_ASSERT(divisor != 0);
+      if (Capacity == 0)
+        return;
+      for (size_t i = 0; i < _size; ++i)
+        if (_slots[i].entry == divisor)
+          return;
+      size_t index;
+      if (_size < Capacity)
+        index = _size++;
+      else {
+        while (_slots[_hand].referenced) {
+          _slots[_hand].referenced = false;
+          _hand = (_hand + 1) % Capacity;
+        }
+        index = _hand;
+        _hand = (_hand + 1) % Capacity;
+      }
+      _slots[index].set(divisor, calc, conf);
+    }
+
+    /** Forgets all cached entries. The hit and miss counts are kept. */
+    void clear() {
+      _size = 0;
+      _hand = 0;
+    }
+
+    /** The number of cached entries. */
+    size_t size() const {return _size;}
+
+    /** The number of calls to find() that returned an entry. */
+    unsigned long long getHitCount() const {return _hits;}
+
+    /** The number of calls to find() that returned null. */
+    unsigned long long getMissCount() const {return _misses;}
+
+  private:
+    class Slot : public DivMaskOf<C>::template HasDivMask<C::UseDivMask> {
+    public:
+      void set(Entry* e, const DivMaskCalculator& calc, const C& conf) {
+        entry = e;
+        referenced = false;
+        this->recalculateDivMask(*e, calc, conf);
+      }
+
+      Entry* entry;
+      bool referenced; /// Set on a hit, cleared as the CLOCK hand passes.
+    };
+
+    Slot _slots[Capacity == 0 ? 1 : Capacity];
+    size_t _size;
+    size_t _hand; /// The next slot to consider for replacement.
+    unsigned long long _hits;
+    unsigned long long _misses;
+  };
+}
+
+#endif
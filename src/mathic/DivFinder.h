@@ -42,6 +42,11 @@
   Set to true to use div masks to speed up queries. This must be a
   static const data member.
 
+ * static const size_t DivMaskBits
+  Optional. The number of bits in each div mask, which can be 32, 64,
+  128 or 256. The default is 32. The bits are spread over the variables,
+  so with many variables a wider mask rules out more divisors.
+
  * size_t getUseAutomaticRebuild() const
  * double getRebuildRatio() const
  * size_t getRebuildMin() const
@@ -64,6 +69,11 @@
  X has returned. This is because the DivFinder may not be in a valid state
  at the time it is calling X.
 
+ A KDTree can be queried from several threads at the same time through
+ its const methods as long as no thread changes it meanwhile. For that
+ to work, the const methods of the Configuration must also be safe to
+ call concurrently.
+
  @todo: put these docs somewhere else.
 */
 namespace {
@@ -3,6 +3,7 @@
 
 #include "stdinc.h"
 #include "DivMask.h"
+#include "DivCache.h"
 #include "Comparer.h"
 #include <memtailor.h>
 #include <vector>
@@ -25,6 +26,11 @@ namespace mathic {
 
       * bool getSortOnInsert() const
       Keep the monomials sorted to speed up queries.
+
+      * static const size_t DivisorCacheSize
+      Optional. The non-const findDivisor and findDivisors first check
+      the last DivisorCacheSize divisors that they found. The default is
+      0, which turns the cache off. See DivCache.h.
   */
   template<class Configuration>
     class DivList;
@@ -57,9 +63,14 @@ namespace mathic {
     static const bool UseDivMask = C::UseDivMask;
 
   private:
-    typedef typename DivMask::Extender<Entry, C::UseDivMask> ExtEntry;
-    typedef typename DivMask::Extender<const Monomial&,C::UseDivMask> ExtMonoRef;
-    typedef typename DivMask::Calculator<C> DivMaskCalculator;
+    typedef typename DivMaskOf<C>::template Extender<Entry, C::UseDivMask>
+      ExtEntry;
+    typedef typename DivMaskOf<C>::template
+      Extender<const Monomial&, C::UseDivMask> ExtMonoRef;
+    typedef typename DivMaskOf<C>::template Calculator<C> DivMaskCalculator;
+    static const size_t DivisorCacheSize =
+      DivCacheInternal::SizeOf<C, 0>::Value;
+    typedef DivCache<C, DivisorCacheSize> RecentDivisors;
 
     typedef typename DivListHelper::ListImpl<C::UseLinkedList, ExtEntry>::Impl
       List;
@@ -88,6 +99,9 @@ namespace mathic {
     Entry* findDivisor(const Monomial& monomial);
     const Entry* findDivisor(const Monomial& monomial) const;
 
+    template<class Iter, class DivisorOutput>
+    void findDivisors(Iter begin, Iter end, DivisorOutput out);
+
     template<class DO>
     void findAllDivisors(const Monomial& monomial, DO& out);
     template<class DO>
@@ -132,6 +146,19 @@ namespace mathic {
 		avoid frequent allocations. */
     size_t getMemoryUse() const;
 
+    /** The number of queries to the non-const findDivisor and
+        findDivisors that were answered by the divisor cache. */
+    unsigned long long getDivisorCacheHitCount() const {
+      return _divisorCache.getHitCount();
+    }
+
+    /** The number of queries to the non-const findDivisor and
+        findDivisors that checked the divisor cache without finding a
+        divisor there. */
+    unsigned long long getDivisorCacheMissCount() const {
+      return _divisorCache.getMissCount();
+    }
+
   private:
     DivList(const DivList<C>&); // unavailable
     void operator=(const DivList<C>&); // unavailable
@@ -139,6 +166,9 @@ namespace mathic {
     void resetNumberOfChangesTillRebuild();
     void reportChanges(size_t changesMadeCount);
 
+    /// Returns the first divisor in the list without using the cache.
+    Entry* searchDivisor(const ExtMonoRef& extMonomial);
+
     template<class DO>
     class ConstEntryOutput {
     public:
@@ -156,6 +186,7 @@ namespace mathic {
     C _conf;
     DivMaskCalculator _divMaskCalculator;
     size_t _changesTillRebuild; /// Update using reportChanges().
+    RecentDivisors _divisorCache; /// The divisors of recent queries.
   };
 
   template<class C>
@@ -457,6 +488,7 @@ namespace mathic {
         }
       }
       _list.erase(it);
+      _divisorCache.clear();
       return true;
     skip:;
     }
@@ -483,7 +515,28 @@ namespace mathic {
   typename DivList<C>::Entry*
   DivList<C>::findDivisor(const Monomial& monomial) {
     ExtMonoRef extMonomial(monomial, _divMaskCalculator, _conf);
+    if (DivisorCacheSize == 0)
+      return searchDivisor(extMonomial);
+
+    Entry* divisor = _divisorCache.find(extMonomial, _conf);
+    if (divisor == 0) {
+      divisor = searchDivisor(extMonomial);
+      if (divisor != 0)
+        _divisorCache.add(divisor, _divMaskCalculator, _conf);
+    }
+    return divisor;
+  }
+
+  template<class C>
+  const typename DivList<C>::Entry*
+  DivList<C>::findDivisor(const Monomial& monomial) const {
+    ExtMonoRef extMonomial(monomial, _divMaskCalculator, _conf);
+    return const_cast<DivList<C>&>(*this).searchDivisor(extMonomial);
+  }
 
+  template<class C>
+  typename DivList<C>::Entry*
+  DivList<C>::searchDivisor(const ExtMonoRef& extMonomial) {
     if (!_conf.getSortOnInsert()) {
       const ListIter listEnd = _list.end();
       for (ListIter it = _list.begin(); it != listEnd; ++it) {
@@ -498,9 +551,58 @@ namespace mathic {
   }
 
   template<class C>
-  const typename DivList<C>::Entry*
-  DivList<C>::findDivisor(const Monomial& monomial) const {
-    return const_cast<DivList<C>&>(*this).findDivisor(monomial);
+  template<class Iter, class DivisorOutput>
+  void DivList<C>::findDivisors(Iter begin, Iter end, DivisorOutput out) {
+    // The list is scanned once for the whole batch with the queries that
+    // have not found a divisor yet in the inner loop. Each query that the
+    // divisor cache does not answer gets the first divisor in the list,
+    // as with findDivisor.
+    std::vector<ExtMonoRef> queries;
+    for (; begin != end; ++begin)
+      queries.push_back(ExtMonoRef(*begin, _divMaskCalculator, _conf));
+    std::vector<Entry*> divisors(queries.size());
+    std::vector<size_t> open;
+    for (size_t q = 0; q < queries.size(); ++q) {
+      if (DivisorCacheSize != 0)
+        divisors[q] = _divisorCache.find(queries[q], _conf);
+      if (divisors[q] == 0)
+        open.push_back(q);
+    }
+    const std::vector<size_t> searched(open);
+
+    size_t openCount = open.size();
+    size_t count = 0;
+    const ListIter listEnd = _list.end();
+    for (ListIter it = _list.begin(); it != listEnd && openCount > 0; ++it) {
+      // when sorted, entries after one that is greater than a query
+      // cannot divide that query.
+      const bool checkOrder = _conf.getSortOnInsert() && ++count == 35;
+      if (checkOrder)
+        count = 0;
+      size_t stillOpen = 0;
+      for (size_t i = 0; i < openCount; ++i) {
+        const size_t q = open[i];
+        if (checkOrder && _conf.isLessThan(queries[q].get(), it->get()))
+          continue;
+        if (it->divides(queries[q], _conf))
+          divisors[q] = &it->get();
+        else
+          open[stillOpen++] = q;
+      }
+      openCount = stillOpen;
+    }
+
+    if (DivisorCacheSize != 0) {
+      for (size_t i = 0; i < searched.size(); ++i) {
+        Entry* divisor = divisors[searched[i]];
+        if (divisor != 0)
+          _divisorCache.add(divisor, _divMaskCalculator, _conf);
+      }
+    }
+    for (size_t q = 0; q < divisors.size(); ++q) {
+      *out = divisors[q];
+      ++out;
+    }
   }
 
   template<class C>
@@ -564,12 +666,18 @@ namespace mathic {
     }
     out << (_conf.getSortOnInsert() ? " sort" : "")
         << (UseDivMask ? " dmask" : "");
+    const size_t maskBits = DivMaskOf<C>::BitCount;
+    if (UseDivMask && maskBits != DivMask::BitCount)
+      out << ':' << maskBits;
+    if (DivisorCacheSize != 0)
+      out << " cache:" << DivisorCacheSize;
     return out.str();
   }
 
   template<class C>
     void DivList<C>::moveToFront(iterator pos) {
     DivListHelper::moveToFront(_list, pos.getInternal());
+    _divisorCache.clear(); // the entries moved
   }
 
   template<class C>
@@ -587,6 +695,7 @@ namespace mathic {
 
   template<class C>
     void DivList<C>::resetNumberOfChangesTillRebuild() {
+    _divisorCache.clear();
     if (!_conf.getDoAutomaticRebuilds())
       return;
     MATHIC_ASSERT(_conf.getRebuildRatio() > 0);
@@ -599,6 +708,8 @@ namespace mathic {
     void DivList<C>::reportChanges(size_t changesMadeCount) {
     // note how negative value/overflow of _changesTillRebuild cannot
     // happen this way.
+    if (changesMadeCount != 0)
+      _divisorCache.clear();
     if (!_conf.getDoAutomaticRebuilds())
       return;
     if (_changesTillRebuild > changesMadeCount)
@@ -1,7 +1,22 @@
 #include "DivMask.h"
 
-#ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// GCC and Clang can compile SSE2 and AVX2 code into functions of their
+// own regardless of the target architecture so that the best version
+// can be chosen at run time.
+#define MATHIC_DIV_MASK_SSE2
+#define MATHIC_DIV_MASK_AVX2
+#define MATHIC_DIV_MASK_TARGET(X) __attribute__((target(X)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+// SSE2 is always there on x64.
+#define MATHIC_DIV_MASK_SSE2
+#define MATHIC_DIV_MASK_TARGET(X)
+#include <emmintrin.h>
+#endif
+
 namespace mathic {
+#ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
   namespace DivMaskStats {
     unsigned long maskComputes = 0;
     unsigned long maskChecks = 0;
@@ -10,9 +25,131 @@ namespace mathic {
     unsigned long divDivides = 0;
     unsigned long divHits = 0;
   }
-}
-#else
-// The purpose of dummy is to silence a MSVC linker warning
-// that says that this file is not adding anything to the build.
-namespace {void dummy(){}}
 #endif
+
+  namespace {
+    typedef unsigned int Mask;
+    typedef size_t (*FindFunction)
+      (const Mask* masks, size_t count, Mask mask, size_t* out);
+
+    /** If Multiples is false then the mask at index i passes if it
+        can divide mask, otherwise it passes if mask can divide it. The
+        indices that pass are appended to out without branching. */
+    template<bool Multiples>
+    size_t findScalar(const Mask* masks, size_t count, Mask mask, size_t* out) {
+      size_t found = 0;
+      for (size_t i = 0; i < count; ++i) {
+        const Mask fail = Multiples ? mask & ~masks[i] : masks[i] & ~mask;
+        out[found] = i;
+        found += (fail == 0);
+      }
+      return found;
+    }
+
+    /** Appends base + i to out for each bit i that is set among the
+        lowest Width bits of bits. */
+    template<size_t Width>
+    inline size_t appendSetBits(int bits, size_t base, size_t* out) {
+      size_t found = 0;
+      for (size_t i = 0; i < Width; ++i) {
+        out[found] = base + i;
+        found += (bits >> i) & 1;
+      }
+      return found;
+    }
+
+#ifdef MATHIC_DIV_MASK_SSE2
+    template<bool Multiples>
+    MATHIC_DIV_MASK_TARGET("sse2")
+    size_t findSse2(const Mask* masks, size_t count, Mask mask, size_t* out) {
+      const __m128i broadcast = _mm_set1_epi32(static_cast<int>(mask));
+      const __m128i zero = _mm_setzero_si128();
+      size_t found = 0;
+      size_t i = 0;
+      for (; i + 4 <= count; i += 4) {
+        const __m128i block =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks + i));
+        // _mm_andnot_si128(a, b) computes ~a & b.
+        const __m128i fail = Multiples ?
+          _mm_andnot_si128(block, broadcast) :
+          _mm_andnot_si128(broadcast, block);
+        const int pass = _mm_movemask_ps
+          (_mm_castsi128_ps(_mm_cmpeq_epi32(fail, zero)));
+        found += appendSetBits<4>(pass, i, out + found);
+      }
+      for (; i < count; ++i) {
+        const Mask fail = Multiples ? mask & ~masks[i] : masks[i] & ~mask;
+        out[found] = i;
+        found += (fail == 0);
+      }
+      return found;
+    }
+#endif
+
+#ifdef MATHIC_DIV_MASK_AVX2
+    template<bool Multiples>
+    MATHIC_DIV_MASK_TARGET("avx2")
+    size_t findAvx2(const Mask* masks, size_t count, Mask mask, size_t* out) {
+      const __m256i broadcast = _mm256_set1_epi32(static_cast<int>(mask));
+      const __m256i zero = _mm256_setzero_si256();
+      size_t found = 0;
+      size_t i = 0;
+      for (; i + 8 <= count; i += 8) {
+        const __m256i block =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(masks + i));
+        const __m256i fail = Multiples ?
+          _mm256_andnot_si256(block, broadcast) :
+          _mm256_andnot_si256(broadcast, block);
+        const int pass = _mm256_movemask_ps
+          (_mm256_castsi256_ps(_mm256_cmpeq_epi32(fail, zero)));
+        found += appendSetBits<8>(pass, i, out + found);
+      }
+      for (; i < count; ++i) {
+        const Mask fail = Multiples ? mask & ~masks[i] : masks[i] & ~mask;
+        out[found] = i;
+        found += (fail == 0);
+      }
+      return found;
+    }
+#endif
+
+    /** Returns the fastest version of find that the CPU supports. */
+    template<bool Multiples>
+    FindFunction selectFind() {
+#ifdef MATHIC_DIV_MASK_AVX2
+      if (__builtin_cpu_supports("avx2"))
+        return &findAvx2<Multiples>;
+#endif
+#if defined(MATHIC_DIV_MASK_SSE2) && defined(__GNUC__)
+      if (__builtin_cpu_supports("sse2"))
+        return &findSse2<Multiples>;
+#elif defined(MATHIC_DIV_MASK_SSE2)
+      return &findSse2<Multiples>;
+#endif
+      return &findScalar<Multiples>;
+    }
+
+    template<bool Multiples>
+    size_t find(const Mask* masks, size_t count, Mask mask, size_t* out) {
+      static const FindFunction function = selectFind<Multiples>();
+      const size_t found = function(masks, count, mask, out);
+#ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
+      DivMaskStats::maskChecks += count;
+      DivMaskStats::maskHits += count - found;
+#endif
+      return found;
+    }
+  }
+
+  namespace DivMaskInternal {
+    size_t findMaybeDivisors(const unsigned int* masks, size_t count,
+      const unsigned int& mask, size_t* out) {
+      return find<false>(masks, count, mask, out);
+    }
+
+    size_t findMaybeMultiples(const unsigned int* masks, size_t count,
+      const unsigned int& mask, size_t* out) {
+      return find<true>(masks, count, mask, out);
+    }
+  }
+}
@@ -5,6 +5,17 @@
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 // Value x means do 2^x mask checks before printing stats
 //#define MATHIC_TRACK_DIV_MASK_HIT_RATIO 25
@@ -26,10 +37,182 @@ namespace mathic {
   }
 #endif
 
+  template<size_t Bits>
+  class BasicDivMask;
+
+  /** The div mask used when the Configuration does not ask for a
+      particular width. */
+  typedef BasicDivMask<32> DivMask;
+
+  namespace DivMaskInternal {
+    // Implementation details for BasicDivMask.
+
+    /** A mask of 64 * Words bits. The point of this over a plain array
+        is that isSubsetOf compiles to a few vector instructions where
+        the target supports them. */
+    template<size_t Words>
+    class WideWord {
+    public:
+      WideWord() {
+        for (size_t i = 0; i < Words; ++i)
+          _words[i] = 0;
+      }
+
+      WideWord operator~() const {
+        WideWord complement;
+        for (size_t i = 0; i < Words; ++i)
+          complement._words[i] = ~_words[i];
+        return complement;
+      }
+
+      WideWord& operator&=(const WideWord& word) {
+        for (size_t i = 0; i < Words; ++i)
+          _words[i] &= word._words[i];
+        return *this;
+      }
+
+      bool operator==(const WideWord& word) const {
+        for (size_t i = 0; i < Words; ++i)
+          if (_words[i] != word._words[i])
+            return false;
+        return true;
+      }
+      bool operator!=(const WideWord& word) const {return !(*this == word);}
+
+      unsigned long long _words[Words];
+    };
+
+    /** Word<Bits>::Type holds a div mask of Bits bits. */
+    template<size_t Bits>
+    struct Word; // only 32, 64, 128 and 256 bits are supported
+    template<>
+    struct Word<32> {typedef unsigned int Type;};
+    template<>
+    struct Word<64> {typedef unsigned long long Type;};
+    template<>
+    struct Word<128> {typedef WideWord<2> Type;};
+    template<>
+    struct Word<256> {typedef WideWord<4> Type;};
+
+    /** Returns true if every bit that is set in a is also set in b. */
+    template<class W>
+    bool isSubsetOf(W a, W b) {return (a & ~b) == 0;}
+
+    template<size_t Words>
+    bool isSubsetOf(const WideWord<Words>& a, const WideWord<Words>& b) {
+#ifdef __AVX__
+      if (Words % 4 == 0) {
+        for (size_t i = 0; i < Words; i += 4) {
+          const __m256i va = _mm256_loadu_si256
+            (reinterpret_cast<const __m256i*>(a._words + i));
+          const __m256i vb = _mm256_loadu_si256
+            (reinterpret_cast<const __m256i*>(b._words + i));
+          // _mm256_testc_si256(x, y) is 1 if ~x & y is zero.
+          if (!_mm256_testc_si256(vb, va))
+            return false;
+        }
+        return true;
+      }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+      if (Words % 2 == 0) {
+        __m128i missing = _mm_setzero_si128();
+        for (size_t i = 0; i < Words; i += 2) {
+          const __m128i va = _mm_loadu_si128
+            (reinterpret_cast<const __m128i*>(a._words + i));
+          const __m128i vb = _mm_loadu_si128
+            (reinterpret_cast<const __m128i*>(b._words + i));
+          missing = _mm_or_si128(missing, _mm_andnot_si128(vb, va));
+        }
+#ifdef __SSE4_1__
+        return _mm_testz_si128(missing, missing) != 0;
+#else
+        return _mm_movemask_epi8
+          (_mm_cmpeq_epi8(missing, _mm_setzero_si128())) == 0xFFFF;
+#endif
+      }
+#endif
+      unsigned long long missing = 0;
+      for (size_t i = 0; i < Words; ++i)
+        missing |= a._words[i] & ~b._words[i];
+      return missing == 0;
+    }
+
+    /** Sets the bit at index in mask if value is true. */
+    template<class W>
+    void setBitIf(W& mask, size_t index, bool value) {
+      mask |= static_cast<W>(value) << index;
+    }
+
+    template<size_t Words>
+    void setBitIf(WideWord<Words>& mask, size_t index, bool value) {
+      const size_t WordBits = sizeof(unsigned long long) * BitsPerByte;
+      mask._words[index / WordBits] |=
+        static_cast<unsigned long long>(value) << (index % WordBits);
+    }
+
+    /** Writes each index i in [0, count) such that masks[i] is a subset
+        of mask to out in increasing order and returns the number of
+        such indices. out must have space for count indices. If
+        Multiples is true then it is the indices where mask is a subset
+        of masks[i] instead. */
+    template<bool Multiples, class W>
+    size_t findSubsets(const W* masks, size_t count, const W& mask, size_t* out) {
+      size_t found = 0;
+      for (size_t i = 0; i < count; ++i) {
+        const bool pass = Multiples ?
+          isSubsetOf(mask, masks[i]) : isSubsetOf(masks[i], mask);
+        out[found] = i;
+        found += pass;
+      }
+#ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
+      DivMaskStats::maskChecks += count;
+      DivMaskStats::maskHits += count - found;
+#endif
+      return found;
+    }
+
+    template<class W>
+    size_t findMaybeDivisors
+      (const W* masks, size_t count, const W& mask, size_t* out) {
+      return findSubsets<false>(masks, count, mask, out);
+    }
+
+    template<class W>
+    size_t findMaybeMultiples
+      (const W* masks, size_t count, const W& mask, size_t* out) {
+      return findSubsets<true>(masks, count, mask, out);
+    }
+
+    // The 32 bit versions check several masks at a time using SIMD
+    // instructions chosen at run time. They are in DivMask.cpp.
+    size_t findMaybeDivisors(const unsigned int* masks, size_t count,
+      const unsigned int& mask, size_t* out);
+    size_t findMaybeMultiples(const unsigned int* masks, size_t count,
+      const unsigned int& mask, size_t* out);
+
+    MATHIC_DEFINE_OPTIONAL_FIELD(BitsOf, size_t, DivMaskBits, 32);
+
+    template<class Mask, bool UseDivMask>
+    class HasDivMask;
+
+    template<class Mask, class T, bool UseDivMask>
+    class Extender;
+  }
+
+  /** The div mask to use for Configuration C. It has C::DivMaskBits
+      bits if C declares a static const size_t DivMaskBits and otherwise
+      32 bits. The supported widths are 32, 64, 128 and 256. The bits
+      are divided among the variables, so more bits pay off when there
+      are many variables. */
+  template<class C>
+  using DivMaskOf = BasicDivMask<DivMaskInternal::BitsOf<C>::Value>;
+
   /** Class representing a div mask. This is a set of bits that can
       be used to determine that one monomial cannot divide another
       monomial. */
-  class DivMask {
+  template<size_t Bits>
+  class BasicDivMask {
   public:
     /** Calculates div masks. Don't change NullCalculator
         from its default value. The actual code are in partial specializations
@@ -38,11 +221,15 @@ namespace mathic {
       bool NullCalculator = Configuration::UseDivMask>
       class Calculator;
 
-  DivMask(): _mask(0) {}
-    static DivMask getMaxMask() {return ~static_cast<MaskType>(0);}
+    BasicDivMask(): _mask() {}
+
+    /** The number of bits in the mask. */
+    static const size_t BitCount = Bits;
+
+    static BasicDivMask getMaxMask() {return ~MaskType();}
 
     template<class T, class Configuration>
-      DivMask(const T& t,
+      BasicDivMask(const T& t,
               const Calculator<Configuration>& calc, const Configuration& conf):
     _mask(calc.compute(t, conf)) {}
 
@@ -53,8 +240,8 @@ namespace mathic {
       _mask = calc.compute(t, conf);
     }
 
-    bool canDivide(const DivMask& mask) const {
-      const bool canDiv = ((_mask & ~mask._mask) == 0);
+    bool canDivide(const BasicDivMask& mask) const {
+      const bool canDiv = DivMaskInternal::isSubsetOf(_mask, mask._mask);
 #ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
       ++DivMaskStats::maskChecks;
       if (!canDiv)
@@ -105,7 +292,7 @@ namespace mathic {
         pr[3] << "of div checks, " << ColumnPrinter::percent
           (DivMaskStats::divHits,
            DivMaskStats::divChecks - DivMaskStats::divDivides)
-           << " adjusted.\n";          
+           << " adjusted.\n";
         std::cerr << pr << "****\n";
       }
 #endif
@@ -113,22 +300,29 @@ namespace mathic {
       return canDiv;
     }
 
-    void combineAnd(const DivMask& mask) {_mask &= mask._mask;}
+    void combineAnd(const BasicDivMask& mask) {_mask &= mask._mask;}
 
-    bool operator==(DivMask& mask) const {return _mask == mask._mask;}
-    bool operator!=(DivMask& mask) const {return _mask != mask._mask;}
+    bool operator==(BasicDivMask& mask) const {return _mask == mask._mask;}
+    bool operator!=(BasicDivMask& mask) const {return _mask != mask._mask;}
 
     /** Extender extends T with a div mask if UseDivMask is true. It is
         allowed for T to be a reference type or const. */
     template<class T, bool UseDivMask>
-    class Extender;
+    using Extender = DivMaskInternal::Extender<BasicDivMask, T, UseDivMask>;
 
     /** Base class to include a DivMask into a class at compile time
         based on the template parameter UseDivMask. The class offers
         the same methods either way, but they are replaced by do-nothing
         or asserting versions if UseDivMask is false. */
     template<bool UseDivMask>
-    class HasDivMask;
+    using HasDivMask = DivMaskInternal::HasDivMask<BasicDivMask, UseDivMask>;
+
+    /** Keeps the div masks of up to Capacity entries in one contiguous
+        array so that all of them can be checked against a single div
+        mask at once using SIMD instructions where available. The
+        version for UseDivMask false stores nothing. */
+    template<size_t Capacity, bool UseDivMask>
+    class Array;
 
   protected:
     template<class C>
@@ -161,18 +355,19 @@ namespace mathic {
       }
     };
 
-    typedef unsigned int MaskType;
-    DivMask(MaskType mask): _mask(mask) {}
+    typedef typename DivMaskInternal::Word<Bits>::Type MaskType;
+    BasicDivMask(MaskType mask): _mask(mask) {}
 
   private:
-    /** To eliminate warnings about T& if T is already a reference type. */
-    template<class T> struct Ref {typedef T& RefType;};
-    template<class T> struct Ref<T&> {typedef T& RefType;};
     MaskType _mask;
   };
 
+  template<size_t Bits>
+  const size_t BasicDivMask<Bits>::BitCount;
+
+  template<size_t Bits>
   template<class C>
-    class DivMask::Calculator<C, true> {
+    class BasicDivMask<Bits>::Calculator<C, true> {
   public:
     Calculator(const C& conf) {rebuildDefault(conf);}
 
@@ -180,7 +375,8 @@ namespace mathic {
         object to something that will likely work well for entries
         in [begin, end). All div masks will have to be recomputed
         after this. Mixing div masks computed before a call to
-        rebuild() with ones after has unpredictable results. */
+        rebuild() with ones after has unpredictable results. The
+        entries are only read, so Iter can be a forward iterator. */
     template<class Iter>
     void rebuild(Iter begin, Iter end, const C& conf);
 
@@ -190,20 +386,33 @@ namespace mathic {
 
     /** Computes a div mask for t. */
     template<class T>
-    DivMask::MaskType compute(const T& t, const C& conf) const;
+    MaskType compute(const T& t, const C& conf) const;
+
+    /** Returns true if this object computes the same div masks as
+        calc, so that masks computed by either can be mixed. */
+    bool operator==(const Calculator& calc) const {return _bits == calc._bits;}
+
+    /** Returns how well the div masks computed by this object tell
+        apart the entries in [begin, end). This is the sum over the bits
+        of the fraction of the entries that have the bit set or that do
+        not, whichever is fewer, so a bit that is the same for all the
+        entries counts for nothing. */
+    template<class Iter>
+    double getSpread(Iter begin, Iter end, const C& conf) const;
 
   private:
     typedef typename C::Exponent Exponent;
     /** If entry at index i is the pair (var,exp) then the bit at
-        index var in a bit mask is 1 if the exponent of var in the
+        index i in a bit mask is 1 if the exponent of var in the
         monomial is strictly greater than exp. */
     typedef std::vector<std::pair<size_t, Exponent> > BitContainer;
     BitContainer _bits;
   };
 
+  template<size_t Bits>
   template<class C>
   template<class Iter>
-  void DivMask::Calculator<C, true>::
+  void BasicDivMask<Bits>::Calculator<C, true>::
   rebuild(Iter begin, Iter end, const C& conf) {
     const size_t size = std::distance(begin, end);
     if (size == 0) {
@@ -213,12 +422,15 @@ namespace mathic {
 
     _bits.clear();
     const size_t varCount = conf.getVarCount();
-    const size_t TotalBits = sizeof(MaskType) * BitsPerByte;
+    const size_t TotalBits = Bits;
 
     // ** Determine information about each variable
     std::vector<VarData> datas;
+    // usefulBits[var] is the number of distinct thresholds that tell
+    // apart the exponents of var in [begin, end).
+    std::vector<size_t> usefulBits(varCount);
     for (size_t var = 0; var < varCount; ++var) {
-      Exponent min = conf.getExponent(*begin, 0);
+      Exponent min = conf.getExponent(*begin, var);
       Exponent max = min;
       for (Iter it = begin; it != end; ++it) {
         Exponent exp = conf.getExponent(*it, var);
@@ -227,6 +439,8 @@ namespace mathic {
         if (exp < min)
           min = exp;
       }
+      usefulBits[var] = max - min < static_cast<Exponent>(TotalBits) ?
+        static_cast<size_t>(max - min) : TotalBits;
       Exponent average = min + (max - min) / 2; // this formula avoids overflow
       size_t split = 0;
       for (Iter it = begin; it != end; ++it)
@@ -251,213 +465,307 @@ namespace mathic {
         ++bitsForVars[var];
     }
 
+    // With wide masks a variable can get more bits than it has
+    // thresholds. Hand the surplus to the variables that can use it,
+    // preferring the variables that split the entries best.
+    size_t surplus = 0;
+    for (size_t var = 0; var < varCount; ++var) {
+      if (bitsForVars[var] > usefulBits[var]) {
+        surplus += bitsForVars[var] - usefulBits[var];
+        bitsForVars[var] = usefulBits[var];
+      }
+    }
+    while (surplus > 0) {
+      const size_t surplusBefore = surplus;
+      for (size_t i = 0; i < varCount && surplus > 0; ++i) {
+        const size_t var = datas[i].var;
+        if (bitsForVars[var] < usefulBits[var]) {
+          ++bitsForVars[var];
+          --surplus;
+        }
+      }
+      if (surplus == surplusBefore)
+        break; // no variable can use more bits
+    }
+
     // calculate the meaning of each bit and put it in _bits
     for (size_t var = 0; var < varCount; ++var) {
       const size_t bitsForVar = bitsForVars[var];
       if (bitsForVar == 0)
         continue;
 
-      const bool useRank = false;
-      if (useRank) {
-        std::sort(begin, end, ExponentComparer<C>(var, conf));
-        size_t size = std::distance(begin, end);
-        size_t offset = size / (bitsForVar + 1);
-        if (offset== 0)
-          offset = 1;
-        Exponent lastExp;
-        size_t lastJ = 0;
-        for (size_t i = 1; i <= bitsForVar; ++i) {
-          size_t j = i * offset;
-          if (i > 1 && j < lastJ)
-            j = lastJ + 1;
-          if (j >= size)
-            j = size - 1;
-          if (i > 1) {
-            while (j < size && conf.getExponent(begin[j], var) == lastExp)
-              ++j;
-            if (j == size)
-              break;
-          }
-          _bits.push_back(
-            std::make_pair(var, conf.getExponent(begin[j], var)));
-          lastJ = j;
-          lastExp = conf.getExponent(begin[j], var);
-          if (j == size - 1)
-            break;
-        }
-      } else {
-        Exponent min = conf.getExponent(*begin, 0);
-        Exponent max = min;
-        for (Iter it = begin; it != end; ++it) {
-          Exponent exp = conf.getExponent(*it, var);
-          if (max < exp)
-            max = exp;
-          if (exp < min)
-            min = exp;
-        }
-
-        // divide the range [a,b] into bitsForVar equal pieces
-        // and use the left end points of those ranges
-        // as the points for the bits.
-        Exponent increment = (max - min) / static_cast<Exponent>(bitsForVar); // todo: can avoid cast?
-        if (increment == 0)
-          increment = 1;
-        for (size_t i = 0; i < bitsForVar; ++i)
-          _bits.push_back(std::make_pair(var, min + increment * static_cast<Exponent>(i)));
-           // todo: can avoid cast?
+      Exponent min = conf.getExponent(*begin, var);
+      Exponent max = min;
+      for (Iter it = begin; it != end; ++it) {
+        Exponent exp = conf.getExponent(*it, var);
+        if (max < exp)
+          max = exp;
+        if (exp < min)
+          min = exp;
       }
+
+      // divide the range [a,b] into bitsForVar equal pieces
+      // and use the left end points of those ranges
+      // as the points for the bits.
+      Exponent increment = (max - min) / static_cast<Exponent>(bitsForVar); // todo: can avoid cast?
+      if (increment == 0)
+        increment = 1;
+      for (size_t i = 0; i < bitsForVar; ++i)
+        _bits.push_back(std::make_pair(var, min + increment * static_cast<Exponent>(i)));
+         // todo: can avoid cast?
     }
+    MATHIC_ASSERT(_bits.size() <= TotalBits);
   }
 
+  template<size_t Bits>
   template<class C>
-    void DivMask::Calculator<C, true>::
+    void BasicDivMask<Bits>::Calculator<C, true>::
     rebuildDefault(const C& conf) {
     _bits.clear();
     const size_t varCount = conf.getVarCount();
-    const size_t TotalBits = sizeof(MaskType) * BitsPerByte;
+    const size_t TotalBits = Bits;
     for (size_t var = 0; var < varCount; ++var) {
       const size_t bitsForVar =
         TotalBits / varCount + (var < TotalBits % varCount);
       Exponent exp = 0;
       for (size_t i = 0; i < bitsForVar; ++i) {
         _bits.push_back(std::make_pair(var, exp));
+        // a wide mask with few variables would make exp overflow, so
+        // leave the remaining bits unused in that case.
+        if (std::numeric_limits<Exponent>::is_specialized &&
+          std::numeric_limits<Exponent>::max() / 2 < exp)
+          break;
         exp = (i == 0 ? 1 : exp * 2);
       }
     }
   }
 
+  template<size_t Bits>
   template<class C>
   template<class T>
-  DivMask::MaskType DivMask::Calculator<C, true>::
+  typename BasicDivMask<Bits>::MaskType
+    BasicDivMask<Bits>::Calculator<C, true>::
     compute(const T& t, const C& conf) const {
 #ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
       ++DivMaskStats::maskComputes;
 #endif
-    typedef typename BitContainer::const_iterator const_iterator;
-    const const_iterator end = _bits.end();
-    DivMask::MaskType mask = 0;
-    for (const_iterator it = _bits.begin(); it != end; ++it)
-      mask = (mask << 1) | (conf.getExponent(t, it->first) > it->second);   
+    const size_t bitCount = _bits.size();
+    MaskType mask = MaskType();
+    for (size_t i = 0; i < bitCount; ++i) {
+      const bool greater =
+        conf.getExponent(t, _bits[i].first) > _bits[i].second;
+      DivMaskInternal::setBitIf(mask, i, greater);
+    }
     return mask;
   }
 
+  template<size_t Bits>
   template<class C>
-    class DivMask::Calculator<C, false> {
+  template<class Iter>
+  double BasicDivMask<Bits>::Calculator<C, true>::
+    getSpread(Iter begin, Iter end, const C& conf) const {
+    const size_t size = std::distance(begin, end);
+    if (size == 0)
+      return 0;
+    double spread = 0;
+    for (size_t i = 0; i < _bits.size(); ++i) {
+      size_t set = 0;
+      for (Iter it = begin; it != end; ++it)
+        if (conf.getExponent(*it, _bits[i].first) > _bits[i].second)
+          ++set;
+      spread += static_cast<double>(std::min(set, size - set)) / size;
+    }
+    return spread;
+  }
+
+  template<size_t Bits>
+  template<class C>
+    class BasicDivMask<Bits>::Calculator<C, false> {
   public:
     Calculator(const C& conf) {}
 
     template<class Iter>
     void rebuild(Iter begin, Iter end, const C& conf) {}
     void rebuildDefault(const C& conf) {}
+    bool operator==(const Calculator& calc) const {return true;}
+    template<class Iter>
+    double getSpread(Iter begin, Iter end, const C& conf) const {return 0;}
   };
 
-  template<>
-  class DivMask::HasDivMask<true> {
+  template<size_t Bits>
+  template<size_t Capacity>
+  class BasicDivMask<Bits>::Array<Capacity, true> {
   public:
-    template<class T, class C>
-      HasDivMask(const T& t, const Calculator<C>& calc, const C& conf):
-    _mask(t, calc, conf) {}
-    HasDivMask() {resetDivMask();}
-
-    DivMask& getDivMask() {return _mask;}
-    const DivMask& getDivMask() const {return _mask;}
-    void resetDivMask() {_mask = DivMask::getMaxMask();}
-    bool canDivide(const HasDivMask<true>& t) const {
-      return getDivMask().canDivide(t.getDivMask());
+    void set(size_t index, const HasDivMask<true>& entry) {
+      MATHIC_ASSERT(index < Capacity);
+      _masks[index] = entry.getDivMask()._mask;
     }
 
-    void updateToLowerBound(const HasDivMask<true>& t) {
-      _mask.combineAnd(t.getDivMask());
+    /** Writes the indices among the first count masks that canDivide
+        mask to out and returns how many there were. */
+    size_t findMaybeDivisors
+      (size_t count, const BasicDivMask& mask, size_t* out) const {
+      MATHIC_ASSERT(count <= Capacity);
+      return DivMaskInternal::findMaybeDivisors
+        (_masks, count, mask._mask, out);
     }
 
-  protected:
-    template<class T, class C>
-      void recalculateDivMask
-      (const T& t, const Calculator<C>& calc, const C& conf) {
-      _mask.recalculate(t, calc, conf);
+    /** Writes the indices among the first count masks that mask
+        canDivide to out and returns how many there were. */
+    size_t findMaybeMultiples
+      (size_t count, const BasicDivMask& mask, size_t* out) const {
+      MATHIC_ASSERT(count <= Capacity);
+      return DivMaskInternal::findMaybeMultiples
+        (_masks, count, mask._mask, out);
     }
 
   private:
-    DivMask _mask;
+    MaskType _masks[Capacity];
   };
 
-  template<>
-  class DivMask::HasDivMask<false> {
+  template<size_t Bits>
+  template<size_t Capacity>
+  class BasicDivMask<Bits>::Array<Capacity, false> {
   public:
-    void resetDivMask() {MATHIC_ASSERT(false);}
-    DivMask getDivMask() const {MATHIC_ASSERT(false); return DivMask();}
-    bool canDivide(const HasDivMask<false>& t) const {return true;}
-    template<bool B>
-    void updateToLowerBound(const HasDivMask<B>& entry) {}
+    template<class T>
+    void set(size_t index, const T& entry) {}
+
+    size_t findMaybeDivisors
+      (size_t count, const BasicDivMask& mask, size_t* out) const {
+      MATHIC_ASSERT(false);
+      return 0;
+    }
+
+    size_t findMaybeMultiples
+      (size_t count, const BasicDivMask& mask, size_t* out) const {
+      MATHIC_ASSERT(false);
+      return 0;
+    }
   };
 
-  template<class T>
-  class DivMask::Extender<T, true> : public HasDivMask<true> {
-  private:
-    typedef typename Ref<T>::RefType Reference;
-    typedef typename Ref<const T>::RefType ConstReference;
-  public:
-  Extender(): HasDivMask<true>(), _t() {}
-    template<class C>
-    Extender(ConstReference t, const Calculator<C>& calc, const C& conf):
-    HasDivMask<true>(t, calc, conf), _t(t) {}
+  namespace DivMaskInternal {
+    template<class Mask>
+    class HasDivMask<Mask, true> {
+    public:
+      template<class T, class C>
+        HasDivMask(const T& t,
+          const typename Mask::template Calculator<C>& calc, const C& conf):
+      _mask(t, calc, conf) {}
+      HasDivMask() {resetDivMask();}
+
+      Mask& getDivMask() {return _mask;}
+      const Mask& getDivMask() const {return _mask;}
+      void resetDivMask() {_mask = Mask::getMaxMask();}
+      bool canDivide(const HasDivMask<Mask, true>& t) const {
+        return getDivMask().canDivide(t.getDivMask());
+      }
+
+      void updateToLowerBound(const HasDivMask<Mask, true>& t) {
+        _mask.combineAnd(t.getDivMask());
+      }
+
+    protected:
+      template<class T, class C>
+        void recalculateDivMask(const T& t,
+          const typename Mask::template Calculator<C>& calc, const C& conf) {
+        _mask.recalculate(t, calc, conf);
+      }
+
+    private:
+      Mask _mask;
+    };
 
-    template<class S, class C>
-    bool divides(const Extender<S, true>& t, const C& conf) const {
-      bool canDiv = this->canDivide(t);
+    template<class Mask>
+    class HasDivMask<Mask, false> {
+    public:
+      void resetDivMask() {MATHIC_ASSERT(false);}
+      Mask getDivMask() const {MATHIC_ASSERT(false); return Mask();}
+      bool canDivide(const HasDivMask<Mask, false>& t) const {return true;}
+      template<bool B>
+      void updateToLowerBound(const HasDivMask<Mask, B>& entry) {}
+
+    protected:
+      template<class T, class C>
+        void recalculateDivMask(const T& t,
+          const typename Mask::template Calculator<C>& calc, const C& conf) {}
+    };
+
+    /** To eliminate warnings about T& if T is already a reference type. */
+    template<class T> struct Ref {typedef T& RefType;};
+    template<class T> struct Ref<T&> {typedef T& RefType;};
+
+    template<class Mask, class T>
+    class Extender<Mask, T, true> : public HasDivMask<Mask, true> {
+    private:
+      typedef typename Ref<T>::RefType Reference;
+      typedef typename Ref<const T>::RefType ConstReference;
+    public:
+    Extender(): HasDivMask<Mask, true>(), _t() {}
+      template<class C>
+      Extender(ConstReference t,
+        const typename Mask::template Calculator<C>& calc, const C& conf):
+      HasDivMask<Mask, true>(t, calc, conf), _t(t) {}
+
+      template<class S, class C>
+      bool divides(const Extender<Mask, S, true>& t, const C& conf) const {
+        bool canDiv = this->canDivide(t);
 #ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
-      ++DivMaskStats::divChecks;
-      if (!canDiv)
-        ++DivMaskStats::divHits;
+        ++DivMaskStats::divChecks;
+        if (!canDiv)
+          ++DivMaskStats::divHits;
 #endif
-      if (!canDiv)
-        return false;
+        if (!canDiv)
+          return false;
 
-      bool actuallyDivides = conf.divides(get(), t.get());
+        bool actuallyDivides = conf.divides(get(), t.get());
 #ifdef MATHIC_TRACK_DIV_MASK_HIT_RATIO
-      if (actuallyDivides)
-        ++DivMaskStats::divDivides;
+        if (actuallyDivides)
+          ++DivMaskStats::divDivides;
 #endif
-      return actuallyDivides;
-    }
+        return actuallyDivides;
+      }
 
-    template<class C>
-      void recalculateDivMask(const Calculator<C>& calc, const C& conf) {
-      this->HasDivMask<true>::recalculateDivMask(get(), calc, conf);
-    }
+      template<class C>
+        void recalculateDivMask
+        (const typename Mask::template Calculator<C>& calc, const C& conf) {
+        this->HasDivMask<Mask, true>::recalculateDivMask(get(), calc, conf);
+      }
 
-    Reference get() {return _t;}
-    ConstReference get() const {return _t;}
+      Reference get() {return _t;}
+      ConstReference get() const {return _t;}
 
-  private:
-    T _t;
-  };
-
-  template<class T>
-    class DivMask::Extender<T, false> : public HasDivMask<false> {
-  private:
-    typedef typename Ref<T>::RefType Reference;
-    typedef typename Ref<const T>::RefType ConstReference;
-  public:
-  Extender(): HasDivMask<false>(), _t() {}
-    template<class C>
-      Extender(ConstReference t, const Calculator<C>& calc, const C& conf):
-    HasDivMask<false>(), _t(t) {}
+    private:
+      T _t;
+    };
 
-    template<class S, class C>
-      bool divides(const Extender<S, false>& t, const C& conf) const {
-      return conf.divides(get(), t.get());
-    }
+    template<class Mask, class T>
+      class Extender<Mask, T, false> : public HasDivMask<Mask, false> {
+    private:
+      typedef typename Ref<T>::RefType Reference;
+      typedef typename Ref<const T>::RefType ConstReference;
+    public:
+    Extender(): HasDivMask<Mask, false>(), _t() {}
+      template<class C>
+        Extender(ConstReference t,
+          const typename Mask::template Calculator<C>& calc, const C& conf):
+      HasDivMask<Mask, false>(), _t(t) {}
+
+      template<class S, class C>
+        bool divides(const Extender<Mask, S, false>& t, const C& conf) const {
+        return conf.divides(get(), t.get());
+      }
 
-    template<class C>
-      void recalculateDivMask(const Calculator<C>& calc, const C& conf) {}
+      template<class C>
+        void recalculateDivMask
+        (const typename Mask::template Calculator<C>& calc, const C& conf) {}
 
-    Reference get() {return _t;}
-    ConstReference get() const {return _t;}
+      Reference get() {return _t;}
+      ConstReference get() const {return _t;}
 
-  private:
-    T _t;
-  };
+    private:
+      T _t;
+    };
+  }
 }
 
 #endif
@@ -0,0 +1,177 @@
+#ifndef MATHIC_DIV_TRACE_GUARD
+#define MATHIC_DIV_TRACE_GUARD
+
+#include "stdinc.h"
+#include "TraceCoding.h"
+#include <ostream>
+#include <vector>
+
+namespace mathic {
+  /** A divisor finder trace is a sequence of insertions, divisor
+      queries and removals of multiples, each with the exponent vector
+      of the monomial involved. divsim can replay a trace through each
+      of its DivList and KDTree models, so that finders can be compared
+      on the monomial ideals that actually come up in client code.
+
+      The format is the header "mathicDiv" and version 1 followed by
+      the number of variables and then the events. An event is a word
+      for its type followed by one word for the exponent of each
+      variable. Exponents must be non-negative. */
+  class DivTraceWriter {
+  public:
+    typedef TraceCoding::Word Exponent;
+    enum Event {
+      InsertEvent = 0,
+      FindDivisorEvent = 1,
+      FindAllDivisorsEvent = 2,
+      RemoveMultiplesEvent = 3
+    };
+
+    DivTraceWriter(std::ostream& out, size_t varCount):
+      _out(out), _varCount(varCount) {
+      TraceCoding::writeHeader(_out, "mathicDiv", 1);
+      TraceCoding::writeWord(_out, varCount);
+    }
+
+    /** Writes an event of the given type. exponents[var] must be the
+        exponent of var for var from 0 to getVarCount() - 1. */
+    template<class Exponents>
+    void write(Event event, const Exponents& exponents) {
+      TraceCoding::writeWord(_out, event);
+      for (size_t var = 0; var < _varCount; ++var) {
+        MATHIC_ASSERT(!(exponents[var] < 0));
+        TraceCoding::writeWord(_out, static_cast<Exponent>(exponents[var]));
+      }
+    }
+
+    size_t getVarCount() const {return _varCount;}
+
+  private:
+    std::ostream& _out;
+    const size_t _varCount;
+  };
+
+  /** Reads the events of a divisor finder trace one at a time from
+      memory, such as from a MappedFile. */
+  class DivTraceReader {
+  public:
+    typedef TraceCoding::Word Exponent;
+    enum Event {
+      InsertEvent = DivTraceWriter::InsertEvent,
+      FindDivisorEvent = DivTraceWriter::FindDivisorEvent,
+      FindAllDivisorsEvent = DivTraceWriter::FindAllDivisorsEvent,
+      RemoveMultiplesEvent = DivTraceWriter::RemoveMultiplesEvent,
+      EndEvent
+    };
+
+    DivTraceReader(const char* begin, const char* end):
+      _begin(begin), _pos(begin), _end(end) {
+      TraceCoding::readHeader(_pos, _end, "mathicDiv", 1);
+      const TraceCoding::Word varCount = TraceCoding::readWord(_pos, _end);
+      if (varCount == 0)
+        reportError("Divisor finder trace has no variables.");
+      _exponents.resize(static_cast<size_t>(varCount));
+      _begin = _pos;
+    }
+
+    /** Reads the next event. The exponents of its monomial are then
+        in exponents(). */
+    Event next() {
+      if (_pos == _end)
+        return EndEvent;
+      const TraceCoding::Word type = TraceCoding::readWord(_pos, _end);
+      if (type >= EndEvent)
+        reportError("Unknown event in divisor finder trace.");
+      for (size_t var = 0; var < _exponents.size(); ++var)
+        _exponents[var] = TraceCoding::readWord(_pos, _end);
+      return static_cast<Event>(type);
+    }
+
+    const std::vector<Exponent>& exponents() const {return _exponents;}
+    size_t getVarCount() const {return _exponents.size();}
+
+    /** Goes back to the first event. */
+    void rewind() {_pos = _begin;}
+
+  private:
+    const char* _begin;
+    const char* _pos;
+    const char* _end;
+    std::vector<Exponent> _exponents;
+  };
+
+  /** Wraps a divisor finder such as DivList or KDTree and records a
+      trace of what is inserted, queried and removed. ExponentOf must
+      have an operator()(x, var) that returns the exponent of var in x
+      for x an Entry or a Monomial of the finder.
+
+      Only the queries are recorded, not their results, since divsim
+      computes and cross-checks the results when it replays the trace. */
+  template<class Finder, class ExponentOf>
+  class DivTraceRecorder {
+  public:
+    typedef typename Finder::Entry Entry;
+    typedef typename Finder::Monomial Monomial;
+
+    DivTraceRecorder(Finder& finder, std::ostream& out,
+                     const ExponentOf& exponentOf = ExponentOf()):
+      _finder(finder),
+      _writer(out, finder.getConfiguration().getVarCount()),
+      _exponentOf(exponentOf) {}
+
+    void insert(const Entry& entry) {
+      record(DivTraceWriter::InsertEvent, entry);
+      _finder.insert(entry);
+    }
+
+    template<class Iter>
+    void insert(Iter begin, Iter end) {
+      for (Iter it = begin; it != end; ++it)
+        record(DivTraceWriter::InsertEvent, *it);
+      _finder.insert(begin, end);
+    }
+
+    Entry* findDivisor(const Monomial& monomial) {
+      record(DivTraceWriter::FindDivisorEvent, monomial);
+      return _finder.findDivisor(monomial);
+    }
+
+    template<class DO>
+    void findAllDivisors(const Monomial& monomial, DO& out) {
+      record(DivTraceWriter::FindAllDivisorsEvent, monomial);
+      _finder.findAllDivisors(monomial, out);
+    }
+
+    bool removeMultiples(const Monomial& monomial) {
+      record(DivTraceWriter::RemoveMultiplesEvent, monomial);
+      return _finder.removeMultiples(monomial);
+    }
+
+    template<class MultipleOutput>
+    bool removeMultiples(const Monomial& monomial, MultipleOutput& out) {
+      record(DivTraceWriter::RemoveMultiplesEvent, monomial);
+      return _finder.removeMultiples(monomial, out);
+    }
+
+    size_t size() const {return _finder.size();}
+
+    Finder& getFinder() {return _finder;}
+    const Finder& getFinder() const {return _finder;}
+
+  private:
+    template<class M>
+    void record(DivTraceWriter::Event event, const M& m) {
+      _exponents.resize(_writer.getVarCount());
+      for (size_t var = 0; var < _exponents.size(); ++var)
+        _exponents[var] = _exponentOf(m, var);
+      _writer.write(event, _exponents);
+    }
+
+    Finder& _finder;
+    DivTraceWriter _writer;
+    ExponentOf _exponentOf;
+    std::vector<DivTraceWriter::Exponent> _exponents;
+  };
+}
+
+#endif
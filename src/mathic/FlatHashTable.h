@@ -0,0 +1,414 @@
+#ifndef MATHIC_FLAT_HASH_TABLE_GUARD
+#define MATHIC_FLAT_HASH_TABLE_GUARD
+
+#include "stdinc.h"
+#include <memory>
+#include <new>
+#include <utility>
+#include <string>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATHIC_FLAT_HASH_TABLE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace mathic {
+  namespace FlatHashTableInternal {
+    /** Every slot of the table has a control byte. It is Empty, Deleted
+        or, if the slot holds an entry, the lowest 7 bits of the mixed
+        hash value of the key of that entry. So the top bit is set
+        exactly for slots without an entry. */
+    typedef signed char Control;
+    static const Control Empty = -128;
+    static const Control Deleted = -2;
+
+    /** The control bytes of a group of consecutive slots are checked
+        together. Groups start at multiples of GroupSize. */
+    static const size_t GroupSize = 16;
+
+    /** Bit i is set if slot i of the group matched. */
+    typedef unsigned int BitMask;
+
+    inline size_t lowestBit(BitMask mask) {
+      MATHIC_ASSERT(mask != 0);
+#if defined(__GNUC__)
+      return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+      unsigned long index;
+      _BitScanForward(&index, mask);
+      return index;
+#else
+      size_t index = 0;
+      for (; (mask & 1) == 0; mask >>= 1)
+        ++index;
+      return index;
+#endif
+    }
+
+    /** The control bytes of a group. With SSE2 each check compares all
+        GroupSize bytes with a few instructions. */
+    class Group {
+    public:
+      explicit Group(const Control* pos) {
+#ifdef MATHIC_FLAT_HASH_TABLE_SSE2
+        _control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+#else
+        _pos = pos;
+#endif
+      }
+
+      BitMask match(Control fingerprint) const {
+#ifdef MATHIC_FLAT_HASH_TABLE_SSE2
+        const __m128i pattern = _mm_set1_epi8(fingerprint);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(pattern, _control));
+#else
+        BitMask mask = 0;
+        for (size_t i = 0; i < GroupSize; ++i)
+          mask |= static_cast<BitMask>(_pos[i] == fingerprint) << i;
+        return mask;
+#endif
+      }
+
+      BitMask matchEmpty() const {return match(Empty);}
+
+      BitMask matchEmptyOrDeleted() const {
+#ifdef MATHIC_FLAT_HASH_TABLE_SSE2
+        return _mm_movemask_epi8(_control);
+#else
+        BitMask mask = 0;
+        for (size_t i = 0; i < GroupSize; ++i)
+          mask |= static_cast<BitMask>(_pos[i] < 0) << i;
+        return mask;
+#endif
+      }
+
+    private:
+#ifdef MATHIC_FLAT_HASH_TABLE_SSE2
+      __m128i _control;
+#else
+      const Control* _pos;
+#endif
+    };
+  }
+
+  /** An open addressing hash table with the same interface as HashTable
+      and the same Configuration. Entries are stored directly in an array
+      of slots. Next to that array there is one control byte per slot
+      that holds 7 bits of the hash value of the key in the slot, so a
+      lookup compares keys only for the few slots whose control byte
+      matches. The control bytes are checked 16 at a time using SSE2 if
+      it is available. This is the layout of the Swiss tables in Abseil.
+
+      Unlike for HashTable, an insert can move all entries to a larger
+      array, so a Handle* is only valid until the next insert, reset or
+      hardReset. */
+  template<class C>
+  class FlatHashTable {
+  public:
+    typedef C Configuration;
+    typedef typename C::Key Key;
+    typedef typename C::Value Value;
+
+    class Handle {
+    public:
+      friend class FlatHashTable;
+
+      Handle(const Key& k, const Value& v): entry(k, v) {}
+
+      const Key& key() const {return entry.first;}
+      const Value& value() const {return entry.second;}
+      Value& value() {return entry.second;}
+      void setKeyButOnlyDoSoIfThisHandleIsNotInHashTable(Key &new_k) {
+        entry.first = new_k;
+      }
+
+    private:
+      std::pair<Key, Value> entry;
+    };
+
+    /** Creates a table with room for at least 2^nbits slots. */
+    FlatHashTable(const Configuration& conf, unsigned int nbits = 10);
+    ~FlatHashTable();
+
+    Configuration& configuration() {return mConf;}
+    Configuration const& configuration() const {return mConf;}
+
+    /** If k is already in the table then returns (false, handle of k).
+        Otherwise inserts k with value v and returns (true, new handle). */
+    std::pair<bool, Handle*> insert(Key const& k, Value const& v);
+
+    /** Returns the handle of k if k is in the table and otherwise null. */
+    Handle* lookup(const Key& k);
+
+    /** Removes p from the table and sets p to null. */
+    void remove(Handle*& p);
+
+    /** Removes all entries. */
+    void reset();
+
+    /** Removes all entries and frees the memory of the table. */
+    void hardReset();
+
+    size_t size() const {return mSize;}
+
+    /** Returns how many bytes of memory this data structure consumes
+        not including sizeof(*this). */
+    size_t memoryUse() const;
+
+    std::string name() const {return "FlatHashTable";}
+
+  private:
+    typedef FlatHashTableInternal::Control Control;
+    typedef FlatHashTableInternal::Group Group;
+    typedef FlatHashTableInternal::BitMask BitMask;
+    static const size_t GroupSize = FlatHashTableInternal::GroupSize;
+
+    FlatHashTable(const FlatHashTable&); // unavailable
+    void operator=(const FlatHashTable&); // unavailable
+
+    /** Spreads the bits of the hash value of k so that both the slot
+        position and the fingerprint depend on all of its bits. */
+    size_t mixedHash(const Key& k) {
+      size_t h = mConf.hash(k) * static_cast<size_t>(0x9E3779B97F4A7C15ull);
+      return h ^ (h >> (4 * sizeof(size_t)));
+    }
+    static Control fingerprint(size_t hash) {
+      return static_cast<Control>(hash & 0x7F);
+    }
+    size_t firstGroup(size_t hash) const {return (hash >> 7) & mGroupMask;}
+
+    /** Returns the index of the first slot without an entry on the probe
+        sequence of hash. There must be such a slot. */
+    size_t findFree(size_t hash) const;
+
+    /** Sets the control byte of a slot and keeps the counts right. */
+    void setControl(size_t slot, Control control);
+
+    /** Moves all entries into a table with the given number of slots. */
+    void rehash(size_t capacity);
+
+    void allocate(size_t capacity);
+    void destroyEntries();
+
+    size_t computeNodeCount() const;
+
+    Control* mControl;
+    Handle* mSlots;
+    size_t mCapacity; // a power of two that is at least GroupSize
+    size_t mGroupMask; // number of groups minus 1
+    size_t mSize; // number of entries
+    size_t mGrowthLeft; // free slots to fill before a rehash
+    std::allocator<Handle> mAllocator;
+    Configuration mConf;
+  };
+
+  template<class C>
+  FlatHashTable<C>::FlatHashTable
+  (const Configuration& conf, unsigned int nbits):
+    mControl(0),
+    mSlots(0),
+    mCapacity(0),
+    mGroupMask(0),
+    mSize(0),
+    mGrowthLeft(0),
+    mConf(conf)
+  {
+    size_t capacity = static_cast<size_t>(1) << nbits;
+    if (capacity < GroupSize)
+      capacity = GroupSize;
+    allocate(capacity);
+  }
+
+  template<class C>
+  FlatHashTable<C>::~FlatHashTable() {
+    destroyEntries();
+    mAllocator.deallocate(mSlots, mCapacity);
+    delete[] mControl;
+  }
+
+  template<class C>
+  void FlatHashTable<C>::allocate(size_t capacity) {
+    MATHIC_ASSERT(capacity >= GroupSize);
+    MATHIC_ASSERT((capacity & (capacity - 1)) == 0);
+    Control* control = new Control[capacity];
+    try {
+      mSlots = mAllocator.allocate(capacity);
+    } catch (...) {
+      delete[] control;
+      throw;
+    }
+    std::fill(control, control + capacity, FlatHashTableInternal::Empty);
+    mControl = control;
+    mCapacity = capacity;
+    mGroupMask = capacity / GroupSize - 1;
+    mSize = 0;
+    // keep the load factor at most 7/8.
+    mGrowthLeft = capacity - capacity / 8;
+  }
+
+  template<class C>
+  void FlatHashTable<C>::destroyEntries() {
+    for (size_t slot = 0; slot < mCapacity; ++slot) {
+      if (mControl[slot] >= 0) {
+        mSlots[slot].~Handle();
+        mControl[slot] = FlatHashTableInternal::Empty;
+      }
+    }
+  }
+
+  template<class C>
+  size_t FlatHashTable<C>::findFree(size_t hash) const {
+    size_t group = firstGroup(hash);
+    for (size_t step = 1; ; ++step) {
+      const size_t base = group * GroupSize;
+      const BitMask free = Group(mControl + base).matchEmptyOrDeleted();
+      if (free != 0)
+        return base + FlatHashTableInternal::lowestBit(free);
+      MATHIC_ASSERT(step <= mGroupMask + 1);
+      group = (group + step) & mGroupMask; // triangular numbers
+    }
+  }
+
+  template<class C>
+  typename FlatHashTable<C>::Handle* FlatHashTable<C>::lookup(const Key& k) {
+    const size_t hash = mixedHash(k);
+    const Control print = fingerprint(hash);
+    size_t group = firstGroup(hash);
+    for (size_t step = 1; ; ++step) {
+      const size_t base = group * GroupSize;
+      const Group g(mControl + base);
+      for (BitMask match = g.match(print); match != 0; match &= match - 1) {
+        Handle& handle =
+          mSlots[base + FlatHashTableInternal::lowestBit(match)];
+        if (mConf.keysEqual(handle.key(), k))
+          return &handle;
+      }
+      // the probe sequence of k ends at the first group with an empty
+      // slot since k would have been put there.
+      if (g.matchEmpty() != 0)
+        return 0;
+      MATHIC_ASSERT(step <= mGroupMask + 1);
+      group = (group + step) & mGroupMask;
+    }
+  }
+
+  template<class C>
+  std::pair<bool, typename FlatHashTable<C>::Handle*>
+  FlatHashTable<C>::insert(const Key& k, const Value& v) {
+    Handle* existing = lookup(k);
+    if (existing != 0)
+      return std::make_pair(false, existing);
+
+    const size_t hash = mixedHash(k);
+    size_t slot = findFree(hash);
+    if (mGrowthLeft == 0 && mControl[slot] == FlatHashTableInternal::Empty) {
+      // If many slots are Deleted then rehashing at the same size is
+      // enough to get rid of them.
+      const size_t maxSize = mCapacity - mCapacity / 8;
+      rehash(mSize < maxSize / 2 ? mCapacity : 2 * mCapacity);
+      slot = findFree(hash);
+    }
+    new (mSlots + slot) Handle(k, v);
+    setControl(slot, fingerprint(hash));
+    MATHIC_SLOW_ASSERT(computeNodeCount() == mSize);
+    return std::make_pair(true, mSlots + slot);
+  }
+
+  template<class C>
+  void FlatHashTable<C>::setControl(size_t slot, Control control) {
+    const Control old = mControl[slot];
+    if (old < 0 && control >= 0) {
+      ++mSize;
+      if (old == FlatHashTableInternal::Empty) {
+        MATHIC_ASSERT(mGrowthLeft > 0);
+        --mGrowthLeft;
+      }
+    } else if (old >= 0 && control < 0) {
+      MATHIC_ASSERT(mSize > 0);
+      --mSize;
+      if (control == FlatHashTableInternal::Empty)
+        ++mGrowthLeft;
+    }
+    mControl[slot] = control;
+  }
+
+  template<class C>
+  void FlatHashTable<C>::remove(Handle*& p) {
+    MATHIC_ASSERT(mSlots <= p && p < mSlots + mCapacity);
+    const size_t slot = p - mSlots;
+    MATHIC_ASSERT(mControl[slot] >= 0);
+    p->~Handle();
+    p = 0;
+
+    // Empty slots are only created by rehash, so if the group of slot has
+    // an empty slot then the group was never full. Then no probe sequence
+    // has continued past the group and the slot can be marked Empty.
+    // Otherwise it must be Deleted so that lookups keep going past it.
+    const size_t base = slot - slot % GroupSize;
+    if (Group(mControl + base).matchEmpty() != 0)
+      setControl(slot, FlatHashTableInternal::Empty);
+    else
+      setControl(slot, FlatHashTableInternal::Deleted);
+    MATHIC_SLOW_ASSERT(computeNodeCount() == mSize);
+  }
+
+  template<class C>
+  void FlatHashTable<C>::rehash(size_t capacity) {
+    Control* const oldControl = mControl;
+    Handle* const oldSlots = mSlots;
+    const size_t oldCapacity = mCapacity;
+    allocate(capacity);
+    for (size_t slot = 0; slot < oldCapacity; ++slot) {
+      if (oldControl[slot] < 0)
+        continue;
+      Handle& handle = oldSlots[slot];
+      const size_t hash = mixedHash(handle.key());
+      const size_t newSlot = findFree(hash);
+      new (mSlots + newSlot) Handle(handle);
+      handle.~Handle();
+      setControl(newSlot, fingerprint(hash));
+    }
+    mAllocator.deallocate(oldSlots, oldCapacity);
+    delete[] oldControl;
+    MATHIC_ASSERT(computeNodeCount() == mSize);
+  }
+
+  template<class C>
+  void FlatHashTable<C>::reset() {
+    destroyEntries();
+    std::fill(mControl, mControl + mCapacity, FlatHashTableInternal::Empty);
+    mSize = 0;
+    mGrowthLeft = mCapacity - mCapacity / 8;
+  }
+
+  template<class C>
+  void FlatHashTable<C>::hardReset() {
+    destroyEntries();
+    mAllocator.deallocate(mSlots, mCapacity);
+    delete[] mControl;
+    mControl = 0;
+    mSlots = 0;
+    allocate(GroupSize);
+  }
+
+  template<class C>
+  size_t FlatHashTable<C>::memoryUse() const {
+    return mCapacity * (sizeof(Handle) + sizeof(Control));
+  }
+
+  template<class C>
+  size_t FlatHashTable<C>::computeNodeCount() const {
+    size_t count = 0;
+    for (size_t slot = 0; slot < mCapacity; ++slot)
+      if (mControl[slot] >= 0)
+        ++count;
+    return count;
+  }
+}
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef MATHIC_GEO_MERGE_GUARD
+#define MATHIC_GEO_MERGE_GUARD
+
+#include "stdinc.h"
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATHIC_GEO_MERGE_SSE2
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
+namespace mathic {
+  /** The ways that Geobucket can merge two sorted ranges of entries.
+
+      GeoMergeCompare merges by calling Configuration::compare for each
+      step and works for any entry.
+
+      GeoMergeBranchless requires that Entry is an integral type and that
+      compare orders entries as the built-in operator < does. It merges
+      without compare and without a data dependent branch per entry, as
+      such branches are mispredicted about half of the time.
+
+      GeoMergeBitonic has the same requirements. Entries of 32 bits are
+      merged four at a time by an SSE2 bitonic merge network. Other
+      entries are merged as for GeoMergeBranchless.
+
+      Merges of a range with a bucket of the geobucket use the selected
+      kernel, while merges where one side is a span given to push are
+      done with compare. If supportDeduplication is true then
+      GeoMergeCompare is always used. */
+  enum GeobucketMergeKernel {
+    GeoMergeCompare = 0,
+    GeoMergeBranchless = 1,
+    GeoMergeBitonic = 2
+  };
+
+  namespace GeoMergeInternal {
+    /** Value is C::mergeKernel if C declares it and otherwise
+        GeoMergeCompare. */
+    MATHIC_DEFINE_OPTIONAL_FIELD
+      (MergeKernelOf, GeobucketMergeKernel, mergeKernel, GeoMergeCompare);
+
+    /** Merges the increasing ranges [a, aEnd) and [b, bEnd) into out
+        and returns the end of the output. */
+    template<class T>
+    T* mergeBranchless(
+      const T* a,
+      const T* aEnd,
+      const T* b,
+      const T* bEnd,
+      T* out
+    ) {
+      while (a != aEnd && b != bEnd) {
+        // neither range can run out in fewer steps than this.
+        size_t steps = std::min(aEnd - a, bEnd - b);
+        for (; steps != 0; --steps) {
+          const T x = *a;
+          const T y = *b;
+          const bool takeA = x < y;
+          *out = takeA ? x : y;
+          ++out;
+          a += takeA;
+          b += !takeA;
+        }
+      }
+      out = std::copy(a, aEnd, out);
+      return std::copy(b, bEnd, out);
+    }
+
+#ifdef MATHIC_GEO_MERGE_SSE2
+    /** A bitonic merge network for four pairs of 32 bit integers. If
+        Signed is false then the integers are flipped in their top bit
+        while they are in registers so that signed comparison orders
+        them as unsigned integers. */
+    template<bool Signed>
+    class Bitonic4 {
+    public:
+      static __m128i load(const void* p) {
+        return bias(_mm_loadu_si128(static_cast<const __m128i*>(p)));
+      }
+      static void store(void* p, __m128i v) {
+        _mm_storeu_si128(static_cast<__m128i*>(p), bias(v));
+      }
+
+      /** lo and hi must be increasing. Afterwards lo is the four least
+          of the eight integers and hi is the four greatest, both
+          increasing. */
+      static void merge(__m128i& lo, __m128i& hi) {
+        const __m128i reversed = _mm_shuffle_epi32(hi, _MM_SHUFFLE(0,1,2,3));
+        __m128i mn;
+        __m128i mx;
+        minMax(lo, reversed, mn, mx);
+        lo = sortBitonic(mn);
+        hi = sortBitonic(mx);
+      }
+
+    private:
+      static __m128i bias(__m128i v) {
+        if (Signed)
+          return v;
+        return _mm_xor_si128(v, _mm_set1_epi32(static_cast<int>(0x80000000u)));
+      }
+
+      static void minMax(__m128i a, __m128i b, __m128i& mn, __m128i& mx) {
+#ifdef __SSE4_1__
+        mn = _mm_min_epi32(a, b);
+        mx = _mm_max_epi32(a, b);
+#else
+        const __m128i aGreater = _mm_cmpgt_epi32(a, b);
+        mn = _mm_or_si128
+          (_mm_and_si128(aGreater, b), _mm_andnot_si128(aGreater, a));
+        mx = _mm_or_si128
+          (_mm_and_si128(aGreater, a), _mm_andnot_si128(aGreater, b));
+#endif
+      }
+
+      /** Sorts four integers that form a bitonic sequence. */
+      static __m128i sortBitonic(__m128i v) {
+        __m128i mn;
+        __m128i mx;
+        minMax(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)), mn, mx);
+        v = _mm_unpacklo_epi64(mn, mx);
+        minMax(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)), mn, mx);
+        return _mm_unpacklo_epi64
+          (_mm_unpacklo_epi32(mn, mx), _mm_unpackhi_epi32(mn, mx));
+      }
+    };
+
+    /** As mergeBranchless for 32 bit integers using Bitonic4 while both
+        ranges have at least four entries left. */
+    template<class T>
+    T* mergeBitonic32(
+      const T* a,
+      const T* aEnd,
+      const T* b,
+      const T* bEnd,
+      T* out
+    ) {
+      typedef Bitonic4<std::is_signed<T>::value> Net;
+      if (aEnd - a < 4 || bEnd - b < 4)
+        return mergeBranchless(a, aEnd, b, bEnd, out);
+
+      __m128i lo = Net::load(a);
+      __m128i hi = Net::load(b);
+      a += 4;
+      b += 4;
+      while (aEnd - a >= 4 && bEnd - b >= 4) {
+        Net::merge(lo, hi);
+        Net::store(out, lo);
+        out += 4;
+        // hi holds the four greatest entries seen so far. The next four
+        // entries to output are among them and the next four of the
+        // range whose next entry is least.
+        const bool takeA = *a < *b;
+        lo = Net::load(takeA ? a : b);
+        a += takeA ? 4 : 0;
+        b += takeA ? 0 : 4;
+      }
+      Net::merge(lo, hi);
+      Net::store(out, lo);
+      out += 4;
+
+      // merge the four entries in hi with what is left of a and b.
+      T pending[4];
+      Net::store(pending, hi);
+      if (aEnd - a < 4) {
+        T shortMerge[7];
+        T* shortEnd = mergeBranchless(a, aEnd,
+          pending + 0, pending + 4, shortMerge);
+        return mergeBranchless
+          (static_cast<const T*>(shortMerge), shortEnd, b, bEnd, out);
+      } else {
+        T shortMerge[7];
+        T* shortEnd = mergeBranchless(b, bEnd,
+          pending + 0, pending + 4, shortMerge);
+        return mergeBranchless
+          (a, aEnd, static_cast<const T*>(shortMerge), shortEnd, out);
+      }
+    }
+#endif
+
+    template<GeobucketMergeKernel Kernel, class T, bool Is32 =
+      std::is_integral<T>::value && sizeof(T) == 4>
+    struct Merger {
+      static T* merge(const T* a, const T* aEnd,
+        const T* b, const T* bEnd, T* out) {
+        return mergeBranchless(a, aEnd, b, bEnd, out);
+      }
+    };
+
+#ifdef MATHIC_GEO_MERGE_SSE2
+    template<class T>
+    struct Merger<GeoMergeBitonic, T, true> {
+      static T* merge(const T* a, const T* aEnd,
+        const T* b, const T* bEnd, T* out) {
+        return mergeBitonic32(a, aEnd, b, bEnd, out);
+      }
+    };
+#endif
+
+    /** Merges the increasing ranges [a, aEnd) and [b, bEnd) of integers
+        into out using Kernel, which must not be GeoMergeCompare. */
+    template<GeobucketMergeKernel Kernel, class T>
+    T* merge(const T* a, const T* aEnd, const T* b, const T* bEnd, T* out) {
+      static_assert(std::is_integral<T>::value,
+        "The merge kernels of Geobucket require an integral Entry.");
+      MATHIC_ASSERT(Kernel != GeoMergeCompare);
+      return Merger<Kernel, T>::merge(a, aEnd, b, bEnd, out);
+    }
+  }
+}
+
+#endif
@@ -6,7 +6,9 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <memory>
 #include "GeoFront.h"
+#include "GeoMerge.h"
 
 namespace mathic {
   enum GeobucketBucketStorage {
@@ -18,6 +20,37 @@ namespace mathic {
 	GeobucketStorageEnd = 3
   };
 
+  namespace GeobucketInternal {
+	/** Value is C::maxVirtualBuckets if C declares it and otherwise 0. */
+	MATHIC_DEFINE_OPTIONAL_FIELD
+	  (MaxVirtualBucketsOf, size_t, maxVirtualBuckets, 0);
+
+	/** Type is C::Allocator if C declares it and otherwise
+		std::allocator<C::Entry>. get returns C::getAllocator() or a
+		default constructed std::allocator. */
+	template<class C>
+	class AllocatorOf {
+	  template<class T>
+	  static char (&check(typename T::Allocator*))[2];
+	  template<class T>
+	  static char check(...);
+	  template<class T, bool Declared>
+	  struct Get {
+		typedef std::allocator<typename T::Entry> Type;
+		static Type get(const T&) {return Type();}
+	  };
+	  template<class T>
+	  struct Get<T, true> {
+		typedef typename T::Allocator Type;
+		static Type get(const T& conf) {return conf.getAllocator();}
+	  };
+	  typedef Get<C, sizeof(check<C>(0)) == 2> Selected;
+	public:
+	  typedef typename Selected::Type Type;
+	  static Type get(const C& conf) {return Selected::get(conf);}
+	};
+  }
+
   /** A geobucket priority queue.
 
 	  The Configuration template parameter specifies properties of the geobucket.
@@ -121,6 +154,35 @@ namespace mathic {
 	  of any other memory area, which makes it possible to do merges with no
 	  copies and also the content of two buckets can be swapped with no copies.
 	  Cannot be combined with useDoubleBucket.
+
+	  * Optionally a static const GeobucketMergeKernel mergeKernel
+	  GeoMergeCompare = 0,
+	  GeoMergeBranchless = 1,
+	  GeoMergeBitonic = 2
+
+	  This selects how a range is merged with the entries of a bucket.
+	  The default is GeoMergeCompare, which calls compare. The other
+	  kernels require an integral Entry that compare orders as operator <
+	  does and they do not call compare. See GeoMerge.h.
+
+	  * Optionally a static const size_t maxVirtualBuckets
+	  The default is 0. This is the number of spans pushed by
+	  pushReference that the geobucket keeps as virtual buckets. A virtual
+	  bucket refers to the caller's memory instead of copying it, and pop
+	  takes entries directly from it. When a span is pushed while there
+	  are already maxVirtualBuckets virtual buckets, the smallest of them
+	  and the new span is materialized, which means that it is pushed
+	  into the buckets as by push(begin, end). Virtual buckets are not
+	  used if supportDeduplication is true, since entries from them
+	  could not be deduplicated against the buckets.
+
+	  * Optionally a typedef Allocator and a method
+	  Allocator getAllocator() const
+	  If these are declared, the memory for the buckets is allocated
+	  through the Allocator that getAllocator returns. Allocator must
+	  be a standard library allocator of Entry. This makes it possible
+	  to take bucket storage from an arena of the caller. The default
+	  is std::allocator<Entry>.
   */
   template<class C>
   class Geobucket {
@@ -141,18 +203,53 @@ namespace mathic {
 	// be present twice in [begin, end).
 	template<class It>
     void push(It begin, It end);
+
+	// As push(begin, end) except that the entries may be kept as a
+	// virtual bucket that refers to [begin, end) instead of a copy of it.
+	// [begin, end) must then stay valid and unchanged until all of its
+	// entries have been popped or until materialize() or clear() is
+	// called. Configuration::maxVirtualBuckets must be non-zero for this
+	// to be different from push(begin, end).
+	void pushReference(const Entry* begin, const Entry* end);
+
+	// Copies the entries of every virtual bucket into the buckets, after
+	// which the geobucket no longer refers to memory from pushReference.
+	void materialize();
 	
     Entry pop();
     void clear();
 	Entry top() const;
     void decreaseTop(Entry newEntry);
 
+	// Pops up to maxCount entries and assigns them to *out in the order
+	// that pop() would have returned them, incrementing out after each.
+	// Entries at the end of the bucket with the maximal entry that are
+	// greater than the maximum of every other bucket are taken in a
+	// single step. Returns the number of entries popped.
+	template<class Out>
+	size_t popBatch(Out out, size_t maxCount);
+
+	// Pops top() and every following entry that is equal to it and
+	// assigns them to *out, incrementing out after each. Must not be
+	// called when empty. Returns the number of entries popped.
+	template<class Out>
+	size_t popWhileEqual(Out out);
+
 	bool empty() const;
     size_t size() const;
 	void print(std::ostream& out) const;
 
     template<class T>
     void forAll(T& t) const {
+      for (size_t i = 0; i < _virtual.size(); ++i) {
+        const VirtualBucket& bucket = _virtual[i];
+        for (const Entry* entry = bucket.begin; entry != bucket.end; ++entry) {
+          if (!t.proceed(*entry)) {
+            MATHIC_ASSERT(isValid());
+            return;
+          }
+        }
+      }
       for (Bucket* bucket = _bucketBegin; bucket != _bucketEnd; ++bucket) {
         const Entry* stop = bucket->end();
         for (const Entry* entry = bucket->begin(); entry != stop; ++entry) {
@@ -194,6 +291,12 @@ namespace mathic {
 		if (Configuration::collectMax && _size > 0)
 		  _back = *(end() - 1);
 	  }
+	  void pop_back(size_t count) {
+		MATHIC_ASSERT(count <= size());
+		_size -= count;
+		if (Configuration::collectMax && _size > 0)
+		  _back = *(end() - 1);
+	  }
 	  void setEntry(Entry* pos, const Entry& entry) {
 		MATHIC_ASSERT(begin() <= pos && pos < end());
 		*pos = entry;
@@ -202,8 +305,7 @@ namespace mathic {
 	  }
 	  void insertAtNotEnd(Entry* pos, const Entry& entry) {
 		MATHIC_ASSERT(begin() <= pos && pos < end());
-		for (Entry* it = end(); it != pos; --it)
-		  *it = *(it - 1);
+		std::copy_backward(pos, end(), end() + 1);
 		*pos = entry;
 		++_size;
 	  }
@@ -278,8 +380,23 @@ namespace mathic {
 	template<class It>
 	  void insert(Bucket* bucket, It begin, It end, size_t size, Premerge<false>);
 
+	static const GeobucketMergeKernel MergeKernel =
+	  GeoMergeInternal::MergeKernelOf<C>::Value;
+	template<bool value> struct UseMergeKernel {};
+
 	template<class It1, class It2, class ResIt>
 	  ResIt merge(It1 begin1, It1 end1, It2 begin2, It2 end2, ResIt res);
+	template<class It1, class It2, class ResIt>
+	  ResIt mergeCompare(It1 begin1, It1 end1, It2 begin2, It2 end2, ResIt res);
+	// Merges of ranges of entries in memory can use a merge kernel.
+	template<class E1, class E2>
+	  Entry* merge(E1* begin1, E1* end1, E2* begin2, E2* end2, Entry* res);
+	template<class E1, class E2>
+	  Entry* merge(E1* begin1, E1* end1, E2* begin2, E2* end2, Entry* res,
+	    UseMergeKernel<true>);
+	template<class E1, class E2>
+	  Entry* merge(E1* begin1, E1* end1, E2* begin2, E2* end2, Entry* res,
+	    UseMergeKernel<false>);
 	template<class It>
 	  size_t singleInsert(It begin, size_t size, const Entry& value) const;
 
@@ -290,11 +407,28 @@ namespace mathic {
 	template<class It>
 	  void mergeToNonEmpty(Bucket& into, It begin, It end);
 
+	// The remaining entries of a span pushed by pushReference in
+	// decreasing order, so the greatest entry is *begin.
+	struct VirtualBucket {
+	  const Entry* begin;
+	  const Entry* end;
+	};
+	static const size_t MaxVirtualBuckets = C::supportDeduplication ?
+	  0 : GeobucketInternal::MaxVirtualBucketsOf<C>::Value;
+
+	/// Returns true if the greatest entry is in a virtual bucket.
+	bool virtualHasMax() const;
+	Entry popVirtual();
+	void removeVirtual(size_t index);
+	void updateVirtualMax();
+
+	typedef typename GeobucketInternal::AllocatorOf<C>::Type Allocator;
+
 	size_t _geoBase;
 	std::vector<Bucket> _buckets;
 	Bucket* _bucketBegin;
 	Bucket* _bucketEnd;
-	std::vector<Entry> _mem;
+	std::vector<Entry, Allocator> _mem;
 	Entry* _tmp; // has capacity equal to the largest bucket
 	size_t _entryCount;
 
@@ -304,6 +438,10 @@ namespace mathic {
 	Configuration _conf;
 	GeoFront<Configuration> _front;
 
+	std::vector<VirtualBucket> _virtual;
+	size_t _virtualMax; // index of the virtual bucket with the greatest entry
+	size_t _virtualEntryCount;
+
     /// Asserts internal invariants if asserts are turned on.
 	bool isValid() const;
   };
@@ -312,12 +450,16 @@ namespace mathic {
 	Geobucket<C>::Geobucket(const C& configuration):
   _bucketBegin(0),
 	_bucketEnd(0),
+	_mem(GeobucketInternal::AllocatorOf<C>::get(configuration)),
 	_tmp(0),
 	_entryCount(0),
 	_tmpForNoPremerge(0),
 	_conf(configuration),
-	_front(_conf, _entryCount) {
+	_front(_conf, _entryCount),
+	_virtualMax(0),
+	_virtualEntryCount(0) {
 	MATHIC_ASSERT(_conf.geoBase > 1);
+	_virtual.reserve(MaxVirtualBuckets);
 	addBucket(); // this avoids the special case of no buckets.
     MATHIC_ASSERT_NO_ASSUME(_front.debugIsValid(_bucketBegin, _bucketEnd));
   }
@@ -336,7 +478,11 @@ namespace mathic {
 		<< (C::collectMax ? " col" : "")
 		<< (C::bucketStorage == GeoStoreDoubleBuffer ? " db" : "")
 		<< (C::bucketStorage == GeoStoreSameSizeBuffer ? " ss" : "")
-		<< ')';
+		<< (MergeKernel == GeoMergeBranchless ? " bl" : "")
+		<< (MergeKernel == GeoMergeBitonic ? " bitonic" : "");
+	if (MaxVirtualBuckets > 0)
+	  out << " v" << MaxVirtualBuckets;
+	out << ')';
 	return out.str();
   }
 
@@ -432,11 +578,105 @@ namespace mathic {
 	MATHIC_SLOW_ASSERT(isValid());
   }
 
+  template<class C>
+  void Geobucket<C>::pushReference(const Entry* begin, const Entry* end) {
+	if (MaxVirtualBuckets == 0) {
+	  push(begin, end);
+	  return;
+	}
+	if (begin == end)
+	  return;
+#ifdef MATHIC_DEBUG
+	for (const Entry* it = begin; it + 1 != end; ++it) {
+	  MATHIC_ASSERT(!_conf.cmpLessThan(_conf.compare(*it, *(it + 1))));
+	}
+#endif
+	if (_virtual.size() == MaxVirtualBuckets) {
+	  // materialize whichever span is smallest, as that is the cheapest
+	  // to copy and the least likely to be worth referring to.
+	  size_t smallest = 0;
+	  for (size_t i = 1; i < _virtual.size(); ++i) {
+		if (_virtual[i].end - _virtual[i].begin <
+		  _virtual[smallest].end - _virtual[smallest].begin)
+		  smallest = i;
+	  }
+	  const VirtualBucket& victim = _virtual[smallest];
+	  if (end - begin <= victim.end - victim.begin) {
+		push(begin, end);
+		return;
+	  }
+	  const VirtualBucket copy = victim;
+	  removeVirtual(smallest);
+	  push(copy.begin, copy.end);
+	}
+	VirtualBucket bucket = {begin, end};
+	_virtual.push_back(bucket);
+	_virtualEntryCount += end - begin;
+	updateVirtualMax();
+	MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  void Geobucket<C>::materialize() {
+	while (!_virtual.empty()) {
+	  const VirtualBucket bucket = _virtual.back();
+	  removeVirtual(_virtual.size() - 1);
+	  push(bucket.begin, bucket.end);
+	}
+	MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  bool Geobucket<C>::virtualHasMax() const {
+	if (_virtual.empty())
+	  return false;
+	if (_entryCount == 0)
+	  return true;
+	const Entry& bucketMax = _front.getMax(_bucketBegin, _bucketEnd)->back();
+	return !_conf.cmpLessThan
+	  (_conf.compare(*_virtual[_virtualMax].begin, bucketMax));
+  }
+
+  template<class C>
+  typename Geobucket<C>::Entry Geobucket<C>::popVirtual() {
+	MATHIC_ASSERT(!_virtual.empty());
+	VirtualBucket& bucket = _virtual[_virtualMax];
+	const Entry top = *bucket.begin;
+	++bucket.begin;
+	--_virtualEntryCount;
+	if (bucket.begin == bucket.end)
+	  removeVirtual(_virtualMax);
+	else
+	  updateVirtualMax();
+	return top;
+  }
+
+  template<class C>
+  void Geobucket<C>::removeVirtual(size_t index) {
+	MATHIC_ASSERT(index < _virtual.size());
+	_virtualEntryCount -= _virtual[index].end - _virtual[index].begin;
+	_virtual[index] = _virtual.back();
+	_virtual.pop_back();
+	updateVirtualMax();
+  }
+
+  template<class C>
+  void Geobucket<C>::updateVirtualMax() {
+	_virtualMax = 0;
+	for (size_t i = 1; i < _virtual.size(); ++i) {
+	  if (_conf.cmpLessThan
+		(_conf.compare(*_virtual[_virtualMax].begin, *_virtual[i].begin)))
+		_virtualMax = i;
+	}
+  }
+
   template<class C>
   void Geobucket<C>::clear() {
 	MATHIC_ASSERT(isValid());
     _entryCount = 0;
     _front.clear();
+    _virtual.clear();
+    _virtualEntryCount = 0;
     for (Bucket* bucket = _bucketBegin; bucket != _bucketEnd; ++bucket)
       bucket->clear();
 	MATHIC_ASSERT(isValid());
@@ -444,6 +684,11 @@ namespace mathic {
 
   template<class C>
   typename Geobucket<C>::Entry Geobucket<C>::pop() {
+	if (virtualHasMax()) {
+	  const Entry top = popVirtual();
+	  MATHIC_SLOW_ASSERT(isValid());
+	  return top;
+	}
 	Bucket* maxBucket =
 	  const_cast<Bucket*>(_front.getMax(_bucketBegin, _bucketEnd));
 	Entry top = maxBucket->back();
@@ -454,9 +699,109 @@ namespace mathic {
 	return top;
   }
 
+  template<class C>
+  template<class Out>
+  size_t Geobucket<C>::popBatch(Out out, size_t maxCount) {
+	size_t popped = 0;
+	while (popped < maxCount && !empty()) {
+	  if (!_virtual.empty()) {
+		// entries are taken one at a time while there are virtual
+		// buckets since a run would have to be bounded by those too.
+		*out = pop();
+		++out;
+		++popped;
+		continue;
+	  }
+	  Bucket* maxBucket =
+		const_cast<Bucket*>(_front.getMax(_bucketBegin, _bucketEnd));
+
+	  // The entries of maxBucket that are greater than the maximum of all
+	  // the other buckets are the next ones that pop() would return. The
+	  // comparison is strict so that deduplication happens in
+	  // keyDecreased just as it would for pop().
+	  const Entry* bound = 0;
+	  for (const Bucket* bucket = _bucketBegin; bucket != _bucketEnd; ++bucket) {
+		if (bucket == maxBucket || bucket->empty())
+		  continue;
+		if (bound == 0 ||
+		  _conf.cmpLessThan(_conf.compare(*bound, bucket->back())))
+		  bound = &bucket->back();
+	  }
+	  const size_t most = std::min(maxCount - popped, maxBucket->size());
+	  const Entry* const runEnd = maxBucket->end();
+	  const Entry* const runLimit = runEnd - most;
+	  const Entry* runBegin = runEnd - 1; // the top is always taken
+	  while (runBegin != runLimit && (bound == 0 ||
+		_conf.cmpLessThan(_conf.compare(*bound, *(runBegin - 1)))))
+		--runBegin;
+
+	  for (const Entry* it = runEnd; it != runBegin; ++out) {
+		--it;
+		*out = *it;
+	  }
+	  const size_t runSize = runEnd - runBegin;
+	  maxBucket->pop_back(runSize);
+	  _entryCount -= runSize;
+	  popped += runSize;
+	  _front.keyDecreased(maxBucket);
+	}
+	MATHIC_SLOW_ASSERT(isValid());
+	return popped;
+  }
+
+  template<class C>
+  template<class Out>
+  size_t Geobucket<C>::popWhileEqual(Out out) {
+	MATHIC_ASSERT(!empty());
+	const Entry first = top();
+	size_t popped = 0;
+	// The entries equal to first are at the end of their buckets since
+	// no entry is greater than first, so each bucket is visited once.
+	for (Bucket* bucket = _bucketBegin; bucket != _bucketEnd; ++bucket) {
+	  const Entry* const runEnd = bucket->end();
+	  const Entry* runBegin = runEnd;
+	  while (runBegin != bucket->begin() &&
+		!_conf.cmpLessThan(_conf.compare(*(runBegin - 1), first)))
+		--runBegin;
+	  if (runBegin == runEnd)
+		continue;
+
+	  for (const Entry* it = runEnd; it != runBegin; ++out) {
+		--it;
+		*out = *it;
+	  }
+	  const size_t runSize = runEnd - runBegin;
+	  bucket->pop_back(runSize);
+	  _entryCount -= runSize;
+	  popped += runSize;
+	  _front.keyDecreased(bucket);
+	}
+	for (size_t i = 0; i < _virtual.size(); ) {
+	  VirtualBucket& bucket = _virtual[i];
+	  while (bucket.begin != bucket.end &&
+		!_conf.cmpLessThan(_conf.compare(*bucket.begin, first))) {
+		*out = *bucket.begin;
+		++out;
+		++bucket.begin;
+		--_virtualEntryCount;
+		++popped;
+	  }
+	  if (bucket.begin == bucket.end)
+		removeVirtual(i);
+	  else
+		++i;
+	}
+	updateVirtualMax();
+	MATHIC_ASSERT(popped > 0);
+	MATHIC_SLOW_ASSERT(isValid());
+	return popped;
+  }
+
   template<class C>
   typename Geobucket<C>::Entry Geobucket<C>::top() const {
 	MATHIC_ASSERT(!empty());
+	if (virtualHasMax())
+	  return *_virtual[_virtualMax].begin;
 	return _front.getMax(_bucketBegin, _bucketEnd)->back();
   }
 
@@ -475,7 +820,7 @@ namespace mathic {
       sum += _buckets[b].size();
 	MATHIC_ASSERT(sum == _entryCount);
 #endif
-    return _entryCount;
+    return _entryCount + _virtualEntryCount;
   }
 
   template<class C>
@@ -497,6 +842,11 @@ namespace mathic {
 		  out << ' ' << (*bucket)[i];
 	  out << " [" << bucket->size() << '/' << bucket->capacity() << "]\n";
 	}
+	for (size_t i = 0; i < _virtual.size(); ++i) {
+	  out << " v" << i << ": " << *_virtual[i].begin << " ... "
+		  << *(_virtual[i].end - 1)
+		  << " [" << (_virtual[i].end - _virtual[i].begin) << "]\n";
+	}
 	out << "}\n";
   }
 
@@ -522,7 +872,7 @@ namespace mathic {
 	  required += newBucketSize; // for _tmpForNoPremerge
 
 	// allocate new memory
-	std::vector<Entry> newMem(required);
+	std::vector<Entry, Allocator> newMem(required, Entry(), _mem.get_allocator());
 	std::copy(_mem.begin(), _mem.end(), newMem.begin());
 
 	// move to new memory buffer
@@ -741,6 +1091,13 @@ namespace mathic {
   template<class C>
   template<class It1, class It2, class ResIt>
   ResIt Geobucket<C>::merge
+	(It1 begin1, It1 end1, It2 begin2, It2 end2, ResIt res) {
+	return mergeCompare(begin1, end1, begin2, end2, res);
+  }
+
+  template<class C>
+  template<class It1, class It2, class ResIt>
+  ResIt Geobucket<C>::mergeCompare
 	(It1 begin1, It1 end1, It2 begin2, It2 end2, ResIt res) {
 	if (begin1 == end1) goto range1Done;
 	if (begin2 == end2) goto range2Done;
@@ -770,6 +1127,43 @@ namespace mathic {
   range2Done: return std::copy(begin1, end1, res);
   }
 
+  template<class C>
+  template<class E1, class E2>
+  typename C::Entry* Geobucket<C>::merge
+	(E1* begin1, E1* end1, E2* begin2, E2* end2, Entry* res) {
+	const bool useKernel =
+	  MergeKernel != GeoMergeCompare && !C::supportDeduplication;
+	return merge
+	  (begin1, end1, begin2, end2, res, UseMergeKernel<useKernel>());
+  }
+
+  template<class C>
+  template<class E1, class E2>
+  typename C::Entry* Geobucket<C>::merge(
+	E1* begin1,
+	E1* end1,
+	E2* begin2,
+	E2* end2,
+	Entry* res,
+	UseMergeKernel<true>
+  ) {
+	return GeoMergeInternal::merge<MergeKernel, Entry>
+	  (begin1, end1, begin2, end2, res);
+  }
+
+  template<class C>
+  template<class E1, class E2>
+  typename C::Entry* Geobucket<C>::merge(
+	E1* begin1,
+	E1* end1,
+	E2* begin2,
+	E2* end2,
+	Entry* res,
+	UseMergeKernel<false>
+  ) {
+	return mergeCompare(begin1, end1, begin2, end2, res);
+  }
+
   template<class C>
   Geobucket<C>::Bucket::Bucket
 	(size_t capacity, Entry* buffer, Entry* otherBuffer):
@@ -786,6 +1180,7 @@ namespace mathic {
   size_t Geobucket<C>::getMemoryUse() const {
     return _mem.capacity() * sizeof(_mem.front()) +
       _buckets.capacity() * sizeof(_buckets.front()) +
+      _virtual.capacity() * sizeof(VirtualBucket) +
       _front.getMemoryUse();
   }
 
@@ -811,6 +1206,20 @@ namespace mathic {
 	  }
 	}
 	MATHIC_ASSERT(entryCount == _entryCount);
+
+	size_t virtualEntryCount = 0;
+	MATHIC_ASSERT(_virtual.size() <= MaxVirtualBuckets);
+	for (size_t i = 0; i < _virtual.size(); ++i) {
+	  const VirtualBucket& bucket = _virtual[i];
+	  MATHIC_ASSERT(bucket.begin != bucket.end);
+	  virtualEntryCount += bucket.end - bucket.begin;
+	  for (const Entry* it = bucket.begin; it != bucket.end - 1; ++it) {
+		MATHIC_ASSERT(!_conf.cmpLessThan(_conf.compare(*it, *(it + 1))));
+	  }
+	  MATHIC_ASSERT(!_conf.cmpLessThan
+		(_conf.compare(*_virtual[_virtualMax].begin, *bucket.begin)));
+	}
+	MATHIC_ASSERT(virtualEntryCount == _virtualEntryCount);
 	return _front.debugIsValid(_bucketBegin, _bucketEnd);
 #endif
   }
@@ -6,8 +6,17 @@
 #include <vector>
 #include <ostream>
 #include <string>
+#include <sstream>
 
 namespace mathic {
+  namespace HeapInternal {
+    /** Value is C::arity if C declares it and otherwise 2. */
+    MATHIC_DEFINE_OPTIONAL_FIELD(ArityOf, size_t, arity, 2);
+
+    /** Value is C::cacheAligned if C declares it and otherwise false. */
+    MATHIC_DEFINE_OPTIONAL_FIELD(CacheAlignedOf, bool, cacheAligned, false);
+  }
+
   /** A heap priority queue.
 
   Configuration serves the same role as for Geobucket. It must have these
@@ -26,6 +35,18 @@ namespace mathic {
   If this field is true, then a faster way of calculating indexes is used.
   This requires sizeof(Entry) to be a power of two! This can be achieved
   by adding padding to Entry, but this class does not do that for you.
+
+  These fields are optional:
+
+  * A static const size_t arity
+  The number of children of each node. The default is 2. A larger arity
+  such as 4 or 8 makes the heap shallower, so a pop visits fewer levels
+  at the price of more comparisons per level.
+
+  * A static const bool cacheAligned
+  If this field is true, then the entries are placed so that the children
+  of each node lie on a single cache line, as long as arity * sizeof(Entry)
+  divides 64. The default is false.
   */
   template<class C>
   class Heap {
@@ -52,12 +73,36 @@ namespace mathic {
     std::string getName() const;
     void push(Entry entry);
 
+    // Pushes the entries in [begin, end). If there are many entries
+    // compared to size(), then they are appended and the heap is rebuilt
+    // bottom-up as in Floyd's heap construction, which takes linear time.
     template<class It>
     void push(It begin, It end);
 
+    // Moves all entries of heap into this heap, leaving heap empty. The
+    // entries of heap are appended to the tree and then only the nodes
+    // above them are sifted down as in Floyd's heap construction, which
+    // takes time linear in heap.size() plus a term for the height of
+    // the tree. If heap is small or Configuration::supportDeduplication
+    // is true, then the entries are pushed one at a time instead.
+    void meld(Heap& heap);
+
     void clear();
     Entry pop();
     Entry top() const {return _tree[Node()];}
+
+    // Pops up to maxCount entries and assigns them to *out in the order
+    // that pop() would have returned them, incrementing out after each.
+    // Returns the number of entries popped.
+    template<class Out>
+    size_t popBatch(Out out, size_t maxCount);
+
+    // Pops top() and every following entry that is equal to it and
+    // assigns them to *out, incrementing out after each. Must not be
+    // called when empty. Returns the number of entries popped.
+    template<class Out>
+    size_t popWhileEqual(Out out);
+
     bool empty() const {return _tree.empty();}
     size_t size() const {return _tree.size();}
 
@@ -68,12 +113,26 @@ namespace mathic {
     size_t getMemoryUse() const;
 
   private:
-    typedef ComTree<Entry, Configuration::fastIndex> Tree;
+    static const size_t Arity = HeapInternal::ArityOf<C>::Value;
+    typedef ComTree<Entry, Configuration::fastIndex, Arity,
+      HeapInternal::CacheAlignedOf<C>::Value> Tree;
     typedef typename Tree::Node Node;
 
     Node moveHoleDown(Node hole);
     void moveValueUp(Node pos, Entry value);
 
+    // Moves the entry at pos down until it is not less than its children,
+    // assuming that the subtrees of the children are heaps.
+    void siftDown(Node pos);
+
+    // Restores the heap property when the entries from first to the last
+    // leaf have been appended to a heap without being moved up.
+    void heapifyFrom(Node first);
+
+    // Returns true if adding count entries is faster by appending them
+    // and calling heapifyFrom than by pushing them one at a time.
+    bool preferHeapify(size_t count) const;
+
     /// Asserts internal invariants if asserts are turned on.
     bool isValid() const;
 
@@ -88,10 +147,16 @@ namespace mathic {
 
   template<class C>
   std::string Heap<C>::getName() const {
-	return std::string("heap(") +
-	  (C::fastIndex ?  "fi" : "si") +
-	  (C::supportDeduplication ? " dedup" : "") +
-	  ')';
+	std::ostringstream name;
+	name << "heap(" << (C::fastIndex ?  "fi" : "si");
+	if (Arity != 2)
+	  name << ' ' << Arity << "-ary";
+	if (HeapInternal::CacheAlignedOf<C>::Value)
+	  name << " aligned";
+	if (C::supportDeduplication)
+	  name << " dedup";
+	name << ')';
+	return name.str();
   }
 
   template<class C>
@@ -104,8 +169,38 @@ namespace mathic {
   template<class C>
   template<class It>
   void Heap<C>::push(It begin, It end) {
+	size_t count = 0;
+	for (It it = begin; it != end; ++it)
+	  ++count;
+	if (C::supportDeduplication || !preferHeapify(count)) {
+	  for (; begin != end; ++begin)
+		push(*begin);
+	  return;
+	}
+	const Node first = _tree.lastLeaf().next();
 	for (; begin != end; ++begin)
-	  push(*begin);
+	  _tree.pushBack(*begin);
+	heapifyFrom(first);
+	MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  void Heap<C>::meld(Heap& heap) {
+	MATHIC_ASSERT(&heap != this);
+	if (heap.empty())
+	  return;
+	if (C::supportDeduplication || !preferHeapify(heap.size())) {
+	  for (Node it = Node(); it <= heap._tree.lastLeaf(); ++it)
+		push(heap._tree[it]);
+	  heap.clear();
+	  return;
+	}
+	const Node first = _tree.lastLeaf().next();
+	for (Node it = Node(); it <= heap._tree.lastLeaf(); ++it)
+	  _tree.pushBack(heap._tree[it]);
+	heap.clear();
+	heapifyFrom(first);
+	MATHIC_SLOW_ASSERT(isValid());
   }
 
   template<class C>
@@ -132,6 +227,34 @@ namespace mathic {
 	MATHIC_SLOW_ASSERT(isValid());
   }
 
+  template<class C>
+  template<class Out>
+  size_t Heap<C>::popBatch(Out out, size_t maxCount) {
+	size_t popped = 0;
+	for (; popped < maxCount && !empty(); ++popped) {
+	  *out = pop();
+	  ++out;
+	}
+	return popped;
+  }
+
+  template<class C>
+  template<class Out>
+  size_t Heap<C>::popWhileEqual(Out out) {
+	MATHIC_ASSERT(!empty());
+	const Entry first = pop();
+	*out = first;
+	++out;
+	size_t popped = 1;
+	// entries are at most first, so they are equal if not less
+	for (; !empty() && !_conf.cmpLessThan(_conf.compare(top(), first));
+	  ++popped) {
+	  *out = pop();
+	  ++out;
+	}
+	return popped;
+  }
+
   template<class C>
 	void Heap<C>::print(std::ostream& out) const {
 	out << getName() << ": {" << _tree << "}\n";
@@ -139,6 +262,32 @@ namespace mathic {
 
   template<class C>
 	typename Heap<C>::Node Heap<C>::moveHoleDown(Node hole) {
+	if (Arity != 2) {
+	  const Node last = _tree.lastLeaf();
+	  while (true) {
+		const Node firstChild = hole.firstChild();
+		if (firstChild > last)
+		  break;
+		Node child = firstChild;
+		if (firstChild.next(Arity - 1) <= last) {
+		  // all Arity children are present, which lets the compiler
+		  // unroll this loop.
+		  for (size_t i = 1; i < Arity; ++i) {
+			const Node sibling = firstChild.next(i);
+			if (_conf.cmpLessThan(_conf.compare(_tree[child], _tree[sibling])))
+			  child = sibling;
+		  }
+		} else {
+		  for (Node sibling = firstChild.next(); sibling <= last; ++sibling)
+			if (_conf.cmpLessThan(_conf.compare(_tree[child], _tree[sibling])))
+			  child = sibling;
+		}
+		_tree[hole] = _tree[child];
+		hole = child;
+	  }
+	  return hole;
+	}
+
 	const Node firstWithout2Children = _tree.lastLeaf().next().parent();
 	while (hole < firstWithout2Children) {
 	  // can assume hole has two children here
@@ -158,6 +307,68 @@ namespace mathic {
 	return hole;
   }
 
+  template<class C>
+	void Heap<C>::siftDown(Node pos) {
+	const Entry value = _tree[pos];
+	const Node last = _tree.lastLeaf();
+	while (true) {
+	  const Node firstChild = pos.firstChild();
+	  if (firstChild > last)
+		break;
+	  Node child = firstChild;
+	  const Node stop = firstChild.next(Arity - 1) <= last ?
+		firstChild.next(Arity) : last.next();
+	  for (Node sibling = firstChild.next(); sibling != stop; ++sibling)
+		if (_conf.cmpLessThan(_conf.compare(_tree[child], _tree[sibling])))
+		  child = sibling;
+	  if (!_conf.cmpLessThan(_conf.compare(value, _tree[child])))
+		break;
+	  _tree[pos] = _tree[child];
+	  pos = child;
+	}
+	_tree[pos] = value;
+  }
+
+  template<class C>
+	void Heap<C>::heapifyFrom(Node first) {
+	MATHIC_ASSERT(!C::supportDeduplication);
+	if (_tree.empty() || first > _tree.lastLeaf() || _tree.lastLeaf().isRoot())
+	  return;
+	// The nodes whose subtrees contain an appended entry form a range
+	// [low, high] on each level since parent() is monotone. Children are
+	// sifted before their parents by going from high to low and then up
+	// one level, skipping the nodes that were sifted on the way already.
+	// If first is the root, then the parents of the nodes after the root
+	// are every node that has a child.
+	Node low = first.isRoot() ? first.next() : first;
+	Node high = _tree.lastLeaf();
+	bool sifted = false; // true if [low, high] has been sifted
+	while (!low.isRoot()) {
+	  const Node previousLow = low;
+	  low = low.parent();
+	  high = high.parent();
+	  if (sifted && !(high < previousLow))
+		high = previousLow.prev();
+	  for (Node pos = high; ; pos = pos.prev()) {
+		siftDown(pos);
+		if (pos == low)
+		  break;
+	  }
+	  sifted = true;
+	}
+  }
+
+  template<class C>
+	bool Heap<C>::preferHeapify(size_t count) const {
+	// A pushed entry takes at most one comparison per level on its way
+	// up while heapifyFrom takes a few comparisons per appended entry
+	// plus some for each level, so pushing is better for few entries.
+	size_t height = 0;
+	for (size_t i = size() + count; i > 1; i /= Arity)
+	  ++height;
+	return count > height;
+  }
+
   template<class C>
 	void Heap<C>::moveValueUp(Node pos, Entry value) {
 	const Node origPos = pos;
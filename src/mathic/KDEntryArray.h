@@ -5,13 +5,17 @@
 
 #include "DivMask.h"
 #include "Comparer.h"
+#include "KDSplit.h"
+#include "KDExponentArray.h"
 
 #include <stdexcept>
 #include <memtailor.h>
 
 namespace mathic {
   template<class C, class EE>
-  class KDEntryArray : public DivMask::HasDivMask<C::UseTreeDivMask> {
+  class KDEntryArray :
+    public DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask>,
+    private KDExponentArray<C, C::LeafSize> {
   public:
     typedef typename C::Entry Entry;
     typedef typename C::Exponent Exponent;
@@ -20,9 +24,10 @@ namespace mathic {
     typedef const EE* const_iterator;
     typedef const EE& const_reference;
     typedef EE value_type;
-    typedef DivMask::Calculator<C> DivMaskCalculator;
+    typedef typename DivMaskOf<C>::template Calculator<C> DivMaskCalculator;
 
-    using DivMask::HasDivMask<C::UseTreeDivMask>::updateToLowerBound;
+    using DivMaskOf<C>::template
+      HasDivMask<C::UseTreeDivMask>::updateToLowerBound;
 
     KDEntryArray(memt::Arena& arena, const C& conf);
 
@@ -35,6 +40,16 @@ namespace mathic {
     void clear();
 
     void recalculateTreeDivMask();
+
+    /** Recomputes the div mask of each entry using calc, which is then
+        the calculator that the masks were computed with, along with the
+        tree div mask and the array of entry div masks. */
+    void recalculateDivMasks(const DivMaskCalculator& calc, const C& conf);
+
+    /** Call this after the entries have been reordered or overwritten
+        through iterators so that the arrays of entry div masks and
+        exponents used for filtering match the entries again. */
+    void updateMaskArray(const C& conf);
 #ifdef MATHIC_DEBUG
     bool debugIsValid() const;
 #endif
@@ -53,9 +68,9 @@ namespace mathic {
     EE& back() {MATHIC_ASSERT(!empty()); return *(_end - 1);}
     const EE& back() const {MATHIC_ASSERT(!empty()); return *(_end - 1);}
 
-    void push_back(const EE& entry);
+    void push_back(const EE& entry, const C& conf);
     void pop_back();
-    void insert(iterator it, const EE& entry);
+    void insert(iterator it, const EE& entry, const C& conf);
     void insert(const EE& entry, const C& conf);
 
     /** Returns how many were removed. */
@@ -89,7 +104,11 @@ namespace mathic {
      begin must not equal end.
      
      If not null, the entry os taken into account when deciding which
-     split to perform. The Entry is NOT inserted   into [begin, end). */
+     split to perform. The Entry is NOT inserted   into [begin, end).
+
+     The split is chosen according to C::splitStrategy as described
+     for KDTreeSplitStrategy. queries is the sample of queries for
+     KDSplitQueries and can be null. */
     template<class Iter>
     static Iter split(
       Iter begin,
@@ -97,11 +116,12 @@ namespace mathic {
       size_t& var,
       Exponent& exp,
       const C& conf,
-      const ExtEntry* extEntry = 0
+      const ExtEntry* extEntry = 0,
+      const KDQuerySample<C>* queries = 0
     );
 
-    using DivMask::HasDivMask<C::UseTreeDivMask>::resetDivMask;
-    using DivMask::HasDivMask<C::UseTreeDivMask>::getDivMask;
+    using DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask>::resetDivMask;
+    using DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask>::getDivMask;
 
   private:
     static Entry& getEntry(Entry& e) {return e;}
@@ -114,10 +134,52 @@ namespace mathic {
 
     class SplitEqualOrLess;
 
+    /** Sets var and exp for split by a strategy other than
+        KDSplitRoundRobin. Returns false if all the entries are equal. */
+    template<class Iter>
+    static bool chooseSplit(
+      Iter begin,
+      Iter end,
+      size_t& var,
+      Exponent& exp,
+      const C& conf,
+      const ExtEntry* extEntry,
+      const KDQuerySample<C>* queries
+    );
+
+    /** Writes the indices of the entries in [begin(), rangeEnd) whose
+        div mask and inline exponents do not rule out that they divide
+        extMonomial to out and returns how many there were. */
+    template<class EM>
+    size_t findMaybeDivisors(const EM& extMonomial, const_iterator rangeEnd,
+      size_t* out, const C& conf) const;
+
+    /** Returns the end of the range of entries that can divide
+        extMonomial, which is end() unless the entries are sorted. */
+    template<class EM>
+    iterator divisorRangeEnd(const EM& extMonomial, const C& conf);
+
+    /** The div masks of the entries in the same order as the entries.
+        Used to rule out many entries at once when C::UseDivMask is
+        true. */
+    typename DivMaskOf<C>::template Array<C::LeafSize, C::UseDivMask>
+      _entryMasks;
+
+    /** Copies of the exponents of the entries in the same order as the
+        entries if C declares InlineExponentVarCount. Used to check
+        divisibility without reading the entries. It is a base class so
+        that it takes no space when it is disabled. */
+    typedef KDExponentArray<C, C::LeafSize> ExponentArray;
+    ExponentArray& entryExponents() {return *this;}
+    const ExponentArray& entryExponents() const {return *this;}
+
+    /** True if the candidates for a divisor are found through the
+        arrays of div masks and exponents instead of entry by entry. */
+    static const bool FilterDivisors = C::UseDivMask || ExponentArray::Enabled;
 
     /** This is the memory for the entries. It is kept as a raw char*
      to avoid constructing all the entries right away. */
-    char _beginMemory[C::LeafSize * sizeof(ExtEntry)];
+    alignas(ExtEntry) char _beginMemory[C::LeafSize * sizeof(ExtEntry)];
     iterator _end; // points into _beginMemory
 #ifdef MATHIC_DEBUG
     const bool _sortOnInsertDebug;
@@ -151,9 +213,20 @@ namespace mathic {
     size_t& var,
     Exponent& exp,
     const C& conf,
-    const ExtEntry* extEntry
+    const ExtEntry* extEntry,
+    const KDQuerySample<C>* queries
   ) {
     MATHIC_ASSERT(begin != end);
+    if (KDSplitInternal::StrategyOf<C>::Value != KDSplitRoundRobin) {
+      if (!chooseSplit(begin, end, var, exp, conf, extEntry, queries)) {
+        MATHIC_ASSERT(false);
+        throw std::logic_error
+          ("ERROR: Inserted duplicate entry into a KD tree.");
+      }
+      SplitEqualOrLess cmp(var, exp, conf);
+      return std::partition(begin, end, cmp);
+    }
+
     const size_t varCount = conf.getVarCount();
     for (size_t i = 0; i < varCount; ++i) {
       var = (var + 1) % conf.getVarCount();
@@ -182,6 +255,80 @@ namespace mathic {
     throw std::logic_error("ERROR: Inserted duplicate entry into a KD tree.");
   }
 
+  template<class C, class EE>
+  template<class Iter>
+  bool KDEntryArray<C, EE>::chooseSplit(
+    Iter begin,
+    Iter end,
+    size_t& var,
+    Exponent& exp,
+    const C& conf,
+    const ExtEntry* extEntry,
+    const KDQuerySample<C>* queries
+  ) {
+    const KDTreeSplitStrategy strategy = KDSplitInternal::StrategyOf<C>::Value;
+    const size_t varCount = conf.getVarCount();
+    const size_t count = std::distance(begin, end);
+    const size_t step =
+      count <= KDSplitSampleSize ? 1 : count / KDSplitSampleSize;
+
+    // the exponents of the sampled entries with one row for each var.
+    std::vector<Exponent> sample;
+    size_t sampleSize = 0;
+    size_t index = 0;
+    for (Iter it = begin; it != end; ++it, ++index) {
+      if (index % step != 0)
+        continue;
+      for (size_t v = 0; v < varCount; ++v)
+        sample.push_back(conf.getExponent(getEntry(*it), v));
+      ++sampleSize;
+    }
+    if (extEntry != 0) {
+      for (size_t v = 0; v < varCount; ++v)
+        sample.push_back(conf.getExponent(getEntry(*extEntry), v));
+      ++sampleSize;
+    }
+
+    bool found = false;
+    double bestScore = 0;
+    std::vector<Exponent> values(sampleSize);
+    for (size_t v = 0; v < varCount; ++v) {
+      for (size_t i = 0; i < sampleSize; ++i)
+        values[i] = sample[i * varCount + v];
+      std::sort(values.begin(), values.end());
+      if (!(values.front() < values.back()))
+        continue;
+      Exponent vExp = values.front();
+      const double score = KDSplitInternal::scoreVar
+        (strategy, values, v, varCount, queries, vExp);
+      if (!found || bestScore < score) {
+        found = true;
+        bestScore = score;
+        var = v;
+        exp = vExp;
+      }
+    }
+    if (found || step == 1)
+      return found;
+
+    // the sample missed the entries that differ, so look at all of them.
+    for (size_t v = 0; v < varCount; ++v) {
+      Exponent min = conf.getExponent
+        (extEntry == 0 ? getEntry(*begin) : getEntry(*extEntry), v);
+      Exponent max = min;
+      for (Iter it = begin; it != end; ++it) {
+        min = std::min(min, conf.getExponent(getEntry(*it), v));
+        max = std::max(max, conf.getExponent(getEntry(*it), v));
+      }
+      if (min < max) {
+        var = v;
+        exp = min + (max - min) / 2;
+        return true;
+      }
+    }
+    return false;
+  }
+
   template<class C, class EE>
   KDEntryArray<C, EE>::KDEntryArray(memt::Arena& arena, const C& conf)
 #ifdef MATHIC_DEBUG
@@ -208,9 +355,11 @@ namespace mathic {
     _end = this->begin();
     // cannot directly copy as memory is not constructed.
     for (; begin != end; ++begin)
-      push_back(EE(*begin, calc, conf));
-    if (conf.getSortOnInsert())
+      push_back(EE(*begin, calc, conf), conf);
+    if (conf.getSortOnInsert()) {
       std::sort(this->begin(), this->end(), Comparer<C>(conf));
+      updateMaskArray(conf);
+    }
   }
 
   template<class C, class EE>
@@ -229,15 +378,19 @@ namespace mathic {
     _end = this->begin();
     // cannot directly copy as memory is not constructed.
     for (; begin != end; ++begin)
-      push_back(*begin);
-    if (conf.getSortOnInsert())
+      push_back(*begin, conf);
+    if (conf.getSortOnInsert()) {
       std::sort(this->begin(), this->end(), Comparer<C>(conf));
+      updateMaskArray(conf);
+    }
   }
 
   template<class C, class EE>
-    void KDEntryArray<C, EE>::push_back(const EE& entry) {
+    void KDEntryArray<C, EE>::push_back(const EE& entry, const C& conf) {
     MATHIC_ASSERT(size() < C::LeafSize);
     new (_end) EE(entry);
+    _entryMasks.set(size(), entry);
+    entryExponents().set(size(), entry.get(), conf);
     updateToLowerBound(entry);
     ++_end;
   }
@@ -250,28 +403,34 @@ namespace mathic {
   }
 
   template<class C, class EE>
-    void KDEntryArray<C, EE>::insert(iterator it, const EE& entry) {
+    void KDEntryArray<C, EE>::insert
+    (iterator it, const EE& entry, const C& conf) {
     MATHIC_ASSERT(size() < C::LeafSize);
     if (it == end()) {
-      push_back(entry);
+      push_back(entry, conf);
       return;
     }
-    push_back(back());
+    push_back(back(), conf);
     iterator moveTo = end();
-    for (--moveTo; moveTo != it; --moveTo)
+    for (--moveTo; moveTo != it; --moveTo) {
       *moveTo = *(moveTo - 1);
+      _entryMasks.set(moveTo - begin(), *moveTo);
+      entryExponents().set(moveTo - begin(), moveTo->get(), conf);
+    }
     updateToLowerBound(entry);
     *it = entry;
+    _entryMasks.set(it - begin(), entry);
+    entryExponents().set(it - begin(), entry.get(), conf);
   }
 
   template<class C, class EE>
     void KDEntryArray<C, EE>::insert(const EE& entry, const C& conf) {
     MATHIC_ASSERT(size() < C::LeafSize);
     if (!conf.getSortOnInsert())
-      push_back(entry);
+      push_back(entry, conf);
     else {
       iterator it = std::upper_bound(begin(), end(), entry, Comparer<C>(conf));
-      insert(it, entry);
+      insert(it, entry, conf);
     }
   }
 
@@ -294,6 +453,39 @@ namespace mathic {
       return 1;
     }
 
+    if (C::UseDivMask) {
+      // Only the entries that pass the div mask check need to be
+      // checked for divisibility. Keep the rest in their order.
+      size_t candidates[C::LeafSize];
+      const size_t candidateCount = _entryMasks.findMaybeMultiples
+        (size(), monomial.getDivMask(), candidates);
+      if (candidateCount == 0)
+        return 0;
+      iterator newEnd = begin() + candidates[0];
+      size_t candidate = 0;
+      for (iterator it = newEnd; it != end(); ++it) {
+        const size_t index = it - begin();
+        if (candidate < candidateCount && candidates[candidate] == index) {
+          ++candidate;
+          if (conf.divides(monomial.get(), it->get())) {
+            out.push_back(it->get());
+            continue;
+          }
+        }
+        if (newEnd != it) {
+          *newEnd = *it;
+          _entryMasks.set(newEnd - begin(), *newEnd);
+          entryExponents().set(newEnd - begin(), newEnd->get(), conf);
+        }
+        ++newEnd;
+      }
+      const size_t newSize = std::distance(begin(), newEnd);
+      const size_t removedCount = size() - newSize;
+      while (newSize < size())
+        pop_back();
+      return removedCount;
+    }
+
     iterator it = begin();
     iterator oldEnd = end();
     for (; it != oldEnd; ++it) {
@@ -308,6 +500,8 @@ namespace mathic {
     for (++it; it != oldEnd; ++it) {
       if (!monomial.divides(*it, conf)) {
         *newEnd = *it;
+        _entryMasks.set(newEnd - begin(), *newEnd);
+        entryExponents().set(newEnd - begin(), newEnd->get(), conf);
         ++newEnd;
       } else
         out.push_back(it->get());
@@ -335,8 +529,11 @@ namespace mathic {
           goto skip;
       if (it != end()) {
         const_iterator next = it;
-        for (++next; next != end(); ++it, ++next)
+        for (++next; next != end(); ++it, ++next) {
           *it = *next;
+          _entryMasks.set(it - begin(), *it);
+          entryExponents().set(it - begin(), it->get(), conf);
+        }
       }
       pop_back();
       return true;
@@ -362,7 +559,18 @@ namespace mathic {
       else
         return end();
     }
-    else if (!conf.getSortOnInsert()) {
+    else if (FilterDivisors) {
+      size_t candidates[C::LeafSize];
+      const size_t candidateCount = findMaybeDivisors
+        (extMonomial, divisorRangeEnd(extMonomial, conf), candidates, conf);
+      const bool exact = entryExponents().isExact(conf);
+      for (size_t i = 0; i < candidateCount; ++i) {
+        const iterator it = begin() + candidates[i];
+        if (exact || conf.divides(it->get(), extMonomial.get()))
+          return it;
+      }
+      return end();
+    } else if (!conf.getSortOnInsert()) {
       const iterator stop = end();
       for (iterator it = begin(); it != stop; ++it)
         if (it->divides(extMonomial, conf))
@@ -393,7 +601,18 @@ namespace mathic {
       return (C::AllowRemovals && empty()) ||
         !begin()->divides(extMonomial, conf) ||
         out.proceed(begin()->get());
-    } else  if (!conf.getSortOnInsert()) {
+    } else if (FilterDivisors) {
+      size_t candidates[C::LeafSize];
+      const size_t candidateCount = findMaybeDivisors
+        (extMonomial, divisorRangeEnd(extMonomial, conf), candidates, conf);
+      const bool exact = entryExponents().isExact(conf);
+      for (size_t i = 0; i < candidateCount; ++i) {
+        const iterator it = begin() + candidates[i];
+        if (exact || conf.divides(it->get(), extMonomial.get()))
+          if (!out.proceed(it->get()))
+            return false;
+      }
+    } else if (!conf.getSortOnInsert()) {
       const iterator stop = end();
       for (iterator it = begin(); it != stop; ++it)
         if (it->divides(extMonomial, conf))
@@ -422,6 +641,19 @@ namespace mathic {
         out.proceed(begin()->get());
     }
 
+    if (C::UseDivMask) {
+      size_t candidates[C::LeafSize];
+      const size_t candidateCount = _entryMasks.findMaybeMultiples
+        (size(), extMonomial.getDivMask(), candidates);
+      for (size_t i = 0; i < candidateCount; ++i) {
+        const iterator it = begin() + candidates[i];
+        if (conf.divides(extMonomial.get(), it->get()))
+          if (!out.proceed(it->get()))
+            return false;
+      }
+      return true;
+    }
+
     // todo: consider making sorted version
     const iterator stop = end();
     for (iterator it = begin(); it != stop; ++it)
@@ -477,6 +709,54 @@ namespace mathic {
     for (const_iterator it = begin(); it != end(); ++it)
       updateToLowerBound(*it);
   }
+
+  template<class C, class EE>
+  void KDEntryArray<C, EE>::recalculateDivMasks
+  (const DivMaskCalculator& calc, const C& conf) {
+    if (!C::UseDivMask)
+      return;
+    for (iterator it = begin(); it != end(); ++it)
+      it->recalculateDivMask(calc, conf);
+    updateMaskArray(conf);
+    recalculateTreeDivMask();
+  }
+
+  template<class C, class EE>
+  void KDEntryArray<C, EE>::updateMaskArray(const C& conf) {
+    if (!FilterDivisors)
+      return;
+    for (const_iterator it = begin(); it != end(); ++it) {
+      _entryMasks.set(it - begin(), *it);
+      entryExponents().set(it - begin(), it->get(), conf);
+    }
+  }
+
+  template<class C, class EE>
+  template<class EM>
+  size_t KDEntryArray<C, EE>::findMaybeDivisors(
+    const EM& extMonomial,
+    const_iterator rangeEnd,
+    size_t* out,
+    const C& conf
+  ) const {
+    const size_t count = rangeEnd - begin();
+    if (!C::UseDivMask)
+      return entryExponents().findDivisors(count, extMonomial.get(), conf, out);
+    const size_t maybeCount = _entryMasks.findMaybeDivisors
+      (count, extMonomial.getDivMask(), out);
+    return entryExponents().filterDivisors
+      (maybeCount, extMonomial.get(), conf, out);
+  }
+
+  template<class C, class EE>
+  template<class EM>
+  typename KDEntryArray<C, EE>::iterator
+  KDEntryArray<C, EE>::divisorRangeEnd(const EM& extMonomial, const C& conf) {
+    if (!conf.getSortOnInsert())
+      return end();
+    return std::upper_bound(begin(), end(), extMonomial, Comparer<C>(conf));
+  }
+
 #ifdef MATHIC_DEBUG
   template<class C, class EE>
   bool KDEntryArray<C, EE>::debugIsValid() const {
@@ -487,6 +767,20 @@ namespace mathic {
         MATHIC_ASSERT(getDivMask().canDivide(it->getDivMask()));
       }
     }
+    if (C::UseDivMask) {
+      // Each entry must pass the mask check against its own div mask.
+      size_t candidates[C::LeafSize];
+      for (const_iterator it = begin(); it != end(); ++it) {
+        const size_t index = it - begin();
+        const size_t count = _entryMasks.findMaybeDivisors
+          (index + 1, it->getDivMask(), candidates);
+        MATHIC_ASSERT(count > 0 && candidates[count - 1] == index);
+        const size_t multipleCount = _entryMasks.findMaybeMultiples
+          (index + 1, it->getDivMask(), candidates);
+        MATHIC_ASSERT(multipleCount > 0 &&
+          candidates[multipleCount - 1] == index);
+      }
+    }
     return true;
   }
 #endif
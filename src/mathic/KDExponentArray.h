@@ -0,0 +1,188 @@
+#ifndef MATHIC_K_D_EXPONENT_ARRAY_GUARD
+#define MATHIC_K_D_EXPONENT_ARRAY_GUARD
+
+#include "stdinc.h"
+#include <limits>
+
+namespace mathic {
+  namespace KDExponentInternal {
+    /** Value is C::InlineExponentVarCount if C declares it and
+        otherwise 0. */
+    MATHIC_DEFINE_OPTIONAL_FIELD
+      (VarCountOf, size_t, InlineExponentVarCount, 0);
+
+    /** Declared is true if C declares MaxExponent. */
+    MATHIC_DEFINE_OPTIONAL_FIELD(MaxExponentOf, size_t, MaxExponent, 0);
+
+    /** The smallest of unsigned char, unsigned short and Exponent that
+        can hold every exponent from 0 to Max. Width is 1 for unsigned
+        char, 2 for unsigned short and 0 for Exponent. A signed Exponent
+        is never narrowed since it can hold negative exponents. */
+    template<class Exponent, int Width>
+    struct Narrow {typedef Exponent Type;};
+    template<class Exponent>
+    struct Narrow<Exponent, 1> {typedef unsigned char Type;};
+    template<class Exponent>
+    struct Narrow<Exponent, 2> {typedef unsigned short Type;};
+
+    template<class C, bool Declared = MaxExponentOf<C>::Declared>
+    struct StoredOf {
+      typedef typename C::Exponent Type;
+      static const bool Clamp = false;
+      static const size_t Max = 0;
+    };
+    template<class C>
+    struct StoredOf<C, true> {
+      static const int Width =
+        std::numeric_limits<typename C::Exponent>::is_signed ? 0 :
+        C::MaxExponent <= 0xFF ? 1 : (C::MaxExponent <= 0xFFFF ? 2 : 0);
+      typedef typename Narrow<typename C::Exponent, Width>::Type Type;
+      static const bool Clamp = true;
+      static const size_t Max = C::MaxExponent;
+    };
+  }
+
+  /** Keeps a copy of the exponents of the first VarCount variables of
+      up to Capacity entries of a KD tree leaf, with one contiguous
+      array for each variable. A scan for divisors then compares the
+      exponents of all the entries one variable at a time without
+      reading the entries themselves, which are often pointers to
+      monomials elsewhere in memory. If the Configuration declares a
+      MaxExponent and the Exponent type is unsigned, the exponents are
+      stored in 8 or 16 bits when that is enough, so the copies take
+      less room in the leaf.
+
+      An index that findDivisors() or filterDivisors() lets through is
+      a divisor if VarCount is at least the number of variables, and
+      otherwise the rest of the variables must still be checked. The
+      version for VarCount 0 stores nothing and filters nothing. */
+  template<class C, size_t Capacity,
+    size_t VarCount = KDExponentInternal::VarCountOf<C>::Value>
+  class KDExponentArray {
+  public:
+    typedef typename C::Exponent Exponent;
+    typedef typename KDExponentInternal::StoredOf<C>::Type Stored;
+    static const bool Enabled = true;
+
+    KDExponentArray() {
+      for (size_t var = 0; var < VarCount; ++var)
+        for (size_t i = 0; i < Capacity; ++i)
+          _exponents[var][i] = 0;
+    }
+
+    /** Stores the exponents of entry as those of the entry at index. */
+    template<class E>
+    void set(size_t index, const E& entry, const C& conf) {
+      MATHIC_ASSERT(index < Capacity);
+      const size_t varCount = inlineVarCount(conf);
+      for (size_t var = 0; var < varCount; ++var) {
+        const Exponent e = conf.getExponent(entry, var);
+        MATHIC_ASSERT(!Clamp || !(static_cast<Exponent>(Max) < e));
+        _exponents[var][index] = static_cast<Stored>(e);
+      }
+    }
+
+    /** Returns true if the indices that findDivisors() and
+        filterDivisors() let through are known to be divisors, because
+        every variable is stored. */
+    static bool isExact(const C& conf) {
+      return VarCount >= conf.getVarCount();
+    }
+
+    /** Writes the indices less than count of the entries whose stored
+        exponents are all at most those of monomial to out and returns
+        how many there were. */
+    template<class M>
+    size_t findDivisors
+      (size_t count, const M& monomial, const C& conf, size_t* out) const {
+      MATHIC_ASSERT(count <= Capacity);
+      // going over all Capacity entries instead of count makes for a
+      // fixed number of iterations that the compiler can vectorize.
+      unsigned char fits[Capacity];
+      for (size_t i = 0; i < Capacity; ++i)
+        fits[i] = 1;
+      const size_t varCount = inlineVarCount(conf);
+      for (size_t var = 0; var < varCount; ++var) {
+        const Stored exponent = toStored(conf.getExponent(monomial, var));
+        const Stored* exponents = _exponents[var];
+        for (size_t i = 0; i < Capacity; ++i)
+          fits[i] &= !(exponent < exponents[i]);
+      }
+      size_t fitCount = 0;
+      for (size_t i = 0; i < count; ++i)
+        if (fits[i])
+          out[fitCount++] = i;
+      return fitCount;
+    }
+
+    /** Keeps the indices among indices[0, count) of the entries whose
+        stored exponents are all at most those of monomial, in the same
+        order, and returns how many there are. */
+    template<class M>
+    size_t filterDivisors
+      (size_t count, const M& monomial, const C& conf, size_t* indices) const {
+      if (count == 0)
+        return 0;
+      Stored query[VarCount];
+      const size_t varCount = inlineVarCount(conf);
+      for (size_t var = 0; var < varCount; ++var)
+        query[var] = toStored(conf.getExponent(monomial, var));
+      size_t fitCount = 0;
+      for (size_t i = 0; i < count; ++i) {
+        const size_t index = indices[i];
+        size_t var = 0;
+        while (var < varCount && !(query[var] < _exponents[var][index]))
+          ++var;
+        if (var == varCount)
+          indices[fitCount++] = index;
+      }
+      return fitCount;
+    }
+
+  private:
+    static size_t inlineVarCount(const C& conf) {
+      return VarCount < conf.getVarCount() ? VarCount : conf.getVarCount();
+    }
+
+    /** Converts e to Stored. If there is a MaxExponent then exponents
+        above it are stored as it, which does not change which stored
+        exponents are at most e since they are all at most MaxExponent. */
+    static Stored toStored(const Exponent& e) {
+      if (Clamp && static_cast<Exponent>(Max) < e)
+        return static_cast<Stored>(Max);
+      return static_cast<Stored>(e);
+    }
+
+    static const bool Clamp = KDExponentInternal::StoredOf<C>::Clamp;
+    static const size_t Max = KDExponentInternal::StoredOf<C>::Max;
+
+    Stored _exponents[VarCount][Capacity];
+  };
+
+  template<class C, size_t Capacity>
+  class KDExponentArray<C, Capacity, 0> {
+  public:
+    static const bool Enabled = false;
+
+    template<class E>
+    void set(size_t index, const E& entry, const C& conf) {}
+
+    static bool isExact(const C& conf) {return false;}
+
+    template<class M>
+    size_t findDivisors
+      (size_t count, const M& monomial, const C& conf, size_t* out) const {
+      for (size_t i = 0; i < count; ++i)
+        out[i] = i;
+      return count;
+    }
+
+    template<class M>
+    size_t filterDivisors
+      (size_t count, const M& monomial, const C& conf, size_t* indices) const {
+      return count;
+    }
+  };
+}
+
+#endif
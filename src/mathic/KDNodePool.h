@@ -0,0 +1,68 @@
+#ifndef MATHIC_K_D_NODE_POOL_GUARD
+#define MATHIC_K_D_NODE_POOL_GUARD
+
+#include "stdinc.h"
+#include <memtailor.h>
+#include <vector>
+
+namespace mathic {
+  /** Keeps the memory of the nodes that a KD tree no longer uses so
+      that new nodes can be made there instead of in more memory from
+      the arena of the tree. The nodes that a tree makes fall into a few
+      size classes, such as leaf and interior, and a freed block is only
+      reused for a node of the same class. The blocks are linked through
+      their first bytes, so a block must be at least as large as a
+      pointer.
+
+      The memory is not returned to the arena, so the tree must call
+      clear() whenever it frees the memory of its arena. */
+  class KDNodePool {
+  public:
+    KDNodePool(): _freeMemoryUse(0) {}
+
+    /** Returns a free block of the size class, or else bytes of new
+        memory from arena. bytes must be the same for every call with
+        the same size class. */
+    void* alloc(memt::Arena& arena, size_t sizeClass, size_t bytes) {
+      if (sizeClass < _free.size() && _free[sizeClass] != 0) {
+        FreeBlock* block = _free[sizeClass];
+        _free[sizeClass] = block->next;
+        MATHIC_ASSERT(_freeMemoryUse >= bytes);
+        _freeMemoryUse -= bytes;
+        return block;
+      }
+      return arena.alloc(bytes);
+    }
+
+    /** Makes block of the size class, which is bytes long, available
+        to alloc. Anything in the block must already be destructed. */
+    void free(void* block, size_t sizeClass, size_t bytes) {
+      MATHIC_ASSERT(block != 0);
+      MATHIC_ASSERT(bytes >= sizeof(FreeBlock));
+      if (sizeClass >= _free.size())
+        _free.resize(sizeClass + 1);
+      FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+      freeBlock->next = _free[sizeClass];
+      _free[sizeClass] = freeBlock;
+      _freeMemoryUse += bytes;
+    }
+
+    /** Forgets all the free blocks. */
+    void clear() {
+      _free.clear();
+      _freeMemoryUse = 0;
+    }
+
+    /** The number of bytes in the free blocks. */
+    size_t getMemoryUse() const {return _freeMemoryUse;}
+
+  private:
+    struct FreeBlock {
+      FreeBlock* next;
+    };
+    std::vector<FreeBlock*> _free; // the free blocks of each size class
+    size_t _freeMemoryUse;
+  };
+}
+
+#endif
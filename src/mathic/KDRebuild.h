@@ -0,0 +1,51 @@
+#ifndef MATHIC_K_D_REBUILD_GUARD
+#define MATHIC_K_D_REBUILD_GUARD
+
+#include "stdinc.h"
+
+namespace mathic {
+  /** KDTree::refreshDivMasks() chooses the div mask bits from at most
+      this many entries spread evenly over the tree. */
+  static const size_t KDDivMaskSampleSize = 4096;
+
+  namespace KDRebuildInternal {
+    /** Returns true if a subtree of a KDTree should be rebuilt after an
+        insertion into it. size is the number of entries in the subtree,
+        builtSize is the number of entries it had when it was last built
+        and heaviest is the number of entries in its largest child.
+        Removals are not counted, so these are upper bounds.
+
+        A subtree is rebuilt if it is out of balance, in that the largest
+        child has more than three quarters of the entries, and if it has
+        had as many insertions since it was built as a whole tree would
+        need before KDTree's automatic rebuild. The second condition
+        makes the rebuilds cost O(1 / getRebuildRatio()) per insertion for
+        each level of the tree, amortized, even if the entries are such
+        that a rebuilt subtree is still out of balance. Without automatic
+        rebuilds no subtree is rebuilt. */
+    template<class C>
+    bool shouldRebuild
+    (size_t size, size_t builtSize, size_t heaviest, const C& conf) {
+      if (!conf.getDoAutomaticRebuilds())
+        return false;
+      MATHIC_ASSERT(builtSize <= size);
+      const size_t changes = size - builtSize;
+      if (changes < conf.getRebuildMin() ||
+        changes < builtSize * conf.getRebuildRatio())
+        return false;
+      return heaviest > size - size / 4;
+    }
+
+    /** Returns true if a KDTree should recompute its div masks using a
+        new calculator whose getSpread() on a sample of the entries is
+        newSpread when the current calculator has oldSpread on the same
+        sample. Recomputing touches every entry, so it is not worth it
+        for the small changes in spread that come from the sample
+        varying. */
+    inline bool shouldReplaceDivMasks(double oldSpread, double newSpread) {
+      return newSpread > oldSpread + oldSpread / 8;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef MATHIC_K_D_SPLIT_GUARD
+#define MATHIC_K_D_SPLIT_GUARD
+
+#include "stdinc.h"
+#include <vector>
+#include <algorithm>
+
+namespace mathic {
+  /** The ways that a KDTree can choose the variable and exponent to
+      split a range of entries on. Entries with an exponent of the
+      variable that is at most the split exponent go on one side and the
+      rest go on the other side.
+
+      KDSplitRoundRobin takes the next variable after the one the parent
+      split on whose exponents are not all equal and splits at the
+      midpoint of its least and greatest exponent. This is cheap but can
+      make deep and lopsided trees when a few variables have large
+      exponents and the rest are near zero.
+
+      KDSplitMedian takes the variable whose exponents have the greatest
+      variance and splits at their median, so the two sides have about
+      the same number of entries.
+
+      KDSplitCost estimates the work of a divisor query below the split
+      as the entries on the equal-or-less side, which a query always
+      visits, plus the entries on the strictly-greater side times the
+      chance that a query goes there too. That chance is taken to be the
+      part of the range of exponents of the variable that lies above the
+      split exponent, like the surface area heuristic for ray tracing.
+      The split with the least estimate is chosen.
+
+      KDSplitQueries is as KDSplitCost except that the chance is the
+      fraction of recent findDivisor queries whose exponent is greater
+      than the split exponent. The tree keeps a sample of the queries
+      for this. Until there are enough queries it works as KDSplitCost.
+
+      The statistics for the strategies other than KDSplitRoundRobin are
+      computed from at most KDSplitSampleSize entries of the range. */
+  enum KDTreeSplitStrategy {
+    KDSplitRoundRobin = 0,
+    KDSplitMedian = 1,
+    KDSplitCost = 2,
+    KDSplitQueries = 3
+  };
+
+  static const size_t KDSplitSampleSize = 256;
+
+  namespace KDSplitInternal {
+    /** Value is C::splitStrategy if C declares it and otherwise
+        KDSplitRoundRobin. */
+    MATHIC_DEFINE_OPTIONAL_FIELD
+      (StrategyOf, KDTreeSplitStrategy, splitStrategy, KDSplitRoundRobin);
+  }
+
+  /** The exponent vectors of a sample of the recent divisor queries to
+      a KDTree, for KDSplitQueries. Every Stride'th query that is added
+      is kept, and once there are Capacity queries the oldest one is
+      replaced, so the sample follows changes in the queries. */
+  template<class C>
+  class KDQuerySample {
+  public:
+    typedef typename C::Exponent Exponent;
+    static const size_t Capacity = 128;
+    static const size_t Stride = 8;
+    // KDSplitQueries uses the sample once it has this many queries.
+    static const size_t MinSize = 16;
+
+    KDQuerySample(): _added(0), _next(0), _size(0) {}
+
+    template<class M>
+    void add(const M& monomial, const C& conf) {
+      if (_added++ % Stride != 0)
+        return;
+      const size_t varCount = conf.getVarCount();
+      if (_exponents.size() != Capacity * varCount) {
+        _exponents.resize(Capacity * varCount);
+        _size = 0;
+        _next = 0;
+      }
+      Exponent* slot = &_exponents[_next * varCount];
+      for (size_t var = 0; var < varCount; ++var)
+        slot[var] = conf.getExponent(monomial, var);
+      _next = (_next + 1) % Capacity;
+      if (_size < Capacity)
+        ++_size;
+    }
+
+    size_t size() const {return _size;}
+
+    /** Returns the fraction of the sampled queries whose exponent of
+        var is strictly greater than exp. */
+    double fractionAbove(size_t var, Exponent exp, size_t varCount) const {
+      MATHIC_ASSERT(size() > 0);
+      size_t above = 0;
+      for (size_t i = 0; i < _size; ++i)
+        if (exp < _exponents[i * varCount + var])
+          ++above;
+      return static_cast<double>(above) / _size;
+    }
+
+    void clear() {
+      _exponents.clear();
+      _added = 0;
+      _next = 0;
+      _size = 0;
+    }
+
+    size_t getMemoryUse() const {
+      return _exponents.capacity() * sizeof(Exponent);
+    }
+
+  private:
+    std::vector<Exponent> _exponents; // Capacity rows of varCount
+    size_t _added;
+    size_t _next; // the row to write next
+    size_t _size; // the number of rows written
+  };
+
+  namespace KDSplitInternal {
+    /** Chooses a split exponent of var for the entries whose exponents
+        of var are in values, which must be sorted and not all equal. Sets
+        exp to it and returns a score where higher is better. Scores are
+        comparable across variables for the same range and strategy. */
+    template<class C>
+    double scoreVar(
+      KDTreeSplitStrategy strategy,
+      const std::vector<typename C::Exponent>& values,
+      size_t var,
+      size_t varCount,
+      const KDQuerySample<C>* queries,
+      typename C::Exponent& exp
+    ) {
+      typedef typename C::Exponent Exponent;
+      MATHIC_ASSERT(!values.empty());
+      MATHIC_ASSERT(values.front() < values.back());
+      const Exponent min = values.front();
+      const Exponent max = values.back();
+      const size_t count = values.size();
+
+      if (strategy == KDSplitMedian) {
+        exp = values[count / 2];
+        if (exp == max) // then the strictly greater side would be empty
+          exp = *(std::lower_bound(values.begin(), values.end(), max) - 1);
+        double mean = 0;
+        for (size_t i = 0; i < count; ++i)
+          mean += static_cast<double>(values[i]);
+        mean /= count;
+        double variance = 0;
+        for (size_t i = 0; i < count; ++i) {
+          const double d = static_cast<double>(values[i]) - mean;
+          variance += d * d;
+        }
+        return variance;
+      }
+
+      MATHIC_ASSERT(strategy == KDSplitCost || strategy == KDSplitQueries);
+      const bool useQueries = strategy == KDSplitQueries &&
+        queries != 0 && queries->size() >= KDQuerySample<C>::MinSize;
+      const double extent =
+        static_cast<double>(max) - static_cast<double>(min);
+      double bestCost = 0;
+      // try splitting after each run of equal exponents except the last.
+      for (size_t i = 0; i < count;) {
+        const Exponent candidate = values[i];
+        if (candidate == max)
+          break;
+        while (i < count && values[i] == candidate)
+          ++i;
+        const double below = static_cast<double>(i);
+        const double above = static_cast<double>(count - i);
+        const double chance = useQueries ?
+          queries->fractionAbove(var, candidate, varCount) :
+          (static_cast<double>(max) - static_cast<double>(candidate)) / extent;
+        const double cost = below + above * chance;
+        if (candidate == min || cost < bestCost) {
+          bestCost = cost;
+          exp = candidate;
+        }
+      }
+      return -bestCost / count;
+    }
+  }
+}
+
+#endif
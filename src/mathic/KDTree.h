@@ -3,6 +3,7 @@
 
 #include "stdinc.h"
 #include "DivMask.h"
+#include "DivCache.h"
 #include "BinaryKDTree.h"
 #include "PackedKDTree.h"
 #include <memtailor.h>
@@ -29,6 +30,61 @@ namespace mathic {
       If false, it is an error to call methods that remove elements from
       the data structure. This can be a slight speed up in some cases.
       Clear and rebuild is still allowed even if this field is false.
+
+      * bool getDoAutomaticRebuilds() const
+      * double getRebuildRatio() const
+      * size_t getRebuildMin() const
+      As described in DivFinder.h, except that a KDTree never rebuilds
+      the whole tree on its own since that makes for long pauses with
+      large trees. Instead, an insertion rebuilds the lowest subtree on
+      its path that is out of balance and that has had
+      max(size * getRebuildRatio(), getRebuildMin()) insertions since it
+      was built, where size is the number of entries in the subtree.
+      See KDRebuild.h. Removals are not counted for this. After that
+      number of insertions and removals into the whole tree, only the
+      div masks are recomputed as by refreshDivMasks(). Call rebuild()
+      to rebuild the whole tree.
+
+      * static const KDTreeSplitStrategy splitStrategy
+      Optional. How to choose the variable and exponent that a node
+      splits its entries on. See KDSplit.h. The default is
+      KDSplitRoundRobin. For KDSplitQueries the tree keeps a sample of
+      the queries to the non-const findDivisor.
+
+      * bool getUseDivisorCache() const
+      * static const size_t DivisorCacheSize
+      If getUseDivisorCache() returns true, the non-const findDivisor
+      first checks the last DivisorCacheSize divisors that it found,
+      which is much faster than searching the tree when the queries
+      keep coming back to a few divisors. DivisorCacheSize is optional
+      and defaults to 1. See DivCache.h.
+
+      * static const size_t InlineExponentVarCount
+      * static const size_t MaxExponent
+      Optional. If InlineExponentVarCount is positive, each leaf keeps a
+      copy of the exponents of the first InlineExponentVarCount variables
+      of its entries, one array per variable, so that a divisor query
+      checks the entries of a leaf without reading the entries. The
+      entries are only read if there are more variables than that. If
+      MaxExponent is declared, no exponent of an entry may be larger
+      than it, and the copies are stored in 8 or 16 bits if that is
+      enough and Exponent is unsigned. This makes leaves larger by
+      InlineExponentVarCount * getLeafSize() exponents. See
+      KDExponentArray.h.
+
+      * size_t getBuildThreadCount() const
+      Optional. The number of threads that build the tree in rebuild()
+      and in insert(begin, end) on an empty tree. The default is 1.
+      Only the packed tree builds in parallel, and only for large inputs.
+      With more than one thread, the const methods of the Configuration
+      must be safe to call concurrently.
+
+      The const query methods do not change the object, not even the
+      divisor cache, so any number of threads can call them at the same
+      time as long as no thread is changing the tree. This requires the
+      const methods of the Configuration to also be safe to call
+      concurrently. Use a DivisorCache per thread to get the benefit of
+      the divisor cache for such concurrent queries.
   */
   template<class Configuration>
   class KDTree;
@@ -53,6 +109,9 @@ namespace mathic {
     typedef typename KDTreeInternal::SelectTree<C, C::PackedTree>::Tree Tree;
     typedef typename Tree::ExtEntry ExtEntry;
     typedef typename Tree::ExtMonoRef ExtMonoRef;
+    static const size_t DivisorCacheSize =
+      DivCacheInternal::SizeOf<C, 1>::Value;
+    typedef DivCache<C, DivisorCacheSize> RecentDivisors;
   public:
     typedef C Configuration;
 
@@ -62,10 +121,9 @@ namespace mathic {
     KDTree(const C& configuration):
       _divMaskCalculator(configuration),
       _tree(configuration),
-      _size(0) {
+      _size(0),
+      _version(1) {
       resetNumberOfChangesTillRebuild();
-      if (getConfiguration().getUseDivisorCache())
-        _divisorCache = 0;
     }
 
     static const bool UseDivMask = C::UseDivMask;
@@ -131,7 +189,8 @@ namespace mathic {
     template<class Output>
     void findAllMultiples(const Monomial& monomial, Output& output) const {
       ConstEntryOutput<Output> constOutput(output);
-      const_cast<KDTree<C>&>(*this).findAllMultiples(monomial, constOutput);
+      ExtMonoRef extMonomial(monomial, _divMaskCalculator, getConfiguration());
+      _tree.findAllMultiples(extMonomial, constOutput);
     }
 
     /** Inserts entry into the data structure. Does NOT remove multiples
@@ -157,13 +216,16 @@ namespace mathic {
       const size_t inserted = std::distance(begin, end); 
       if (!empty()) {
         for (; begin != end; ++begin)
-          _tree.insert(*begin);
+          _tree.insert
+            (ExtEntry(*begin, _divMaskCalculator, getConfiguration()));
+        reportChanges(inserted, 0);
       } else {
-        _tree.insert(begin, end);
         // insert into empty container is equivalent to rebuild
+        _divMaskCalculator.rebuild(begin, end, getConfiguration());
+        _tree.reset(begin, end, _divMaskCalculator);
+        _size = inserted;
         resetNumberOfChangesTillRebuild();
       }
-      reportChanges(inserted, 0);
     }
 
     /** Removes an element whose exponents are equal to monomial's. Returns
@@ -172,30 +234,113 @@ namespace mathic {
       MATHIC_ASSERT(C::AllowRemovals);
       if (!C::AllowRemovals)
         throw std::logic_error("Removal request while removals disabled.");
-      return _tree.removeElement(monomial);
+      const bool removed = _tree.removeElement(monomial);
+      if (removed)
+        reportChanges(0, 1);
+      return removed;
     }
 
     /** Returns a pointer to an entry that divides monomial. Returns null if no
         entries divide monomial. */
     inline Entry* findDivisor(const Monomial& monomial) {
-      // todo: do this on extended monomials. requires cache to be extended.
       const C& conf = getConfiguration();
-      if (conf.getUseDivisorCache() &&
-        _divisorCache != 0 &&
-        conf.divides(*_divisorCache, monomial))
-        return _divisorCache;
-
-      ExtMonoRef extMonomial(monomial, _divMaskCalculator, getConfiguration());
-      Entry* divisor = _tree.findDivisor(extMonomial);
-      if (conf.getUseDivisorCache() && divisor != 0)
-        _divisorCache = divisor;
+      if (KDSplitInternal::StrategyOf<C>::Value == KDSplitQueries)
+        _tree.getQuerySample().add(monomial, conf);
+      ExtMonoRef extMonomial(monomial, _divMaskCalculator, conf);
+      if (!conf.getUseDivisorCache())
+        return _tree.findDivisor(extMonomial);
+
+      Entry* divisor = _divisorCache.find(extMonomial, conf);
+      if (divisor == 0) {
+        divisor = _tree.findDivisor(extMonomial);
+        if (divisor != 0)
+          _divisorCache.add(divisor, _divMaskCalculator, conf);
+      }
       return divisor;
     }
 
     /** Returns the position of a divisor of monomial. Returns null if no
-        entries divide monomial. */
+        entries divide monomial. The divisor cache is neither used nor
+        updated, so this method can be called concurrently. */
     inline const Entry* findDivisor(const Monomial& monomial) const {
-      return const_cast<KDTree<C>&>(*this).findDivisor(monomial);
+      ExtMonoRef extMonomial(monomial, _divMaskCalculator, getConfiguration());
+      return _tree.findDivisor(extMonomial);
+    }
+
+    /** Remembers the most recently found divisors for a sequence of
+        calls to findDivisor(monomial, cache), as many as the divisor
+        cache of the tree. Each thread that queries the same tree
+        concurrently should have its own cache. A cache is automatically
+        cleared after the tree has been changed. */
+    class DivisorCache {
+    public:
+      DivisorCache(): _version(0) {}
+
+      unsigned long long getHitCount() const {return _divisors.getHitCount();}
+      unsigned long long getMissCount() const {
+        return _divisors.getMissCount();
+      }
+
+    private:
+      friend class KDTree<C>;
+      RecentDivisors _divisors;
+      unsigned long long _version;
+    };
+
+    /** As findDivisor(monomial) const, except that the divisor cache is
+        the passed-in cache instead of the one in this object. Any number
+        of threads can call this method concurrently as long as they pass
+        different caches. */
+    const Entry* findDivisor
+      (const Monomial& monomial, DivisorCache& cache) const {
+      const C& conf = getConfiguration();
+      if (cache._version != _version) {
+        cache._divisors.clear();
+        cache._version = _version;
+      }
+      ExtMonoRef extMonomial(monomial, _divMaskCalculator, conf);
+      const Entry* divisor = cache._divisors.find(extMonomial, conf);
+      if (divisor == 0) {
+        divisor = _tree.findDivisor(extMonomial);
+        // the cache only ever hands its entries back as const.
+        if (divisor != 0)
+          cache._divisors.add
+            (const_cast<Entry*>(divisor), _divMaskCalculator, conf);
+      }
+      return divisor;
+    }
+
+    /** Sets *out to findDivisor(monomial) and increments out for each
+        monomial in [begin, end). The tree is traversed once for the whole
+        batch instead of once per monomial, though the divisor found for a
+        given monomial can differ from what findDivisor would return. */
+    template<class Iter, class DivisorOutput>
+    void findDivisors(Iter begin, Iter end, DivisorOutput out) {
+      const C& conf = getConfiguration();
+      std::vector<ExtMonoRef> queries;
+      std::vector<Entry*> divisors;
+      for (; begin != end; ++begin) {
+        const Monomial& monomial = *begin;
+        queries.push_back(ExtMonoRef(monomial, _divMaskCalculator, conf));
+        if (conf.getUseDivisorCache())
+          divisors.push_back(_divisorCache.find(queries.back(), conf));
+        else
+          divisors.push_back(0);
+      }
+      if (queries.empty())
+        return;
+
+      std::vector<Entry*> cached;
+      if (conf.getUseDivisorCache())
+        cached = divisors;
+      _tree.findDivisors(&queries.front(), queries.size(), &divisors.front());
+      for (size_t i = 0; i < divisors.size(); ++i) {
+        if (conf.getUseDivisorCache() &&
+          divisors[i] != 0 && cached[i] == 0)
+          _divisorCache.add(divisors[i], _divMaskCalculator, conf);
+        *out = divisors[i];
+        ++out;
+      }
     }
 
     /** Calls out.proceed(entry) for each entry that divides monomial.
@@ -213,7 +358,8 @@ namespace mathic {
     template<class DivisorOutput>
     void findAllDivisors(const Monomial& monomial, DivisorOutput& output) const {
       ConstEntryOutput<DivisorOutput> constOutput(output);
-      const_cast<KDTree<C>&>(*this).findAllDivisors(monomial, constOutput);
+      ExtMonoRef extMonomial(monomial, _divMaskCalculator, getConfiguration());
+      _tree.findAllDivisors(extMonomial, constOutput);
     }
 
     /** Calls output.proceed(entry) for each entry.
@@ -230,7 +376,7 @@ namespace mathic {
     template<class EntryOutput>
     void forAll(EntryOutput& output) const {
       ConstEntryOutput<EntryOutput> constOutput(output);
-      const_cast<KDTree<C>&>(*this).forAll(constOutput);
+      _tree.forAll(constOutput);
     }
 
     /** Removes all entries. Does not reset the configuration object. */
@@ -250,6 +396,26 @@ namespace mathic {
       resetNumberOfChangesTillRebuild();
     }
 
+    /** Chooses the meaning of the div mask bits again from a sample of
+        at most KDDivMaskSampleSize of the entries that are in the tree
+        now. If that fits the sample clearly better than the current
+        meaning, as by KDRebuildInternal::shouldReplaceDivMasks, then
+        the div mask of every entry and node is recomputed. The tree and
+        the entries stay the same, so this is cheaper than rebuild(),
+        which chooses the bits from all the entries. */
+    void refreshDivMasks();
+
+    /** Lays out the nodes of a binary tree again so that the nodes on
+        each path from the root are close together in memory, which
+        they stop being after many insertions. This is cheaper than
+        rebuild(), which also does it, since the tree stays the same.
+        Does nothing for a packed tree. */
+    void relayout() {
+      relayout(_tree);
+      ++_version; // the entries moved
+      _divisorCache.clear();
+    }
+
 	/** Returns the number of bytes allocated by this object. Does not
 		include sizeof(*this), does not include any additional memory
 		that the configuration may have allocated and does not include
@@ -258,6 +424,33 @@ namespace mathic {
 		avoid frequent allocations. */
     size_t getMemoryUse() const {return _tree.getMemoryUse();}
 
+    /** The part of getMemoryUse() that is taken up by nodes that have
+        been removed from the tree. New nodes are made there, so it does
+        not grow without bound, but only compact() frees it. */
+    size_t getDeadMemoryUse() const {return _tree.getDeadMemoryUse();}
+
+    /** The number of queries to the non-const findDivisor and
+        findDivisors that were answered by the divisor cache. */
+    unsigned long long getDivisorCacheHitCount() const {
+      return _divisorCache.getHitCount();
+    }
+
+    /** The number of queries to the non-const findDivisor and
+        findDivisors that checked the divisor cache without finding a
+        divisor there. */
+    unsigned long long getDivisorCacheMissCount() const {
+      return _divisorCache.getMissCount();
+    }
+
+    /** Copies the tree to new memory without the nodes that have been
+        removed and frees the old memory. This takes time proportional to
+        the size of the tree. Pointers to entries become invalid. */
+    void compact() {
+      _tree.compact();
+      ++_version; // the entries moved
+      _divisorCache.clear();
+    }
+
   private:
     KDTree(const KDTree<C>&); // unavailable
     void operator=(const KDTree<C>&); // unavailable
@@ -278,6 +471,50 @@ namespace mathic {
       memt::ArenaVector<Entry, true> _entries;
     };
 
+    // For recording pointers to every stride'th entry in the tree
+    // using forAll.
+    class EntryPointerRecorder {
+    public:
+      EntryPointerRecorder(memt::Arena& arena, size_t capacity, size_t stride):
+        _entries(arena, capacity), _stride(stride), _seen(0) {}
+      bool proceed(const Entry& entry) {
+        if (_seen++ % _stride == 0)
+          _entries.push_back(&entry);
+        return true;
+      }
+      const Entry* const* begin() {return _entries.begin();}
+      const Entry* const* end() {return _entries.end();}
+
+    private:
+      memt::ArenaVector<const Entry*, true> _entries;
+      size_t _stride;
+      size_t _seen;
+    };
+
+    /// Iterates through the entries that a range of pointers point to,
+    /// so that they can be looked at without copying them.
+    class EntryPointerIterator {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef Entry value_type;
+      typedef ptrdiff_t difference_type;
+      typedef const Entry* pointer;
+      typedef const Entry& reference;
+
+      EntryPointerIterator(const Entry* const* it): _it(it) {}
+      const Entry& operator*() const {return **_it;}
+      EntryPointerIterator& operator++() {++_it; return *this;}
+      bool operator==(const EntryPointerIterator& it) const {
+        return _it == it._it;
+      }
+      bool operator!=(const EntryPointerIterator& it) const {
+        return _it != it._it;
+      }
+
+    private:
+      const Entry* const* _it;
+    };
+
     /// makes the parameter given to proceed be const.
     template<class EntryOutput>
     class ConstEntryOutput {
@@ -294,17 +531,24 @@ namespace mathic {
       void push_back(Entry& e) {}
     };
 
+    void relayout(BinaryKDTree<C>& tree) {tree.relayout();}
+    void relayout(PackedKDTree<C>& tree) {}
+
     void reportChanges(size_t additions, size_t removals);
     void resetNumberOfChangesTillRebuild();
     bool reportChangesRebuild(size_t additions, size_t removals);
     size_t _changesTillRebuild; /// Update using reportChanges().
 
-    Entry* _divisorCache; /// The divisor in the previous query. Can be null.
+    RecentDivisors _divisorCache; /// The divisors of recent queries.
 
     // All DivMasks calculated using this.
     typename Tree::DivMaskCalculator _divMaskCalculator;
     Tree _tree;
     size_t _size;
+
+    /// Changes whenever the entries change so that a DivisorCache can
+    /// tell whether its divisor is still in the tree.
+    unsigned long long _version;
   };
 
   template<class C>
@@ -318,18 +562,59 @@ namespace mathic {
           << '/' << conf.getRebuildMin();
     }
     out << (C::UseDivMask && !C::UseTreeDivMask ? " dmask" : "")
-        << (C::UseTreeDivMask ? " tree-dmask" : "")
-        << (conf.getSortOnInsert() ? " sort" : "")
-        << (conf.getUseDivisorCache() ? " cache" : "")
-        << (C::AllowRemovals ? "" : " no-removals");
+        << (C::UseTreeDivMask ? " tree-dmask" : "");
+    const size_t maskBits = DivMaskOf<C>::BitCount;
+    if (C::UseDivMask && maskBits != DivMask::BitCount)
+      out << ':' << maskBits;
+    out << (conf.getSortOnInsert() ? " sort" : "")
+        << (conf.getUseDivisorCache() ? " cache" : "");
+    if (conf.getUseDivisorCache() && DivisorCacheSize != 1)
+      out << ':' << DivisorCacheSize;
+    out << (C::AllowRemovals ? "" : " no-removals");
+    const size_t inlineVarCount = KDExponentInternal::VarCountOf<C>::Value;
+    if (inlineVarCount != 0) {
+      out << " inline:" << inlineVarCount;
+      typedef typename KDExponentInternal::StoredOf<C>::Type Stored;
+      if (KDExponentInternal::StoredOf<C>::Clamp)
+        out << 'x' << sizeof(Stored) * 8;
+    }
+    switch (KDSplitInternal::StrategyOf<C>::Value) {
+    case KDSplitRoundRobin: break;
+    case KDSplitMedian: out << " split:median"; break;
+    case KDSplitCost: out << " split:cost"; break;
+    case KDSplitQueries: out << " split:queries"; break;
+    }
     return out.str();
   }
 
+  template<class C>
+  void KDTree<C>::refreshDivMasks() {
+    if (UseDivMask && !empty()) {
+      const C& conf = getConfiguration();
+      const size_t stride = size() / KDDivMaskSampleSize + 1;
+      EntryPointerRecorder sample
+        (memt::Arena::getArena(), size() / stride + 1, stride);
+      _tree.forAll(sample);
+      const EntryPointerIterator begin(sample.begin());
+      const EntryPointerIterator end(sample.end());
+      typename Tree::DivMaskCalculator calc(conf);
+      calc.rebuild(begin, end, conf);
+      if (!(calc == _divMaskCalculator) &&
+        KDRebuildInternal::shouldReplaceDivMasks
+          (_divMaskCalculator.getSpread(begin, end, conf),
+           calc.getSpread(begin, end, conf))) {
+        _divMaskCalculator = calc;
+        _tree.recalculateDivMasks(_divMaskCalculator);
+      }
+    }
+    resetNumberOfChangesTillRebuild();
+  }
+
   template<class C>
   void KDTree<C>::resetNumberOfChangesTillRebuild() {
     const C& conf = getConfiguration();
-    if (conf.getUseDivisorCache())
-      _divisorCache = 0;
+    ++_version;
+    _divisorCache.clear();
     if (!conf.getDoAutomaticRebuilds())
       return;
     MATHIC_ASSERT(conf.getRebuildRatio() > 0);
@@ -340,10 +625,12 @@ namespace mathic {
 
   template<class C>
   void KDTree<C>::reportChanges(size_t additions, size_t removals) {
-    if (getConfiguration().getUseDivisorCache() && (additions | removals) != 0)
-      _divisorCache = 0;
+    if ((additions | removals) != 0) {
+      ++_version;
+      _divisorCache.clear();
+    }
     if (reportChangesRebuild(additions, removals))
-      rebuild();
+      refreshDivMasks();
   }
 
   template<class C>
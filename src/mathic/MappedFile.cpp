@@ -0,0 +1,86 @@
+#include "MappedFile.h"
+
+#include "error.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mathic {
+#ifdef _WIN32
+  MappedFile::MappedFile(const std::string& fileName):
+    _begin(0),
+    _size(0),
+    _fileName(fileName),
+    _file(INVALID_HANDLE_VALUE),
+    _mapping(0) {
+    _file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (_file == INVALID_HANDLE_VALUE)
+      reportError("Could not open file \"" + fileName + "\".");
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size)) {
+      CloseHandle(_file);
+      reportError("Could not get the size of file \"" + fileName + "\".");
+    }
+    _size = static_cast<size_t>(size.QuadPart);
+    if (_size == 0)
+      return; // an empty file cannot be mapped
+    _mapping = CreateFileMappingA(_file, 0, PAGE_READONLY, 0, 0, 0);
+    if (_mapping != 0)
+      _begin = static_cast<const char*>
+        (MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (_begin == 0) {
+      if (_mapping != 0)
+        CloseHandle(_mapping);
+      CloseHandle(_file);
+      reportError("Could not map file \"" + fileName + "\" into memory.");
+    }
+  }
+
+  MappedFile::~MappedFile() {
+    if (_begin != 0)
+      UnmapViewOfFile(_begin);
+    if (_mapping != 0)
+      CloseHandle(_mapping);
+    CloseHandle(_file);
+  }
+#else
+  MappedFile::MappedFile(const std::string& fileName):
+    _begin(0),
+    _size(0),
+    _fileName(fileName) {
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+      reportError("Could not open file \"" + fileName + "\".");
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      reportError("Could not get the size of file \"" + fileName + "\".");
+    }
+    _size = static_cast<size_t>(info.st_size);
+    if (_size == 0) {
+      close(fd);
+      return; // an empty file cannot be mapped
+    }
+    void* map = mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the file is closed.
+    close(fd);
+    if (map == MAP_FAILED)
+      reportError("Could not map file \"" + fileName + "\" into memory.");
+#ifdef MADV_SEQUENTIAL
+    madvise(map, _size, MADV_SEQUENTIAL);
+#endif
+    _begin = static_cast<const char*>(map);
+  }
+
+  MappedFile::~MappedFile() {
+    if (_begin != 0)
+      munmap(const_cast<char*>(_begin), _size);
+  }
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef MATHIC_MAPPED_FILE_GUARD
+#define MATHIC_MAPPED_FILE_GUARD
+
+#include "stdinc.h"
+#include <string>
+
+namespace mathic {
+  /** Maps the contents of a file into memory for reading. The operating
+      system reads the pages of the file as they are accessed, so even
+      very large files can be streamed through without first loading
+      them into a buffer.
+
+      Reports an error through reportError if the file cannot be opened
+      or mapped. */
+  class MappedFile {
+  public:
+    MappedFile(const std::string& fileName);
+    ~MappedFile();
+
+    const char* begin() const {return _begin;}
+    const char* end() const {return _begin + _size;}
+    size_t size() const {return _size;}
+    const std::string& getFileName() const {return _fileName;}
+
+  private:
+    MappedFile(const MappedFile&); // unavailable
+    void operator=(const MappedFile&); // unavailable
+
+    const char* _begin;
+    size_t _size;
+    std::string _fileName;
+#ifdef _WIN32
+    void* _file;
+    void* _mapping;
+#endif
+  };
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef MATHIC_NODE_STACK_GUARD
+#define MATHIC_NODE_STACK_GUARD
+
+#include "stdinc.h"
+#include <vector>
+#include <algorithm>
+
+namespace mathic {
+  /** A stack of nodes to visit for a traversal of a tree. The first
+      InlineCapacity elements are stored inside the object, so a local
+      NodeStack only allocates memory for unusually deep traversals. This
+      allows queries to use a stack of their own instead of one stored in
+      the tree, which is what makes concurrent queries on the same tree
+      possible.
+
+      T must have a trivial copy constructor and destructor. */
+  template<class T, size_t InlineCapacity = 64>
+  class NodeStack {
+  public:
+    NodeStack():
+      _begin(_inline), _end(_inline), _capacityEnd(_inline + InlineCapacity) {}
+
+    bool empty() const {return _begin == _end;}
+    size_t size() const {return _end - _begin;}
+
+    void push_back(const T& t) {
+      if (_end == _capacityEnd)
+        grow();
+      *_end = t;
+      ++_end;
+    }
+
+    T& back() {
+      MATHIC_ASSERT(!empty());
+      return *(_end - 1);
+    }
+
+    void pop_back() {
+      MATHIC_ASSERT(!empty());
+      --_end;
+    }
+
+    void clear() {_end = _begin;}
+
+  private:
+    NodeStack(const NodeStack&); // unavailable
+    void operator=(const NodeStack&); // unavailable
+
+    void grow() {
+      const size_t oldSize = size();
+      std::vector<T> larger(2 * oldSize);
+      std::copy(_begin, _end, larger.begin());
+      _overflow.swap(larger);
+      _begin = &_overflow.front();
+      _end = _begin + oldSize;
+      _capacityEnd = _begin + _overflow.size();
+    }
+
+    T* _begin;
+    T* _end;
+    T* _capacityEnd;
+    std::vector<T> _overflow; // used once _inline runs out
+    T _inline[InlineCapacity];
+  };
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef MATHIC_P_Q_TRACE_GUARD
+#define MATHIC_P_Q_TRACE_GUARD
+
+#include "stdinc.h"
+#include "TraceCoding.h"
+#include <ostream>
+#include <vector>
+
+namespace mathic {
+  /** A priority queue trace is a sequence of push and pop events where
+      each entry is represented by an integer key. Keys are compared as
+      the entries they represent, so a trace can be replayed through any
+      priority queue by pqsim.
+
+      The format is the header "mathicPQ" and version 1 followed by the
+      events. A push of n keys is the word 1, the word n, the first key
+      and then the difference from the previous key for each other key.
+      A pop is the word 0 followed by the key that was popped. */
+  class PQTraceWriter {
+  public:
+    typedef TraceCoding::Word Key;
+
+    PQTraceWriter(std::ostream& out): _out(out) {
+      TraceCoding::writeHeader(_out, "mathicPQ", 1);
+    }
+
+    template<class It>
+    void push(It begin, It end) {
+      size_t count = 0;
+      for (It it = begin; it != end; ++it)
+        ++count;
+      TraceCoding::writeWord(_out, 1);
+      TraceCoding::writeWord(_out, count);
+      Key previous = 0;
+      for (It it = begin; it != end; ++it) {
+        const Key key = *it;
+        TraceCoding::writeSignedWord
+          (_out, static_cast<long long>(key - previous));
+        previous = key;
+      }
+    }
+
+    void pop(Key key) {
+      TraceCoding::writeWord(_out, 0);
+      TraceCoding::writeWord(_out, key);
+    }
+
+  private:
+    std::ostream& _out;
+  };
+
+  /** Reads the events of a priority queue trace one at a time from
+      memory, such as from a MappedFile. */
+  class PQTraceReader {
+  public:
+    typedef TraceCoding::Word Key;
+    enum Event {PushEvent, PopEvent, EndEvent};
+
+    PQTraceReader(const char* begin, const char* end):
+      _begin(begin), _pos(begin), _end(end), _popped(0) {
+      TraceCoding::readHeader(_pos, _end, "mathicPQ", 1);
+      _begin = _pos;
+    }
+
+    /** Reads the next event. For a push the keys are then in pushed()
+        and for a pop the key is popped(). */
+    Event next() {
+      if (_pos == _end)
+        return EndEvent;
+      const TraceCoding::Word type = TraceCoding::readWord(_pos, _end);
+      if (type == 0) {
+        _popped = TraceCoding::readWord(_pos, _end);
+        return PopEvent;
+      }
+      if (type != 1)
+        reportError("Unknown event in priority queue trace.");
+      const size_t count =
+        static_cast<size_t>(TraceCoding::readWord(_pos, _end));
+      _pushed.clear();
+      Key key = 0;
+      for (size_t i = 0; i < count; ++i) {
+        key += static_cast<Key>(TraceCoding::readSignedWord(_pos, _end));
+        _pushed.push_back(key);
+      }
+      return PushEvent;
+    }
+
+    const std::vector<Key>& pushed() const {return _pushed;}
+    Key popped() const {return _popped;}
+
+    /** Goes back to the first event. */
+    void rewind() {_pos = _begin;}
+
+  private:
+    const char* _begin;
+    const char* _pos;
+    const char* _end;
+    std::vector<Key> _pushed;
+    Key _popped;
+  };
+
+  /** Wraps a priority queue such as Geobucket, Heap or TourTree and
+      records a trace of what is pushed and popped. KeyOf must map each
+      entry to an integer key such that entries compare as their keys.
+
+      pqsim pops an entry together with all entries that are equal to it,
+      so a pop of an entry equal to the entry popped just before is not
+      recorded. A trace therefore only replays correctly if equal entries
+      are popped together, which is how the queues are normally used. */
+  template<class PQ, class KeyOf>
+  class PQTraceRecorder {
+  public:
+    typedef typename PQ::Entry Entry;
+    typedef TraceCoding::Word Key;
+
+    PQTraceRecorder(PQ& pq, std::ostream& out, const KeyOf& keyOf = KeyOf()):
+      _pq(pq), _writer(out), _keyOf(keyOf), _hasLastPop(false), _lastPop(0) {}
+
+    void push(const Entry& entry) {
+      const Key key = _keyOf(entry);
+      _writer.push(&key, &key + 1);
+      _hasLastPop = false;
+      _pq.push(entry);
+    }
+
+    template<class It>
+    void push(It begin, It end) {
+      _keys.clear();
+      for (It it = begin; it != end; ++it)
+        _keys.push_back(_keyOf(*it));
+      _writer.push(_keys.begin(), _keys.end());
+      _hasLastPop = false;
+      _pq.push(begin, end);
+    }
+
+    Entry pop() {
+      const Entry entry = _pq.pop();
+      const Key key = _keyOf(entry);
+      if (!_hasLastPop || key != _lastPop)
+        _writer.pop(key);
+      _hasLastPop = true;
+      _lastPop = key;
+      return entry;
+    }
+
+    Entry top() const {return _pq.top();}
+    bool empty() const {return _pq.empty();}
+
+    PQ& getQueue() {return _pq;}
+    const PQ& getQueue() const {return _pq;}
+
+  private:
+    PQ& _pq;
+    PQTraceWriter _writer;
+    KeyOf _keyOf;
+    std::vector<Key> _keys;
+    bool _hasLastPop;
+    Key _lastPop;
+  };
+}
+
+#endif
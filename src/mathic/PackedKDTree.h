@@ -4,19 +4,46 @@
 #include "stdinc.h"
 #include "DivMask.h"
 #include "KDEntryArray.h"
+#include "KDRebuild.h"
+#include "KDNodePool.h"
+#include "NodeStack.h"
 #include <memtailor.h>
 #include <ostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <system_error>
 
 namespace mathic {
+  namespace PackedKDTreeInternal {
+    MATHIC_DEFINE_HAS_MEMBER(HasBuildThreadCount, getBuildThreadCount);
+
+    /** Returns the number of threads to build a tree with, which is 1
+        unless C has a getBuildThreadCount method. */
+    template<class C, bool Has = HasBuildThreadCount<C>::Value>
+    struct BuildThreadCount {
+      static size_t get(const C& conf) {return 1;}
+    };
+    template<class C>
+    struct BuildThreadCount<C, true> {
+      static size_t get(const C& conf) {return conf.getBuildThreadCount();}
+    };
+  }
+
   template<class C>
   class PackedKDTree {
   public:
     typedef typename C::Monomial Monomial;
     typedef typename C::Entry Entry;
     typedef typename C::Exponent Exponent;
-    typedef typename DivMask::Extender<Entry, C::UseDivMask> ExtEntry;
-    typedef typename DivMask::Extender<const Monomial&,C::UseDivMask> ExtMonoRef;
-    typedef typename DivMask::Calculator<C> DivMaskCalculator;
+    typedef typename DivMaskOf<C>::template Extender<Entry, C::UseDivMask>
+      ExtEntry;
+    typedef typename DivMaskOf<C>::template
+      Extender<const Monomial&, C::UseDivMask> ExtMonoRef;
+    typedef typename DivMaskOf<C>::template Calculator<C> DivMaskCalculator;
 
     struct ExpOrder {
     ExpOrder(size_t var, const C& conf): _var(var), _conf(conf) {}
@@ -34,35 +61,63 @@ namespace mathic {
 
     class Node {
     public:
-      static Node* makeNode(memt::Arena& arena, const C& conf) {
-        return new (arena.alloc(sizeOf(0)))
-          Node(arena, conf);
+      // The nodes are made in memory from pool if it is not null and
+      // otherwise from arena. The size class of a node in pool is its
+      // childCapacity().
+      static Node* makeNode
+        (memt::Arena& arena, KDNodePool* pool, const C& conf) {
+        return new (alloc(arena, pool, 0)) Node(arena, conf);
       }
 
       template<class Iter>
       static Node* makeNode(Iter begin, Iter end, memt::Arena& arena,
-        const C& conf, size_t childCount) {
-        return new (arena.alloc(sizeOf(childCount)))
+        KDNodePool* pool, const C& conf, size_t childCount) {
+        return new (alloc(arena, pool, childCount))
           Node(begin, end, arena, conf, childCount);
       }
 
       template<class Iter>
       static Node* makeNode(Iter begin, Iter end, memt::Arena& arena,
-        const DivMaskCalculator& calc, const C& conf, size_t childCount) {
-        return new (arena.alloc(sizeOf(childCount)))
+        KDNodePool* pool, const DivMaskCalculator& calc, const C& conf,
+        size_t childCount) {
+        return new (alloc(arena, pool, childCount))
           Node(begin, end, arena, calc, conf, childCount);
       }
 
+      /** Makes a copy of node in memory, which must have room for
+          sizeOf(node.childCount()) bytes. The children of the copy are
+          the same nodes as those of node. */
+      static Node* makeCopy
+        (Node& node, void* memory, memt::Arena& arena, const C& conf) {
+        Node* copy = new (memory) Node(node.entries().begin(),
+          node.entries().end(), arena, conf, node.childCount());
+        std::copy(node.childBegin(), node.childEnd(), copy->childBegin());
+        return copy;
+      }
+
+      static void* alloc
+        (memt::Arena& arena, KDNodePool* pool, size_t childCount) {
+        if (pool == 0)
+          return arena.alloc(sizeOf(childCount));
+        return pool->alloc(arena, childCount, sizeOf(childCount));
+      }
+
       static size_t sizeOf(size_t childCount) {
         if (childCount > 0)
           --childCount; // array has size 1, so one element already there
         return sizeof(Node) + childCount * sizeof(Child);
       }
 
-      struct Child : public mathic::DivMask::HasDivMask<C::UseTreeDivMask> {
+      struct Child :
+        public DivMaskOf<C>::template HasDivMask<C::UseTreeDivMask> {
         size_t var;
         Exponent exponent;
         Node* node;
+        // The number of entries in the subtree at node, counting
+        // insertions but not removals, and that number when the subtree
+        // was last built.
+        size_t size;
+        size_t builtSize;
       };
       typedef Child* iterator;
       typedef Child const* const_iterator;
@@ -72,6 +127,16 @@ namespace mathic {
       const_iterator childEnd() const {return _childrenEnd;}
 
       bool hasChildren() const {return childBegin() != childEnd();}
+      size_t childCount() const {return childEnd() - childBegin();}
+      size_t childCapacity() const {return _childCapacity;}
+
+      /** Removes child from the children. The capacity stays the
+          same. */
+      void removeChild(iterator child) {
+        MATHIC_ASSERT(childBegin() <= child && child < childEnd());
+        std::copy(child + 1, childEnd(), child);
+        --_childrenEnd;
+      }
       template<class ME> // ME is MonomialOrEntry
       bool inChild(const_iterator child, const ME me, const C& conf) const {
         return child->exponent < conf.getExponent(me, child->var);
@@ -84,7 +149,9 @@ namespace mathic {
         const ExtEntry& extEntry,
         Child* childFromParent,
         memt::Arena& arena,
-        const C& conf);
+        KDNodePool& pool,
+        const C& conf,
+        const KDQuerySample<C>& queries);
 
       /// Asserts internal invariants if asserts are turned on.
       bool debugIsValid() const;
@@ -110,6 +177,9 @@ namespace mathic {
       // or errors. Actual size can be greater if more memory has been
       // allocated for the node than sizeof(Node).
       Child* _childrenEnd; // points into _childrenMemoryBegin
+      // The number of children that there is memory for. It can be
+      // more than childCount() after splitInsert or removeChild.
+      size_t _childCapacity;
       Child _childrenMemoryBegin[1];
     };
 
@@ -127,27 +197,56 @@ namespace mathic {
     template<class Iter>
     void reset(Iter begin, Iter end, const DivMaskCalculator& calc);
 
-    inline Entry* findDivisor(const ExtMonoRef& monomial);
+    inline Entry* findDivisor(const ExtMonoRef& monomial) const;
+
+    /** Sets divisors[i] to an entry that divides queries[i] for each i
+        in [0, queryCount) where divisors[i] is null and there is such an
+        entry. The entries that are not null to begin with are left
+        alone. All the queries go down the tree together, so each node
+        is visited at most once for the whole batch. */
+    void findDivisors
+      (const ExtMonoRef* queries, size_t queryCount, Entry** divisors) const;
 
     template<class DivisorOutput>
     inline void findAllDivisors
-      (const ExtMonoRef& monomial, DivisorOutput& out);
+      (const ExtMonoRef& monomial, DivisorOutput& out) const;
 
     template<class DivisorOutput>
     inline void findAllMultiples
-      (const ExtMonoRef& monomial, DivisorOutput& out);
+      (const ExtMonoRef& monomial, DivisorOutput& out) const;
 
     template<class EntryOutput>
-    void forAll(EntryOutput& out);
+    void forAll(EntryOutput& out) const;
 
     void clear();
 
+    /** Recomputes every div mask in the tree using calc. */
+    void recalculateDivMasks(const DivMaskCalculator& calc);
+
+    /** Copies the nodes into one block of memory in depth first order
+        and frees the memory of the old nodes, including those that are
+        no longer in the tree. The entries move, so pointers to them
+        become invalid. */
+    void compact();
+
+    /** The memory of the nodes, including removed ones, and of the
+        sample of queries. */
     size_t getMemoryUse() const;
 
+    /** The part of getMemoryUse() that is taken up by nodes that have
+        been removed from the tree, either because their entries were
+        removed or because a rebuild replaced them. New nodes are made
+        there, and compact() frees it. */
+    size_t getDeadMemoryUse() const {return _pool.getMemoryUse();}
+
     void print(std::ostream& out) const;
 
     C& getConfiguration() {return _conf;}
 
+    /** The sample of queries that splits are chosen from when
+        C::splitStrategy is KDSplitQueries. */
+    KDQuerySample<C>& getQuerySample() {return _querySample;}
+
     bool debugIsValid() const;
 
   private:
@@ -163,15 +262,117 @@ namespace mathic {
       typename Node::Child* fromParent;
     };
 
+    /** Makes the node for task out of the range of task and appends the
+        tasks for the children of that node to todo. children is only
+        used as temporary storage. The div masks of Entry's are computed
+        by *calc while ExtEntry's already have theirs, so calc can then
+        be null. */
+    template<class Iter>
+    void buildNode(
+      const InsertTodo<Iter>& task,
+      std::vector<InsertTodo<Iter> >& todo,
+      std::vector<InsertTodo<Iter> >& children,
+      memt::Arena& arena,
+      const DivMaskCalculator* calc
+    );
+
+    template<class Iter>
+    Node* makeNode(Iter begin, Iter end, memt::Arena& arena,
+      const DivMaskCalculator* calc, size_t childCount) {
+      return Node::makeNode
+        (begin, end, arena, poolFor(arena), *calc, _conf, childCount);
+    }
+    Node* makeNode(ExtEntry* begin, ExtEntry* end, memt::Arena& arena,
+      const DivMaskCalculator*, size_t childCount) {
+      return Node::makeNode
+        (begin, end, arena, poolFor(arena), _conf, childCount);
+    }
+
+    /** Returns _pool for _arena and null for the arenas of the other
+        threads of a parallel build, which must not use _pool. */
+    KDNodePool* poolFor(memt::Arena& arena) {
+      return &arena == &_arena ? &_pool : 0;
+    }
+
+    /** Puts the memory of node in _pool. Its entries must have been
+        cleared. */
+    void freeNode(Node* node) {
+      MATHIC_ASSERT(node->entries().empty());
+      const size_t capacity = node->childCapacity();
+      _pool.free(node, capacity, Node::sizeOf(capacity));
+    }
+
+    /** If node has no entries and no children, then removes it from
+        the children of parent, or from the tree if parent is null,
+        frees it and returns true. Otherwise returns false. */
+    bool removeIfEmpty(Node* parent, Node* node);
+
+    /** A node to visit in removeMultiples. A node is visited again
+        after its children so that it can be removed if it has become
+        empty. */
+    struct RemoveTodo {
+      RemoveTodo() {}
+      RemoveTodo(Node* node, Node* parent, bool childrenDone):
+        node(node), parent(parent), childrenDone(childrenDone) {}
+      Node* node;
+      Node* parent;
+      bool childrenDone;
+    };
+
+    /** Sets the sizes of the children in the subtree at root to the
+        number of entries below them and marks them as just built.
+        fromParent is the child that points to root, or null for the
+        root of the tree. */
+    void updateSizes(Node* root, typename Node::Child* fromParent);
+
+    /** Recomputes the tree div masks of the children in the subtree at
+        root from the div masks of the entries. */
+    static void updateTreeDivMasks(Node* root);
+
+    /** Rebuilds the subtree at fromParent->node, or the whole tree if
+        fromParent is null. The entries move. */
+    void rebuildSubtree(typename Node::Child* fromParent);
+
+    /** Does the work of reset for task using threadCount threads. */
+    template<class Iter>
+    void parallelBuild(
+      const InsertTodo<Iter>& task,
+      const DivMaskCalculator& calc,
+      size_t threadCount
+    );
+
+    template<class Iter>
+    class ParallelBuild;
+
+    /** A node to visit in findDivisors along with the queries that are
+        to be looked up in it. */
+    struct BatchTodo {
+      BatchTodo(Node* node, size_t begin, size_t end):
+        node(node), begin(begin), end(end) {}
+      Node* node;
+      size_t begin; // first index of the queries in the index buffer
+      size_t end; // one past the last index
+    };
+
     memt::Arena _arena; // Everything permanent allocated from here.
+    std::vector<char> _layout; // except the nodes moved by compact.
+    KDNodePool _pool; // The memory of removed nodes in the two above.
     C _conf; // User supplied configuration.
-    mutable std::vector<Node*> _tmp; // For navigating the tree.
     Node* _root; // Root of the tree. Can be null!
+    KDQuerySample<C> _querySample;
+
+    // As the size and builtSize of a Child, for the root.
+    size_t _rootSize;
+    size_t _rootBuiltSize;
+
+    /// Nodes made by the other threads of a parallel reset are allocated
+    /// from these. The nodes made by the calling thread go in _arena.
+    std::vector<memt::Arena*> _buildArenas;
   };
 
   template<class C>
   PackedKDTree<C>::PackedKDTree(const C& configuration):
-  _conf(configuration), _root(0) {
+  _conf(configuration), _root(0), _rootSize(0), _rootBuiltSize(0) {
     MATHIC_ASSERT(C::LeafSize > 0);
     MATHIC_ASSERT(debugIsValid());
   }
@@ -179,12 +380,15 @@ namespace mathic {
   template<class C>
   PackedKDTree<C>::~PackedKDTree() {
     clear();
+    for (size_t i = 0; i < _buildArenas.size(); ++i)
+      delete _buildArenas[i];
   }
 
   template<class C>
   PackedKDTree<C>::Node::Node(memt::Arena& arena, const C& conf):
   _entries(arena, conf) {
     _childrenEnd = childBegin();
+    _childCapacity = 0;
   }
 
   template<class C>
@@ -197,6 +401,7 @@ namespace mathic {
     size_t childCount):
     _entries(begin, end, arena, conf) {
     _childrenEnd = childBegin() + childCount;
+    _childCapacity = childCount;
   }
 
   template<class C>
@@ -210,6 +415,7 @@ namespace mathic {
     size_t childCount):
     _entries(begin, end, arena, calc, conf) {
     _childrenEnd = childBegin() + childCount;
+    _childCapacity = childCount;
   }
 
   template<class C>
@@ -218,66 +424,119 @@ namespace mathic {
     const ExtMonoRef& extMonomial,
     MO& out
   ) {
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<RemoveTodo> stack;
     if (_root == 0)
       return 0;
     size_t removedCount = 0;
-    Node* node = _root;
-    while (true) {
+    stack.push_back(RemoveTodo(_root, 0, false));
+    while (!stack.empty()) {
+      RemoveTodo todo = stack.back();
+      stack.pop_back();
+      if (todo.childrenDone) {
+        removeIfEmpty(todo.parent, todo.node);
+        continue;
+      }
+      Node* node = todo.node;
+      todo.childrenDone = true;
+      stack.push_back(todo);
       for (typename Node::const_iterator it = node->childBegin();
         it != node->childEnd(); ++it) {
-        _tmp.push_back(it->node);
+        stack.push_back(RemoveTodo(it->node, node, false));
         if (node->inChild(it, extMonomial.get(), _conf))
           goto stopped;
       }
       removedCount += node->entries().removeMultiples(extMonomial, out, _conf);
 stopped:;
-      if (_tmp.empty())
-        break;
-      node = _tmp.back();
-      _tmp.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
     MATHIC_ASSERT(debugIsValid());
     return removedCount;
   }
 
   template<class C>
   bool PackedKDTree<C>::removeElement(const Monomial& monomial) {
-    MATHIC_ASSERT(_tmp.empty());
     if (_root == 0)
       return false;
     Node* node = _root;
+    NodeStack<Node*> path; // the ancestors of node
  
     typename Node::iterator child = node->childBegin();
     while (child != node->childEnd()) {
       if (node->inChild(child, monomial, _conf)) {
+        path.push_back(node);
         node = child->node;
         child = node->childBegin();
       } else
         ++child;
     }
     const bool value = node->entries().removeElement(monomial, _conf);
+    while (removeIfEmpty(path.empty() ? 0 : path.back(), node) &&
+      !path.empty()) {
+      node = path.back();
+      path.pop_back();
+    }
     MATHIC_ASSERT(debugIsValid());
     return value;
   }
 
+  template<class C>
+  bool PackedKDTree<C>::removeIfEmpty(Node* parent, Node* node) {
+    if (!node->entries().empty() || node->hasChildren())
+      return false;
+    if (parent == 0) {
+      MATHIC_ASSERT(node == _root);
+      _root = 0;
+      _rootSize = 0;
+      _rootBuiltSize = 0;
+    } else {
+      // The entries that would have gone in node go on to the next
+      // child or to parent instead. The div masks of the children
+      // before node are lower bounds for those of the children after
+      // it, so they stay right.
+      typename Node::iterator child = parent->childBegin();
+      while (child->node != node) {
+        ++child;
+        MATHIC_ASSERT(child != parent->childEnd());
+      }
+      parent->removeChild(child);
+    }
+    freeNode(node);
+    return true;
+  }
+
   template<class C>
   void PackedKDTree<C>::insert(const ExtEntry& extEntry) {
     MATHIC_ASSERT(debugIsValid());
     // find node in which to insert extEntry
     typename Node::Child* parentChild = 0;
     if (_root == 0)
-      _root = Node::makeNode(_arena, _conf);
+      _root = Node::makeNode(_arena, &_pool, _conf);
     Node* node = _root;
+    ++_rootSize;
+    // the lowest subtree on the path to rebuild, if any. It is the
+    // subtree at rebuild->node, or the whole tree if rebuild is null.
+    bool doRebuild = false;
+    typename Node::Child* rebuild = 0;
+    size_t size = _rootSize;
+    size_t builtSize = _rootBuiltSize;
     typename Node::iterator child = node->childBegin();
     while (true) {
+      if (child == node->childBegin() && node->hasChildren()) {
+        size_t heaviest = 0;
+        for (typename Node::iterator it = child; it != node->childEnd(); ++it)
+          heaviest = std::max(heaviest, it->size);
+        if (KDRebuildInternal::shouldRebuild
+          (size, builtSize, heaviest, _conf)) {
+          doRebuild = true;
+          rebuild = parentChild;
+        }
+      }
       if (child == node->childEnd()) {
         MATHIC_ASSERT(node->entries().size() <= C::LeafSize);
         if (node->entries().size() < C::LeafSize)
           node->entries().insert(extEntry, _conf);
         else { // split full node
-          node = node->splitInsert(extEntry, parentChild, _arena, _conf);
+          node = node->splitInsert
+            (extEntry, parentChild, _arena, _pool, _conf, _querySample);
           if (parentChild == 0)
             _root = node;
         }
@@ -287,12 +546,17 @@ stopped:;
         child->updateToLowerBound(extEntry);
       if (node->inChild(child, extEntry.get(), _conf)) {
         parentChild = &*child;
+        ++parentChild->size;
+        size = parentChild->size;
+        builtSize = parentChild->builtSize;
         node = child->node;
         child = node->childBegin();
       } else
         ++child;
     }
     MATHIC_ASSERT(debugIsValid());
+    if (doRebuild)
+      rebuildSubtree(rebuild);
   }
 
   template<class C>
@@ -304,99 +568,380 @@ stopped:;
 
     typedef InsertTodo<Iter> Task;
     typedef std::vector<Task> TaskCont;
-    TaskCont todo;
-    TaskCont children;
-
-    {
-      Task initialTask;
-      initialTask.begin = insertBegin;
-      initialTask.end = insertEnd;
-      initialTask.var = static_cast<size_t>(-1);
-      initialTask.fromParent = 0;
+
+    Task initialTask;
+    initialTask.begin = insertBegin;
+    initialTask.end = insertEnd;
+    initialTask.var = static_cast<size_t>(-1);
+    initialTask.fromParent = 0;
+
+    // Building in parallel does not pay off for small trees.
+    const size_t ParallelMinSize = 16 * 1024;
+    const size_t threadCount =
+      PackedKDTreeInternal::BuildThreadCount<C>::get(_conf);
+    if (threadCount > 1 &&
+      static_cast<size_t>(std::distance(insertBegin, insertEnd)) >=
+        ParallelMinSize)
+      parallelBuild(initialTask, calc, threadCount);
+    else {
+      TaskCont todo;
+      TaskCont children;
       todo.push_back(initialTask);
+      while (!todo.empty()) {
+        const Task task = todo.back();
+        todo.pop_back();
+        buildNode(task, todo, children, _arena, &calc);
+      }
     }
-    while (!todo.empty()) {
-      Iter begin = todo.back().begin;
-      Iter end = todo.back().end;
-      size_t var = todo.back().var;
-      typename Node::Child* fromParent = todo.back().fromParent;
-      if (fromParent != 0) {
-        fromParent->var = var;
-        fromParent->exponent = todo.back().exp;
+    MATHIC_ASSERT(_root != 0);
+    updateSizes(_root, 0);
+    updateTreeDivMasks(_root);
+    MATHIC_ASSERT(debugIsValid());
+  }
+
+  template<class C>
+  void PackedKDTree<C>::updateSizes
+  (Node* root, typename Node::Child* fromParent) {
+    // record nodes with the child that points to them using breadth
+    // first search
+    typedef std::pair<Node*, typename Node::Child*> Pair;
+    std::vector<Pair> nodes;
+    nodes.push_back(Pair(root, fromParent));
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      Node* node = nodes[i].first;
+      for (typename Node::iterator child = node->childBegin();
+        child != node->childEnd(); ++child)
+        nodes.push_back(Pair(child->node, &*child));
+    }
+    // the children come after their parent
+    for (size_t i = nodes.size(); i > 0; --i) {
+      Node* node = nodes[i - 1].first;
+      size_t size = node->entries().size();
+      for (typename Node::iterator child = node->childBegin();
+        child != node->childEnd(); ++child)
+        size += child->size;
+      typename Node::Child* from = nodes[i - 1].second;
+      if (from != 0) {
+        from->size = size;
+        from->builtSize = size;
+      } else {
+        _rootSize = size;
+        _rootBuiltSize = size;
       }
+    }
+  }
+
+  template<class C>
+  void PackedKDTree<C>::updateTreeDivMasks(Node* root) {
+    if (!C::UseTreeDivMask)
+      return;
+    // record nodes in tree using breadth first search
+    typedef std::vector<Node*> NodeCont;
+    NodeCont nodes;
+    nodes.push_back(root);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      Node* node = nodes[i];
+      for (typename Node::iterator child = node->childBegin();
+        child != node->childEnd(); ++child)
+        nodes.push_back(child->node);
+    }
+    // compute div masks in reverse order of breath first search
+    typename NodeCont::reverse_iterator it = nodes.rbegin();
+    typename NodeCont::reverse_iterator end = nodes.rend();
+    for (; it != end; ++it) {
+      Node* node = *it;
+      typedef std::reverse_iterator<typename Node::iterator> riter;
+      riter rbegin = riter(node->childEnd());
+      riter rend = riter(node->childBegin());
+      for (riter child = rbegin; child != rend; ++child) {
+        child->resetDivMask();
+        if (child == rbegin)
+          child->updateToLowerBound(node->entries());
+        else {
+          riter prev = child;
+          --prev;
+          child->updateToLowerBound(*prev);
+        }
+        if (child->node->hasChildren())
+          child->updateToLowerBound(*child->node->childBegin());
+        else
+          child->updateToLowerBound(child->node->entries());
+      }
+      MATHIC_ASSERT(node->debugIsValid());
+    }
+  }
+
+  template<class C>
+  void PackedKDTree<C>::rebuildSubtree(typename Node::Child* fromParent) {
+    Node* root = fromParent == 0 ? _root : fromParent->node;
+    std::vector<ExtEntry> entries;
+    entries.reserve(fromParent == 0 ? _rootSize : fromParent->size);
+    NodeStack<Node*> stack;
+    stack.push_back(root);
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
+      KDEntryArray<C, ExtEntry>& nodeEntries = node->entries();
+      entries.insert(entries.end(), nodeEntries.begin(), nodeEntries.end());
+      nodeEntries.clear();
+      for (typename Node::iterator it = node->childBegin();
+        it != node->childEnd(); ++it)
+        stack.push_back(it->node);
+      freeNode(node);
+    }
+    // The new subtree is made in the memory of the old one.
+
+    typedef InsertTodo<ExtEntry*> Task;
+    Task task;
+    task.begin = entries.empty() ? 0 : &entries.front();
+    task.end = task.begin + entries.size();
+    task.fromParent = fromParent;
+    if (fromParent != 0) {
+      task.var = fromParent->var;
+      task.exp = fromParent->exponent;
+    } else
+      task.var = static_cast<size_t>(-1);
+    std::vector<Task> todo;
+    std::vector<Task> children;
+    todo.push_back(task);
+    while (!todo.empty()) {
+      const Task next = todo.back();
       todo.pop_back();
+      buildNode(next, todo, children, _arena, 0);
+    }
+    root = fromParent == 0 ? _root : fromParent->node;
+    updateSizes(root, fromParent);
+    // The entries are the same, so the div masks above are still right.
+    updateTreeDivMasks(root);
+    MATHIC_ASSERT(debugIsValid());
+  }
 
-      // split off children until reaching few enough entries
-      while (C::LeafSize < static_cast<size_t>(std::distance(begin, end))) {
-        Task child;
-        Iter middle = KDEntryArray<C, ExtEntry>::
-          split(begin, end, var, child.exp, _conf);
-        MATHIC_ASSERT(begin < middle && middle < end);
-        MATHIC_ASSERT(var < _conf.getVarCount());
-        child.begin = middle;
-        child.end = end;
-        child.var = var;
-        children.push_back(child);
-        // now operate on the equal-or-less part of the range
-        end = middle;
-      }
-      Node* node = Node::makeNode
-        (begin, end, _arena, calc, _conf, children.size());
-      if (_root == 0)
-        _root = node;
-      if (fromParent != 0)
-        fromParent->node = node;
-      for (size_t child = 0; child < children.size(); ++child) {
-        children[child].fromParent = &*(node->childBegin() + child);
-        todo.push_back(children[child]);
-      }
-      children.clear();
+  template<class C>
+  void PackedKDTree<C>::recalculateDivMasks(const DivMaskCalculator& calc) {
+    if (!C::UseDivMask || _root == 0)
+      return;
+    NodeStack<Node*> stack;
+    stack.push_back(_root);
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
+      node->entries().recalculateDivMasks(calc, _conf);
+      for (typename Node::iterator it = node->childBegin();
+        it != node->childEnd(); ++it)
+        stack.push_back(it->node);
     }
-    MATHIC_ASSERT(_root != 0);
+    updateTreeDivMasks(_root);
+    MATHIC_ASSERT(debugIsValid());
+  }
 
-    if (C::UseTreeDivMask) {
-      // record nodes in tree using breadth first search
-      typedef std::vector<Node*> NodeCont;
-      NodeCont nodes;
-      nodes.push_back(_root);
-      for (size_t i = 0; i < nodes.size(); ++i) {
-        Node* node = nodes[i];
-        for (typename Node::iterator child = node->childBegin();
-          child != node->childEnd(); ++child)
-          nodes.push_back(child->node);
-      }
-      // compute div masks in reverse order of breath first search
-      typename NodeCont::reverse_iterator it = nodes.rbegin();
-      typename NodeCont::reverse_iterator end = nodes.rend();
-      for (; it != end; ++it) {
-        Node* node = *it;
-        typedef std::reverse_iterator<typename Node::iterator> riter;
-        riter rbegin = riter(node->childEnd());
-        riter rend = riter(node->childBegin());
-        for (riter child = rbegin; child != rend; ++child) {
-          child->resetDivMask();
-          if (child == rbegin)
-            child->updateToLowerBound(node->entries());
-          else {
-            riter prev = child;
-            --prev;
-            child->updateToLowerBound(*prev);
+  template<class C>
+  template<class Iter>
+  void PackedKDTree<C>::buildNode(
+    const InsertTodo<Iter>& task,
+    std::vector<InsertTodo<Iter> >& todo,
+    std::vector<InsertTodo<Iter> >& children,
+    memt::Arena& arena,
+    const DivMaskCalculator* calc
+  ) {
+    MATHIC_ASSERT(children.empty());
+    Iter begin = task.begin;
+    Iter end = task.end;
+    size_t var = task.var;
+    typename Node::Child* fromParent = task.fromParent;
+    if (fromParent != 0) {
+      fromParent->var = var;
+      fromParent->exponent = task.exp;
+    }
+
+    // split off children until reaching few enough entries
+    while (C::LeafSize < static_cast<size_t>(std::distance(begin, end))) {
+      InsertTodo<Iter> child;
+      Iter middle = KDEntryArray<C, ExtEntry>::
+        split(begin, end, var, child.exp, _conf, 0, &_querySample);
+      MATHIC_ASSERT(begin < middle && middle < end);
+      MATHIC_ASSERT(var < _conf.getVarCount());
+      child.begin = middle;
+      child.end = end;
+      child.var = var;
+      children.push_back(child);
+      // now operate on the equal-or-less part of the range
+      end = middle;
+    }
+    Node* node = makeNode(begin, end, arena, calc, children.size());
+    if (fromParent != 0)
+      fromParent->node = node;
+    else
+      _root = node;
+    for (size_t child = 0; child < children.size(); ++child) {
+      children[child].fromParent = &*(node->childBegin() + child);
+      todo.push_back(children[child]);
+    }
+    children.clear();
+  }
+
+  /** Shares the tasks of a reset between threads. Each thread builds the
+      nodes of its own tasks depth first and hands the children with
+      ranges of at least grain entries over to the other threads. The
+      ranges of different tasks do not overlap and each task writes only
+      to its own node and to its own Child in the parent node, so the
+      threads need only synchronize on the shared tasks. */
+  template<class C>
+  template<class Iter>
+  class PackedKDTree<C>::ParallelBuild {
+  public:
+    typedef InsertTodo<Iter> Task;
+
+    ParallelBuild(
+      PackedKDTree<C>& tree,
+      const DivMaskCalculator& calc,
+      size_t grain
+    ):
+      _tree(tree), _calc(calc), _grain(grain), _failed(false), _busy(0) {}
+
+    void push(const Task& task) {_shared.push_back(task);}
+
+    /** Builds nodes into arena until there are no more tasks. */
+    void work(memt::Arena& arena) {
+      std::vector<Task> todo;
+      std::vector<Task> children;
+      Task task;
+      while (takeTask(task)) {
+        try {
+          todo.push_back(task);
+          while (!todo.empty() && !_failed) {
+            const Task next = todo.back();
+            todo.pop_back();
+            const size_t childrenBegin = todo.size();
+            _tree.buildNode(next, todo, children, arena, &_calc);
+            share(todo, childrenBegin);
           }
-          if (child->node->hasChildren())
-            child->updateToLowerBound(*child->node->childBegin());
-          else
-            child->updateToLowerBound(child->node->entries());
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(_mutex);
+          if (!_exception)
+            _exception = std::current_exception();
+          _failed = true;
         }
-        MATHIC_ASSERT(node->debugIsValid());
+        todo.clear();
+        children.clear();
+        finishTask();
       }
     }
-    MATHIC_ASSERT(debugIsValid());
+
+    /** Throws the first exception thrown by any thread, if any. */
+    void rethrow() {
+      if (_exception)
+        std::rethrow_exception(_exception);
+    }
+
+  private:
+    ParallelBuild(const ParallelBuild&); // unavailable
+    void operator=(const ParallelBuild&); // unavailable
+
+    static size_t sizeOf(const Task& task) {
+      return static_cast<size_t>(std::distance(task.begin, task.end));
+    }
+
+    /** Waits for a shared task and sets task to it. Returns false if
+        the build is over. */
+    bool takeTask(Task& task) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (_shared.empty() && _busy > 0 && !_failed)
+        _available.wait(lock);
+      if (_shared.empty() || _failed)
+        return false;
+      task = _shared.back();
+      _shared.pop_back();
+      ++_busy;
+      return true;
+    }
+
+    void finishTask() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      MATHIC_ASSERT(_busy > 0);
+      --_busy;
+      if (_busy == 0)
+        _available.notify_all();
+    }
+
+    /** Moves the large tasks among todo[childrenBegin, todo.size() - 1)
+        to the shared tasks. The last task is kept as this thread is about
+        to work on it. */
+    void share(std::vector<Task>& todo, size_t childrenBegin) {
+      if (todo.size() < childrenBegin + 2)
+        return;
+      const size_t last = todo.size() - 1;
+      size_t i = childrenBegin;
+      while (i < last && sizeOf(todo[i]) < _grain)
+        ++i;
+      if (i == last)
+        return;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      size_t kept = i;
+      for (; i < last; ++i) {
+        if (sizeOf(todo[i]) >= _grain)
+          _shared.push_back(todo[i]);
+        else
+          todo[kept++] = todo[i];
+      }
+      todo[kept++] = todo[last];
+      todo.resize(kept);
+      _available.notify_all();
+    }
+
+    PackedKDTree<C>& _tree;
+    const DivMaskCalculator& _calc;
+    const size_t _grain;
+
+    std::atomic<bool> _failed; // stop early as another thread failed
+
+    std::mutex _mutex; // protects all the fields below
+    std::condition_variable _available; // notified on new tasks and at end
+    std::vector<Task> _shared;
+    size_t _busy; // number of threads working on a shared task
+    std::exception_ptr _exception;
+  };
+
+  template<class C>
+  template<class Iter>
+  void PackedKDTree<C>::parallelBuild(
+    const InsertTodo<Iter>& task,
+    const DivMaskCalculator& calc,
+    size_t threadCount
+  ) {
+    MATHIC_ASSERT(threadCount > 1);
+    while (_buildArenas.size() < threadCount - 1) {
+      _buildArenas.reserve(threadCount - 1);
+      _buildArenas.push_back(new memt::Arena());
+    }
+
+    // Enough tasks to keep every thread busy until the end.
+    const size_t grain = std::max<size_t>
+      (C::LeafSize + 1,
+       static_cast<size_t>(std::distance(task.begin, task.end)) /
+         (16 * threadCount));
+    ParallelBuild<Iter> build(*this, calc, grain);
+    build.push(task);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threadCount - 1; ++i) {
+      try {
+        threads.push_back(std::thread
+          (&ParallelBuild<Iter>::work, &build, std::ref(*_buildArenas[i])));
+      } catch (const std::system_error&) {
+        break; // make do with the threads we have
+      }
+    }
+    build.work(_arena);
+    for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+    build.rethrow();
   }
 
   template<class C>
   typename PackedKDTree<C>::Entry* PackedKDTree<C>::findDivisor
-    (const ExtMonoRef& extMonomial) {
-    MATHIC_ASSERT(_tmp.empty());
+    (const ExtMonoRef& extMonomial) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return 0;
     Node* node = _root;
@@ -408,7 +953,7 @@ stopped:;
           !it->getDivMask().canDivide(extMonomial.getDivMask()))
           goto next;
         if (node->inChild(it, extMonomial.get(), _conf))
-          _tmp.push_back(it->node);
+          stack.push_back(it->node);
       }
 
       // look for divisor in entries of node
@@ -417,29 +962,96 @@ stopped:;
           node->entries().findDivisor(extMonomial, _conf);
         if (it != node->entries().end()) {
           MATHIC_ASSERT(_conf.divides(it->get(), extMonomial.get()));
-          _tmp.clear();
           return &it->get();
         }
       }
 
 next:
       // grab next node to process
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
     return 0;
   }
 
+  template<class C>
+  void PackedKDTree<C>::findDivisors(
+    const ExtMonoRef* queries,
+    size_t queryCount,
+    Entry** divisors
+  ) const {
+    if (_root == 0)
+      return;
+
+    // The queries for a node to visit are a range in indices. The range
+    // of each node on todo ends where the range of the node above it
+    // begins, so the ranges of nodes that have already been visited
+    // are removed by shrinking indices to the end of the next range.
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < queryCount; ++i)
+      if (divisors[i] == 0)
+        indices.push_back(i);
+    if (indices.empty())
+      return;
+    std::vector<BatchTodo> todo;
+    todo.push_back(BatchTodo(_root, 0, indices.size()));
+    while (!todo.empty()) {
+      const BatchTodo visit = todo.back();
+      todo.pop_back();
+      indices.resize(visit.end);
+      Node* node = visit.node;
+
+      // Drop the queries that found a divisor elsewhere since this
+      // node was recorded.
+      size_t openEnd = visit.begin;
+      for (size_t i = visit.begin; i < visit.end; ++i)
+        if (divisors[indices[i]] == 0)
+          indices[openEnd++] = indices[i];
+
+      // record relevant children for later processing
+      for (typename Node::const_iterator it = node->childBegin();
+        it != node->childEnd(); ++it) {
+        const size_t childBegin = indices.size();
+        size_t stillOpen = visit.begin;
+        for (size_t i = visit.begin; i < openEnd; ++i) {
+          const size_t query = indices[i];
+          // a query that fails the div mask check of a child cannot
+          // have a divisor in that child, the later children or the
+          // entries of this node.
+          if (C::UseTreeDivMask &&
+            !it->getDivMask().canDivide(queries[query].getDivMask()))
+            continue;
+          indices[stillOpen++] = query;
+          if (node->inChild(it, queries[query].get(), _conf))
+            indices.push_back(query);
+        }
+        openEnd = stillOpen;
+        if (childBegin < indices.size())
+          todo.push_back(BatchTodo(it->node, childBegin, indices.size()));
+      }
+
+      // look for divisors in entries of node
+      for (size_t i = visit.begin; i < openEnd; ++i) {
+        const size_t query = indices[i];
+        typename KDEntryArray<C, ExtEntry>::iterator it =
+          node->entries().findDivisor(queries[query], _conf);
+        if (it != node->entries().end()) {
+          MATHIC_ASSERT(_conf.divides(it->get(), queries[query].get()));
+          divisors[query] = &it->get();
+        }
+      }
+    }
+  }
+
   template<class C>
   template<class DO>
   void PackedKDTree<C>::findAllDivisors(
     const ExtMonoRef& extMonomial,
     DO& output
-  ) {
-    MATHIC_ASSERT(_tmp.empty());
+  ) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
@@ -450,19 +1062,16 @@ next:
           !it->getDivMask().canDivide(extMonomial.getDivMask()))
           goto next; // div mask rules this sub tree out
         if (node->inChild(it, extMonomial.get(), _conf))
-          _tmp.push_back(it->node);
+          stack.push_back(it->node);
       }
-      if (!node->entries().findAllDivisors(extMonomial, output, _conf)) {
-        _tmp.clear();
+      if (!node->entries().findAllDivisors(extMonomial, output, _conf))
         break;
-      }
 next:
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
@@ -470,84 +1079,142 @@ next:
   void PackedKDTree<C>::findAllMultiples(
     const ExtMonoRef& extMonomial,
     DO& output
-  ) {
-    MATHIC_ASSERT(_tmp.empty());
+  ) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
     while (true) {
       for (typename Node::const_iterator it = node->childBegin();
         it != node->childEnd(); ++it) {
-          _tmp.push_back(it->node);
+          stack.push_back(it->node);
           if (node->inChild(it, extMonomial.get(), _conf))
             goto next;
       }
-      if (!node->entries().findAllMultiples(extMonomial, output, _conf)) {
-        _tmp.clear();
+      if (!node->entries().findAllMultiples(extMonomial, output, _conf))
         break;
-      }
 next:
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
   template<class EO>
-  void PackedKDTree<C>::forAll(EO& output) {
-    MATHIC_ASSERT(_tmp.empty());
+  void PackedKDTree<C>::forAll(EO& output) const {
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
     while (true) {
-      if (!node->entries().forAll(output)) {
-        _tmp.clear();
+      if (!node->entries().forAll(output))
         break;
-      }
       for (typename Node::iterator it = node->childBegin();
         it != node->childEnd(); ++it)
-        _tmp.push_back(it->node);
-      if (_tmp.empty())
+        stack.push_back(it->node);
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
   void PackedKDTree<C>::clear() {
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     // Call Entry destructors
     if (_root != 0)
-      _tmp.push_back(_root);
-    while (!_tmp.empty()) {
-      Node* node = _tmp.back();
-      _tmp.pop_back();
+      stack.push_back(_root);
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
       node->entries().clear(); // calls destructors
       for (typename Node::iterator it = node->childBegin();
         it != node->childEnd(); ++it)
-        _tmp.push_back(it->node);
+        stack.push_back(it->node);
     }
     _arena.freeAllAllocs();
+    for (size_t i = 0; i < _buildArenas.size(); ++i)
+      _buildArenas[i]->freeAllAllocs();
+    std::vector<char>().swap(_layout);
+    _pool.clear();
     _root = 0;
+    _rootSize = 0;
+    _rootBuiltSize = 0;
+  }
+
+  template<class C>
+  void PackedKDTree<C>::compact() {
+    if (_root == 0) {
+      clear();
+      return;
+    }
+
+    // Both passes visit the nodes in the same order, so the offsets from
+    // the first pass are where the second pass puts the nodes.
+    std::vector<size_t> offsets;
+    size_t layoutSize = 0;
+    NodeStack<Node*> stack;
+    stack.push_back(_root);
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
+      const size_t align = alignof(Node);
+      layoutSize = (layoutSize + align - 1) / align * align;
+      offsets.push_back(layoutSize);
+      layoutSize += Node::sizeOf(node->childCount());
+      for (typename Node::iterator it = node->childEnd();
+        it != node->childBegin();)
+        stack.push_back((--it)->node);
+    }
+    std::vector<char> layout(layoutSize);
+
+    // the child that points to a node, or null for the root.
+    typedef std::pair<Node*, typename Node::Child*> Todo;
+    NodeStack<Todo> todo;
+    todo.push_back(Todo(_root, 0));
+    for (size_t i = 0; !todo.empty(); ++i) {
+      Node* node = todo.back().first;
+      typename Node::Child* fromParent = todo.back().second;
+      todo.pop_back();
+      MATHIC_ASSERT(i < offsets.size());
+      Node* copy = Node::makeCopy(*node, &layout[offsets[i]], _arena, _conf);
+      node->entries().clear(); // calls destructors
+      if (fromParent == 0)
+        _root = copy;
+      else
+        fromParent->node = copy;
+      // the children of copy still point to the old nodes.
+      for (typename Node::iterator it = copy->childEnd();
+        it != copy->childBegin();) {
+        --it;
+        todo.push_back(Todo(it->node, &*it));
+      }
+    }
+
+    _arena.freeAllAllocs();
+    for (size_t i = 0; i < _buildArenas.size(); ++i)
+      _buildArenas[i]->freeAllAllocs();
+    _layout.swap(layout); // the old layout is freed when layout goes
+    _pool.clear();
+    MATHIC_ASSERT(debugIsValid());
   }
 
   template<class C>
   size_t PackedKDTree<C>::getMemoryUse() const {
-    // todo: not accurate
-	size_t sum = _arena.getMemoryUse();
-	sum += _tmp.capacity() * sizeof(_tmp.front());
-	return sum;
+    size_t sum = _arena.getMemoryUse() + _layout.capacity();
+    for (size_t i = 0; i < _buildArenas.size(); ++i)
+      sum += _buildArenas[i]->getMemoryUse();
+    sum += _querySample.getMemoryUse();
+    return sum;
   }
 
   template<class C>
   void PackedKDTree<C>::print(std::ostream& out) const {
     out << "<<<<<<<< PackedKDTree >>>>>>>>\n";
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     if (_root == 0)
       return;
     Node* node = _root;
@@ -555,7 +1222,7 @@ next:
       out << "**** Node " << node << "\nchildren:\n";
       for (typename Node::iterator it = node->childBegin();
         it != node->childEnd(); ++it) {
-        _tmp.push_back(it->node);
+        stack.push_back(it->node);
         out << "Child " << ((it - node->childBegin()) + 1) << ": "
           << '>' << (it->var + 1) << '^' << it->exponent
           << ' ' << it->node << '\n';
@@ -565,12 +1232,11 @@ next:
           << node->entries().begin()[i].get() << '\n';
       }
       out << '\n';
-      if (_tmp.empty())
+      if (stack.empty())
         break;
-      node = _tmp.back();
-      _tmp.pop_back();
+      node = stack.back();
+      stack.pop_back();
     }
-    MATHIC_ASSERT(_tmp.empty());
   }
 
   template<class C>
@@ -579,7 +1245,6 @@ next:
     return true;
 #else
     //print(std::cerr); std::cerr << std::flush;
-    MATHIC_ASSERT(_tmp.empty());
     MATHIC_ASSERT(!_conf.getDoAutomaticRebuilds() || _conf.getRebuildRatio() > 0);
     if (_root == 0)
       return true;
@@ -600,30 +1265,35 @@ next:
     }
 
     // check the recorded nodes
-    MATHIC_ASSERT(_tmp.empty());
+    NodeStack<Node*> stack;
     for (size_t i = 0; i < nodes.size(); ++i) {
       Node* ancestor = nodes[i];
 
       for (typename Node::iterator ancestorIt = ancestor->childBegin();
         ancestorIt != ancestor->childEnd(); ++ancestorIt) {
-        MATHIC_ASSERT(_tmp.empty());
+        MATHIC_ASSERT(stack.empty());
         size_t var = ancestorIt->var;
         Exponent exp = ancestorIt->exponent;
+        MATHIC_ASSERT(ancestorIt->builtSize <= ancestorIt->size);
+        size_t entryCount = 0;
         // check strictly greater than subtree
-        _tmp.push_back(ancestorIt->node);
-        while (!_tmp.empty()) {
-          Node* node = _tmp.back();
-          _tmp.pop_back();
+        stack.push_back(ancestorIt->node);
+        while (!stack.empty()) {
+          Node* node = stack.back();
+          stack.pop_back();
           for (typename Node::iterator it = node->childBegin();
             it != node->childEnd(); ++it) {
             MATHIC_ASSERT(!C::UseTreeDivMask || ancestorIt->canDivide(*it));
-            _tmp.push_back(it->node);
+            stack.push_back(it->node);
           }
           MATHIC_ASSERT(node->entries().
             allStrictlyGreaterThan(var, exp, _conf));
           MATHIC_ASSERT(!C::UseTreeDivMask ||
             ancestorIt->canDivide(node->entries()));
+          entryCount += node->entries().size();
         }
+        // removals are not counted in the size
+        MATHIC_ASSERT(entryCount <= ancestorIt->size);
         // check less than or equal to sub tree.
         MATHIC_ASSERT(ancestor->entries().
           allLessThanOrEqualTo(var, exp, _conf));
@@ -631,15 +1301,15 @@ next:
         typename Node::iterator restIt = ancestorIt;
         for (++restIt; restIt != ancestor->childEnd(); ++restIt) {
           MATHIC_ASSERT(!C::UseTreeDivMask || ancestorIt->canDivide(*restIt));
-          _tmp.push_back(restIt->node);
+          stack.push_back(restIt->node);
         }
-        while (!_tmp.empty()) {
-          Node* node = _tmp.back();
-          _tmp.pop_back();
+        while (!stack.empty()) {
+          Node* node = stack.back();
+          stack.pop_back();
           for (typename Node::iterator it = node->childBegin();
             it != node->childEnd(); ++it) {
             MATHIC_ASSERT(!C::UseTreeDivMask || ancestorIt->canDivide(*it));
-            _tmp.push_back(it->node);
+            stack.push_back(it->node);
           }
           MATHIC_ASSERT(node->entries().
             allLessThanOrEqualTo(var, exp, _conf));
@@ -673,7 +1343,9 @@ next:
     const ExtEntry& extEntry,
     Child* childFromParent,
     memt::Arena& arena,
-    const C& conf
+    KDNodePool& pool,
+    const C& conf,
+    const KDQuerySample<C>& queries
   ) {
     MATHIC_ASSERT(conf.getVarCount() > 0);
     MATHIC_ASSERT(entries().size() > 0);
@@ -693,10 +1365,10 @@ next:
 
     typename KDEntryArray<C, ExtEntry>::iterator middle =
       KDEntryArray<C, ExtEntry>::split
-      (entries().begin(), entries().end(), var, exp, conf, &extEntry);
+      (entries().begin(), entries().end(), var, exp, conf, &extEntry, &queries);
 
     // ** copy relevant part of *this into new space
-    Node* copied = makeNode(entries().begin(), middle, arena, conf,
+    Node* copied = makeNode(entries().begin(), middle, arena, &pool, conf,
       std::distance(childBegin(), childEnd()) + 1);
     std::copy(childBegin(), childEnd(), copied->childBegin());
     Child& newChild = *(copied->childEnd() - 1);
@@ -719,6 +1391,7 @@ next:
       entries().pop_back();
     if (conf.getSortOnInsert())
       std::sort(entries().begin(), entries().end(), Comparer<C>(conf));
+    entries().updateMaskArray(conf);
     if (C::UseTreeDivMask)
       entries().recalculateTreeDivMask();
     _childrenEnd = childBegin();
@@ -727,6 +1400,8 @@ next:
       entries().insert(extEntry, conf);
     else
       copied->entries().insert(extEntry, conf);
+    newChild.size = entries().size();
+    newChild.builtSize = newChild.size;
 
     MATHIC_ASSERT(debugIsValid());
     MATHIC_ASSERT(copied->debugIsValid());
@@ -11,6 +11,7 @@
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
+#include <memory>
 
 namespace mathic {
   // A priority queue of integer pairs (col, row) with custom
@@ -225,6 +226,43 @@ namespace mathic {
 	template<class Iter>
 	void addColumnDescending(Iter rowsBegin, Iter rowsEnd);
 
+	// The rows of a column that have been sorted by prepareColumn so
+	// that the column can be added by addPreparedColumn.
+	class PreparedColumn {
+	public:
+	  PreparedColumn(): mColumnIndex(0) {}
+
+	  Index columnIndex() const {return mColumnIndex;}
+	  size_t size() const {return mRows.size();}
+
+	private:
+	  friend class PairQueue<C>;
+	  Index mColumnIndex;
+	  std::vector<Index> mRows; // weakly descending
+	};
+
+	// Sorts the rows [rowsBegin, rowsEnd) of column col into
+	// prepared in weakly descending order according to the custom
+	// sorting function, leaving out retired rows. This does not add
+	// the column - call addPreparedColumn for that. col can be larger
+	// than columnCount(), so several columns can be prepared ahead of
+	// being added.
+	//
+	// This is the expensive part of adding a column as it computes
+	// the PairData of every row. Any number of threads can call
+	// prepareColumn at the same time as long as no other method is
+	// called meanwhile, so the configuration's computePairData and
+	// compare must also be safe to call concurrently for this.
+	template<class Iter>
+	void prepareColumn
+	(size_t col, Iter rowsBegin, Iter rowsEnd, PreparedColumn& prepared);
+
+	// Adds the column that prepareColumn put into prepared. Columns
+	// must be added in order, so prepared.columnIndex() must be
+	// columnCount(). This computes only a single PairData. prepared
+	// is left empty.
+	void addPreparedColumn(PreparedColumn& prepared);
+
     // Returns the maximal pair according to the custom ordering on
 	// pairs.
 	std::pair<size_t, size_t> topPair() const;
@@ -235,6 +273,13 @@ namespace mathic {
 	// Removes topPair() from the data structure.
 	void pop();
 
+	// Pops up to maxCount pairs and assigns them to *out as
+	// std::pair<size_t, size_t> in the order that topPair() would have
+	// returned them, incrementing out after each one. Returns the
+	// number of pairs popped.
+	template<class Out>
+	size_t popBatch(size_t maxCount, Out out);
+
 	// Returns how many bytes of memory this data structure consumes
 	// not including sizeof(*this).
 	size_t getMemoryUse() const;
@@ -325,6 +370,34 @@ namespace mathic {
 	  };
 	};
 
+	// Orders the positions of rows by their pairs in descending order.
+	class DescendingRows {
+	public:
+	  DescendingRows(C& conf, Index col,
+					 const Index* rows, const PairData* pds):
+		mConf(conf), mCol(col), mRows(rows), mPds(pds) {}
+
+	  bool operator()(size_t a, size_t b) const {
+		// a goes first if b < a
+		return mConf.cmpLessThan(mConf.compare
+		  (mCol, mRows[b], mPds[b], mCol, mRows[a], mPds[a]));
+	  }
+
+	private:
+	  C& mConf;
+	  Index mCol;
+	  const Index* mRows;
+	  const PairData* mPds;
+	};
+
+	class RetiredRow {
+	public:
+	  RetiredRow(const PairQueue<C>& pq): mPq(pq) {}
+	  bool operator()(Index row) const {return mPq.retired(row);}
+	private:
+	  const PairQueue<C>& mPq;
+	};
+
 	class ColumnSizeSummer {
 	public:
 	  ColumnSizeSummer(): mSizeSum(0) {}
@@ -576,6 +649,88 @@ namespace mathic {
 	}
   }
 
+  template<class C>
+  template<class Iter>
+  void PairQueue<C>::prepareColumn
+  (size_t const col,
+   Iter const rowsBegin, Iter const rowsEnd,
+   PreparedColumn& prepared) {
+	if (col >= std::numeric_limits<Index>::max())
+	  throw std::overflow_error("Too large column index in PairQueue.");
+	Index const colIndex = static_cast<Index>(col);
+	prepared.mColumnIndex = colIndex;
+	prepared.mRows.clear();
+
+	std::vector<Index> rows;
+	for (Iter it = rowsBegin; it != rowsEnd; ++it) {
+	  MATHIC_ASSERT(*it < col);
+	  if (!SupportRetirement || *it >= columnCount() || !retired(*it))
+		rows.push_back(static_cast<Index>(*it));
+	}
+	size_t const rowCount = rows.size();
+	if (rowCount < 2) {
+	  prepared.mRows.swap(rows);
+	  return;
+	}
+
+	// compute the PairData of each row once and sort according to those
+	std::allocator<PairData> allocator;
+	PairData* const pds = allocator.allocate(rowCount);
+	size_t constructed = 0;
+	try {
+	  for (; constructed < rowCount; ++constructed) {
+		PairQueueNamespace::constructPairData
+		  (pds + constructed, colIndex, rows[constructed], mConf);
+	  }
+	  std::vector<size_t> order(rowCount);
+	  for (size_t i = 0; i < rowCount; ++i)
+		order[i] = i;
+	  std::sort(order.begin(), order.end(),
+				DescendingRows(mConf, colIndex, &rows.front(), pds));
+	  prepared.mRows.resize(rowCount);
+	  for (size_t i = 0; i < rowCount; ++i)
+		prepared.mRows[i] = rows[order[i]];
+	} catch (...) {
+	  prepared.mRows.clear();
+	  for (size_t i = 0; i < constructed; ++i)
+		PairQueueNamespace::destructPairData(pds + i, colIndex, rows[i], mConf);
+	  allocator.deallocate(pds, rowCount);
+	  throw;
+	}
+	for (size_t i = 0; i < rowCount; ++i)
+	  PairQueueNamespace::destructPairData(pds + i, colIndex, rows[i], mConf);
+	allocator.deallocate(pds, rowCount);
+  }
+
+  template<class C>
+  void PairQueue<C>::addPreparedColumn(PreparedColumn& prepared) {
+	if (prepared.columnIndex() != columnCount()) {
+	  throw std::logic_error
+		("Prepared column added out of order to PairQueue.");
+	}
+	std::vector<Index>& rows = prepared.mRows;
+	if (SupportRetirement) {
+	  // rows can have been retired since the column was prepared
+	  rows.erase(std::remove_if(rows.begin(), rows.end(), RetiredRow(*this)),
+				 rows.end());
+	}
+	Index const* const begin = rows.empty() ? 0 : &rows.front();
+	addColumnDescending(begin, begin + rows.size());
+	rows.clear();
+  }
+
+  template<class C>
+  template<class Out>
+  size_t PairQueue<C>::popBatch(size_t const maxCount, Out out) {
+	size_t count = 0;
+	for (; count < maxCount && !empty(); ++count) {
+	  *out = topPair();
+	  ++out;
+	  pop();
+	}
+	return count;
+  }
+
   template<class C>
   void PairQueue<C>::pop() {
 	MATHIC_ASSERT(!empty());
@@ -0,0 +1,430 @@
+#ifndef MATHIC_PAIRING_HEAP_GUARD
+#define MATHIC_PAIRING_HEAP_GUARD
+
+#include "stdinc.h"
+#include <vector>
+#include <ostream>
+#include <string>
+
+namespace mathic {
+  /** A pairing heap priority queue. Its advantage over Heap and TourTree
+      is that two pairing heaps can be melded in constant time, which
+      makes it a good choice when partial results computed separately
+      are combined many times.
+
+  Configuration serves the same role as for Geobucket. It must have these
+  fields that work as for Geobucket.
+
+  * A type Entry
+  * A type CompareResult
+  * A const or static method: CompareResult compare(Entry, Entry)
+  * A const or static method: bool cmpLessThan(CompareResult)
+  * A static const bool supportDeduplication
+  * A static or const method: bool cmpEqual(CompareResult)
+  * A static or const method: Entry deduplicate(Entry a, Entry b)
+
+  Deduplication happens when two equal entries are compared as the roots
+  of two trees that are linked, so equal entries can still be popped one
+  at a time.
+
+  Each entry is stored in a node that is allocated from blocks owned by
+  the heap. A meld takes over the blocks and the free nodes of the other
+  heap instead of copying its nodes.
+  */
+  template<class C>
+  class PairingHeap {
+  public:
+    typedef C Configuration;
+    typedef typename Configuration::Entry Entry;
+
+    PairingHeap(const Configuration& configuration);
+    ~PairingHeap();
+
+    Configuration& getConfiguration() {return _conf;}
+    const Configuration& getConfiguration() const {return _conf;}
+
+    template<class T>
+    void forAll(T& t) const {
+      if (_root == 0)
+        return;
+      std::vector<const Node*> pending(1, _root);
+      while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        if (!t.proceed(node->entry))
+          return;
+        for (const Node* child = node->child; child != 0;
+          child = child->sibling)
+          pending.push_back(child);
+      }
+    }
+
+    std::string getName() const;
+    void push(Entry entry);
+
+    template<class It>
+    void push(It begin, It end);
+
+    // Moves all entries of heap into this heap in constant time, leaving
+    // heap empty.
+    void meld(PairingHeap& heap);
+
+    void clear();
+    Entry pop();
+    Entry top() const {
+      MATHIC_ASSERT(!empty());
+      return _root->entry;
+    }
+
+    // Pops up to maxCount entries and assigns them to *out in the order
+    // that pop() would have returned them, incrementing out after each.
+    // Returns the number of entries popped.
+    template<class Out>
+    size_t popBatch(Out out, size_t maxCount);
+
+    // Pops top() and every following entry that is equal to it and
+    // assigns them to *out, incrementing out after each. Must not be
+    // called when empty. Returns the number of entries popped.
+    template<class Out>
+    size_t popWhileEqual(Out out);
+
+    bool empty() const {return _root == 0;}
+    size_t size() const {return _size;}
+
+    void print(std::ostream& out) const;
+
+    void decreaseTop(Entry newEntry);
+
+    size_t getMemoryUse() const;
+
+  private:
+    PairingHeap(const PairingHeap&); // unavailable
+    void operator=(const PairingHeap&); // unavailable
+
+    struct Node {
+      Entry entry;
+      Node* child; // the first child
+      Node* sibling; // the next sibling, or the next free node
+    };
+    struct Block {
+      Node* nodes;
+      size_t size;
+    };
+
+    Node* newNode(const Entry& entry);
+    void deleteNode(Node* node);
+
+    // Makes the root with the smaller entry the first child of the other
+    // root and returns the root that remains. a and b must be roots
+    // without siblings.
+    Node* link(Node* a, Node* b);
+
+    // Links a list of sibling trees into one tree by the two-pass
+    // pairing method and returns its root.
+    Node* linkSiblings(Node* first);
+
+    void freeBlocks();
+
+    /// Asserts internal invariants if asserts are turned on.
+    bool isValid() const;
+
+    Node* _root;
+    size_t _size;
+    Node* _free; // the free nodes linked through sibling
+    Node* _freeTail; // the last free node, so free lists can be spliced
+    std::vector<Block> _blocks;
+    size_t _nodeCount; // the number of nodes in _blocks
+    Configuration _conf;
+  };
+
+  template<class C>
+  PairingHeap<C>::PairingHeap(const Configuration& configuration):
+    _root(0),
+    _size(0),
+    _free(0),
+    _freeTail(0),
+    _nodeCount(0),
+    _conf(configuration) {
+  }
+
+  template<class C>
+  PairingHeap<C>::~PairingHeap() {
+    MATHIC_ASSERT(isValid());
+    freeBlocks();
+  }
+
+  template<class C>
+  size_t PairingHeap<C>::getMemoryUse() const {
+    return _nodeCount * sizeof(Node) + _blocks.capacity() * sizeof(Block);
+  }
+
+  template<class C>
+  std::string PairingHeap<C>::getName() const {
+    return std::string("pairing heap") +
+      (C::supportDeduplication ? " dedup" : "");
+  }
+
+  template<class C>
+  void PairingHeap<C>::push(Entry entry) {
+    Node* node = newNode(entry);
+    ++_size;
+    _root = _root == 0 ? node : link(_root, node);
+    MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  template<class It>
+  void PairingHeap<C>::push(It begin, It end) {
+    for (; begin != end; ++begin)
+      push(*begin);
+  }
+
+  template<class C>
+  void PairingHeap<C>::meld(PairingHeap& heap) {
+    MATHIC_ASSERT(&heap != this);
+    _blocks.insert(_blocks.end(), heap._blocks.begin(), heap._blocks.end());
+    _nodeCount += heap._nodeCount;
+    if (heap._free != 0) {
+      heap._freeTail->sibling = _free;
+      if (_free == 0)
+        _freeTail = heap._freeTail;
+      _free = heap._free;
+    }
+    if (heap._root != 0) {
+      _size += heap._size;
+      _root = _root == 0 ? heap._root : link(_root, heap._root);
+    }
+
+    heap._blocks.clear();
+    heap._nodeCount = 0;
+    heap._free = 0;
+    heap._freeTail = 0;
+    heap._root = 0;
+    heap._size = 0;
+    MATHIC_SLOW_ASSERT(isValid());
+    MATHIC_SLOW_ASSERT(heap.isValid());
+  }
+
+  template<class C>
+  void PairingHeap<C>::clear() {
+    MATHIC_ASSERT(isValid());
+    // the nodes are not put on the free list one at a time since it is
+    // just as fast to allocate them again from new blocks.
+    freeBlocks();
+    _root = 0;
+    _size = 0;
+    MATHIC_ASSERT(isValid());
+  }
+
+  template<class C>
+  typename PairingHeap<C>::Entry PairingHeap<C>::pop() {
+    MATHIC_ASSERT(!empty());
+    Node* oldRoot = _root;
+    const Entry top = oldRoot->entry;
+    _root = oldRoot->child == 0 ? 0 : linkSiblings(oldRoot->child);
+    deleteNode(oldRoot);
+    --_size;
+    MATHIC_SLOW_ASSERT(isValid());
+    return top;
+  }
+
+  template<class C>
+  void PairingHeap<C>::decreaseTop(Entry newEntry) {
+    MATHIC_ASSERT(!empty());
+    Node* oldRoot = _root;
+    Node* children = oldRoot->child;
+    oldRoot->entry = newEntry;
+    oldRoot->child = 0;
+    _root = children == 0 ? oldRoot : link(linkSiblings(children), oldRoot);
+    MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  template<class Out>
+  size_t PairingHeap<C>::popBatch(Out out, size_t maxCount) {
+    size_t popped = 0;
+    for (; popped < maxCount && !empty(); ++popped) {
+      *out = pop();
+      ++out;
+    }
+    return popped;
+  }
+
+  template<class C>
+  template<class Out>
+  size_t PairingHeap<C>::popWhileEqual(Out out) {
+    MATHIC_ASSERT(!empty());
+    const Entry first = pop();
+    *out = first;
+    ++out;
+    size_t popped = 1;
+    // entries are at most first, so they are equal if not less
+    for (; !empty() && !_conf.cmpLessThan(_conf.compare(top(), first));
+      ++popped) {
+      *out = pop();
+      ++out;
+    }
+    return popped;
+  }
+
+  template<class C>
+  void PairingHeap<C>::print(std::ostream& out) const {
+    out << getName() << ": {";
+    if (_root != 0) {
+      std::vector<std::pair<const Node*, size_t> > pending;
+      pending.push_back(std::make_pair(_root, 0));
+      while (!pending.empty()) {
+        const Node* node = pending.back().first;
+        const size_t depth = pending.back().second;
+        pending.pop_back();
+        out << '\n' << std::string(2 * depth + 1, ' ') << node->entry;
+        if (node->sibling != 0 && depth > 0)
+          pending.push_back(std::make_pair(node->sibling, depth));
+        if (node->child != 0)
+          pending.push_back(std::make_pair(node->child, depth + 1));
+      }
+    }
+    out << "}\n";
+  }
+
+  template<class C>
+  typename PairingHeap<C>::Node* PairingHeap<C>::newNode(const Entry& entry) {
+    if (_free == 0) {
+      // blocks double in size so there are few of them to meld.
+      const size_t blockSize = _nodeCount < 32 ? 32 : _nodeCount;
+      Block block = {new Node[blockSize], blockSize};
+      _blocks.push_back(block);
+      _nodeCount += blockSize;
+      for (size_t i = 0; i + 1 < blockSize; ++i)
+        block.nodes[i].sibling = &block.nodes[i + 1];
+      block.nodes[blockSize - 1].sibling = 0;
+      _free = block.nodes;
+      _freeTail = &block.nodes[blockSize - 1];
+    }
+    Node* node = _free;
+    _free = node->sibling;
+    if (_free == 0)
+      _freeTail = 0;
+    node->entry = entry;
+    node->child = 0;
+    node->sibling = 0;
+    return node;
+  }
+
+  template<class C>
+  void PairingHeap<C>::deleteNode(Node* node) {
+    node->sibling = _free;
+    if (_free == 0)
+      _freeTail = node;
+    _free = node;
+  }
+
+  template<class C>
+  typename PairingHeap<C>::Node* PairingHeap<C>::link(Node* a, Node* b) {
+    MATHIC_ASSERT(a != 0 && a->sibling == 0);
+    MATHIC_ASSERT(b != 0 && b->sibling == 0);
+    typename C::CompareResult cmp = _conf.compare(a->entry, b->entry);
+    if (C::supportDeduplication && _conf.cmpEqual(cmp)) {
+      a->entry = _conf.deduplicate(a->entry, b->entry);
+      // the children of b become the first children of a.
+      if (b->child != 0) {
+        Node* last = b->child;
+        while (last->sibling != 0)
+          last = last->sibling;
+        last->sibling = a->child;
+        a->child = b->child;
+      }
+      deleteNode(b);
+      --_size;
+      return a;
+    }
+    if (_conf.cmpLessThan(cmp))
+      std::swap(a, b);
+    b->sibling = a->child;
+    a->child = b;
+    return a;
+  }
+
+  template<class C>
+  typename PairingHeap<C>::Node* PairingHeap<C>::linkSiblings(Node* first) {
+    MATHIC_ASSERT(first != 0);
+    // first pass: link the trees in pairs from left to right and put the
+    // results on a list in reverse order.
+    Node* pairs = 0;
+    while (first != 0) {
+      Node* a = first;
+      Node* b = a->sibling;
+      if (b == 0) {
+        a->sibling = pairs;
+        pairs = a;
+        break;
+      }
+      first = b->sibling;
+      a->sibling = 0;
+      b->sibling = 0;
+      Node* linked = link(a, b);
+      linked->sibling = pairs;
+      pairs = linked;
+    }
+
+    // second pass: link each pair into the accumulated tree from right
+    // to left.
+    Node* root = pairs;
+    pairs = pairs->sibling;
+    root->sibling = 0;
+    while (pairs != 0) {
+      Node* next = pairs->sibling;
+      pairs->sibling = 0;
+      root = link(root, pairs);
+      pairs = next;
+    }
+    return root;
+  }
+
+  template<class C>
+  void PairingHeap<C>::freeBlocks() {
+    for (size_t i = 0; i < _blocks.size(); ++i)
+      delete[] _blocks[i].nodes;
+    _blocks.clear();
+    _nodeCount = 0;
+    _free = 0;
+    _freeTail = 0;
+  }
+
+  template<class C>
+  bool PairingHeap<C>::isValid() const {
+#ifndef MATHIC_DEBUG
+    return true;
+#else
+    MATHIC_ASSERT((_root == 0) == (_size == 0));
+    MATHIC_ASSERT((_free == 0) == (_freeTail == 0));
+    MATHIC_ASSERT(_freeTail == 0 || _freeTail->sibling == 0);
+    size_t blockNodes = 0;
+    for (size_t i = 0; i < _blocks.size(); ++i)
+      blockNodes += _blocks[i].size;
+    MATHIC_ASSERT(blockNodes == _nodeCount);
+    if (_root == 0)
+      return true;
+    MATHIC_ASSERT(_root->sibling == 0);
+
+    size_t count = 0;
+    std::vector<const Node*> pending(1, _root);
+    while (!pending.empty()) {
+      const Node* node = pending.back();
+      pending.pop_back();
+      ++count;
+      for (const Node* child = node->child; child != 0;
+        child = child->sibling) {
+        MATHIC_ASSERT(!_conf.cmpLessThan
+          (_conf.compare(node->entry, child->entry)));
+        pending.push_back(child);
+      }
+    }
+    MATHIC_ASSERT(count == _size);
+    MATHIC_ASSERT(count <= _nodeCount);
+    return true;
+#endif
+  }
+}
+
+#endif
@@ -0,0 +1,396 @@
+#ifndef MATHIC_RADIX_HEAP_GUARD
+#define MATHIC_RADIX_HEAP_GUARD
+
+#include "stdinc.h"
+#include <vector>
+#include <ostream>
+#include <string>
+#include <limits>
+#include <type_traits>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace mathic {
+  namespace RadixHeapInternal {
+    typedef unsigned long long Word;
+
+    /** Returns the number of bits needed to write w, so 0 for 0. */
+    inline size_t bitLength(Word w) {
+      if (w == 0)
+        return 0;
+#if defined(__GNUC__)
+      return 64 - __builtin_clzll(w);
+#elif defined(_MSC_VER) && defined(_M_X64)
+      unsigned long index;
+      _BitScanReverse64(&index, w);
+      return index + 1;
+#else
+      size_t length = 0;
+      for (; w != 0; w >>= 1)
+        ++length;
+      return length;
+#endif
+    }
+
+    /** Returns the index of the lowest set bit of w, which must not
+        be 0. */
+    inline size_t lowestBit(Word w) {
+      MATHIC_ASSERT(w != 0);
+#if defined(__GNUC__)
+      return __builtin_ctzll(w);
+#elif defined(_MSC_VER) && defined(_M_X64)
+      unsigned long index;
+      _BitScanForward64(&index, w);
+      return index;
+#else
+      size_t index = 0;
+      for (; (w & 1) == 0; w >>= 1)
+        ++index;
+      return index;
+#endif
+    }
+  }
+
+  /** A radix heap priority queue for entries that are ordered by an
+      unsigned integer key. It does not compare entries. Instead it keeps
+      a bound that no key exceeds, which is the most recently popped key
+      if keys are monotone, and puts each entry in the bucket given by
+      the highest bit where its key differs from the bound. The top
+      entries are then the ones in bucket 0. When bucket 0 runs empty,
+      the lowest non-empty bucket is split up by its greatest key, which
+      becomes the new bound. Each split moves an entry to a lower bucket,
+      so an entry is moved at most once for each bit of the key.
+
+      This is fastest when pushed keys are never greater than the last
+      popped key, as is the case in Dijkstra-like searches and for
+      multiplication of a popped term by terms that are not greater than
+      1 in a monomial order. A key above the bound is still handled
+      correctly. The bound is then raised to that key, which merges all
+      buckets below the highest bit where the key and the old bound
+      differ, so those entries can move up again.
+
+  Configuration serves the same role as for Geobucket, except that
+  entries are ordered by their keys instead of by compare. It must have
+  these fields.
+
+  * A type Entry
+  * An unsigned integral type Key
+  * A const or static method: Key getKey(Entry)
+  * A static const bool supportDeduplication, which must be false
+
+  Entries with the same key are equal. The order between them is not
+  specified.
+  */
+  template<class C>
+  class RadixHeap {
+  public:
+    typedef C Configuration;
+    typedef typename Configuration::Entry Entry;
+    typedef typename Configuration::Key Key;
+
+    RadixHeap(const Configuration& configuration);
+
+    Configuration& getConfiguration() {return _conf;}
+    const Configuration& getConfiguration() const {return _conf;}
+
+    template<class T>
+    void forAll(T& t) const {
+      for (size_t b = 0; b < BucketCount; ++b) {
+        const std::vector<Entry>& bucket = _buckets[b];
+        for (size_t i = 0; i < bucket.size(); ++i)
+          if (!t.proceed(bucket[i]))
+            return;
+      }
+    }
+
+    std::string getName() const;
+    void push(Entry entry);
+
+    template<class It>
+    void push(It begin, It end);
+
+    void clear();
+    Entry pop();
+    Entry top() const {
+      MATHIC_ASSERT(!empty());
+      return _buckets[0].back();
+    }
+
+    // Pops up to maxCount entries and assigns them to *out in the order
+    // that pop() would have returned them, incrementing out after each.
+    // Returns the number of entries popped.
+    template<class Out>
+    size_t popBatch(Out out, size_t maxCount);
+
+    // Pops top() and every following entry that is equal to it and
+    // assigns them to *out, incrementing out after each. Must not be
+    // called when empty. Returns the number of entries popped.
+    template<class Out>
+    size_t popWhileEqual(Out out);
+
+    bool empty() const {return _size == 0;}
+    size_t size() const {return _size;}
+
+    void print(std::ostream& out) const;
+
+    void decreaseTop(Entry newEntry);
+
+    size_t getMemoryUse() const;
+
+  private:
+    typedef RadixHeapInternal::Word Word;
+    static const size_t KeyBits = std::numeric_limits<Key>::digits;
+    static const size_t BucketCount = KeyBits + 1;
+
+    static_assert(std::is_integral<Key>::value &&
+      !std::numeric_limits<Key>::is_signed,
+      "The Key of a RadixHeap must be an unsigned integral type.");
+    static_assert(KeyBits <= 64,
+      "The Key of a RadixHeap can have at most 64 bits.");
+    static_assert(!C::supportDeduplication,
+      "RadixHeap does not support deduplication.");
+
+    size_t bucketOf(Key key) const {
+      MATHIC_ASSERT(!(_bound < key));
+      return RadixHeapInternal::bitLength
+        (static_cast<Word>(_bound ^ key));
+    }
+
+    void insert(const Entry& entry, Key key) {
+      const size_t b = bucketOf(key);
+      _buckets[b].push_back(entry);
+      if (b != 0)
+        _nonEmpty |= Word(1) << (b - 1);
+    }
+
+    // Makes key the bound. key must be greater than the bound.
+    void raiseBound(Key key);
+
+    // Splits the lowest non-empty bucket so that bucket 0 is not empty,
+    // unless the heap is empty.
+    void refill();
+
+    /// Asserts internal invariants if asserts are turned on.
+    bool isValid() const;
+
+    Key _bound; // no key is greater
+    Word _nonEmpty; // bit b - 1 is set if bucket b > 0 is not empty
+    size_t _size;
+    std::vector<Entry> _buckets[BucketCount];
+    Configuration _conf;
+  };
+
+  template<class C>
+  RadixHeap<C>::RadixHeap(const Configuration& configuration):
+    _bound(0),
+    _nonEmpty(0),
+    _size(0),
+    _conf(configuration) {
+  }
+
+  template<class C>
+  size_t RadixHeap<C>::getMemoryUse() const {
+    size_t sum = 0;
+    for (size_t b = 0; b < BucketCount; ++b)
+      sum += _buckets[b].capacity() * sizeof(Entry);
+    return sum;
+  }
+
+  template<class C>
+  std::string RadixHeap<C>::getName() const {
+    return "radix heap";
+  }
+
+  template<class C>
+  void RadixHeap<C>::push(Entry entry) {
+    const Key key = _conf.getKey(entry);
+    if (empty())
+      _bound = key;
+    else if (_bound < key)
+      raiseBound(key);
+    insert(entry, key);
+    ++_size;
+    MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  template<class It>
+  void RadixHeap<C>::push(It begin, It end) {
+    for (; begin != end; ++begin)
+      push(*begin);
+  }
+
+  template<class C>
+  void RadixHeap<C>::clear() {
+    MATHIC_ASSERT(isValid());
+    for (size_t b = 0; b < BucketCount; ++b)
+      _buckets[b].clear();
+    _nonEmpty = 0;
+    _size = 0;
+    MATHIC_ASSERT(isValid());
+  }
+
+  template<class C>
+  typename RadixHeap<C>::Entry RadixHeap<C>::pop() {
+    MATHIC_ASSERT(!empty());
+    const Entry top = _buckets[0].back();
+    _buckets[0].pop_back();
+    --_size;
+    if (_buckets[0].empty())
+      refill();
+    MATHIC_SLOW_ASSERT(isValid());
+    return top;
+  }
+
+  template<class C>
+  void RadixHeap<C>::decreaseTop(Entry newEntry) {
+    MATHIC_ASSERT(!empty());
+    const Key key = _conf.getKey(newEntry);
+    MATHIC_ASSERT(!(_bound < key));
+    if (key == _bound) {
+      _buckets[0].back() = newEntry;
+      return;
+    }
+    _buckets[0].pop_back();
+    insert(newEntry, key);
+    if (_buckets[0].empty())
+      refill();
+    MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  template<class Out>
+  size_t RadixHeap<C>::popBatch(Out out, size_t maxCount) {
+    size_t popped = 0;
+    while (popped < maxCount && !empty()) {
+      // the entries of bucket 0 are the top entries and are all equal.
+      std::vector<Entry>& bucket = _buckets[0];
+      while (popped < maxCount && !bucket.empty()) {
+        *out = bucket.back();
+        ++out;
+        bucket.pop_back();
+        --_size;
+        ++popped;
+      }
+      if (bucket.empty())
+        refill();
+    }
+    MATHIC_SLOW_ASSERT(isValid());
+    return popped;
+  }
+
+  template<class C>
+  template<class Out>
+  size_t RadixHeap<C>::popWhileEqual(Out out) {
+    MATHIC_ASSERT(!empty());
+    std::vector<Entry>& bucket = _buckets[0];
+    const size_t popped = bucket.size();
+    while (!bucket.empty()) {
+      *out = bucket.back();
+      ++out;
+      bucket.pop_back();
+    }
+    _size -= popped;
+    refill();
+    MATHIC_SLOW_ASSERT(isValid());
+    return popped;
+  }
+
+  template<class C>
+  void RadixHeap<C>::raiseBound(Key key) {
+    MATHIC_ASSERT(_bound < key);
+    // Let h be the highest bit where key and the bound differ. It is set
+    // in key. An entry in bucket b > h + 1 agrees with the bound above
+    // bit b - 1, and so with key, so it stays put. Bucket h + 1 is empty
+    // since its entries would be greater than the bound. The rest move
+    // to bucket h + 1.
+    const size_t target = RadixHeapInternal::bitLength
+      (static_cast<Word>(_bound ^ key));
+    std::vector<Entry>& to = _buckets[target];
+    MATHIC_ASSERT(to.empty());
+    for (size_t b = 0; b < target; ++b) {
+      std::vector<Entry>& from = _buckets[b];
+      if (from.empty())
+        continue;
+      if (to.empty())
+        to.swap(from);
+      else {
+        to.insert(to.end(), from.begin(), from.end());
+        from.clear();
+      }
+    }
+    const Word belowTarget = (Word(1) << (target - 1)) - 1;
+    if (!to.empty())
+      _nonEmpty = (_nonEmpty & ~belowTarget) | (Word(1) << (target - 1));
+    _bound = key;
+  }
+
+  template<class C>
+  void RadixHeap<C>::refill() {
+    MATHIC_ASSERT(_buckets[0].empty());
+    if (_nonEmpty == 0) {
+      MATHIC_ASSERT(_size == 0);
+      return;
+    }
+    const size_t b = RadixHeapInternal::lowestBit(_nonEmpty) + 1;
+    std::vector<Entry> split;
+    split.swap(_buckets[b]);
+    _nonEmpty &= ~(Word(1) << (b - 1));
+
+    Key max = _conf.getKey(split.front());
+    for (size_t i = 1; i < split.size(); ++i) {
+      const Key key = _conf.getKey(split[i]);
+      if (max < key)
+        max = key;
+    }
+    // Every key of bucket b agrees with max above bit b - 1, so each
+    // goes to a bucket below b, and max goes to bucket 0.
+    _bound = max;
+    for (size_t i = 0; i < split.size(); ++i)
+      insert(split[i], _conf.getKey(split[i]));
+
+    // keep the capacity of the bucket to avoid reallocating it later.
+    split.clear();
+    _buckets[b].swap(split);
+    MATHIC_ASSERT(!_buckets[0].empty());
+  }
+
+  template<class C>
+  void RadixHeap<C>::print(std::ostream& out) const {
+    out << getName() << " with bound " << _bound << ":\n";
+    for (size_t b = 0; b < BucketCount; ++b) {
+      const std::vector<Entry>& bucket = _buckets[b];
+      if (bucket.empty())
+        continue;
+      out << " bucket " << b << ':';
+      for (size_t i = 0; i < bucket.size(); ++i)
+        out << ' ' << bucket[i];
+      out << '\n';
+    }
+  }
+
+  template<class C>
+  bool RadixHeap<C>::isValid() const {
+#ifndef MATHIC_DEBUG
+    return true;
+#else
+    size_t count = 0;
+    for (size_t b = 0; b < BucketCount; ++b) {
+      const std::vector<Entry>& bucket = _buckets[b];
+      if (b > 0) {
+        const bool marked = (_nonEmpty & (Word(1) << (b - 1))) != 0;
+        MATHIC_ASSERT(marked == !bucket.empty());
+      }
+      for (size_t i = 0; i < bucket.size(); ++i)
+        MATHIC_ASSERT(bucketOf(_conf.getKey(bucket[i])) == b);
+      count += bucket.size();
+    }
+    MATHIC_ASSERT(count == _size);
+    MATHIC_ASSERT(_buckets[0].empty() == empty());
+    return true;
+#endif
+  }
+}
+
+#endif
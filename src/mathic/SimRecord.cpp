@@ -0,0 +1,256 @@
+#include "SimRecord.h"
+
+#include "error.h"
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cmath>
+
+namespace mathic {
+  void SimRecord::addParameter
+  (const std::string& name, const std::string& value) {
+    _parameters.push_back(Parameter(name, value));
+  }
+
+  void SimRecord::addParameter
+  (const std::string& name, unsigned long long value) {
+    std::ostringstream out;
+    out << value;
+    addParameter(name, out.str());
+  }
+
+  void SimRecord::addMetric(const std::string& name, double value) {
+    _metrics.push_back(Metric(name, value));
+  }
+
+  const double* SimRecord::findMetric(const std::string& name) const {
+    for (size_t i = 0; i < _metrics.size(); ++i)
+      if (_metrics[i].first == name)
+        return &_metrics[i].second;
+    return 0;
+  }
+
+  std::string SimRecord::getKey() const {
+    std::string key = _name;
+    for (size_t i = 0; i < _parameters.size(); ++i)
+      key += " " + _parameters[i].first + '=' + _parameters[i].second;
+    return key;
+  }
+
+  namespace {
+    const char* const ParameterPrefix = "param.";
+    const char* const NameColumn = "name";
+
+    void addColumn(std::vector<std::string>& columns, const std::string& name) {
+      for (size_t i = 0; i < columns.size(); ++i)
+        if (columns[i] == name)
+          return;
+      columns.push_back(name);
+    }
+
+    void writeCsvField(std::ostream& out, const std::string& field) {
+      if (field.find_first_of(",\"\n\r") == std::string::npos) {
+        out << field;
+        return;
+      }
+      out << '"';
+      for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '"')
+          out << '"';
+        out << field[i];
+      }
+      out << '"';
+    }
+
+    /** Returns true if line is a header line. Those start with the name
+        column without quotes, while a record with that name is written
+        with quotes so that it is not mistaken for a header. */
+    bool isCsvHeader(const std::string& line) {
+      const size_t length = std::string(NameColumn).size();
+      return line.compare(0, length, NameColumn) == 0 &&
+        (line.size() == length || line[length] == ',' || line[length] == '\r');
+    }
+
+    /** Splits a line of CSV into its fields. */
+    void readCsvLine
+    (const std::string& line, std::vector<std::string>& fields) {
+      fields.clear();
+      fields.push_back(std::string());
+      bool quoted = false;
+      for (size_t i = 0; i < line.size(); ++i) {
+        const char c = line[i];
+        if (quoted) {
+          if (c != '"')
+            fields.back() += c;
+          else if (i + 1 < line.size() && line[i + 1] == '"')
+            fields.back() += line[++i];
+          else
+            quoted = false;
+        } else if (c == '"')
+          quoted = true;
+        else if (c == ',')
+          fields.push_back(std::string());
+        else if (c != '\r')
+          fields.back() += c;
+      }
+      if (quoted)
+        reportError("Unterminated quote in CSV line \"" + line + "\".");
+    }
+
+    void writeJsonString(std::ostream& out, const std::string& str) {
+      out << '"';
+      for (size_t i = 0; i < str.size(); ++i) {
+        const unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c == '"' || c == '\\')
+          out << '\\' << c;
+        else if (c == '\n')
+          out << "\\n";
+        else if (c < 0x20) {
+          const char* const hex = "0123456789abcdef";
+          out << "\\u00" << hex[c >> 4] << hex[c & 0xF];
+        } else
+          out << c;
+      }
+      out << '"';
+    }
+  }
+
+  void writeSimRecordsCsv
+  (std::ostream& out, const std::vector<SimRecord>& records) {
+    std::vector<std::string> parameters;
+    std::vector<std::string> metrics;
+    for (size_t r = 0; r < records.size(); ++r) {
+      for (size_t i = 0; i < records[r].getParameters().size(); ++i)
+        addColumn(parameters, records[r].getParameters()[i].first);
+      for (size_t i = 0; i < records[r].getMetrics().size(); ++i)
+        addColumn(metrics, records[r].getMetrics()[i].first);
+    }
+
+    out << NameColumn;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      out << ',';
+      writeCsvField(out, ParameterPrefix + parameters[i]);
+    }
+    for (size_t i = 0; i < metrics.size(); ++i) {
+      out << ',';
+      writeCsvField(out, metrics[i]);
+    }
+    out << '\n';
+
+    const std::streamsize oldPrecision = out.precision(15);
+    for (size_t r = 0; r < records.size(); ++r) {
+      const SimRecord& record = records[r];
+      if (record.getName() == NameColumn)
+        out << '"' << NameColumn << '"';
+      else
+        writeCsvField(out, record.getName());
+      for (size_t p = 0; p < parameters.size(); ++p) {
+        out << ',';
+        for (size_t i = 0; i < record.getParameters().size(); ++i)
+          if (record.getParameters()[i].first == parameters[p])
+            writeCsvField(out, record.getParameters()[i].second);
+      }
+      for (size_t m = 0; m < metrics.size(); ++m) {
+        out << ',';
+        const double* value = record.findMetric(metrics[m]);
+        if (value != 0)
+          out << *value;
+      }
+      out << '\n';
+    }
+    out.precision(oldPrecision);
+  }
+
+  void appendSimRecordsCsv
+  (const std::string& fileName, const std::vector<SimRecord>& records) {
+    std::ofstream out(fileName.c_str(), std::ios::out | std::ios::app);
+    if (!out)
+      reportError("Could not open file \"" + fileName + "\" for writing.");
+    writeSimRecordsCsv(out, records);
+    out.flush();
+    if (!out)
+      reportError("Could not write to file \"" + fileName + "\".");
+  }
+
+  std::vector<SimRecord> readSimRecordsCsv(const std::string& fileName) {
+    std::ifstream in(fileName.c_str());
+    if (!in)
+      reportError("Could not open file \"" + fileName + "\".");
+
+    std::vector<SimRecord> records;
+    std::vector<std::string> header;
+    std::vector<std::string> fields;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty() || line == "\r")
+        continue;
+      readCsvLine(line, fields);
+      if (isCsvHeader(line)) {
+        header.swap(fields);
+        continue;
+      }
+      if (header.empty())
+        reportError("CSV file \"" + fileName + "\" has no header line.");
+      if (fields.size() != header.size()) {
+        reportError("A line of CSV file \"" + fileName +
+          "\" does not have the same number of fields as its header.");
+      }
+
+      SimRecord record(fields.front());
+      const size_t prefixLength = std::string(ParameterPrefix).size();
+      for (size_t i = 1; i < fields.size(); ++i) {
+        if (header[i].compare(0, prefixLength, ParameterPrefix) == 0) {
+          if (!fields[i].empty())
+            record.addParameter(header[i].substr(prefixLength), fields[i]);
+          continue;
+        }
+        if (fields[i].empty())
+          continue;
+        char* end;
+        const double value = std::strtod(fields[i].c_str(), &end);
+        if (*end != '\0') {
+          reportError("Metric " + header[i] + " has the value \"" +
+            fields[i] + "\" in CSV file \"" + fileName +
+            "\", which is not a number.");
+        }
+        record.addMetric(header[i], value);
+      }
+      records.push_back(record);
+    }
+    return records;
+  }
+
+  void writeSimRecordsJson
+  (std::ostream& out, const std::vector<SimRecord>& records) {
+    const std::streamsize oldPrecision = out.precision(15);
+    out << '[';
+    for (size_t r = 0; r < records.size(); ++r) {
+      const SimRecord& record = records[r];
+      out << (r == 0 ? "\n" : ",\n") << "  {\"name\": ";
+      writeJsonString(out, record.getName());
+      out << ",\n   \"parameters\": {";
+      for (size_t i = 0; i < record.getParameters().size(); ++i) {
+        if (i > 0)
+          out << ", ";
+        writeJsonString(out, record.getParameters()[i].first);
+        out << ": ";
+        writeJsonString(out, record.getParameters()[i].second);
+      }
+      out << "},\n   \"metrics\": {";
+      for (size_t i = 0; i < record.getMetrics().size(); ++i) {
+        if (i > 0)
+          out << ", ";
+        writeJsonString(out, record.getMetrics()[i].first);
+        const double value = record.getMetrics()[i].second;
+        // JSON has no NaN or infinity.
+        if (std::isfinite(value))
+          out << ": " << value;
+        else
+          out << ": null";
+      }
+      out << "}}";
+    }
+    out << "\n]\n";
+    out.precision(oldPrecision);
+  }
+}
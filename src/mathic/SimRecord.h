@@ -0,0 +1,77 @@
+#ifndef MATHIC_SIM_RECORD_GUARD
+#define MATHIC_SIM_RECORD_GUARD
+
+#include "stdinc.h"
+#include <ostream>
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace mathic {
+  /** The outcome of running one configuration of a data structure in
+      pqsim or divsim. The parameters describe the configuration and the
+      simulation it was run on. The metrics are the measured amounts,
+      such as time, comparisons and memory, and for all of them lower is
+      better. Records can be written as CSV or JSON so that results can
+      be processed by other programs and compared across versions. */
+  class SimRecord {
+  public:
+    typedef std::pair<std::string, std::string> Parameter;
+    typedef std::pair<std::string, double> Metric;
+
+    SimRecord(const std::string& name = ""): _name(name) {}
+
+    const std::string& getName() const {return _name;}
+
+    void addParameter(const std::string& name, const std::string& value);
+    void addParameter(const std::string& name, unsigned long long value);
+    void addMetric(const std::string& name, double value);
+
+    const std::vector<Parameter>& getParameters() const {return _parameters;}
+    const std::vector<Metric>& getMetrics() const {return _metrics;}
+
+    /** Returns the value of the metric with the given name, or null if
+        the record has no such metric. */
+    const double* findMetric(const std::string& name) const;
+
+    /** Returns a string that identifies the configuration and
+        simulation of this record, so records with the same key are
+        repeated measurements of the same thing. */
+    std::string getKey() const;
+
+  private:
+    std::string _name;
+    std::vector<Parameter> _parameters;
+    std::vector<Metric> _metrics;
+  };
+
+  /** Writes records as CSV with a header line. The columns are name,
+      then a column param.X for each parameter X and then a column for
+      each metric. Records that lack a column leave it empty. Several
+      blocks of header and records can be concatenated into one file,
+      which is how samples from repeated runs are collected. A record
+      with the name "name" has its name written in quotes so that it is
+      not read as a header line. */
+  void writeSimRecordsCsv
+    (std::ostream& out, const std::vector<SimRecord>& records);
+
+  /** Appends records to the CSV file fileName as by writeSimRecordsCsv.
+      Reports an error through reportError if the file cannot be
+      written. */
+  void appendSimRecordsCsv
+    (const std::string& fileName, const std::vector<SimRecord>& records);
+
+  /** Reads all records from a CSV file as written by writeSimRecordsCsv.
+      Reports an error through reportError if the file cannot be read or
+      is not in the expected format. */
+  std::vector<SimRecord> readSimRecordsCsv(const std::string& fileName);
+
+  /** Writes records as a JSON array with one object for each record.
+      Each object has a string "name", an object "parameters" of strings
+      and an object "metrics" of numbers, where a metric that is NaN or
+      infinite is null since JSON has no number for those. */
+  void writeSimRecordsJson
+    (std::ostream& out, const std::vector<SimRecord>& records);
+}
+
+#endif
@@ -1,13 +1,30 @@
 #include "Timer.h"
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define MATHIC_HAS_CYCLE_COUNTER
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define MATHIC_HAS_CYCLE_COUNTER
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define MATHIC_HAS_CYCLE_COUNTER
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
 namespace mathic {
   unsigned long Timer::getMilliseconds() const {
-    const double floatSpan = clock() - _clocksAtReset;
-    const double floatMilliseconds = 1000 * (floatSpan / CLOCKS_PER_SEC);
-    unsigned long milliseconds = static_cast<unsigned long>(floatMilliseconds);
-    if (floatMilliseconds - milliseconds >= 0.5)
-      ++milliseconds;
-    return milliseconds;
+    const std::chrono::steady_clock::duration span =
+      std::chrono::steady_clock::now() - _atReset;
+    const long long microseconds =
+      std::chrono::duration_cast<std::chrono::microseconds>(span).count();
+    return static_cast<unsigned long>((microseconds + 500) / 1000);
   }
 
   void Timer::print(FILE* out) const {
@@ -48,4 +65,118 @@ namespace mathic {
     out << (milliseconds % 10);
     out << "s";
   }
+
+  namespace {
+#ifdef __linux__
+    /** Opens a counter of user space events of the calling thread. Returns
+        -1 if the counter is not available. */
+    int openCounter(unsigned long long config, int group) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config;
+      attr.disabled = group == -1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      return static_cast<int>
+        (syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+    }
+#endif
+  }
+
+  PerfTimer::PerfTimer(bool useCounters): _counterGroup(-1) {
+    for (size_t i = 0; i < CounterCount; ++i)
+      _counters[i] = -1;
+#ifdef __linux__
+    if (useCounters) {
+      const unsigned long long configs[CounterCount] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+      };
+      for (size_t i = 0; i < CounterCount; ++i) {
+        _counters[i] = openCounter(configs[i], _counters[0]);
+        if (_counters[i] == -1)
+          break;
+      }
+      if (_counters[CounterCount - 1] != -1)
+        _counterGroup = _counters[0];
+      else {
+        // use all of the counters or none of them.
+        for (size_t i = 0; i < CounterCount; ++i) {
+          if (_counters[i] != -1)
+            close(_counters[i]);
+          _counters[i] = -1;
+        }
+      }
+    }
+#endif
+    reset();
+  }
+
+  PerfTimer::~PerfTimer() {
+#ifdef __linux__
+    for (size_t i = 0; i < CounterCount; ++i)
+      if (_counters[i] != -1)
+        close(_counters[i]);
+#endif
+  }
+
+  void PerfTimer::reset() {
+#ifdef __linux__
+    if (_counterGroup != -1) {
+      ioctl(_counterGroup, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(_counterGroup, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+    _cyclesAtReset = readCycleCounter();
+    _wallAtReset = std::chrono::steady_clock::now();
+  }
+
+  PerfCounts PerfTimer::read() const {
+    PerfCounts counts;
+    // read the clocks first so that reading the counters is not timed.
+    const std::chrono::steady_clock::duration wall =
+      std::chrono::steady_clock::now() - _wallAtReset;
+    counts.cycles = readCycleCounter() - _cyclesAtReset;
+    counts.hasCycles = hasCycleCounter();
+    counts.nanoseconds = static_cast<unsigned long long>
+      (std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count());
+#ifdef __linux__
+    if (_counterGroup != -1) {
+      unsigned long long values[1 + CounterCount];
+      if (::read(_counterGroup, values, sizeof(values)) ==
+        static_cast<ssize_t>(sizeof(values)) && values[0] == CounterCount) {
+        counts.instructions = values[1];
+        counts.cacheMisses = values[2];
+        counts.branchMisses = values[3];
+        counts.hasCounters = true;
+      }
+    }
+#endif
+    return counts;
+  }
+
+  unsigned long long PerfTimer::readCycleCounter() {
+#if defined(MATHIC_HAS_CYCLE_COUNTER) && defined(__aarch64__)
+    // user space cannot read the cycle counter, so use the virtual timer.
+    unsigned long long cycles;
+    asm volatile("mrs %0, cntvct_el0" : "=r" (cycles));
+    return cycles;
+#elif defined(MATHIC_HAS_CYCLE_COUNTER)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  bool PerfTimer::hasCycleCounter() {
+#ifdef MATHIC_HAS_CYCLE_COUNTER
+    return true;
+#else
+    return false;
+#endif
+  }
 }
@@ -2,43 +2,100 @@
 #define MATHIC_TIMER_GUARD
 
 #include "stdinc.h"
-#include <ctime>
 #include <cstdio>
 #include <ostream>
+#include <chrono>
 
 namespace mathic {
-  /** Measures spans of CPU time.
-
-      The internal record of time can overflow quickly. If
-      clock_t is 32 bits unsigned and CLOCKS_PER_TIC is one million
-      then overflow will occur after 71 minutes. */
+  /** Measures spans of wall time with std::chrono::steady_clock. Use
+      PerfTimer to also measure cycles and hardware events. */
   class Timer {
   public:
     Timer() {reset();}
 
-    /** Resets the amount of elapsed CPU time to zero. */
-    void reset() {_clocksAtReset = std::clock();}
+    /** Resets the amount of elapsed time to zero. */
+    void reset() {_atReset = std::chrono::steady_clock::now();}
 
-    /** Returns the number of CPU milliseconds since the last reset.
-        See class description for time span overflow limitations. */
+    /** Returns the number of milliseconds since the last reset. */
     unsigned long getMilliseconds() const;
 
-    /** Prints the elapsed time in a human readable format. See
-        class description for time span overflow limitations. */
+    /** Prints the elapsed time in a human readable format. */
     void print(FILE* out) const;
 
-    /** Prints the elapsed time in a human readable format. See
-        class description for time span overflow limitations. */
+    /** Prints the elapsed time in a human readable format. */
     void print(std::ostream& out) const;
 
   private:
-    std::clock_t _clocksAtReset;
+    std::chrono::steady_clock::time_point _atReset;
   };
 
   inline std::ostream& operator<<(std::ostream& out, const Timer& timer) {
     timer.print(out);
     return out;
   }
+
+  /** The amounts measured by a PerfTimer. hasCycles is false if the
+      processor has no cycle counter that mathic can read, in which
+      case cycles is zero. hasCounters is false if the hardware event
+      counters are not available, in which case the counts are zero. */
+  struct PerfCounts {
+    PerfCounts():
+      nanoseconds(0), cycles(0), instructions(0), cacheMisses(0),
+      branchMisses(0), hasCycles(false), hasCounters(false) {}
+
+    double getMilliseconds() const {return nanoseconds / 1000000.0;}
+
+    unsigned long long nanoseconds;
+    unsigned long long cycles;
+    unsigned long long instructions;
+    unsigned long long cacheMisses;
+    unsigned long long branchMisses;
+    bool hasCycles;
+    bool hasCounters;
+  };
+
+  /** Measures spans of wall time with std::chrono::steady_clock, of
+      processor cycles with the time stamp counter and, on Linux, of
+      retired instructions, cache misses and branch misses through
+      perf_event_open.
+
+      The hardware event counters count only the thread that constructs
+      the timer and only in user space. They are not available if the
+      kernel does not allow access to them, such as when
+      /proc/sys/kernel/perf_event_paranoid is too high, and then only
+      the time and cycles are measured. */
+  class PerfTimer {
+  public:
+    /** Counts hardware events only if useCounters is true. */
+    PerfTimer(bool useCounters = true);
+    ~PerfTimer();
+
+    /** Resets all the measured amounts to zero. */
+    void reset();
+
+    /** Returns the amounts measured since the last reset. */
+    PerfCounts read() const;
+
+    bool hasCounters() const {return _counterGroup != -1;}
+
+    /** Returns the current value of the cycle counter of the processor,
+        or zero if there is no such counter that mathic can read. On
+        current x86 processors the time stamp counter ticks at a constant
+        rate, so this counts reference cycles rather than core cycles. */
+    static unsigned long long readCycleCounter();
+    static bool hasCycleCounter();
+
+  private:
+    PerfTimer(const PerfTimer&); // unavailable
+    void operator=(const PerfTimer&); // unavailable
+
+    static const size_t CounterCount = 3;
+
+    std::chrono::steady_clock::time_point _wallAtReset;
+    unsigned long long _cyclesAtReset;
+    int _counterGroup; // -1 if there are no counters
+    int _counters[CounterCount];
+  };
 }
 
 #endif
@@ -24,10 +24,33 @@ namespace mathic {
 
     std::string getName() const;
 	void push(Entry entry);
+	// Pushes the entries in [begin, end). If there are many entries
+	// compared to the number of entries in the tree, then the tournament
+	// is replayed bottom-up over all entries instead.
     template<class It>
 	void push(It begin, It end);
+
+	// Moves all entries of tree into this tree, leaving tree empty. If
+	// tree is small compared to this tree, then its entries are pushed
+	// one at a time. Otherwise the tournament is replayed bottom-up over
+	// all the entries, which takes one comparison per internal node.
+	void meld(TourTree& tree);
+
 	Entry pop();
 	Entry top() const;
+
+	// Pops up to maxCount entries and assigns them to *out in the order
+	// that pop() would have returned them, incrementing out after each.
+	// Returns the number of entries popped.
+	template<class Out>
+	size_t popBatch(Out out, size_t maxCount);
+
+	// Pops top() and every following entry that is equal to it and
+	// assigns them to *out, incrementing out after each. Must not be
+	// called when empty. Returns the number of entries popped.
+	template<class Out>
+	size_t popWhileEqual(Out out);
+
 	bool empty() const {return _tree.empty();}
 	void print(std::ostream& out) const;
 
@@ -70,6 +93,14 @@ namespace mathic {
 
 	void reallocate();
 
+	// Returns true if adding count entries is faster by rebuild() than
+	// by pushing them one at a time.
+	bool preferRebuild(size_t count) const;
+
+	// Rebuilds _tree from scratch with a leaf for each player in
+	// _players and plays every match bottom-up.
+	void rebuild();
+
     /// Asserts internal invariants if asserts are turned on.
 	bool isValid() const;
 
@@ -145,8 +176,85 @@ namespace mathic {
   template<class C>
   template<class It>
   void TourTree<C>::push(It begin, It end) {
+	size_t count = 0;
+	for (It it = begin; it != end; ++it)
+	  ++count;
+	if (!preferRebuild(count)) {
+	  for (; begin != end; ++begin)
+		push(*begin);
+	  return;
+	}
+	// rebuild() redirects the tree to the new location of the players.
+	_players.reserve(_players.size() + count);
 	for (; begin != end; ++begin)
-	  push(*begin);
+	  _players.push_back(Player(*begin, Node()));
+	rebuild();
+	MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+  void TourTree<C>::meld(TourTree& tree) {
+	MATHIC_ASSERT(&tree != this);
+	const size_t count = tree._players.size();
+	if (!preferRebuild(count)) {
+	  for (size_t i = 0; i < count; ++i)
+		push(tree._players[i].entry);
+	} else {
+	  // rebuild() redirects the tree to the new location of the players.
+	  _players.reserve(_players.size() + count);
+	  for (size_t i = 0; i < count; ++i)
+		_players.push_back(Player(tree._players[i].entry, Node()));
+	  rebuild();
+	}
+	tree.clear();
+	MATHIC_SLOW_ASSERT(isValid());
+  }
+
+  template<class C>
+	bool TourTree<C>::preferRebuild(size_t count) const {
+	// a push takes up to one comparison per level while a rebuild takes
+	// one comparison per entry in total.
+	const size_t total = _players.size() + count;
+	size_t height = 0;
+	for (size_t i = total; i > 1; i /= 2)
+	  ++height;
+	return count * height >= total;
+  }
+
+  template<class C>
+	void TourTree<C>::rebuild() {
+	_tree.clear();
+	if (_players.empty())
+	  return;
+	const size_t playerCount = _players.size();
+	while (!_tree.hasFreeCapacity(2 * playerCount - 1))
+	  _tree.increaseCapacity();
+	if (_players.capacity() < _tree.capacity() / 2 + 2)
+	  _players.reserve(_tree.capacity() / 2 + 2);
+
+	// place the players at the leaves where push() would have put them,
+	// since pop() relies on that order. push() moves the leaf at the
+	// first free node's parent down as a left child and puts the new
+	// player to its right.
+	_tree.pushBackWithCapacity(&_players.front());
+	for (size_t i = 1; i < playerCount; ++i) {
+	  Player* moveDown = _tree[_tree.lastLeaf().next().parent()];
+	  _tree.pushBackWithCapacity(moveDown);
+	  _tree.pushBackWithCapacity(&_players[i]);
+	}
+	const Node lastInternal = _tree.lastLeaf().parent();
+	for (Node pos = lastInternal.next(); pos <= _tree.lastLeaf(); ++pos)
+	  _tree[pos]->leaf = pos;
+	if (playerCount == 1)
+	  return;
+	for (Node pos = lastInternal; ; pos = pos.prev()) {
+	  Player* left = _tree[pos.left()];
+	  Player* right = _tree[pos.right()];
+	  _tree[pos] = _conf.cmpLessThan(_conf.compare(left->entry, right->entry)) ?
+		right : left;
+	  if (pos.isRoot())
+		break;
+	}
   }
 
   template<class C>
@@ -207,6 +315,34 @@ namespace mathic {
 	return top;
   }
 
+  template<class C>
+  template<class Out>
+  size_t TourTree<C>::popBatch(Out out, size_t maxCount) {
+	size_t popped = 0;
+	for (; popped < maxCount && !empty(); ++popped) {
+	  *out = pop();
+	  ++out;
+	}
+	return popped;
+  }
+
+  template<class C>
+  template<class Out>
+  size_t TourTree<C>::popWhileEqual(Out out) {
+	MATHIC_ASSERT(!empty());
+	const Entry first = pop();
+	*out = first;
+	++out;
+	size_t popped = 1;
+	// entries are at most first, so they are equal if not less
+	for (; !empty() && !_conf.cmpLessThan(_conf.compare(top(), first));
+	  ++popped) {
+	  *out = pop();
+	  ++out;
+	}
+	return popped;
+  }
+
   template<class C>
 	typename TourTree<C>::Entry TourTree<C>::top() const {
 	MATHIC_ASSERT(!empty());
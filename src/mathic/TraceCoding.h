@@ -0,0 +1,74 @@
+#ifndef MATHIC_TRACE_CODING_GUARD
+#define MATHIC_TRACE_CODING_GUARD
+
+#include "stdinc.h"
+#include "error.h"
+#include <ostream>
+#include <string>
+#include <cstring>
+
+namespace mathic {
+  /** Helpers for the binary trace formats of the simulators. Numbers
+      are written as variable length integers with 7 bits per byte, low
+      bits first, where the top bit of a byte is set if more bytes
+      follow. Signed numbers are zigzag encoded first so that numbers
+      close to zero are short whatever their sign. */
+  namespace TraceCoding {
+    typedef unsigned long long Word;
+
+    inline void writeWord(std::ostream& out, Word w) {
+      char buffer[10];
+      size_t size = 0;
+      for (; w >= 0x80; w >>= 7)
+        buffer[size++] = static_cast<char>((w & 0x7F) | 0x80);
+      buffer[size++] = static_cast<char>(w);
+      out.write(buffer, size);
+    }
+
+    inline void writeSignedWord(std::ostream& out, long long w) {
+      const Word u = static_cast<Word>(w);
+      writeWord(out, (u << 1) ^ (w < 0 ? ~static_cast<Word>(0) : 0));
+    }
+
+    /** Reads a word at pos and moves pos past it. */
+    inline Word readWord(const char*& pos, const char* end) {
+      Word w = 0;
+      for (unsigned int shift = 0; ; shift += 7) {
+        if (pos == end || shift > 63)
+          reportError("Trace ends in the middle of a number.");
+        const unsigned char byte = static_cast<unsigned char>(*pos);
+        ++pos;
+        w |= static_cast<Word>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+          return w;
+      }
+    }
+
+    inline long long readSignedWord(const char*& pos, const char* end) {
+      const Word u = readWord(pos, end);
+      return static_cast<long long>((u >> 1) ^ (~(u & 1) + 1));
+    }
+
+    /** Writes the magic string that identifies a kind of trace and the
+        version of its format. */
+    inline void writeHeader
+    (std::ostream& out, const char* magic, Word version) {
+      out.write(magic, std::strlen(magic));
+      writeWord(out, version);
+    }
+
+    /** Checks the header written by writeHeader and moves pos past it. */
+    inline void readHeader(const char*& pos, const char* end,
+                           const char* magic, Word version) {
+      const size_t length = std::strlen(magic);
+      if (static_cast<size_t>(end - pos) < length ||
+        std::memcmp(pos, magic, length) != 0)
+        reportError(std::string("Input is not a trace of type ") + magic + '.');
+      pos += length;
+      if (readWord(pos, end) != version)
+        reportError("Trace has an unsupported format version.");
+    }
+  }
+}
+
+#endif
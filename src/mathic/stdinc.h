@@ -94,6 +94,39 @@ namespace mathic {
   static unsigned long const BitsPerByte = 8;
 }
 
+/** Defines a class template NAME<C> whose Value is true if C has a
+    member called MEMBER. The member can be a static field, an
+    enumerator or a method. */
+#define MATHIC_DEFINE_HAS_MEMBER(NAME, MEMBER) \
+  template<class C> \
+  class NAME { \
+    template<class T> \
+    static char (&check(decltype(&T::MEMBER)*, int))[2]; \
+    template<class T> \
+    static char (&check(decltype(T::MEMBER)*, long))[2]; \
+    template<class T> \
+    static char check(...); \
+  public: \
+    static const bool Value = sizeof(check<C>(0, 0)) == 2; \
+  }
+
+/** Defines a class template NAME<C, Default> for an optional static
+    const field of a Configuration. Its Value is C::MEMBER if C declares
+    MEMBER and otherwise Default, which defaults to DEFAULT, and its
+    Declared is true if C declares MEMBER. */
+#define MATHIC_DEFINE_OPTIONAL_FIELD(NAME, TYPE, MEMBER, DEFAULT) \
+  template<class Conf, TYPE Default = DEFAULT> \
+  class NAME { \
+    MATHIC_DEFINE_HAS_MEMBER(Has, MEMBER); \
+    template<class T, bool HasMember> \
+    struct Get {static const TYPE Value = Default;}; \
+    template<class T> \
+    struct Get<T, true> {static const TYPE Value = T::MEMBER;}; \
+  public: \
+    static const bool Declared = Has<Conf>::Value; \
+    static const TYPE Value = Get<Conf, Declared>::Value; \
+  }
+
 #ifndef MATHIC_NO_MIC_NAMESPACE
 namespace mic {
   using namespace mathic;
@@ -10,7 +10,9 @@ template<
   bool Premerge,
   bool CollectMax,
   int BucketStorage,
-  size_t InsertFactor>
+  size_t InsertFactor,
+  int MergeKernel,
+  size_t MaxVirtualBuckets>
 class GeobucketModelBase {
 public:
   GeobucketModelBase(size_t geoBase, size_t minBucketSize):
@@ -25,8 +27,22 @@ public:
   static const mathic::GeobucketBucketStorage bucketStorage =
     (mathic::GeobucketBucketStorage)BucketStorage;
   static const size_t insertFactor = InsertFactor;
+  static const mathic::GeobucketMergeKernel mergeKernel =
+    (mathic::GeobucketMergeKernel)MergeKernel;
+  static const size_t maxVirtualBuckets = MaxVirtualBuckets;
 };
 
+namespace ModelHelper {
+  // The spans of a simulation stay in memory for the whole run, so they
+  // can be pushed by reference. This is the same as push(begin, end)
+  // unless the configuration has virtual buckets.
+  template<class C>
+  inline void push(mathic::Geobucket<C>& ds,
+    const Value* begin, const Value* end, OnSpans<0>) {
+    ds.pushReference(begin, end);
+  }
+}
+
 template<
   bool OnSpans,
   bool TrackFront,
@@ -35,7 +51,9 @@ template<
   bool Premerge,
   bool CollectMax,
   int BucketStorage,
-  size_t InsertFactor = 1>
+  size_t InsertFactor = 1,
+  int MergeKernel = 0,
+  size_t MaxVirtualBuckets = 0>
 class GeobucketModel :
   public Model<
     OnSpans,
@@ -48,7 +66,9 @@ class GeobucketModel :
       Premerge,
       CollectMax,
       BucketStorage,
-      InsertFactor> > {
+      InsertFactor,
+      MergeKernel,
+      MaxVirtualBuckets> > {
 public:
   GeobucketModel(size_t geoBase, size_t minBucketSize):
     Model<
@@ -62,7 +82,9 @@ public:
       Premerge,
       CollectMax,
       BucketStorage,
-      InsertFactor> >(geoBase, minBucketSize) {}
+      InsertFactor,
+      MergeKernel,
+      MaxVirtualBuckets> >(geoBase, minBucketSize) {}
 };
 
 #endif
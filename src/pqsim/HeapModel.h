@@ -4,13 +4,24 @@
 #include "Model.h"
 #include "mathic/Heap.h"
 
-template<bool FastIndex>
+template<bool FastIndex, size_t Arity, bool CacheAligned>
 struct HeapModelBase {
   static const bool fastIndex = FastIndex;
+  static const size_t arity = Arity;
+  static const bool cacheAligned = CacheAligned;
 };
 
-template<bool OnSpans, bool Deduplicate, bool FastIndex>
+template<
+  bool OnSpans,
+  bool Deduplicate,
+  bool FastIndex,
+  size_t Arity = 2,
+  bool CacheAligned = false>
 class HeapModel : public Model<
-  OnSpans, Deduplicate, true, mathic::Heap, HeapModelBase<FastIndex> > {};
+  OnSpans,
+  Deduplicate,
+  true,
+  mathic::Heap,
+  HeapModelBase<FastIndex, Arity, CacheAligned> > {};
 
 #endif
@@ -4,6 +4,10 @@
 #include "Item.h"
 #include <vector>
 
+namespace mathic {
+  template<class C> class Geobucket;
+}
+
 namespace ModelHelper {
   class NullConfigurationBase {};
   template<bool> struct OnSpans {};
@@ -13,6 +17,9 @@ namespace ModelHelper {
   inline void push(DS& ds, const Value* begin, const Value* end, OnSpans<0>);
   template<class DS>
   inline void push(DS& ds, const Value* begin, const Value* end, OnSpans<1>);
+  template<class C> // defined in GeobucketModel.h
+  inline void push
+    (mathic::Geobucket<C>& ds, const Value* begin, const Value* end, OnSpans<0>);
   template<class DS, bool DT>
   inline Value pop(DS& ds, OnSpans<0>, UseDecreaseTop<DT>);
 
@@ -0,0 +1,11 @@
+#ifndef PAIRING_HEAP_MODEL_GUARD
+#define PAIRING_HEAP_MODEL_GUARD
+
+#include "Model.h"
+#include "mathic/PairingHeap.h"
+
+template<bool OnSpans, bool Deduplicate>
+class PairingHeapModel :
+  public Model<OnSpans, Deduplicate, true, mathic::PairingHeap> {};
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef RADIX_HEAP_MODEL_GUARD
+#define RADIX_HEAP_MODEL_GUARD
+
+#include "Model.h"
+#include "mathic/RadixHeap.h"
+
+struct RadixHeapModelBase {
+  typedef Value Key;
+  static Key getKey(Value v) {return v;}
+  static Key getKey(const Item& item) {return item.getValue();}
+};
+
+template<bool OnSpans>
+class RadixHeapModel : public Model<
+  OnSpans,
+  false,
+  true,
+  mathic::RadixHeap,
+  RadixHeapModelBase> {};
+
+#endif
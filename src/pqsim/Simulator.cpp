@@ -8,7 +8,7 @@
 #include <set>
 
 namespace {
-  std::string commafy(unsigned long l) {
+  std::string commafy(unsigned long long l) {
     std::stringstream out;
     out << l;
     std::string str;
@@ -20,6 +20,10 @@ namespace {
     return str;
   }
 
+  unsigned long long wallMilliseconds(const mic::PerfCounts& counts) {
+    return (counts.nanoseconds + 500000) / 1000000;
+  }
+
   struct SimBuilder {
     typedef Simulator::Event Event;
     SimBuilder(bool popDuplicates,
@@ -188,6 +192,10 @@ void Simulator::dupSpans
       sim.pop();
   }
   _description = makeDescription(sim, _repeats, "dup spans");
+  std::ostringstream simType;
+  simType << "dup spans " << pushSumGoal << ' ' << avgSpan << ' '
+    << avgLiveGoal << ' ' << dupPercentage;
+  _simType = simType.str();
 }
 
 void Simulator::orderSpans
@@ -220,6 +228,9 @@ void Simulator::orderSpans
   }
 
   _description = makeDescription(sim, _repeats, "ordered spans");
+  std::ostringstream simType;
+  simType << "ordered spans " << spanCount << ' ' << spanSize << ' ' << avgSize;
+  _simType = simType.str();
 }
 
 void Simulator::randomSpans(size_t spanCount, size_t spanSize, size_t initialSize) {
@@ -247,6 +258,78 @@ void Simulator::randomSpans(size_t spanCount, size_t spanSize, size_t initialSiz
     }
   }
   _description = makeDescription(sim, _repeats, "random spans");
+  std::ostringstream simType;
+  simType << "random spans " << spanCount << ' ' << spanSize << ' '
+    << initialSize;
+  _simType = simType.str();
+}
+
+void Simulator::replay(const std::string& fileName) {
+  _events.clear();
+  _mem.clear();
+  _trace.reset(new mic::MappedFile(fileName));
+
+  size_t pushCount = 0;
+  size_t pushSum = 0;
+  size_t popCount = 0;
+  mic::PQTraceReader reader(_trace->begin(), _trace->end());
+  while (true) {
+    const mic::PQTraceReader::Event event = reader.next();
+    if (event == mic::PQTraceReader::EndEvent)
+      break;
+    if (event == mic::PQTraceReader::PopEvent)
+      ++popCount;
+    else {
+      ++pushCount;
+      pushSum += reader.pushed().size();
+    }
+  }
+
+  std::ostringstream out;
+  out << "*** Trace \"" << fileName << "\"\n ";
+  out << pushCount << " spans\n ";
+  out << (pushCount == 0 ? 0 : pushSum / pushCount)
+    << " per span on average\n ";
+  out << pushSum << " entries pushed in total.\n ";
+  out << popCount << " pops.\n ";
+  out << _repeats << " repeats.\n";
+  _simType = "trace " + fileName;
+  _description = out.str();
+}
+
+const Value* Simulator::storeSpan
+(const std::vector<mic::PQTraceReader::Key>& keys, size_t& size) {
+  const size_t BlockSize = 1 << 16;
+  if (_spanBlock == _spanBlocks.size() ||
+    _spanBlocks[_spanBlock].size() + keys.size() >
+    _spanBlocks[_spanBlock].capacity()) {
+    if (_spanBlock < _spanBlocks.size())
+      ++_spanBlock;
+    if (_spanBlock == _spanBlocks.size())
+      _spanBlocks.push_back(std::vector<Value>());
+    std::vector<Value>& block = _spanBlocks[_spanBlock];
+    block.clear();
+    if (block.capacity() < keys.size()) {
+      // replace the block since reserve on a large block would copy it.
+      std::vector<Value>().swap(block);
+    }
+    block.reserve(std::max<size_t>(BlockSize, keys.size()));
+  }
+  std::vector<Value>& block = _spanBlocks[_spanBlock];
+  const size_t offset = block.size();
+  for (size_t i = 0; i < keys.size(); ++i)
+    block.push_back(static_cast<Value>(keys[i]));
+  std::vector<Value>::iterator begin = block.begin() + offset;
+  std::sort(begin, block.end(), std::greater<Value>());
+  block.erase(std::unique(begin, block.end()), block.end());
+  size = block.size() - offset;
+  return size == 0 ? 0 : &block[offset];
+}
+
+void Simulator::releaseSpans() {
+  _spanBlock = 0;
+  if (!_spanBlocks.empty())
+    _spanBlocks.front().clear();
 }
 
 void Simulator::printEventSummary(std::ostream& out) const {
@@ -276,21 +359,68 @@ void Simulator::printData(std::ostream& out) const {
   std::vector<SimData> sorted(_data);
   sort(sorted.begin(), sorted.end());
   out << "*** Simulation outcome ***" << std::endl;
+  bool hasCycles = false;
+  bool hasCounters = false;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    hasCycles = hasCycles || sorted[i].counts.hasCycles;
+    hasCounters = hasCounters || sorted[i].counts.hasCounters;
+  }
+
   mic::ColumnPrinter pr;
   pr.addColumn(true);
   pr.addColumn(false, " ", "ms");
   pr.addColumn(false, " ", "cmps");
   pr.addColumn(false, " ", "kb");
+  if (hasCycles)
+    pr.addColumn(false, " ", "Mcycles");
+  if (hasCounters) {
+    pr.addColumn(false, " ", "Minstrs");
+    pr.addColumn(false, " ", "k cache misses");
+    pr.addColumn(false, " ", "k branch misses");
+  }
   for (std::vector<SimData>::const_iterator it = sorted.begin();
     it != sorted.end(); ++it) {
     pr[0] << it->name << '\n';
-    pr[1] << commafy(it->mseconds) << '\n';
+    pr[1] << commafy(wallMilliseconds(it->counts)) << '\n';
     pr[2] << commafy(it->comparisons) << '\n';
     pr[3] << commafy(it->memoryUse / 1024) << '\n';
+    size_t column = 4;
+    if (hasCycles)
+      pr[column++] << commafy(it->counts.cycles / 1000000) << '\n';
+    if (hasCounters) {
+      pr[column++] << commafy(it->counts.instructions / 1000000) << '\n';
+      pr[column++] << commafy(it->counts.cacheMisses / 1000) << '\n';
+      pr[column++] << commafy(it->counts.branchMisses / 1000) << '\n';
+    }
   }
   pr.print(out);
 }
 
+std::vector<mic::SimRecord> Simulator::getRecords() const {
+  std::vector<mic::SimRecord> records;
+  for (size_t i = 0; i < _data.size(); ++i) {
+    const SimData& data = _data[i];
+    mic::SimRecord record(data.name);
+    record.addParameter("simulation", _simType);
+    record.addParameter("repeats", _repeats);
+    record.addMetric("ms", data.counts.getMilliseconds());
+    if (data.counts.hasCycles)
+      record.addMetric("cycles", static_cast<double>(data.counts.cycles));
+    record.addMetric("comparisons", data.comparisons);
+    record.addMetric("memory_bytes", static_cast<double>(data.memoryUse));
+    if (data.counts.hasCounters) {
+      record.addMetric
+        ("instructions", static_cast<double>(data.counts.instructions));
+      record.addMetric
+        ("cache_misses", static_cast<double>(data.counts.cacheMisses));
+      record.addMetric
+        ("branch_misses", static_cast<double>(data.counts.branchMisses));
+    }
+    records.push_back(record);
+  }
+  return records;
+}
+
 void Simulator::setupEvents() {
   size_t activeSum = 0;
   std::priority_queue<int> queue;
@@ -315,12 +445,19 @@ void Simulator::setupEvents() {
 
 void Simulator::SimData::print(std::ostream& out) {
   out << name
-    << " " << commafy(mseconds) << " ms"
-    << " " << commafy(comparisons) << " cmps"
-    << " " << commafy(memoryUse / 1024) << " kb"
-    << '\n';
+    << " " << commafy(wallMilliseconds(counts)) << " ms";
+  if (counts.hasCycles)
+    out << " " << commafy(counts.cycles / 1000000) << " Mcycles";
+  out << " " << commafy(comparisons) << " cmps"
+    << " " << commafy(memoryUse / 1024) << " kb";
+  if (counts.hasCounters) {
+    out << " " << commafy(counts.instructions / 1000000) << " Minstrs"
+      << " " << commafy(counts.cacheMisses / 1000) << " k cache misses"
+      << " " << commafy(counts.branchMisses / 1000) << " k branch misses";
+  }
+  out << '\n';
 }
 
 bool Simulator::SimData::operator<(const SimData& sd) const {
-  return mseconds < sd.mseconds;
+  return counts.nanoseconds < sd.counts.nanoseconds;
 }
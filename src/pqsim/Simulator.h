@@ -2,8 +2,14 @@
 #define SIMULATOR_GUARD
 
 #include "Item.h"
+#include "mathic/MappedFile.h"
+#include "mathic/PQTrace.h"
+#include "mathic/Timer.h"
+#include "mathic/SimRecord.h"
 #include <queue>
 #include <vector>
+#include <deque>
+#include <memory>
 #include <ctime>
 #include <algorithm>
 #include <sstream>
@@ -12,13 +18,19 @@
 
 class Simulator {
 public:
-  Simulator(size_t repeats): _repeats(repeats), _simType("none") {}
+  Simulator(size_t repeats):
+    _repeats(repeats), _simType("none"), _spanBlock(0) {}
 
   void dupSpans(size_t pushSumGoal, size_t avgSpan, size_t avgLiveGoal,
     size_t dupPercentage);
   void orderSpans(size_t spanCount, size_t spanSize, size_t avgSize);
   void randomSpans(size_t spanCount, size_t spanSize, size_t initialSize);
 
+  // Replays the priority queue trace in fileName instead of generated
+  // events. The trace is memory mapped and decoded again on each run, so
+  // it is never loaded into memory as a whole. See mathic/PQTrace.h.
+  void replay(const std::string& fileName);
+
   template<class PQueue>
   void run(PQueue& pq, bool printData = true, bool printStates = false);
 
@@ -26,6 +38,9 @@ public:
   void printEvents(std::ostream& out) const;
   void printData(std::ostream& out) const;
 
+  // Returns the data of each run as records for writing to CSV or JSON.
+  std::vector<mic::SimRecord> getRecords() const;
+
   struct Event {
     Event(): size(0) {}
     size_t begin;
@@ -37,8 +52,8 @@ private:
   struct SimData {
     std::string name;
     unsigned long comparisons;
-    unsigned long mseconds;
     size_t memoryUse;
+    mic::PerfCounts counts;
     bool operator<(const SimData& sd) const;
     void print(std::ostream& out);
   };
@@ -46,6 +61,16 @@ private:
   void setupEvents();
   void print(const Event& e, std::ostream& out) const;
 
+  template<class PQueue>
+  void runTrace(PQueue& pqueue);
+
+  // Copies the keys of a push from a trace into memory that stays valid
+  // until releaseSpans is called, sorted in decreasing order and without
+  // duplicates. Sets size to the number of values stored.
+  const Value* storeSpan(const std::vector<mic::PQTraceReader::Key>& keys,
+    size_t& size);
+  void releaseSpans();
+
   std::vector<Event> _events;
   std::vector<SimData> _data;
   std::vector<Value> _mem;
@@ -55,13 +80,23 @@ private:
   size_t _repeats;
   std::string _simType;
   std::string _description;
+
+  std::unique_ptr<mic::MappedFile> _trace;
+  // Items of models on spans point into these blocks. A deque never moves
+  // its elements, so the blocks stay put when more are added.
+  std::deque<std::vector<Value> > _spanBlocks;
+  size_t _spanBlock;
 };
 
 template<class PQueue>
 void Simulator::run(PQueue& pqueue, bool printData, bool printStates) {
-  clock_t timeBegin = clock();
+  mic::PerfTimer perfTimer;
   std::vector<Event>::const_iterator end = _events.end();
   for (size_t turn = 0; turn < _repeats; ++turn) {
+    if (_trace.get() != 0) {
+      runTrace(pqueue);
+      continue;
+    }
     typedef std::vector<Event>::const_iterator CIterator;
     CIterator end = _events.end();
     for (CIterator it = _events.begin(); it != end; ++it) {
@@ -87,17 +122,50 @@ void Simulator::run(PQueue& pqueue, bool printData, bool printStates) {
       }
     }
   }
-  clock_t timeEnd = clock();
+  const mic::PerfCounts counts = perfTimer.read();
 
   SimData data;
   data.name = pqueue.getName();
   data.memoryUse = pqueue.getMemoryUse();
   data.comparisons = pqueue.getComparisons();
-  data.mseconds = (unsigned long)
-    ((double(timeEnd) - timeBegin) * 1000) / CLOCKS_PER_SEC;
+  data.counts = counts;
   _data.push_back(data);
   if (printData)
     data.print(std::cerr);
 }
 
+template<class PQueue>
+void Simulator::runTrace(PQueue& pqueue) {
+  mic::PQTraceReader reader(_trace->begin(), _trace->end());
+  releaseSpans();
+  while (true) {
+    const mic::PQTraceReader::Event event = reader.next();
+    if (event == mic::PQTraceReader::EndEvent)
+      break;
+    if (event == mic::PQTraceReader::PopEvent) {
+      Value item = pqueue.pop();
+      if (!(item == static_cast<Value>(reader.popped()))) {
+        std::cerr << "ERROR: queue " << pqueue.getName()
+          << " gave incorrect value " << item << " while replaying trace "
+          << _trace->getFileName() << std::endl;
+        exit(1);
+      }
+    } else {
+      size_t size;
+      const Value* begin = storeSpan(reader.pushed(), size);
+      if (size > 0)
+        pqueue.push(begin, begin + size);
+    }
+    // no item can point to the stored spans once the queue is empty.
+    if (pqueue.empty())
+      releaseSpans();
+  }
+  // a trace can end with items left in the queue. Pop those so that the
+  // next run starts from an empty queue and so that no item points into
+  // the spans when they are released for reuse.
+  while (!pqueue.empty())
+    pqueue.pop();
+  releaseSpans();
+}
+
 #endif
@@ -3,10 +3,17 @@
 #include "StlSetModel.h"
 #include "HeapModel.h"
 #include "GeobucketModel.h"
+#include "PairingHeapModel.h"
+#include "RadixHeapModel.h"
 #include "TourTreeModel.h"
 #include "Simulator.h"
+#include "mathic/CliParser.h"
+#include "mathic/CompareAction.h"
 #include <iostream>
+#include <fstream>
 #include <ctime>
+#include <string>
+#include <exception>
 
 namespace {
   size_t toInt(const char* str) {
@@ -15,30 +22,97 @@ namespace {
 	in >> i;
 	return i;
   }
+
+  // Runs the compare action of mathic on the arguments after "compare".
+  int compare(int argc, const char** args) {
+	try {
+	  mic::CliParser parser;
+	  parser.registerAction<mic::CompareAction>();
+	  std::vector<std::string> commandLine(args, args + argc);
+	  parser.parse(commandLine)->performAction();
+	} catch (const std::exception& e) {
+	  std::cerr << e.what() << std::endl;
+	  return 1;
+	}
+	return 0;
+  }
+
+  // Writes the results to the files given by -csv and -json, if any. CSV
+  // is appended to so that repeated runs collect samples for compare.
+  bool writeRecords(const Simulator& sim,
+	const std::string& csvFile, const std::string& jsonFile) {
+	try {
+	  if (!csvFile.empty())
+		mic::appendSimRecordsCsv(csvFile, sim.getRecords());
+	  if (!jsonFile.empty()) {
+		std::ofstream out(jsonFile.c_str());
+		mic::writeSimRecordsJson(out, sim.getRecords());
+		if (!out)
+		  mic::reportError("Could not write to file \"" + jsonFile + "\".");
+	  }
+	} catch (const std::exception& e) {
+	  std::cerr << e.what() << std::endl;
+	  return false;
+	}
+	return true;
+  }
 }
 
 int main(int argc, const char** args) {
   srand(static_cast<unsigned int>(time(0)));
   srand(0);
-  if (argc < 4) {
-	std::cerr << "usage: elements span-length target-avg-size\n";
+  if (argc >= 2 && std::string(args[1]) == "compare")
+	return compare(argc - 1, args + 1);
+
+  std::string csvFile;
+  std::string jsonFile;
+  std::vector<const char*> positional;
+  for (int i = 0; i < argc; ++i) {
+	const std::string arg = args[i];
+	if ((arg == "-csv" || arg == "-json") && i + 1 < argc)
+	  (arg == "-csv" ? csvFile : jsonFile) = args[++i];
+	else
+	  positional.push_back(args[i]);
+  }
+  argc = static_cast<int>(positional.size());
+  args = &positional[0];
+
+  const bool replay = argc >= 2 && std::string(args[1]) == "replay";
+  if (replay ? argc < 3 : argc < 4) {
+	std::cerr << "usage: elements span-length target-avg-size [dup-percentage]\n"
+	  << "   or: replay trace-file [repeats]\n"
+	  << "   or: compare baseline.csv candidate.csv [-threshold percent]\n"
+	  << "Give -csv file or -json file to also write the results to file.\n";
 	return 0;
   }
-  size_t elements = toInt(args[1]);
-  size_t spanSize = toInt(args[2]);
-  size_t avgOrInitialSize = toInt(args[3]);
-  size_t dups = 30;
-  if (argc >= 5)
-    dups = toInt(args[4]);
 
   size_t repeats = 500;
+  if (replay)
+	repeats = argc >= 4 ? toInt(args[3]) : 1;
   IF_DEBUG(repeats = 2;);
-
-  std::cerr << "Generating simulation..." << std::endl;
   Simulator sim(repeats);
-  //sim.orderSpans(elements / spanSize, spanSize, avgOrInitialSize);
-  //sim.randomSpans(elements / spanSize, spanSize, avgOrInitialSize);
-  sim.dupSpans(elements, spanSize, avgOrInitialSize, dups);
+
+  if (replay) {
+	std::cerr << "Reading trace..." << std::endl;
+	try {
+	  sim.replay(args[2]);
+	} catch (const std::exception& e) {
+	  std::cerr << e.what() << std::endl;
+	  return 1;
+	}
+  } else {
+	size_t elements = toInt(args[1]);
+	size_t spanSize = toInt(args[2]);
+	size_t avgOrInitialSize = toInt(args[3]);
+	size_t dups = 30;
+	if (argc >= 5)
+	  dups = toInt(args[4]);
+
+	std::cerr << "Generating simulation..." << std::endl;
+	//sim.orderSpans(elements / spanSize, spanSize, avgOrInitialSize);
+	//sim.randomSpans(elements / spanSize, spanSize, avgOrInitialSize);
+	sim.dupSpans(elements, spanSize, avgOrInitialSize, dups);
+  }
   sim.printEventSummary(std::cerr);
   //sim.printEvents(std::cerr);
   std::cerr << '\n' << std::endl;
@@ -52,14 +126,26 @@ int main(int argc, const char** args) {
   {GeobucketModel<0,0,0,0,0,0,0> x(4, 32); sim.run(x);}
   {GeobucketModel<0,0,0,0,0,0,0> x(2, 32); sim.run(x);}
   {GeobucketModel<0,0,0,1,0,0,0> x(4, 32); sim.run(x);}
+  {GeobucketModel<0,0,0,0,0,0,0,1,1> x(4, 32); sim.run(x);}
+  {GeobucketModel<0,0,0,0,0,0,2,1,1> x(4, 32); sim.run(x);}
+  {GeobucketModel<0,0,0,0,0,0,0,1,0,4> x(4, 32); sim.run(x);}
   {StlSetModel<1> x; sim.run(x);}
   {StlSetModel<0> x; sim.run(x);}
   {HeapModel<0,0,0> x; sim.run(x);}
   {HeapModel<1,0,0> x; sim.run(x);}
   {HeapModel<0,1,0> x; sim.run(x);}
   {HeapModel<1,1,0> x; sim.run(x);}
+  {HeapModel<0,0,0,4> x; sim.run(x);}
+  {HeapModel<0,0,0,8> x; sim.run(x);}
+  {HeapModel<0,0,0,4,1> x; sim.run(x);}
+  {HeapModel<0,0,0,8,1> x; sim.run(x);}
+  {HeapModel<0,1,0,4,1> x; sim.run(x);}
+  {PairingHeapModel<0,0> x; sim.run(x);}
+  {PairingHeapModel<0,1> x; sim.run(x);}
+  {RadixHeapModel<0> x; sim.run(x);}
+  {RadixHeapModel<1> x; sim.run(x);}
 #endif
 
   sim.printData(std::cout);
-  return 0;
+  return writeRecords(sim, csvFile, jsonFile) ? 0 : 1;
 }
@@ -4,7 +4,582 @@
 
 #include "mathic/DivList.h"
 #include "divsim/KDTreeModel.h"
+#include "divsim/DivListModel.h"
+#include "mathic/DivTrace.h"
+#include <cstdlib>
+#include <thread>
+#include <algorithm>
+#include <sstream>
 
 TEST(DivFinder, NoOp) {
   KDTreeModel<1,1,1,1,1> model(1, 1, 0, 0, 1.0, 1000);
 };
+
+namespace {
+  const size_t VarCount = 4;
+
+  /** Returns count random exponent vectors of VarCount variables with
+      exponents less than maxExponent. If distinct is true then the
+      duplicates are removed and the rest are shuffled, so there can be
+      fewer than count. */
+  std::vector<std::vector<int> > makeExponents
+    (size_t count, int maxExponent = 10, bool distinct = false) {
+    std::vector<std::vector<int> > exponents
+      (count, std::vector<int>(VarCount));
+    for (size_t i = 0; i < count; ++i)
+      for (size_t var = 0; var < VarCount; ++var)
+        exponents[i][var] = std::rand() % maxExponent;
+    if (distinct) {
+      std::sort(exponents.begin(), exponents.end());
+      exponents.erase
+        (std::unique(exponents.begin(), exponents.end()), exponents.end());
+      std::random_shuffle(exponents.begin(), exponents.end());
+    }
+    return exponents;
+  }
+
+  /** Fills storage with count random exponent vectors as for
+      makeExponents() and returns monomials that refer to them. */
+  std::vector<Monomial> makeMonomials(
+    std::vector<std::vector<int> >& storage,
+    size_t count,
+    int maxExponent = 10
+  ) {
+    storage = makeExponents(count, maxExponent);
+    std::vector<Monomial> monomials;
+    for (size_t i = 0; i < count; ++i)
+      monomials.push_back(Monomial(storage[i]));
+    return monomials;
+  }
+
+  /** Returns true if a divides b. A and B can be Monomial or
+      std::vector<int>. */
+  template<class A, class B>
+  bool divides(const A& a, const B& b) {
+    for (size_t var = 0; var < VarCount; ++var)
+      if (b[var] < a[var])
+        return false;
+    return true;
+  }
+
+  /** Returns true if one of entries divides query by checking them all.
+      If present is not empty then only the entries whose flag in
+      present is set count. */
+  template<class E, class Q>
+  bool hasDivisor(
+    const std::vector<E>& entries,
+    const Q& query,
+    const std::vector<bool>& present = std::vector<bool>()
+  ) {
+    for (size_t i = 0; i < entries.size(); ++i)
+      if ((present.empty() || present[i]) && divides(entries[i], query))
+        return true;
+    return false;
+  }
+
+  /** Checks that finder.findDivisor(query) returns a divisor of query
+      if expected is true and null otherwise. */
+  template<class Finder, class Q>
+  void checkFindDivisor(Finder& finder, const Q& query, bool expected) {
+    const auto divisor = finder.findDivisor(query);
+    ASSERT_EQ(expected, divisor != 0);
+    if (divisor != 0) {
+      ASSERT_TRUE(divides(*divisor, query));
+    }
+  }
+
+  template<class Finder>
+  void checkFindDivisors(Finder& finder, bool sameDivisor) {
+    std::srand(0);
+    std::vector<std::vector<int> > entryStorage;
+    std::vector<Monomial> entries = makeMonomials(entryStorage, 200);
+    for (size_t i = 0; i < entries.size(); ++i)
+      finder.insert(entries[i]);
+
+    std::vector<std::vector<int> > queryStorage;
+    std::vector<Monomial> queries = makeMonomials(queryStorage, 300);
+    std::vector<Monomial*> divisors;
+    finder.findDivisors
+      (queries.begin(), queries.end(), std::back_inserter(divisors));
+    ASSERT_EQ(queries.size(), divisors.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+      Monomial* divisor = finder.findDivisor(queries[i]);
+      ASSERT_EQ(divisor == 0, divisors[i] == 0);
+      if (divisor == 0)
+        continue;
+      if (sameDivisor) {
+        ASSERT_EQ(divisor->getPointer(), divisors[i]->getPointer());
+      }
+      ASSERT_TRUE(divides(*divisors[i], queries[i]));
+      checkFindDivisor(finder, queries[i], hasDivisor(entries, queries[i]));
+    }
+  }
+}
+
+TEST(DivFinder, FindDivisors) {
+  {
+    KDTreeModel<1,1,1,4,1> model(VarCount, 1, 0, 0, 0.0, 0);
+    checkFindDivisors(model, false);
+  }
+  {
+    KDTreeModel<1,1,0,4,1> model(VarCount, 1, 0, 1, 0.0, 0);
+    checkFindDivisors(model, false);
+  }
+  {
+    KDTreeModel<1,0,1,1,1,64> model(VarCount, 1, 1, 0, 0.0, 0);
+    checkFindDivisors(model, false);
+  }
+  {
+    DivListModel<0,1> model(VarCount, 0, 0, 0, 0.0, 0);
+    checkFindDivisors(model, true);
+  }
+  {
+    DivListModel<1,1> model(VarCount, 1, 0, 1, 0.0, 0);
+    checkFindDivisors(model, true);
+  }
+}
+
+namespace {
+  template<bool Packed, int Strategy>
+  void checkSplitStrategy() {
+    typedef KDTreeModel<1,1,Packed,4,1,32,Strategy> Model;
+    {
+      Model model(VarCount, 1, 0, 0, 0.0, 0);
+      checkFindDivisors(model, false);
+    }
+
+    // Exponents of variable 0 are large and the rest are near zero,
+    // which is where the strategies differ from round robin. Queries
+    // are interleaved with insertions so that KDSplitQueries has a
+    // sample to learn from when leaves split.
+    Model model(VarCount, 0, 0, 0, 0.0, 0);
+    std::srand(0);
+    std::vector<std::vector<int> > storage;
+    std::vector<Monomial> monomials = makeMonomials(storage, 600, 3);
+    for (size_t i = 0; i < storage.size(); ++i)
+      storage[i][0] = std::rand() % 1000;
+    for (size_t i = 0; i < 400; ++i) {
+      for (size_t q = 400; q < 420; ++q)
+        model.findDivisor(monomials[q + std::rand() % 180]);
+      model.insert(monomials[i]);
+    }
+    const std::vector<Monomial> entries
+      (monomials.begin(), monomials.begin() + 400);
+    for (size_t q = 400; q < monomials.size(); ++q)
+      checkFindDivisor(model, monomials[q], hasDivisor(entries, monomials[q]));
+  }
+}
+
+TEST(DivFinder, SplitStrategies) {
+  checkSplitStrategy<true, mathic::KDSplitMedian>();
+  checkSplitStrategy<false, mathic::KDSplitMedian>();
+  checkSplitStrategy<true, mathic::KDSplitCost>();
+  checkSplitStrategy<false, mathic::KDSplitCost>();
+  checkSplitStrategy<true, mathic::KDSplitQueries>();
+  checkSplitStrategy<false, mathic::KDSplitQueries>();
+}
+
+namespace {
+  template<bool Packed>
+  void checkIncrementalRebuild() {
+    // Automatic rebuilds after half the size in changes or at least 10.
+    KDTreeModel<1,1,Packed,4,1> model(VarCount, 0, 0, 0, 0.5, 10);
+    std::srand(0);
+    std::vector<std::vector<int> > storage;
+    std::vector<Monomial> monomials = makeMonomials(storage, 1200, 8);
+    // increasing in variable 0, so the insertions keep going to the
+    // same side of the tree and subtrees go out of balance.
+    for (size_t i = 0; i < storage.size(); ++i)
+      storage[i][0] = static_cast<int>(i / 3);
+
+    std::vector<bool> present(800);
+    for (size_t i = 0; i < present.size(); ++i) {
+      model.insert(monomials[i]);
+      present[i] = true;
+      if (i % 50 == 49) {
+        // remove the multiples of an entry other than itself
+        const size_t j = std::rand() % i;
+        std::vector<Monomial> removed;
+        model.removeMultiples(monomials[j], removed);
+        for (size_t k = 0; k <= i; ++k)
+          if (k != j && divides(storage[j], storage[k]))
+            present[k] = false;
+        present[j] = false;
+        model.insert(monomials[j]);
+        present[j] = true;
+      }
+    }
+
+    size_t presentCount = 0;
+    for (size_t i = 0; i < present.size(); ++i)
+      presentCount += present[i];
+    ASSERT_EQ(presentCount, model.size());
+    const std::vector<Monomial> entries
+      (monomials.begin(), monomials.begin() + present.size());
+    for (size_t q = 0; q < monomials.size(); ++q) {
+      checkFindDivisor
+        (model, monomials[q], hasDivisor(entries, monomials[q], present));
+    }
+  }
+}
+
+TEST(DivFinder, IncrementalRebuild) {
+  checkIncrementalRebuild<true>();
+  checkIncrementalRebuild<false>();
+}
+
+namespace {
+  /** A configuration whose const methods do not change anything, so
+      that it can be used from several threads at once. */
+  template<bool Packed, size_t BuildThreadCount = 1>
+  class ConcurrentConfiguration {
+  public:
+    typedef int Exponent;
+    typedef std::vector<int> Monomial;
+    typedef Monomial Entry;
+
+    size_t getVarCount() const {return VarCount;}
+    bool getSortOnInsert() const {return false;}
+    Exponent getExponent(const Monomial& m, size_t var) const {return m[var];}
+    bool divides(const Monomial& a, const Monomial& b) const {
+      for (size_t var = 0; var < VarCount; ++var)
+        if (b[var] < a[var])
+          return false;
+      return true;
+    }
+    bool isLessThan(const Monomial& a, const Monomial& b) const {
+      return a < b;
+    }
+    size_t getLeafSize() const {return LeafSize;}
+    bool getUseDivisorCache() const {return true;}
+    bool getDoAutomaticRebuilds() const {return false;}
+    double getRebuildRatio() const {return 0.0;}
+    size_t getRebuildMin() const {return 0;}
+    size_t getBuildThreadCount() const {return BuildThreadCount;}
+
+    static const bool UseDivMask = true;
+    static const bool UseTreeDivMask = true;
+    static const bool PackedTree = Packed;
+    static const size_t LeafSize = 4;
+    static const bool AllowRemovals = true;
+  };
+
+  template<bool Packed>
+  void checkConcurrentQueries() {
+    typedef ConcurrentConfiguration<Packed> C;
+    mathic::KDTree<C> tree((C()));
+    std::srand(0);
+    const std::vector<std::vector<int> > entries = makeExponents(300);
+    for (size_t i = 0; i < entries.size(); ++i)
+      if (tree.findDivisor(entries[i]) == 0)
+        tree.insert(entries[i]);
+    const std::vector<std::vector<int> > queries = makeExponents(2000, 12);
+
+    const mathic::KDTree<C>& constTree = tree;
+    std::vector<bool> expected(queries.size());
+    for (size_t i = 0; i < queries.size(); ++i)
+      expected[i] = constTree.findDivisor(queries[i]) != 0;
+
+    const size_t threadCount = 4;
+    std::vector<size_t> failures(threadCount);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadCount; ++t) {
+      threads.push_back(std::thread([&, t]() {
+        typename mathic::KDTree<C>::DivisorCache cache;
+        for (size_t i = 0; i < queries.size(); ++i) {
+          const std::vector<int>* divisor =
+            constTree.findDivisor(queries[i], cache);
+          if ((divisor != 0) != expected[i] ||
+            (divisor != 0 && !divides(*divisor, queries[i])))
+            ++failures[t];
+        }
+      }));
+    }
+    for (size_t t = 0; t < threadCount; ++t) {
+      threads[t].join();
+      ASSERT_EQ(0u, failures[t]);
+    }
+  }
+}
+
+TEST(DivFinder, ConcurrentQueries) {
+  checkConcurrentQueries<true>();
+  checkConcurrentQueries<false>();
+}
+
+TEST(DivFinder, ParallelBuild) {
+  typedef ConcurrentConfiguration<true, 4> C;
+  typedef ConcurrentConfiguration<true, 1> SerialC;
+  std::srand(0);
+  const std::vector<std::vector<int> > entries =
+    makeExponents(100000, 1000, true);
+
+  std::vector<std::vector<int> > copy(entries);
+  mathic::KDTree<C> tree((C()));
+  tree.insert(copy.begin(), copy.end());
+  ASSERT_EQ(entries.size(), tree.size());
+  copy = entries;
+  mathic::KDTree<SerialC> serialTree((SerialC()));
+  serialTree.insert(copy.begin(), copy.end());
+
+  const std::vector<std::vector<int> > queries = makeExponents(2000, 1000);
+  for (size_t i = 0; i < queries.size(); ++i) {
+    checkFindDivisor
+      (tree, queries[i], serialTree.findDivisor(queries[i]) != 0);
+  }
+
+  tree.rebuild();
+  ASSERT_EQ(entries.size(), tree.size());
+  for (size_t i = 0; i < entries.size(); i += 97)
+    ASSERT_TRUE(tree.findDivisor(entries[i]) != 0);
+}
+
+TEST(DivFinder, Relayout) {
+  typedef ConcurrentConfiguration<false> C;
+  mathic::KDTree<C> tree((C()));
+  std::srand(0);
+  const std::vector<std::vector<int> > queries = makeExponents(500, 12);
+
+  // Grow the tree by single insertions and removals, then check that
+  // relayout keeps the answers to queries, also when there are
+  // insertions after a relayout.
+  std::vector<bool> found(queries.size());
+  for (size_t round = 0; round < 3; ++round) {
+    const std::vector<std::vector<int> > entries = makeExponents(400);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (std::rand() % 8 == 0)
+        tree.removeMultiples(entries[i]);
+      else if (tree.findDivisor(entries[i]) == 0)
+        tree.insert(entries[i]);
+    }
+    const size_t size = tree.size();
+    for (size_t i = 0; i < queries.size(); ++i)
+      found[i] = tree.findDivisor(queries[i]) != 0;
+    tree.relayout();
+    ASSERT_EQ(size, tree.size());
+    for (size_t i = 0; i < queries.size(); ++i)
+      checkFindDivisor(tree, queries[i], found[i]);
+  }
+}
+
+namespace {
+  template<bool Packed>
+  void checkReclaimRemovedNodes() {
+    typedef ConcurrentConfiguration<Packed> C;
+    mathic::KDTree<C> tree((C()));
+    std::srand(0);
+    const std::vector<std::vector<int> > entries = makeExponents(600, 30, true);
+    const std::vector<int> one(VarCount);
+
+    // Removing everything and inserting the same entries again makes
+    // the same nodes in the memory of the removed ones.
+    size_t memoryUse = 0;
+    for (size_t round = 0; round < 3; ++round) {
+      for (size_t i = 0; i < entries.size(); ++i)
+        tree.insert(entries[i]);
+      ASSERT_EQ(entries.size(), tree.size());
+      if (round == 0)
+        memoryUse = tree.getMemoryUse();
+      ASSERT_EQ(memoryUse, tree.getMemoryUse());
+      ASSERT_EQ(0u, tree.getDeadMemoryUse());
+      tree.removeMultiples(one);
+      ASSERT_EQ(0u, tree.size());
+      ASSERT_EQ(memoryUse, tree.getMemoryUse());
+      ASSERT_EQ(memoryUse, tree.getDeadMemoryUse());
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i)
+      tree.insert(entries[i]);
+    std::vector<bool> present(entries.size(), true);
+    for (size_t i = 0; i < entries.size(); i += 2) {
+      ASSERT_TRUE(tree.removeElement(entries[i]));
+      present[i] = false;
+    }
+    ASSERT_EQ(entries.size() / 2, tree.size());
+    ASSERT_LT(0u, tree.getDeadMemoryUse());
+    const size_t before = tree.getMemoryUse();
+    tree.compact();
+    ASSERT_EQ(0u, tree.getDeadMemoryUse());
+    ASSERT_LT(tree.getMemoryUse(), before);
+    ASSERT_EQ(entries.size() / 2, tree.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      checkFindDivisor
+        (tree, entries[i], hasDivisor(entries, entries[i], present));
+    }
+    for (size_t i = 0; i < entries.size(); i += 2)
+      tree.insert(entries[i]);
+    ASSERT_EQ(entries.size(), tree.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+      ASSERT_TRUE(tree.findDivisor(entries[i]) != 0);
+  }
+}
+
+TEST(DivFinder, ReclaimRemovedNodes) {
+  checkReclaimRemovedNodes<true>();
+  checkReclaimRemovedNodes<false>();
+}
+
+namespace {
+  template<bool Packed, size_t CacheSize>
+  class CacheConfiguration : public ConcurrentConfiguration<Packed> {
+  public:
+    static const size_t DivisorCacheSize = CacheSize;
+    static const bool UseLinkedList = false;
+  };
+
+  template<class Finder>
+  void checkDivisorCache() {
+    typedef typename Finder::Configuration C;
+    Finder finder((C()));
+    std::srand(0);
+    const std::vector<std::vector<int> > entries = makeExponents(200, 10, true);
+    for (size_t i = 0; i < entries.size(); ++i)
+      finder.insert(entries[i]);
+
+    // Queries that keep coming back to the same few divisors miss the
+    // cache only the first time around.
+    std::vector<std::vector<int> > queries;
+    for (size_t i = 0; i < C::DivisorCacheSize; ++i) {
+      queries.push_back(entries[i * 7]);
+      queries.back()[i % VarCount] += 20;
+    }
+    for (size_t round = 0; round < 50; ++round)
+      for (size_t i = 0; i < queries.size(); ++i)
+        checkFindDivisor(finder, queries[i], true);
+    const unsigned long long total = 50 * queries.size();
+    ASSERT_EQ(total, finder.getDivisorCacheHitCount() +
+      finder.getDivisorCacheMissCount());
+    ASSERT_LE(finder.getDivisorCacheMissCount(), queries.size());
+
+    // A removed divisor must not come back from the cache.
+    const std::vector<int> removed = *finder.findDivisor(queries[0]);
+    ASSERT_TRUE(finder.removeElement(removed));
+    const std::vector<int>* divisor = finder.findDivisor(queries[0]);
+    ASSERT_TRUE(divisor == 0 || *divisor != removed);
+  }
+}
+
+TEST(DivFinder, DivisorCache) {
+  checkDivisorCache<mathic::KDTree<CacheConfiguration<true, 4> > >();
+  checkDivisorCache<mathic::KDTree<CacheConfiguration<false, 8> > >();
+  checkDivisorCache<mathic::DivList<CacheConfiguration<false, 4> > >();
+}
+
+namespace {
+  struct MonomialExponent {
+    int operator()(const Monomial& monomial, size_t var) const {
+      return monomial[var];
+    }
+  };
+
+  struct CountDivisors {
+    CountDivisors(): count(0) {}
+    bool proceed(const Monomial&) {++count; return true;}
+    size_t count;
+  };
+}
+
+TEST(DivFinder, TraceRoundTrip) {
+  typedef DivListModelConfiguration<false, true> C;
+  typedef mathic::DivList<C> Finder;
+  Finder finder(C(VarCount, false, 0.0, 0));
+  std::ostringstream out;
+  mathic::DivTraceRecorder<Finder, MonomialExponent> recorder(finder, out);
+
+  std::srand(0);
+  std::vector<std::vector<int> > storage;
+  std::vector<Monomial> monomials = makeMonomials(storage, 3);
+  recorder.insert(monomials[0]);
+  recorder.insert(monomials.begin() + 1, monomials.end());
+  recorder.findDivisor(monomials[1]);
+  CountDivisors divisors;
+  recorder.findAllDivisors(monomials[2], divisors);
+  ASSERT_LT(0u, divisors.count);
+  ASSERT_TRUE(recorder.removeMultiples(monomials[0]));
+  ASSERT_EQ(finder.size(), recorder.size());
+
+  const std::string trace = out.str();
+  mathic::DivTraceReader reader(trace.data(), trace.data() + trace.size());
+  typedef mathic::DivTraceReader Reader;
+  ASSERT_EQ(VarCount, reader.getVarCount());
+  const Reader::Event events[] = {
+    Reader::InsertEvent, Reader::InsertEvent, Reader::InsertEvent,
+    Reader::FindDivisorEvent, Reader::FindAllDivisorsEvent,
+    Reader::RemoveMultiplesEvent
+  };
+  const size_t monomialOf[] = {0, 1, 2, 1, 2, 0};
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < sizeof(events) / sizeof(*events); ++i) {
+      ASSERT_EQ(events[i], reader.next());
+      for (size_t var = 0; var < VarCount; ++var)
+        ASSERT_EQ(static_cast<Reader::Exponent>(storage[monomialOf[i]][var]),
+          reader.exponents()[var]);
+    }
+    ASSERT_EQ(Reader::EndEvent, reader.next());
+    reader.rewind();
+  }
+
+  ASSERT_THROW(Reader(trace.data() + 1, trace.data() + trace.size()),
+    mathic::MathicException);
+}
+
+namespace {
+  template<bool Packed, size_t VarsInline, size_t Max, bool Mask,
+    class E = unsigned int>
+  class InlineConfiguration : public ConcurrentConfiguration<Packed> {
+  public:
+    typedef E Exponent;
+    Exponent getExponent(const std::vector<int>& m, size_t var) const {
+      return m[var];
+    }
+
+    static const size_t InlineExponentVarCount = VarsInline;
+    static const size_t MaxExponent = Max;
+    static const bool UseDivMask = Mask;
+    static const bool UseTreeDivMask = Mask;
+  };
+
+  template<class C>
+  void checkInlineExponents() {
+    mathic::KDTree<C> tree((C()));
+    std::srand(0);
+    const std::vector<std::vector<int> > entries = makeExponents(500, 30, true);
+    for (size_t i = 0; i < entries.size(); ++i)
+      tree.insert(entries[i]);
+    std::vector<bool> present(entries.size(), true);
+    for (size_t i = 0; i < entries.size(); i += 3) {
+      ASSERT_TRUE(tree.removeElement(entries[i]));
+      present[i] = false;
+    }
+    std::vector<int> multiple(VarCount, 25);
+    multiple[0] = 5;
+    tree.removeMultiples(multiple);
+    for (size_t i = 0; i < entries.size(); ++i)
+      if (divides(multiple, entries[i]))
+        present[i] = false;
+
+    // Query exponents above MaxExponent must still be found to be
+    // divisible by the entries.
+    std::vector<std::vector<int> > queries = makeExponents(2000, 40);
+    for (size_t q = 0; q < queries.size(); ++q) {
+      queries[q][0] = std::rand() % 70000;
+      checkFindDivisor
+        (tree, queries[q], hasDivisor(entries, queries[q], present));
+    }
+  }
+}
+
+TEST(DivFinder, InlineExponents) {
+  typedef InlineConfiguration<true, VarCount, 255, true> Narrow;
+  typedef InlineConfiguration<true, VarCount, 255, true, int> Signed;
+  static_assert(sizeof(mathic::KDExponentInternal::StoredOf<Narrow>::Type)
+    == 1, "unsigned exponents up to 255 should be stored in 8 bits");
+  static_assert(sizeof(mathic::KDExponentInternal::StoredOf<Signed>::Type)
+    == sizeof(int), "signed exponents should not be narrowed");
+
+  checkInlineExponents<Narrow>();
+  checkInlineExponents<Signed>();
+  checkInlineExponents<InlineConfiguration<false, VarCount, 255, true> >();
+  checkInlineExponents<InlineConfiguration<true, 2, 1000, false> >();
+  checkInlineExponents<InlineConfiguration<false, 2, 100000, false> >();
+}
@@ -0,0 +1,93 @@
+#include "mathic/DivMask.h"
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+  typedef std::vector<int> Monomial;
+
+  template<size_t Bits>
+  class WideConfiguration {
+  public:
+    typedef int Exponent;
+    static const bool UseDivMask = true;
+    static const size_t DivMaskBits = Bits;
+
+    WideConfiguration(size_t varCount): _varCount(varCount) {}
+    size_t getVarCount() const {return _varCount;}
+    Exponent getExponent(const Monomial& m, size_t var) const {return m[var];}
+
+  private:
+    size_t _varCount;
+  };
+
+  bool divides(const Monomial& a, const Monomial& b) {
+    for (size_t var = 0; var < a.size(); ++var)
+      if (a[var] > b[var])
+        return false;
+    return true;
+  }
+
+  /** Checks the div masks of width Bits against brute force divisibility
+      for random monomials, first with the default calculator and then
+      with one rebuilt for those monomials. There are Bits / 2 variables,
+      so each variable gets two bits and the last variables get bits
+      past the first 64. */
+  template<size_t Bits>
+  void checkWideDivMask() {
+    typedef WideConfiguration<Bits> C;
+    typedef mathic::DivMaskOf<C> Mask;
+    ASSERT_EQ(Bits, Mask::BitCount);
+
+    const size_t varCount = Bits / 2;
+    const C conf(varCount);
+    std::srand(0);
+    std::vector<Monomial> monomials(100, Monomial(varCount));
+    for (size_t i = 0; i < monomials.size(); ++i)
+      for (size_t var = 0; var < varCount; ++var)
+        monomials[i][var] = std::rand() % 4;
+    // a divisor of everything so that some pairs divide.
+    monomials.back() = Monomial(varCount);
+
+    typename Mask::template Calculator<C> calc(conf);
+    for (int rebuilt = 0; rebuilt < 2; ++rebuilt) {
+      if (rebuilt)
+        calc.rebuild(monomials.begin(), monomials.end(), conf);
+
+      std::vector<Mask> masks;
+      for (size_t i = 0; i < monomials.size(); ++i)
+        masks.push_back(Mask(monomials[i], calc, conf));
+      size_t ruledOut = 0;
+      for (size_t a = 0; a < monomials.size(); ++a) {
+        for (size_t b = 0; b < monomials.size(); ++b) {
+          const bool canDivide = masks[a].canDivide(masks[b]);
+          if (divides(monomials[a], monomials[b])) {
+            ASSERT_TRUE(canDivide);
+          } else if (!canDivide)
+            ++ruledOut;
+        }
+      }
+      ASSERT_LT(0u, ruledOut);
+
+      // The mask must tell apart monomials that only differ in one of
+      // the last variables, whose bits are past bit 64.
+      for (size_t var = varCount - 4; var < varCount; ++var) {
+        Monomial big(varCount);
+        big[var] = 3;
+        const Monomial one(varCount);
+        const Mask bigMask(big, calc, conf);
+        const Mask oneMask(one, calc, conf);
+        ASSERT_FALSE(bigMask.canDivide(oneMask));
+        ASSERT_TRUE(oneMask.canDivide(bigMask));
+      }
+    }
+  }
+}
+
+TEST(DivMask, Bits128) {
+  checkWideDivMask<128>();
+}
+
+TEST(DivMask, Bits256) {
+  checkWideDivMask<256>();
+}
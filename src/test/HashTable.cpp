@@ -1,7 +1,11 @@
 #include "mathic/HashTable.h"
+#include "mathic/FlatHashTable.h"
+#include "mathic/ConcurrentHashTable.h"
 #include <gtest/gtest.h>
 #include <string>
 #include <functional>
+#include <vector>
+#include <thread>
 
 namespace {
   class HashTableConf 
@@ -69,3 +73,102 @@ TEST(HashTable, StringKeys) {
   ASSERT_TRUE(p == NULL);
 };
 
+
+namespace {
+  typedef mathic::FlatHashTable<HashTableConf> FlatHashTab;
+}
+
+TEST(HashTable, Flat) {
+  HashTableConf C;
+  FlatHashTab H(C, 4);
+
+  // Enough keys to make the table grow several times. The keys are
+  // multiples of 1024 so that the low bits of the hash values are equal.
+  const int count = 5000;
+  for (int i = 0; i < count; ++i) {
+    std::pair<bool, FlatHashTab::Handle*> p = H.insert(i * 1024, i);
+    ASSERT_TRUE(p.first);
+    ASSERT_EQ(p.second->key(), i * 1024);
+  }
+  ASSERT_EQ(H.size(), static_cast<size_t>(count));
+  ASSERT_FALSE(H.insert(7 * 1024, 0).first);
+  ASSERT_EQ(H.lookup(7 * 1024)->value(), 7);
+  ASSERT_TRUE(H.lookup(7 * 1024 + 1) == NULL);
+
+  // remove the odd keys and insert other keys into the freed slots
+  for (int i = 1; i < count; i += 2) {
+    FlatHashTab::Handle* p = H.lookup(i * 1024);
+    ASSERT_FALSE(p == NULL);
+    H.remove(p);
+    ASSERT_TRUE(p == NULL);
+  }
+  for (int i = 0; i < count; ++i) {
+    FlatHashTab::Handle* p = H.lookup(i * 1024);
+    if (i % 2 == 0) {
+      ASSERT_FALSE(p == NULL);
+      ASSERT_EQ(p->value(), i);
+    } else
+      ASSERT_TRUE(p == NULL);
+  }
+  for (int i = 0; i < count; ++i)
+    ASSERT_TRUE(H.insert(-i - 1, i).first);
+  ASSERT_EQ(H.size(), static_cast<size_t>(count / 2 + count));
+  for (int i = 0; i < count; ++i)
+    ASSERT_EQ(H.lookup(-i - 1)->value(), i);
+
+  H.reset();
+  ASSERT_EQ(H.size(), 0u);
+  ASSERT_TRUE(H.lookup(0) == NULL);
+  ASSERT_TRUE(H.insert(0, 1).first);
+}
+
+namespace {
+  typedef mathic::ConcurrentHashTable<HashTableConf> ConcurrentHashTab;
+
+  // Inserts keys from an overlapping range and records the handles.
+  void internKeys(ConcurrentHashTab& H, int offset, int count,
+                  std::vector<ConcurrentHashTab::Handle*>& handles) {
+    handles.resize(count);
+    for (int i = 0; i < count; ++i) {
+      const int key = (offset + i) % count;
+      handles[key] = H.insert(key, key).second;
+      ConcurrentHashTab::Handle* p = H.lookup((key * 7) % count);
+      if (p != NULL && p->key() != (key * 7) % count)
+        handles[key] = NULL;
+    }
+  }
+}
+
+TEST(HashTable, Concurrent) {
+  HashTableConf C;
+  ConcurrentHashTab H(C, 2);
+  const int count = 40000;
+  const size_t threadCount = 4;
+
+  std::vector<std::vector<ConcurrentHashTab::Handle*> > handles(threadCount);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threadCount; ++t)
+    threads.push_back(std::thread(internKeys, std::ref(H),
+      static_cast<int>(t * count / threadCount), count,
+      std::ref(handles[t])));
+  for (size_t t = 0; t < threadCount; ++t)
+    threads[t].join();
+
+  // every thread must have gotten the same handle for the same key
+  ASSERT_EQ(H.size(), static_cast<size_t>(count));
+  for (int key = 0; key < count; ++key) {
+    ASSERT_FALSE(handles[0][key] == NULL);
+    ASSERT_EQ(handles[0][key]->key(), key);
+    for (size_t t = 1; t < threadCount; ++t)
+      ASSERT_EQ(handles[0][key], handles[t][key]);
+    ASSERT_EQ(H.lookup(key), handles[0][key]);
+  }
+  ASSERT_TRUE(H.lookup(count) == NULL);
+
+  H.finishResize();
+  ASSERT_EQ(H.lookup(count / 2), handles[0][count / 2]);
+  H.reset();
+  ASSERT_EQ(H.size(), 0u);
+  ASSERT_TRUE(H.lookup(1) == NULL);
+  ASSERT_TRUE(H.insert(1, 1).first);
+}
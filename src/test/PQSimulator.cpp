@@ -0,0 +1,45 @@
+#include "pqsim/stdinc.h"
+#include "pqsim/Simulator.h"
+#include "pqsim/TourTreeModel.h"
+#include "pqsim/HeapModel.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+namespace {
+  /** Replays the trace in fileName twice through a queue of type Model.
+      Exits with code 1 if the queue pops an incorrect value and with
+      code 0 otherwise, so it has to run in a death test. */
+  template<class Model>
+  void replayTwice(const char* fileName) {
+    Simulator sim(2);
+    sim.replay(fileName);
+    Model model;
+    sim.run(model, false);
+    std::exit(0);
+  }
+}
+
+TEST(PQSimulator, ReplayNonEmptyTrace) {
+  // The trace ends with 10 still in the queue. The second run must not
+  // see that item, or it pops 10 instead of 1.
+  const char* const fileName = "pqSimulatorTest.trace";
+  {
+    std::ofstream out(fileName, std::ios::binary);
+    mathic::PQTraceWriter writer(out);
+    const int one[] = {1};
+    const int ten[] = {10};
+    writer.push(one, one + 1);
+    writer.pop(1);
+    writer.push(ten, ten + 1);
+  }
+
+  EXPECT_EXIT((replayTwice<TourTreeModel<true, false> >(fileName)),
+    ::testing::ExitedWithCode(0), "");
+  EXPECT_EXIT((replayTwice<TourTreeModel<false, false> >(fileName)),
+    ::testing::ExitedWithCode(0), "");
+  EXPECT_EXIT((replayTwice<HeapModel<false, false, false> >(fileName)),
+    ::testing::ExitedWithCode(0), "");
+  std::remove(fileName);
+}
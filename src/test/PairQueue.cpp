@@ -4,6 +4,10 @@
 #include <string>
 #include <sstream>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <thread>
 
 namespace {
   class PQConf {
@@ -449,3 +453,53 @@ TEST(PairQueue, Retirement) {
   pq.pop();
   ASSERT_TRUE(pq.empty());
 }
+
+TEST(PairQueue, PreparedColumnsAndPopBatch) {
+  typedef mathic::PairQueue<PQConf> PQ;
+  PQ pq(PQConf(3));
+  size_t const columnCount = 40;
+
+  // prepare all the columns up front from several threads
+  std::vector<PQ::PreparedColumn> prepared(columnCount);
+  size_t const threadCount = 4;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threadCount; ++t) {
+	threads.push_back(std::thread([&, t]() {
+	  for (size_t col = t; col < columnCount; col += threadCount) {
+		// rows in an order that is not descending
+		std::vector<size_t> rows;
+		for (size_t row = 0; row < col; ++row)
+		  if ((row * 7 + col) % 3 != 0)
+			rows.push_back((row * 5) % col);
+		std::sort(rows.begin(), rows.end());
+		rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+		pq.prepareColumn(col, rows.begin(), rows.end(), prepared[col]);
+	  }
+	}));
+  }
+  for (size_t t = 0; t < threadCount; ++t)
+	threads[t].join();
+
+  ASSERT_THROW(pq.addPreparedColumn(prepared[1]), std::logic_error);
+  size_t pairCount = 0;
+  for (size_t col = 0; col < columnCount; ++col) {
+	pairCount += prepared[col].size();
+	pq.addPreparedColumn(prepared[col]);
+	ASSERT_EQ(0, prepared[col].size());
+  }
+  ASSERT_EQ(columnCount, pq.columnCount());
+  ASSERT_EQ(pairCount, pq.pairCount());
+
+  std::vector<std::pair<size_t, size_t> > popped;
+  while (pq.popBatch(7, std::back_inserter(popped)) == 7) {
+	ASSERT_EQ(pairCount - popped.size(), pq.pairCount());
+  }
+  ASSERT_TRUE(pq.empty());
+  ASSERT_EQ(pairCount, popped.size());
+  for (size_t i = 1; i < popped.size(); ++i) {
+	// PQConf orders pairs by decreasing string
+	const PQConf& conf = pq.configuration();
+	ASSERT_LE(conf.pairString(popped[i - 1].first, popped[i - 1].second),
+			  conf.pairString(popped[i].first, popped[i].second));
+  }
+}
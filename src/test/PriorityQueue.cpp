@@ -0,0 +1,515 @@
+#include "mathic/Heap.h"
+#include "mathic/TourTree.h"
+#include "mathic/Geobucket.h"
+#include "mathic/PairingHeap.h"
+#include "mathic/RadixHeap.h"
+#include "mathic/PQTrace.h"
+#include <gtest/gtest.h>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+namespace {
+  template<bool TrackFront, bool CollectMax, bool FastIndex,
+    size_t Arity = 2, bool CacheAligned = false>
+  class PQConf {
+  public:
+    PQConf(): geoBase(4), minBucketSize(2) {}
+
+    typedef int Entry;
+    typedef int CompareResult;
+    CompareResult compare(Entry a, Entry b) const {
+      return a < b ? -1 : (a == b ? 0 : 1);
+    }
+    bool cmpLessThan(CompareResult r) const {return r < 0;}
+    bool cmpEqual(CompareResult r) const {return r == 0;}
+    Entry deduplicate(Entry a, Entry b) const {return a;}
+
+    static const bool supportDeduplication = false;
+    static const bool fastIndex = FastIndex;
+    static const size_t arity = Arity;
+    static const bool cacheAligned = CacheAligned;
+
+    size_t geoBase;
+    size_t minBucketSize;
+    static const bool trackFront = TrackFront;
+    static const bool minBucketBinarySearch = false;
+    static const bool premerge = false;
+    static const bool collectMax = CollectMax;
+    static const mathic::GeobucketBucketStorage bucketStorage =
+      mathic::GeoStoreSameSizeBuffer;
+    static const size_t insertFactor = 1;
+  };
+
+  // Pushes many entries with lots of repeats, then checks that popBatch
+  // and popWhileEqual return entries in the same order as pop().
+  template<class PQ>
+  void checkBatchPops() {
+    typedef typename PQ::Configuration Conf;
+    std::srand(0);
+    std::vector<int> entries;
+    for (size_t i = 0; i < 3000; ++i)
+      entries.push_back(std::rand() % 400);
+
+    std::vector<int> expected(entries);
+    std::sort(expected.begin(), expected.end(), std::greater<int>());
+
+    PQ batch((Conf()));
+    PQ equal((Conf()));
+    for (size_t i = 0; i < entries.size(); ++i) {
+      batch.push(entries[i]);
+      equal.push(entries[i]);
+    }
+
+    std::vector<int> popped;
+    size_t batchSize = 0;
+    while (!batch.empty()) {
+      batchSize = (batchSize * 7 + 3) % 50;
+      const size_t before = popped.size();
+      const size_t count =
+        batch.popBatch(std::back_inserter(popped), batchSize);
+      ASSERT_EQ(before + count, popped.size());
+      ASSERT_TRUE(count == batchSize || batch.empty());
+    }
+    ASSERT_EQ(expected, popped);
+
+    popped.clear();
+    while (!equal.empty()) {
+      const int top = equal.top();
+      const size_t before = popped.size();
+      const size_t count = equal.popWhileEqual(std::back_inserter(popped));
+      ASSERT_EQ(before + count, popped.size());
+      for (size_t i = before; i < popped.size(); ++i)
+        ASSERT_EQ(top, popped[i]);
+      ASSERT_TRUE(equal.empty() || equal.top() < top);
+    }
+    ASSERT_EQ(expected, popped);
+  }
+}
+
+TEST(PriorityQueue, BatchPops) {
+  checkBatchPops<mathic::Heap<PQConf<false, false, false> > >();
+  checkBatchPops<mathic::Heap<PQConf<false, false, true> > >();
+  checkBatchPops<mathic::Heap<PQConf<false, false, false, 4> > >();
+  checkBatchPops<mathic::Heap<PQConf<false, false, true, 8, true> > >();
+  checkBatchPops<mathic::TourTree<PQConf<false, false, false> > >();
+  checkBatchPops<mathic::Geobucket<PQConf<false, false, false> > >();
+  checkBatchPops<mathic::Geobucket<PQConf<true, true, false> > >();
+  checkBatchPops<mathic::PairingHeap<PQConf<false, false, false> > >();
+}
+
+TEST(PriorityQueue, HeapArity) {
+  // Each arity must pop entries in the same order as the binary heap,
+  // also when pushes and pops are interleaved.
+  mathic::Heap<PQConf<false, false, false> > binary
+    ((PQConf<false, false, false>()));
+  mathic::Heap<PQConf<false, false, false, 3> > ternary
+    ((PQConf<false, false, false, 3>()));
+  mathic::Heap<PQConf<false, false, true, 4, true> > quaternary
+    ((PQConf<false, false, true, 4, true>()));
+  mathic::Heap<PQConf<false, false, false, 8, true> > octonary
+    ((PQConf<false, false, false, 8, true>()));
+  std::srand(1);
+  for (size_t step = 0; step < 20000; ++step) {
+    if (binary.empty() || std::rand() % 3 != 0) {
+      const int entry = std::rand() % 1000;
+      binary.push(entry);
+      ternary.push(entry);
+      quaternary.push(entry);
+      octonary.push(entry);
+    } else {
+      const int top = binary.pop();
+      ASSERT_EQ(top, ternary.pop());
+      ASSERT_EQ(top, quaternary.pop());
+      ASSERT_EQ(top, octonary.pop());
+    }
+    ASSERT_EQ(binary.size(), octonary.size());
+  }
+  while (!binary.empty()) {
+    const int top = binary.pop();
+    ASSERT_EQ(top, ternary.pop());
+    ASSERT_EQ(top, quaternary.pop());
+    ASSERT_EQ(top, octonary.pop());
+  }
+  ASSERT_TRUE(octonary.empty());
+}
+
+namespace {
+  // Melds queues of many different sizes into one queue and checks that
+  // all entries are popped in order. The small sizes exercise pushing
+  // one entry at a time and the large ones the bulk build.
+  template<class PQ>
+  void checkMeld() {
+    typedef typename PQ::Configuration Conf;
+    std::srand(5);
+    PQ pq((Conf()));
+    std::vector<int> expected;
+    for (size_t round = 0; round < 30; ++round) {
+      PQ other((Conf()));
+      const size_t count = round % 3 == 0 ? std::rand() % 1000 : round % 7;
+      for (size_t i = 0; i < count; ++i) {
+        const int entry = std::rand() % 5000;
+        other.push(entry);
+        expected.push_back(entry);
+      }
+      if (round % 4 == 1) {
+        // meld in the other direction
+        other.meld(pq);
+        ASSERT_TRUE(pq.empty());
+        pq.meld(other);
+      } else
+        pq.meld(other);
+      ASSERT_TRUE(other.empty());
+      other.push(1);
+      ASSERT_EQ(1, other.pop()); // other is still usable
+
+      // pop some entries between melds too
+      std::sort(expected.begin(), expected.end());
+      for (size_t i = 0; i < 10 && !expected.empty(); ++i) {
+        ASSERT_EQ(expected.back(), pq.pop());
+        expected.pop_back();
+      }
+    }
+    std::sort(expected.begin(), expected.end(), std::greater<int>());
+    std::vector<int> popped;
+    while (!pq.empty())
+      popped.push_back(pq.pop());
+    ASSERT_EQ(expected, popped);
+  }
+}
+
+TEST(PriorityQueue, Meld) {
+  checkMeld<mathic::Heap<PQConf<false, false, false> > >();
+  checkMeld<mathic::Heap<PQConf<false, false, true> > >();
+  checkMeld<mathic::Heap<PQConf<false, false, false, 4> > >();
+  checkMeld<mathic::Heap<PQConf<false, false, true, 8, true> > >();
+  checkMeld<mathic::TourTree<PQConf<false, false, false> > >();
+  checkMeld<mathic::PairingHeap<PQConf<false, false, false> > >();
+}
+
+namespace {
+  // Pushes ranges of many different sizes, including ranges much larger
+  // than the queue, and checks that all entries are popped in order.
+  template<class PQ>
+  void checkRangePush() {
+    typedef typename PQ::Configuration Conf;
+    std::srand(6);
+    PQ pq((Conf()));
+    std::vector<int> expected;
+    for (size_t round = 0; round < 40; ++round) {
+      std::vector<int> range;
+      const size_t count = round % 5 == 0 ? std::rand() % 3000 : round % 9;
+      for (size_t i = 0; i < count; ++i)
+        range.push_back(std::rand() % 5000);
+      pq.push(range.begin(), range.end());
+      expected.insert(expected.end(), range.begin(), range.end());
+
+      std::sort(expected.begin(), expected.end());
+      for (size_t i = 0; i < 20 && !expected.empty(); ++i) {
+        ASSERT_EQ(expected.back(), pq.pop());
+        expected.pop_back();
+      }
+    }
+    std::sort(expected.begin(), expected.end(), std::greater<int>());
+    std::vector<int> popped;
+    while (!pq.empty())
+      popped.push_back(pq.pop());
+    ASSERT_EQ(expected, popped);
+  }
+}
+
+TEST(PriorityQueue, RangePush) {
+  checkRangePush<mathic::Heap<PQConf<false, false, false> > >();
+  checkRangePush<mathic::Heap<PQConf<false, false, true> > >();
+  checkRangePush<mathic::Heap<PQConf<false, false, false, 3> > >();
+  checkRangePush<mathic::Heap<PQConf<false, false, true, 8, true> > >();
+  checkRangePush<mathic::TourTree<PQConf<false, false, false> > >();
+}
+
+namespace {
+  struct IntKey {
+    mathic::PQTraceWriter::Key operator()(int i) const {return i;}
+  };
+}
+
+TEST(PriorityQueue, TraceRoundTrip) {
+  typedef PQConf<false, false, false> Conf;
+  typedef mathic::Heap<Conf> PQ;
+  PQ pq((Conf()));
+  std::ostringstream out;
+  mathic::PQTraceRecorder<PQ, IntKey> recorder(pq, out);
+
+  const int span[] = {9, 7, 4, 2};
+  recorder.push(span, span + 4);
+  recorder.push(7);
+  ASSERT_EQ(9, recorder.pop());
+  ASSERT_EQ(7, recorder.pop());
+  ASSERT_EQ(7, recorder.pop()); // equal to the previous pop so not recorded
+  recorder.push(100);
+  ASSERT_EQ(100, recorder.pop());
+
+  const std::string trace = out.str();
+  mathic::PQTraceReader reader(trace.data(), trace.data() + trace.size());
+  typedef mathic::PQTraceReader Reader;
+  for (int pass = 0; pass < 2; ++pass) {
+    ASSERT_EQ(Reader::PushEvent, reader.next());
+    ASSERT_EQ(4u, reader.pushed().size());
+    for (size_t i = 0; i < 4; ++i)
+      ASSERT_EQ(static_cast<Reader::Key>(span[i]), reader.pushed()[i]);
+    ASSERT_EQ(Reader::PushEvent, reader.next());
+    ASSERT_EQ(1u, reader.pushed().size());
+    ASSERT_EQ(7u, reader.pushed()[0]);
+    ASSERT_EQ(Reader::PopEvent, reader.next());
+    ASSERT_EQ(9u, reader.popped());
+    ASSERT_EQ(Reader::PopEvent, reader.next());
+    ASSERT_EQ(7u, reader.popped());
+    ASSERT_EQ(Reader::PushEvent, reader.next());
+    ASSERT_EQ(Reader::PopEvent, reader.next());
+    ASSERT_EQ(100u, reader.popped());
+    ASSERT_EQ(Reader::EndEvent, reader.next());
+    reader.rewind();
+  }
+
+  ASSERT_THROW(Reader(trace.data() + 1, trace.data() + trace.size()),
+    mathic::MathicException);
+}
+
+namespace {
+  template<class E, mathic::GeobucketMergeKernel Kernel, int Storage>
+  class GeoKernelConf {
+  public:
+    GeoKernelConf(): geoBase(2), minBucketSize(2) {}
+
+    typedef E Entry;
+    typedef int CompareResult;
+    CompareResult compare(Entry a, Entry b) const {
+      return a < b ? -1 : (a == b ? 0 : 1);
+    }
+    bool cmpLessThan(CompareResult r) const {return r < 0;}
+    bool cmpEqual(CompareResult r) const {return r == 0;}
+    Entry deduplicate(Entry a, Entry b) const {return a;}
+
+    size_t geoBase;
+    size_t minBucketSize;
+    static const bool supportDeduplication = false;
+    static const bool trackFront = true;
+    static const bool minBucketBinarySearch = false;
+    static const bool premerge = Storage == mathic::GeoStorePlain;
+    static const bool collectMax = true;
+    static const mathic::GeobucketBucketStorage bucketStorage =
+      (mathic::GeobucketBucketStorage)Storage;
+    static const size_t insertFactor = 1;
+    static const mathic::GeobucketMergeKernel mergeKernel = Kernel;
+  };
+
+  // Merges random sorted ranges of every small length with the kernel
+  // and checks the result against std::merge.
+  template<class E, mathic::GeobucketMergeKernel Kernel>
+  void checkMergeKernel() {
+    std::srand(2);
+    for (size_t sizeA = 0; sizeA < 40; ++sizeA) {
+      for (size_t sizeB = 0; sizeB < 40; ++sizeB) {
+        std::vector<E> a;
+        std::vector<E> b;
+        for (size_t i = 0; i < sizeA; ++i)
+          a.push_back(static_cast<E>(std::rand() % 60 - 30));
+        for (size_t i = 0; i < sizeB; ++i)
+          b.push_back(static_cast<E>(std::rand() % 60 - 30));
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        std::vector<E> expected(sizeA + sizeB);
+        std::merge(a.begin(), a.end(), b.begin(), b.end(), expected.begin());
+
+        std::vector<E> merged(sizeA + sizeB + 1);
+        const E* aBegin = a.empty() ? 0 : &a.front();
+        const E* bBegin = b.empty() ? 0 : &b.front();
+        E* end = mathic::GeoMergeInternal::merge<Kernel>
+          (aBegin, aBegin + sizeA, bBegin, bBegin + sizeB, &merged.front());
+        ASSERT_EQ(&merged.front() + sizeA + sizeB, end);
+        merged.pop_back();
+        ASSERT_EQ(expected, merged);
+      }
+    }
+  }
+
+  // Pushes single entries and spans into a Geobucket that merges with a
+  // kernel and checks that everything is popped in decreasing order.
+  template<class E, mathic::GeobucketMergeKernel Kernel, int Storage>
+  void checkGeobucketKernel() {
+    typedef GeoKernelConf<E, Kernel, Storage> Conf;
+    mathic::Geobucket<Conf> pq((Conf()));
+    std::srand(3);
+    std::vector<E> expected;
+    for (size_t step = 0; step < 300; ++step) {
+      std::vector<E> span;
+      const size_t size = step % 5 == 0 ? std::rand() % 100 : 1;
+      for (size_t i = 0; i < size; ++i)
+        span.push_back(static_cast<E>(std::rand() % 500 - 250));
+      std::sort(span.begin(), span.end(), std::greater<E>());
+      expected.insert(expected.end(), span.begin(), span.end());
+      if (span.size() == 1)
+        pq.push(span.front());
+      else if (!span.empty())
+        pq.push(span.begin(), span.end());
+    }
+    std::sort(expected.begin(), expected.end(), std::greater<E>());
+    std::vector<E> popped;
+    while (!pq.empty())
+      popped.push_back(pq.pop());
+    ASSERT_EQ(expected, popped);
+  }
+}
+
+TEST(PriorityQueue, GeobucketMergeKernels) {
+  checkMergeKernel<int, mathic::GeoMergeBranchless>();
+  checkMergeKernel<int, mathic::GeoMergeBitonic>();
+  checkMergeKernel<unsigned int, mathic::GeoMergeBitonic>();
+  checkMergeKernel<long long, mathic::GeoMergeBitonic>();
+
+  checkGeobucketKernel<int, mathic::GeoMergeBitonic,
+    mathic::GeoStoreSameSizeBuffer>();
+  checkGeobucketKernel<unsigned int, mathic::GeoMergeBitonic,
+    mathic::GeoStoreDoubleBuffer>();
+  checkGeobucketKernel<int, mathic::GeoMergeBranchless,
+    mathic::GeoStorePlain>();
+  checkGeobucketKernel<long long, mathic::GeoMergeBranchless,
+    mathic::GeoStoreSameSizeBuffer>();
+}
+
+namespace {
+  // An allocator that counts how many entries have been allocated
+  // through it, standing in for an arena of the caller.
+  template<class T>
+  class CountingAllocator : public std::allocator<T> {
+  public:
+    template<class U> struct rebind {typedef CountingAllocator<U> other;};
+
+    CountingAllocator(size_t& allocated): _allocated(&allocated) {}
+    template<class U>
+    CountingAllocator(const CountingAllocator<U>& a):
+      _allocated(a.getAllocated()) {}
+
+    T* allocate(size_t count) {
+      *_allocated += count;
+      return std::allocator<T>::allocate(count);
+    }
+    size_t* getAllocated() const {return _allocated;}
+
+    bool operator==(const CountingAllocator& a) const {
+      return _allocated == a._allocated;
+    }
+    bool operator!=(const CountingAllocator& a) const {return !(*this == a);}
+
+  private:
+    size_t* _allocated;
+  };
+
+  class GeoVirtualConf : public GeoKernelConf
+    <int, mathic::GeoMergeCompare, mathic::GeoStoreSameSizeBuffer> {
+  public:
+    GeoVirtualConf(size_t& allocated): _allocated(&allocated) {}
+
+    static const size_t maxVirtualBuckets = 3;
+    typedef CountingAllocator<int> Allocator;
+    Allocator getAllocator() const {return Allocator(*_allocated);}
+
+  private:
+    size_t* _allocated;
+  };
+}
+
+TEST(PriorityQueue, GeobucketVirtualBuckets) {
+  size_t allocated = 0;
+  mathic::Geobucket<GeoVirtualConf> pq((GeoVirtualConf(allocated)));
+  ASSERT_TRUE(allocated > 0);
+
+  // Pushing a span by reference must not copy it into the buckets.
+  std::vector<int> big;
+  for (int i = 5000; i > 0; --i)
+    big.push_back(i);
+  const size_t memoryUse = pq.getMemoryUse();
+  pq.pushReference(&big.front(), &big.front() + big.size());
+  ASSERT_EQ(memoryUse, pq.getMemoryUse());
+  ASSERT_EQ(big.size(), pq.size());
+  ASSERT_EQ(5000, pq.top());
+
+  // Interleave pushes by reference, which materialize spans once there
+  // are more than 3 of them, with single pushes and pops.
+  std::srand(4);
+  std::vector<std::vector<int> > spans(40);
+  std::vector<int> expected(big);
+  for (size_t s = 0; s < spans.size(); ++s) {
+    for (size_t i = std::rand() % 200; i > 0; --i)
+      spans[s].push_back(std::rand() % 6000);
+    std::sort(spans[s].begin(), spans[s].end(), std::greater<int>());
+    expected.insert(expected.end(), spans[s].begin(), spans[s].end());
+    if (!spans[s].empty())
+      pq.pushReference(&spans[s].front(), &spans[s].front() + spans[s].size());
+    const int single = std::rand() % 6000;
+    pq.push(single);
+    expected.push_back(single);
+  }
+  std::sort(expected.begin(), expected.end(), std::greater<int>());
+  ASSERT_EQ(expected.size(), pq.size());
+
+  std::vector<int> popped;
+  for (size_t i = 0; i < 1000; ++i)
+    popped.push_back(pq.pop());
+  pq.popWhileEqual(std::back_inserter(popped));
+  pq.popBatch(std::back_inserter(popped), 500);
+  pq.materialize();
+  while (!pq.empty())
+    popped.push_back(pq.pop());
+  ASSERT_EQ(expected, popped);
+}
+
+namespace {
+  class RadixConf : public PQConf<false, false, false> {
+  public:
+    typedef unsigned int Key;
+    Key getKey(Entry e) const {return static_cast<Key>(e);}
+  };
+}
+
+TEST(PriorityQueue, RadixHeap) {
+  typedef mathic::RadixHeap<RadixConf> PQ;
+  checkBatchPops<PQ>();
+  checkRangePush<PQ>();
+
+  // Mostly monotone pushes below the last popped key with some pushes
+  // above it and some decreaseTop calls, checked against a sorted vector.
+  std::srand(7);
+  PQ pq((RadixConf()));
+  std::vector<int> expected;
+  int last = 1 << 20;
+  for (size_t step = 0; step < 20000; ++step) {
+    const int r = std::rand() % 10;
+    if (r < 4 || pq.empty()) {
+      const int entry = r == 0 ?
+        last + std::rand() % 5000 : last - std::rand() % (last + 1);
+      pq.push(entry);
+      expected.push_back(entry);
+      std::sort(expected.begin(), expected.end());
+    } else if (r < 6) {
+      const int entry = pq.top() - std::rand() % (pq.top() + 1);
+      ASSERT_EQ(expected.back(), pq.top());
+      pq.decreaseTop(entry);
+      expected.back() = entry;
+      std::sort(expected.begin(), expected.end());
+    } else {
+      last = pq.pop();
+      ASSERT_EQ(expected.back(), last);
+      expected.pop_back();
+    }
+    ASSERT_EQ(expected.size(), pq.size());
+  }
+  while (!pq.empty()) {
+    ASSERT_EQ(expected.back(), pq.pop());
+    expected.pop_back();
+  }
+  ASSERT_TRUE(expected.empty());
+}
@@ -0,0 +1,165 @@
+#include "mathic/SimRecord.h"
+#include "mathic/CompareAction.h"
+#include "mathic/CliParser.h"
+#include "mathic/error.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <limits>
+
+TEST(SimRecord, CsvRoundTrip) {
+  std::vector<mathic::SimRecord> records(2);
+  records[0] = mathic::SimRecord("heap, \"fast\"");
+  records[0].addParameter("repeats", 3);
+  records[0].addMetric("ms", 12.5);
+  records[0].addMetric("cycles", 1e12);
+  records[1] = mathic::SimRecord("geobucket");
+  records[1].addParameter("repeats", 3);
+  records[1].addMetric("ms", 7);
+
+  const char* const fileName = "simRecordTest.csv";
+  std::remove(fileName);
+  mathic::appendSimRecordsCsv(fileName, records);
+  mathic::appendSimRecordsCsv(fileName, records);
+  const std::vector<mathic::SimRecord> read =
+    mathic::readSimRecordsCsv(fileName);
+  std::remove(fileName);
+
+  ASSERT_EQ(4u, read.size());
+  for (size_t i = 0; i < read.size(); ++i) {
+    const mathic::SimRecord& original = records[i % 2];
+    ASSERT_EQ(original.getKey(), read[i].getKey());
+    ASSERT_EQ(original.getMetrics().size(), read[i].getMetrics().size());
+    for (size_t m = 0; m < original.getMetrics().size(); ++m) {
+      const double* value = read[i].findMetric(original.getMetrics()[m].first);
+      ASSERT_TRUE(value != 0);
+      ASSERT_EQ(original.getMetrics()[m].second, *value);
+    }
+  }
+  ASSERT_TRUE(read[1].findMetric("cycles") == 0);
+
+  std::ostringstream json;
+  mathic::writeSimRecordsJson(json, records);
+  ASSERT_NE(std::string::npos,
+    json.str().find("{\"name\": \"heap, \\\"fast\\\"\""));
+
+  ASSERT_THROW(mathic::readSimRecordsCsv("simRecordTestMissing.csv"),
+    mathic::MathicException);
+}
+
+TEST(SimRecord, NameLikeHeader) {
+  std::vector<mathic::SimRecord> records(2);
+  records[0] = mathic::SimRecord("name");
+  records[0].addMetric("ms", 3);
+  records[1] = mathic::SimRecord("heap");
+  records[1].addMetric("ms", 4);
+
+  const char* const fileName = "simRecordTest.csv";
+  std::remove(fileName);
+  mathic::appendSimRecordsCsv(fileName, records);
+  mathic::appendSimRecordsCsv(fileName, records);
+  const std::vector<mathic::SimRecord> read =
+    mathic::readSimRecordsCsv(fileName);
+  std::remove(fileName);
+
+  ASSERT_EQ(4u, read.size());
+  ASSERT_EQ("name", read[2].getName());
+  ASSERT_EQ(3, *read[2].findMetric("ms"));
+  ASSERT_EQ("heap", read[3].getName());
+}
+
+TEST(SimRecord, JsonNonFinite) {
+  std::vector<mathic::SimRecord> records(1);
+  records[0].addMetric("nan", std::numeric_limits<double>::quiet_NaN());
+  records[0].addMetric("inf", std::numeric_limits<double>::infinity());
+  records[0].addMetric("ms", 2);
+  std::ostringstream json;
+  mathic::writeSimRecordsJson(json, records);
+  ASSERT_NE(std::string::npos, json.str().find(
+    "\"metrics\": {\"nan\": null, \"inf\": null, \"ms\": 2}"));
+}
+
+namespace {
+  /** Appends a record with metric ms for each sample to fileName, each
+      in its own block as from separate runs of a simulator. */
+  void writeSamples(const char* fileName, const std::vector<double>& samples) {
+    for (size_t i = 0; i < samples.size(); ++i) {
+      std::vector<mathic::SimRecord> records(1);
+      records[0] = mathic::SimRecord("heap");
+      records[0].addParameter("repeats", 1);
+      records[0].addMetric("ms", samples[i]);
+      mathic::appendSimRecordsCsv(fileName, records);
+    }
+  }
+
+  /** Runs the compare action on the samples with the given threshold in
+      percent. Returns true if it reported a regression. */
+  bool compare(
+    const std::vector<double>& baseline,
+    const std::vector<double>& candidate,
+    const char* threshold = "5"
+  ) {
+    const char* const baseFile = "compareTestBase.csv";
+    const char* const candFile = "compareTestCand.csv";
+    std::remove(baseFile);
+    std::remove(candFile);
+    writeSamples(baseFile, baseline);
+    writeSamples(candFile, candidate);
+
+    mathic::CliParser parser;
+    parser.registerAction<mathic::CompareAction>();
+    std::vector<std::string> commandLine;
+    commandLine.push_back("compare");
+    commandLine.push_back(baseFile);
+    commandLine.push_back(candFile);
+    commandLine.push_back("-threshold");
+    commandLine.push_back(threshold);
+    std::unique_ptr<mathic::Action> action = parser.parse(commandLine);
+
+    // keep the table out of the test output.
+    std::ostringstream out;
+    std::streambuf* const coutBuffer = std::cout.rdbuf(out.rdbuf());
+    bool regressed = false;
+    try {
+      action->performAction();
+    } catch (const mathic::MathicException&) {
+      regressed = true;
+    }
+    std::cout.rdbuf(coutBuffer);
+    std::remove(baseFile);
+    std::remove(candFile);
+    EXPECT_EQ(regressed, out.str().find("REGRESSION") != std::string::npos);
+    return regressed;
+  }
+
+  std::vector<double> samples(double a, double b, double c) {
+    std::vector<double> s;
+    s.push_back(a);
+    s.push_back(b);
+    s.push_back(c);
+    return s;
+  }
+}
+
+TEST(SimRecord, CompareAction) {
+  // a slowdown of 20% with little noise is flagged.
+  ASSERT_TRUE(compare(samples(100, 101, 99), samples(120, 119, 121)));
+  // the same or faster is not.
+  ASSERT_FALSE(compare(samples(100, 101, 99), samples(100, 101, 99)));
+  ASSERT_FALSE(compare(samples(100, 101, 99), samples(80, 81, 79)));
+
+  // one slow outlier is not a regression. The medians are the same even
+  // though the mean is 50% higher, and the outlier widens the noise.
+  ASSERT_FALSE(compare(samples(100, 100, 100), samples(100, 100, 250)));
+
+  // 10% slower is inside the noise when samples vary by 20%, but not
+  // when they vary by 2%.
+  ASSERT_FALSE(compare(samples(90, 100, 110), samples(100, 110, 120)));
+  ASSERT_TRUE(compare(samples(99, 100, 101), samples(109, 110, 111)));
+
+  // 4% slower is a regression only if the threshold is below 4%.
+  ASSERT_FALSE(compare(samples(100, 100, 100), samples(104, 104, 104)));
+  ASSERT_TRUE(compare(samples(100, 100, 100), samples(104, 104, 104), "3"));
+}